@@ -1,4 +1,5 @@
 ﻿#pragma once
 
 #include <stdint.h>
-typedef _Atomic uint32_t atomic_uint32;
\ No newline at end of file
+typedef _Atomic uint32_t atomic_uint32;
+typedef _Atomic uint64_t atomic_uint64;
\ No newline at end of file
@@ -0,0 +1,717 @@
+﻿#include "./io.h"
+#include "./slab.c"
+#include "./state_machine.c"
+#include "./scan.c"
+#include "./string.c"
+#include "./tcp_common/consts.h"
+#include "./tcp_common/headers.c"
+#include "./tcp_common/router.c"
+#include "./tcp.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+
+uint64_t NowNanos() {
+#ifdef _WIN32
+    LARGE_INTEGER freq, counter;
+    QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&counter);
+
+    return (uint64_t)((double)counter.QuadPart * 1e9 / (double)freq.QuadPart);
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+#endif
+}
+
+void PrintResult(const char *name, uint64_t ops, uint64_t nanos) {
+    printf("%-40s %12llu ops %10.2f ns/op %14.0f ops/s\n",
+        name,
+        (unsigned long long)ops,
+        (double)nanos / (double)ops,
+        (double)ops * 1e9 / (double)nanos
+    );
+}
+
+// Single vs Batched Dequeue
+
+#define DEQUEUE_ROUNDS 256
+#define DEQUEUE_ROUND_OPS 2048
+
+// Posts a round of completions, then times draining them, so only the dequeue side is measured.
+void BenchDequeue(struct io_handler *ioHandler, bool batched) {
+    struct io_op *ops = calloc(DEQUEUE_ROUND_OPS, sizeof(struct io_op));
+
+    uint64_t nanos = 0;
+
+    for (uint32_t round = 0; round < DEQUEUE_ROUNDS; round++) {
+        for (uint32_t i = 0; i < DEQUEUE_ROUND_OPS; i++) {
+            InitIOOperation(&ops[i], IO_SUBROUTINE, NULL);
+
+            if (!ResolveIOOperation(ioHandler, &ops[i])) {
+                fprintf(stderr, "bench: ResolveIOOperation failed\n");
+                abort();
+            }
+        }
+
+        uint64_t start = NowNanos();
+        uint32_t drained = 0;
+
+        while (drained < DEQUEUE_ROUND_OPS) {
+            uint32_t err;
+
+            if (batched) {
+                struct io_completion completions[IO_BATCH_MAX];
+                uint32_t count = RunIOBatch(ioHandler, completions, IO_BATCH_MAX, IO_WAIT_INFINITE, &err);
+
+                if (count == 0) abort();
+                drained += count;
+            } else {
+                bool ok;
+                typeof(((struct io_completion *)NULL)->bytesTransferred) bytesTransferred;
+
+                if (RunIO(ioHandler, &ok, &bytesTransferred, &err) == NULL) abort();
+                drained++;
+            }
+        }
+
+        nanos += NowNanos() - start;
+    }
+
+    PrintResult(batched ? "dequeue: RunIOBatch" : "dequeue: RunIO", (uint64_t)DEQUEUE_ROUNDS * DEQUEUE_ROUND_OPS, nanos);
+
+    free(ops);
+}
+
+// State Machine Allocation
+
+#define ALLOC_OPS (1 << 22)
+#define ALLOC_PAYLOAD 256
+
+// Keeps the compiler from eliding allocation pairs.
+void *volatile allocSink;
+
+// Previous AwaitAsync layout, async_state and the constructor's payload are separate heap allocations.
+void BenchSplitStateAlloc() {
+    uint64_t start = NowNanos();
+
+    for (uint32_t i = 0; i < ALLOC_OPS; i++) {
+        struct async_state *machineState = calloc(1, sizeof(struct async_state));
+        machineState->state = calloc(1, ALLOC_PAYLOAD);
+        allocSink = machineState;
+
+        free(machineState->state);
+        free(machineState);
+    }
+
+    PrintResult("alloc: calloc header + payload", ALLOC_OPS, NowNanos() - start);
+}
+
+// As AwaitAsync allocates, the payload is zeroed unless the descriptor sets constructsState.
+void BenchInlineStateAlloc(bool constructsState) {
+    uint64_t start = NowNanos();
+
+    for (uint32_t i = 0; i < ALLOC_OPS; i++) {
+        struct async_state *machineState = SlabAlloc(sizeof(struct async_state) + ALLOC_PAYLOAD);
+        *machineState = (struct async_state){ .refs = 1 };
+        if (!constructsState) memset(machineState + 1, 0, ALLOC_PAYLOAD);
+
+        machineState->state = machineState + 1;
+        allocSink = machineState;
+
+        SlabFree(machineState);
+    }
+
+    PrintResult(constructsState ? "alloc: slab inline state, constructed" : "alloc: slab inline state, zeroed", ALLOC_OPS, NowNanos() - start);
+}
+
+// Nested State Machines
+
+struct nestState {
+    uint32_t remaining;
+    bool awaited;
+};
+
+// Lowest and highest stack address any subroutine of the chain ran at.
+uintptr_t nestStackLow, nestStackHigh;
+
+void *nestConstructor(struct nestState *state, uint32_t *remaining) {
+    state->remaining = *remaining;
+    return state;
+}
+
+void nestDestructor(void *state) {}
+
+extern const struct async_descriptor nestAsync;
+
+// Each machine awaits the next until the end of the chain, which then finishes back up to the first.
+struct subroutine_result runNest(struct nestState *state) {
+    uintptr_t sp = (uintptr_t)&state;
+    if (sp < nestStackLow) nestStackLow = sp;
+    if (sp > nestStackHigh) nestStackHigh = sp;
+
+    if (state->awaited || state->remaining == 0) return subroutine_finish;
+
+    state->awaited = true;
+
+    uint32_t remaining = state->remaining - 1;
+    return subroutine_await(AwaitAsync(nestAsync, &remaining));
+}
+
+const struct async_descriptor nestAsync = {
+    .constructor = (async_constructor)nestConstructor,
+    .destructor = nestDestructor,
+    .subroutine = (async_subroutine)runNest,
+    .stateSize = sizeof(struct nestState),
+};
+
+void BenchNesting(uint32_t depth) {
+    // The whole run is timed, a chain of depth machines per round.
+    uint32_t rounds = 100000 / depth;
+
+    nestStackLow = UINTPTR_MAX;
+    nestStackHigh = 0;
+
+    uint64_t start = NowNanos();
+
+    for (uint32_t i = 0; i < rounds; i++) {
+        uint32_t remaining = depth - 1;
+        struct async_state *root = AwaitAsync(nestAsync, &remaining);
+
+        // Caller is responsible for setting RUNNING flag.
+        atomic_fetch_or(&root->flags, MACHINE_RUNNING);
+        RunAsync(root);
+    }
+
+    uint64_t nanos = NowNanos() - start;
+
+    char name[64];
+    snprintf(name, sizeof(name), "nesting: chain of %u", depth);
+    PrintResult(name, (uint64_t)rounds * depth, nanos);
+
+    // Constant whatever the depth, the run queue doesn't recurse.
+    printf("nesting: chain of %u stack span %llu bytes\n", depth, (unsigned long long)(nestStackHigh - nestStackLow));
+}
+
+// Request Head Scanning
+
+const char *browserHead =
+    "GET /account/settings?tab=security&ref=nav HTTP/1.1\r\n"
+    "Host: app.example.com\r\n"
+    "Connection: keep-alive\r\n"
+    "sec-ch-ua: \"Chromium\";v=\"124\", \"Google Chrome\";v=\"124\", \"Not-A.Brand\";v=\"99\"\r\n"
+    "sec-ch-ua-mobile: ?0\r\n"
+    "sec-ch-ua-platform: \"Windows\"\r\n"
+    "Upgrade-Insecure-Requests: 1\r\n"
+    "User-Agent: Mozilla/5.0 (Windows NT 10.0; Win64; x64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/124.0.0.0 Safari/537.36\r\n"
+    "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,image/avif,image/webp,image/apng,*/*;q=0.8\r\n"
+    "Sec-Fetch-Site: same-origin\r\n"
+    "Sec-Fetch-Mode: navigate\r\n"
+    "Sec-Fetch-User: ?1\r\n"
+    "Sec-Fetch-Dest: document\r\n"
+    "Referer: https://app.example.com/account\r\n"
+    "Accept-Encoding: gzip, deflate, br, zstd\r\n"
+    "Accept-Language: en-US,en;q=0.9,nb;q=0.8\r\n"
+    "Cookie: session=4f9c2d7e1a8b3c6d5e0f9a8b7c6d5e4f; theme=dark; _ga=GA1.1.1234567890.1700000000; csrftoken=Zm9vYmFyYmF6cXV4cXV1eA\r\n"
+    "\r\n";
+
+const char *curlHead =
+    "GET /api/v1/items/42 HTTP/1.1\r\n"
+    "Host: localhost:6000\r\n"
+    "User-Agent: curl/8.5.0\r\n"
+    "Accept: */*\r\n"
+    "\r\n";
+
+const char *healthCheckHead =
+    "GET /healthz HTTP/1.1\r\n"
+    "Host: 10.0.3.17:6000\r\n"
+    "User-Agent: ELB-HealthChecker/2.0\r\n"
+    "Connection: close\r\n"
+    "\r\n";
+
+#define SCAN_ITERATIONS (1 << 18)
+
+// Previous ProcessLines approach, one memchr per line and per token.
+uint32_t ParseHeadMemchr(const uint8_t *buf, uint32_t len) {
+    uint32_t tokens = 0;
+    uint32_t pos = 0;
+    bool requestLine = true;
+
+    for (;;) {
+        const uint8_t *lineEnd = memchr(buf + pos, '\n', len - pos);
+        if (lineEnd == NULL) break;
+
+        uint32_t end = lineEnd - buf;
+        union string line = SliceString(buf + pos, end - pos);
+        union string token;
+
+        if (requestLine) {
+            if (SplitString(&line, &token, ' ')) tokens++;
+            if (SplitString(&line, &token, ' ')) tokens++;
+            requestLine = false;
+        } else if (SplitString(&line, &token, ':')) {
+            tokens++;
+        }
+
+        pos = end + 1;
+    }
+
+    return tokens;
+}
+
+uint32_t ParseHeadScan(scan_kernel kernel, struct scan_index *index, const uint8_t *buf, uint32_t len) {
+    uint32_t tokens = 0;
+    uint32_t pos = 0;
+    uint32_t end;
+    bool requestLine = true;
+
+    if (!ScanChunkWith(kernel, index, buf, len)) abort();
+
+    while (ScanFind(index, SCAN_LINE_END, pos, len, &end)) {
+        uint32_t token;
+
+        if (ScanAny(index, SCAN_INVALID, pos, end)) return 0;
+
+        if (requestLine) {
+            if (ScanFind(index, SCAN_SPACE, pos, end, &token)) {
+                tokens++;
+                if (ScanFind(index, SCAN_SPACE, token + 1, end, &token)) tokens++;
+            }
+            requestLine = false;
+        } else if (ScanFind(index, SCAN_COLON, pos, end, &token)) {
+            tokens++;
+        }
+
+        pos = end + 1;
+    }
+
+    return tokens;
+}
+
+// Keeps the compiler from eliding the parse.
+volatile uint32_t tokenSink;
+
+void BenchHeadScan(const char *set, const char *head) {
+    const uint8_t *buf = (const uint8_t *)head;
+    uint32_t len = strlen(head);
+
+    struct scan_index index = { .base = NULL, .len = 0, .capacityWords = 0, .masks = NULL };
+    char name[64];
+
+    uint64_t start = NowNanos();
+    for (uint32_t i = 0; i < SCAN_ITERATIONS; i++) tokenSink = ParseHeadMemchr(buf, len);
+    snprintf(name, sizeof(name), "scan %s: memchr", set);
+    PrintResult(name, SCAN_ITERATIONS, NowNanos() - start);
+
+    struct { const char *name; scan_kernel kernel; } kernels[] = {
+        { "scalar", ScanBlockScalar },
+#ifdef SCAN_X86
+        { "sse2", ScanBlockSSE2 },
+        { "avx2", __builtin_cpu_supports("avx2") ? ScanBlockAVX2 : NULL },
+#endif
+    };
+
+    for (uint32_t k = 0; k < sizeof(kernels) / sizeof(kernels[0]); k++) {
+        if (kernels[k].kernel == NULL) continue;
+
+        start = NowNanos();
+        for (uint32_t i = 0; i < SCAN_ITERATIONS; i++) tokenSink = ParseHeadScan(kernels[k].kernel, &index, buf, len);
+        snprintf(name, sizeof(name), "scan %s: %s", set, kernels[k].name);
+        PrintResult(name, SCAN_ITERATIONS, NowNanos() - start);
+    }
+
+    free(index.masks);
+}
+
+// Header Table
+
+#define HEADER_ITERATIONS (1 << 20)
+
+// Fills a table from the browser head, as ProcessLine does once per header line.
+void FillBrowserHeaders(struct http_headers *headers) {
+    const uint8_t *buf = (const uint8_t *)browserHead;
+    const uint8_t *end = buf + strlen(browserHead);
+
+    ResetHeaders(headers);
+
+    // Skip the request line.
+    const uint8_t *line = (const uint8_t *)memchr(buf, '\n', end - buf) + 1;
+
+    while (line < end) {
+        const uint8_t *lineEnd = memchr(line, '\n', end - line);
+        const uint8_t *colon = memchr(line, ':', lineEnd - line);
+        if (colon == NULL) break;
+
+        if (!AddHeader(headers, line, colon - line, colon + 1, lineEnd - colon - 2)) abort();
+
+        line = lineEnd + 1;
+    }
+}
+
+void BenchHeaderTable() {
+    struct http_headers *headers = malloc(sizeof(struct http_headers));
+
+    uint64_t start = NowNanos();
+    for (uint32_t i = 0; i < HEADER_ITERATIONS; i++) {
+        FillBrowserHeaders(headers);
+        tokenSink = headers->knownMask;
+    }
+    PrintResult("headers: fill browser table", HEADER_ITERATIONS, NowNanos() - start);
+
+    union string value;
+
+    start = NowNanos();
+    for (uint32_t i = 0; i < HEADER_ITERATIONS; i++) {
+        uint32_t found = GetHeader(headers, HEADER_HOST, &value);
+        found += GetHeader(headers, HEADER_CONTENT_LENGTH, &value);
+        tokenSink = found;
+    }
+    PrintResult("headers: Host + Content-Length by id", HEADER_ITERATIONS, NowNanos() - start);
+
+    start = NowNanos();
+    for (uint32_t i = 0; i < HEADER_ITERATIONS; i++) {
+        uint32_t found = FindHeader(headers, "host", &value);
+        found += FindHeader(headers, "content-length", &value);
+        tokenSink = found;
+    }
+    PrintResult("headers: Host + Content-Length by name", HEADER_ITERATIONS, NowNanos() - start);
+
+    free(headers);
+}
+
+// Router
+
+// Resources with a list, item, sub-list and sub-item route each.
+#define ROUTER_RESOURCES 500
+#define ROUTER_PATTERNS (ROUTER_RESOURCES * 4)
+#define ROUTER_PATHS 1024
+#define ROUTER_ITERATIONS (1 << 20)
+
+char routerPatterns[ROUTER_PATTERNS][64];
+char routerPaths[ROUTER_PATHS][64];
+
+// What routing looks like without the tree, every pattern is compared in turn, segment by segment.
+bool MatchPatternLinear(const char *pattern, const char *path, uint32_t len) {
+    const char *end = path + len;
+
+    while (*pattern != '\0') {
+        if (*pattern == '*') return true;
+
+        if (*pattern == ':') {
+            const char *segmentEnd = memchr(path, '/', end - path);
+            if (segmentEnd == NULL) segmentEnd = end;
+            if (segmentEnd == path) return false;
+
+            path = segmentEnd;
+            pattern += strcspn(pattern, "/");
+            continue;
+        }
+
+        if (path == end || *pattern != *path) return false;
+
+        pattern++;
+        path++;
+    }
+
+    return path == end;
+}
+
+void BenchRouter() {
+    for (uint32_t i = 0; i < ROUTER_RESOURCES; i++) {
+        sprintf(routerPatterns[i * 4], "/api/v1/resource%u", i);
+        sprintf(routerPatterns[i * 4 + 1], "/api/v1/resource%u/:id", i);
+        sprintf(routerPatterns[i * 4 + 2], "/api/v1/resource%u/:id/items", i);
+        sprintf(routerPatterns[i * 4 + 3], "/api/v1/resource%u/:id/items/:item", i);
+    }
+
+    for (uint32_t i = 0; i < ROUTER_PATTERNS; i++) AddRoute(HTTP_METHOD_GET, routerPatterns[i], nullAsync, NULL);
+    BuildRouter();
+
+    uint32_t seed = 1;
+
+    for (uint32_t i = 0; i < ROUTER_PATHS; i++) {
+        seed = seed * 1103515245 + 12345;
+        uint32_t resource = (seed >> 8) % ROUTER_RESOURCES;
+
+        switch ((seed >> 4) % 4) {
+            case 0: sprintf(routerPaths[i], "/api/v1/resource%u", resource); break;
+            case 1: sprintf(routerPaths[i], "/api/v1/resource%u/%u", resource, seed % 100000); break;
+            case 2: sprintf(routerPaths[i], "/api/v1/resource%u/%u/items", resource, seed % 100000); break;
+            default: sprintf(routerPaths[i], "/api/v1/resource%u/%u/items/%u", resource, seed % 100000, seed % 97); break;
+        }
+    }
+
+    struct HTTPRequest req;
+    memset(&req, 0, sizeof(req));
+    req.method = HTTP_METHOD_GET;
+
+    const char *allow;
+    uint64_t matched = 0;
+
+    uint64_t start = NowNanos();
+    for (uint32_t i = 0; i < ROUTER_ITERATIONS; i++) {
+        const char *path = routerPaths[i % ROUTER_PATHS];
+        req.path = SliceString((const uint8_t *)path, strlen(path));
+
+        matched += MatchRoute(&req, &allow) != NULL;
+    }
+    PrintResult("router: radix tree, 2000 routes", ROUTER_ITERATIONS, NowNanos() - start);
+
+    uint64_t linearMatched = 0;
+    // The linear scan is far slower, fewer iterations keep the run short.
+    uint32_t linearIterations = ROUTER_ITERATIONS / 64;
+
+    start = NowNanos();
+    for (uint32_t i = 0; i < linearIterations; i++) {
+        const char *path = routerPaths[i % ROUTER_PATHS];
+        uint32_t len = strlen(path);
+
+        for (uint32_t route = 0; route < ROUTER_PATTERNS; route++) {
+            if (MatchPatternLinear(routerPatterns[route], path, len)) {
+                linearMatched++;
+                break;
+            }
+        }
+    }
+    PrintResult("router: linear scan, 2000 routes", linearIterations, NowNanos() - start);
+
+    // Every path is routable, both must have found them all.
+    if (matched != ROUTER_ITERATIONS || linearMatched != linearIterations) {
+        fprintf(stderr, "bench: router missed paths\n");
+        abort();
+    }
+}
+
+// Idle Connections
+
+#define IDLE_CONNECTIONS 100000
+
+// Footprint of a slab allocation of size, rounded up to its class.
+size_t SlabFootprint(size_t size) {
+    uint32_t sizeClass = SlabSizeClass(size);
+    if (sizeClass == SLAB_LARGE_CLASS) return sizeof(struct slab_block) + size;
+
+    return SlabClassSize(sizeClass);
+}
+
+// Memory an idle keep-alive connection holds once its request was answered and the response sent,
+// which is what most of a large number of long-lived connections look like at any time.
+void BenchIdleConnections() {
+    static const char request[] = "GET /idle HTTP/1.1\r\nHost: localhost\r\n\r\n";
+
+    struct tcpConnCommon *conns = calloc(IDLE_CONNECTIONS, sizeof(struct tcpConnCommon));
+
+    uint64_t start = NowNanos();
+    for (uint32_t i = 0; i < IDLE_CONNECTIONS; i++) {
+        struct tcpConnCommon *conn = &conns[i];
+        SetupCommonConn(conn, MAX_HEADER_SIZE);
+
+        uint8_t *buf;
+        uint32_t len;
+
+        if (!PrepareRecv(conn, &buf, &len)) abort();
+
+        memcpy(buf, request, sizeof(request) - 1);
+        CommitRecv(conn, sizeof(request) - 1);
+
+        if (!ProcessLines(conn)) abort();
+
+        struct send_vec *vecs;
+        uint32_t count;
+
+        while (PrepareSend(conn, &vecs, &count)) {
+            uint32_t n = 0;
+            for (uint32_t v = 0; v < count; v++) n += vecs[v].len;
+
+            CommitSend(conn, n);
+        }
+    }
+    PrintResult("idle connections: request + drain", IDLE_CONNECTIONS, NowNanos() - start);
+
+    uint64_t heldBytes = 0;
+
+    for (uint32_t i = 0; i < IDLE_CONNECTIONS; i++) {
+        for (struct recv_segment *segment = conns[i].recv.head; segment != NULL; segment = segment->next) {
+            heldBytes += SlabFootprint(sizeof(struct recv_segment) + segment->capacity);
+        }
+
+        if (conns[i].send != NULL) heldBytes += SlabFootprint(sizeof(struct send_queue));
+    }
+
+    size_t stateBytes = SlabFootprint(sizeof(struct async_state) + sizeof(struct connState));
+
+    printf("idle connection memory: %zu bytes of state + %.1f bytes of buffers (a kept receive buffer is %u)\n",
+        stateBytes,
+        (double)heldBytes / IDLE_CONNECTIONS,
+        RECV_SEGMENT_BLOCK
+    );
+
+    for (uint32_t i = 0; i < IDLE_CONNECTIONS; i++) CleanupCommonConn(&conns[i]);
+    free(conns);
+}
+
+// Timer Wheel
+
+#define BENCH_TIMERS 1000000
+
+uint64_t benchTimersFired;
+
+void BenchTimerFired(struct timer *timer) {
+    benchTimersFired++;
+}
+
+// A deadline per connection: armed, pushed back by every read (re-arm), cancelled by most, expired by the rest.
+void BenchTimers() {
+    struct timer *timers = malloc(BENCH_TIMERS * sizeof(struct timer));
+    struct timer_wheel *wheel = CreateTimerWheel(0);
+
+    if (timers == NULL || wheel == NULL) abort();
+
+    uint64_t start = NowNanos();
+    for (uint32_t i = 0; i < BENCH_TIMERS; i++) {
+        timers[i] = nullTimer;
+        ArmTimer(wheel, &timers[i], 1 + (i * 7919ull) % 60000, BenchTimerFired);
+    }
+    PrintResult("timers: arm", BENCH_TIMERS, NowNanos() - start);
+
+    start = NowNanos();
+    for (uint32_t i = 0; i < BENCH_TIMERS; i++) ArmTimer(wheel, &timers[i], 1 + (i * 104729ull) % 60000, BenchTimerFired);
+    PrintResult("timers: re-arm", BENCH_TIMERS, NowNanos() - start);
+
+    start = NowNanos();
+    for (uint32_t i = 0; i < BENCH_TIMERS; i += 2) CancelTimer(&timers[i]);
+    PrintResult("timers: cancel", BENCH_TIMERS / 2, NowNanos() - start);
+
+    start = NowNanos();
+    for (uint64_t now = 0; now <= 60000; now++) ExpireTimers(wheel, now);
+    PrintResult("timers: expire (1ms steps)", benchTimersFired, NowNanos() - start);
+
+    printf("timer memory: %zu bytes per timer, %zu bytes per wheel\n", sizeof(struct timer), sizeof(struct timer_wheel));
+
+    if (benchTimersFired != BENCH_TIMERS / 2) abort();
+
+    free(wheel);
+    free(timers);
+}
+
+// Metrics
+
+#define BENCH_METRIC_REQUESTS 1000000
+#define BENCH_METRIC_RECORDS 10000000
+
+// Keep-alive requests on a single connection, so recording is the only difference between the runs.
+void BenchMetricRequests(bool enabled) {
+    static const char request[] = "GET /idle HTTP/1.1\r\nHost: localhost\r\n\r\n";
+
+    struct tcpConnCommon conn;
+    SetupCommonConn(&conn, MAX_HEADER_SIZE);
+
+    metricsEnabled = enabled;
+
+    uint64_t start = NowNanos();
+    for (uint32_t i = 0; i < BENCH_METRIC_REQUESTS; i++) {
+        uint8_t *buf;
+        uint32_t len;
+
+        if (!PrepareRecv(&conn, &buf, &len)) abort();
+
+        memcpy(buf, request, sizeof(request) - 1);
+        CommitRecv(&conn, sizeof(request) - 1);
+
+        if (!ProcessLines(&conn)) abort();
+
+        struct send_vec *vecs;
+        uint32_t count;
+
+        while (PrepareSend(&conn, &vecs, &count)) {
+            uint32_t n = 0;
+            for (uint32_t v = 0; v < count; v++) n += vecs[v].len;
+
+            CommitSend(&conn, n);
+        }
+    }
+    PrintResult(enabled ? "metrics on: request + drain" : "metrics off: request + drain", BENCH_METRIC_REQUESTS, NowNanos() - start);
+
+    metricsEnabled = true;
+    CleanupCommonConn(&conn);
+}
+
+void BenchMetrics() {
+    BenchMetricRequests(false);
+    BenchMetricRequests(true);
+
+    uint64_t start = NowNanos();
+    for (uint32_t i = 0; i < BENCH_METRIC_RECORDS; i++) MetricRecord(METRIC_BATCH_DISPATCH, (i * 7919ull) % 1000000);
+    PrintResult("metrics: histogram record", BENCH_METRIC_RECORDS, NowNanos() - start);
+
+    struct metrics_snapshot *snapshot = malloc(sizeof(struct metrics_snapshot));
+    char *text = malloc(16384);
+
+    if (snapshot == NULL || text == NULL) abort();
+
+    start = NowNanos();
+    SnapshotMetrics(snapshot);
+    size_t len = FormatMetrics(snapshot, text, 16384);
+    PrintResult("metrics: scrape", 1, NowNanos() - start);
+
+    printf("metrics: request latency p50 %llu ns, p99 %llu ns, p99.9 %llu ns; %zu bytes per scrape, %zu bytes per thread\n",
+        (unsigned long long)SnapshotQuantile(snapshot, METRIC_REQUEST_LATENCY, 0.5),
+        (unsigned long long)SnapshotQuantile(snapshot, METRIC_REQUEST_LATENCY, 0.99),
+        (unsigned long long)SnapshotQuantile(snapshot, METRIC_REQUEST_LATENCY, 0.999),
+        len,
+        sizeof(struct thread_metrics)
+    );
+
+    free(text);
+    free(snapshot);
+}
+
+int main(void) {
+    struct io_handler ioHandler = CreateIOHandler();
+
+    if (!IsValidIOHandler(&ioHandler)) {
+        fprintf(stderr, "bench: failed to create IO Handler\n");
+        return 1;
+    }
+
+    BenchDequeue(&ioHandler, false);
+    BenchDequeue(&ioHandler, true);
+
+    // Operations are embedded, so none of the posted completions may have touched the heap.
+    printf("io_op heap allocations: %llu\n", (unsigned long long)atomic_load(&ioOpHeapAllocations));
+
+    BenchSplitStateAlloc();
+    BenchInlineStateAlloc(false);
+    BenchInlineStateAlloc(true);
+
+    BenchNesting(10);
+    BenchNesting(100);
+    BenchNesting(1000);
+    BenchNesting(10000);
+
+    BenchHeadScan("browser", browserHead);
+    BenchHeadScan("curl", curlHead);
+    BenchHeadScan("health check", healthCheckHead);
+
+    BenchHeaderTable();
+    BenchRouter();
+
+    // Parsing reads the Response Cache.
+    QSBRRegister();
+    BenchIdleConnections();
+
+    BenchTimers();
+
+    BenchMetrics();
+
+    CloseIOHandler(&ioHandler);
+    return 0;
+}
\ No newline at end of file
@@ -0,0 +1,378 @@
+﻿// Work-Stealing Executor
+
+#pragma once
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdatomic.h>
+#include <immintrin.h>
+#include <limits.h>
+#include "./atomics.c"
+#include "./slab.c"
+#include "./qsbr.c"
+#include "./io.h"
+#include "./state_machine.c"
+#include "./tcp_common/consts.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#include <semaphore.h>
+#endif
+
+// CPU-bound State Machines are spawned onto executor threads instead of running inline on the worker that
+// dequeued a completion, so a long computation doesn't hold up the I/O of every other connection of that worker.
+//
+// Every thread spawning pushes onto a deque of its own (Chase-Lev), executors take from the bottom of theirs and
+// steal from the top of the others. The spawning machine awaits the spawned one, and is resumed through
+// ResumeFromAwait on the worker it was spawned from, by an IO_SPAWN completion posted once it finishes.
+
+// Power of two, a thread with this many spawned machines pending runs the next one inline instead.
+#ifndef SPAWN_DEQUE_SIZE
+#define SPAWN_DEQUE_SIZE 4096
+#endif
+
+#ifndef SPAWN_MAX_DEQUES
+#define SPAWN_MAX_DEQUES 256
+#endif
+
+struct spawn_task {
+    // First, so the task is found from the completion.
+    struct io_op op;
+    struct async_state *machine;
+    // Handler of the worker the task (or the first of its spawning machines) was spawned from, NULL if none.
+    const struct io_handler *io_handler;
+};
+
+struct spawn_deque {
+    // Stolen from, by any thread.
+    _Atomic int64_t top;
+    // Pushed to and taken from, only by the owning thread.
+    _Atomic int64_t bottom __attribute__((aligned(64)));
+    _Atomic(struct spawn_task *) tasks[SPAWN_DEQUE_SIZE];
+} __attribute__((aligned(64)));
+
+// Deques are never freed, a thread that spawned once may spawn again at any time.
+_Atomic(struct spawn_deque *) spawnDeques[SPAWN_MAX_DEQUES];
+atomic_uint32 spawnDequeCount = 0;
+
+_Thread_local struct spawn_deque *spawnSelf = NULL;
+
+// Set by workers, spawned machines finish by posting to it.
+_Thread_local const struct io_handler *spawnIOHandler = NULL;
+
+// Task being run by this executor, and whether its completion was posted (the task then belongs to the worker).
+_Thread_local struct spawn_task *spawnCurrent = NULL;
+_Thread_local bool spawnPosted = false;
+
+// Executors parked waiting for tasks.
+atomic_uint32 spawnSleepers = 0;
+atomic_uint32 spawnExecutorCount = 0;
+
+#ifdef _WIN32
+HANDLE spawnSemaphore = NULL;
+#else
+sem_t spawnSemaphore;
+#endif
+
+struct spawn_deque *GetSpawnDeque() {
+    if (spawnSelf != NULL) return spawnSelf;
+
+    uint32_t index = atomic_fetch_add(&spawnDequeCount, 1);
+
+    if (index >= SPAWN_MAX_DEQUES) {
+        fprintf(stderr, "panic: too many spawning threads.\n");
+        abort();
+    }
+
+    struct spawn_deque *deque = aligned_alloc(alignof(struct spawn_deque), sizeof(struct spawn_deque));
+
+    if (deque == NULL) {
+        fprintf(stderr, "panic: failed to allocate Spawn Deque.\n");
+        abort();
+    }
+
+    atomic_init(&deque->top, 0);
+    atomic_init(&deque->bottom, 0);
+
+    // Stealers skip the slot until it's published.
+    atomic_store(&spawnDeques[index], deque);
+    spawnSelf = deque;
+
+    return deque;
+}
+
+// Owner only. Returns false if the deque is full.
+bool PushSpawnTask(struct spawn_deque *deque, struct spawn_task *task) {
+    int64_t bottom = atomic_load_explicit(&deque->bottom, memory_order_relaxed);
+    int64_t top = atomic_load_explicit(&deque->top, memory_order_acquire);
+
+    if (bottom - top >= SPAWN_DEQUE_SIZE) return false;
+
+    atomic_store_explicit(&deque->tasks[bottom & (SPAWN_DEQUE_SIZE - 1)], task, memory_order_relaxed);
+    // Publishes the task (and the machine) to the stealers that acquire bottom.
+    atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_release);
+
+    return true;
+}
+
+// Owner only, takes the most recently pushed task. Returns NULL if empty.
+struct spawn_task *TakeSpawnTask(struct spawn_deque *deque) {
+    int64_t bottom = atomic_load_explicit(&deque->bottom, memory_order_relaxed) - 1;
+    atomic_store_explicit(&deque->bottom, bottom, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    int64_t top = atomic_load_explicit(&deque->top, memory_order_relaxed);
+
+    if (top > bottom) {
+        atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_relaxed);
+        return NULL;
+    }
+
+    struct spawn_task *task = atomic_load_explicit(&deque->tasks[bottom & (SPAWN_DEQUE_SIZE - 1)], memory_order_relaxed);
+
+    if (top == bottom) {
+        // Last task, race the stealers for it.
+        if (!atomic_compare_exchange_strong_explicit(&deque->top, &top, top + 1, memory_order_seq_cst, memory_order_relaxed)) {
+            task = NULL;
+        }
+
+        atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_relaxed);
+    }
+
+    return task;
+}
+
+// Any thread, takes the oldest task. Returns NULL if empty or another thread took it first.
+struct spawn_task *StealSpawnTask(struct spawn_deque *deque) {
+    int64_t top = atomic_load_explicit(&deque->top, memory_order_acquire);
+    atomic_thread_fence(memory_order_seq_cst);
+    int64_t bottom = atomic_load_explicit(&deque->bottom, memory_order_acquire);
+
+    if (top >= bottom) return NULL;
+
+    struct spawn_task *task = atomic_load_explicit(&deque->tasks[top & (SPAWN_DEQUE_SIZE - 1)], memory_order_relaxed);
+
+    if (!atomic_compare_exchange_strong_explicit(&deque->top, &top, top + 1, memory_order_seq_cst, memory_order_relaxed)) {
+        return NULL;
+    }
+
+    return task;
+}
+
+// Steals from every other deque, starting at start so executors don't all go after the same one.
+struct spawn_task *StealAnySpawnTask(uint32_t start) {
+    uint32_t count = atomic_load(&spawnDequeCount);
+    if (count > SPAWN_MAX_DEQUES) count = SPAWN_MAX_DEQUES;
+
+    for (uint32_t i = 0; i < count; i++) {
+        struct spawn_deque *deque = atomic_load(&spawnDeques[(start + i) % count]);
+        if (deque == NULL || deque == spawnSelf) continue;
+
+        struct spawn_task *task = StealSpawnTask(deque);
+        if (task != NULL) return task;
+    }
+
+    return NULL;
+}
+
+bool SpawnTasksPending() {
+    uint32_t count = atomic_load(&spawnDequeCount);
+    if (count > SPAWN_MAX_DEQUES) count = SPAWN_MAX_DEQUES;
+
+    for (uint32_t i = 0; i < count; i++) {
+        struct spawn_deque *deque = atomic_load(&spawnDeques[i]);
+        if (deque == NULL) continue;
+
+        if (atomic_load(&deque->top) < atomic_load(&deque->bottom)) return true;
+    }
+
+    return false;
+}
+
+// Called after a push, wakes one parked executor if any.
+void WakeExecutor() {
+    // Pairs with the increment in ParkExecutor, either the push is seen by its last scan or the sleeper by us.
+    atomic_thread_fence(memory_order_seq_cst);
+
+    uint32_t sleepers = atomic_load(&spawnSleepers);
+
+    while (sleepers > 0) {
+        if (!atomic_compare_exchange_weak(&spawnSleepers, &sleepers, sleepers - 1)) continue;
+
+#ifdef _WIN32
+        ReleaseSemaphore(spawnSemaphore, 1, NULL);
+#else
+        sem_post(&spawnSemaphore);
+#endif
+        return;
+    }
+}
+
+void ParkExecutor() {
+    atomic_fetch_add(&spawnSleepers, 1);
+
+    if (SpawnTasksPending()) {
+        uint32_t sleepers = atomic_load(&spawnSleepers);
+
+        while (sleepers > 0) {
+            if (atomic_compare_exchange_weak(&spawnSleepers, &sleepers, sleepers - 1)) return;
+        }
+
+        // A pusher already took the count and is posting, consume it.
+    }
+
+#ifdef _WIN32
+    WaitForSingleObject(spawnSemaphore, INFINITE);
+#else
+    while (sem_wait(&spawnSemaphore) != 0) {}
+#endif
+}
+
+void RunSpawnTask(struct spawn_task *task) {
+    spawnCurrent = task;
+    spawnPosted = false;
+
+    // Caller is responsible for setting RUNNING flag.
+    atomic_fetch_or(&task->machine->flags, MACHINE_RUNNING);
+    RunAsync(task->machine);
+
+    spawnCurrent = NULL;
+
+    if (!spawnPosted) SlabFree(task);
+}
+
+#ifdef _WIN32
+DWORD StartExecutor(void *param) {
+#else
+void *StartExecutor(void *param) {
+#endif
+    // Spawned machines may read the Response Cache like any other.
+    QSBRRegister();
+
+    struct spawn_deque *deque = GetSpawnDeque();
+    uint32_t victim = (uint32_t)(uintptr_t)param;
+
+    for (;;) {
+        struct spawn_task *task = TakeSpawnTask(deque);
+        if (task == NULL) task = StealAnySpawnTask(victim++);
+
+        if (task == NULL) {
+            QSBROffline();
+            ParkExecutor();
+            QSBROnline();
+
+            continue;
+        }
+
+        RunSpawnTask(task);
+        QSBRQuiescent();
+    }
+
+#ifdef _WIN32
+    return 0;
+#else
+    return NULL;
+#endif
+}
+
+// Starts count executor threads, once. Until then, spawned machines run inline.
+void StartExecutors(uint32_t count) {
+    uint32_t started = 0;
+    if (count == 0 || !atomic_compare_exchange_strong(&spawnExecutorCount, &started, count)) return;
+
+#ifdef _WIN32
+    spawnSemaphore = CreateSemaphoreW(NULL, 0, LONG_MAX, NULL);
+
+    if (spawnSemaphore == NULL) {
+        fprintf(stderr, "panic: CreateSemaphore failed: %lu\n", GetLastError());
+        abort();
+    }
+#else
+    if (sem_init(&spawnSemaphore, 0, 0) != 0) {
+        fprintf(stderr, "panic: sem_init failed.\n");
+        abort();
+    }
+#endif
+
+    for (uint32_t i = 0; i < count; i++) {
+#ifdef _WIN32
+        HANDLE thread = CreateThread(NULL, 0, StartExecutor, (void *)(uintptr_t)i, 0, NULL);
+
+        if (thread == NULL) {
+            fprintf(stderr, "panic: CreateThread failed: %lu\n", GetLastError());
+            abort();
+        }
+
+        CloseHandle(thread);
+#else
+        pthread_t thread;
+        int err = pthread_create(&thread, NULL, StartExecutor, (void *)(uintptr_t)i);
+
+        if (err != 0) {
+            fprintf(stderr, "panic: pthread_create failed: %i\n", err);
+            abort();
+        }
+
+        pthread_detach(thread);
+#endif
+    }
+}
+
+// Called by RunAsync once the spawning machine is suspended.
+void SpawnOnExecutor(struct async_state *machineState) {
+    struct spawn_task *task = SlabAlloc(sizeof(struct spawn_task));
+
+    if (task == NULL || atomic_load(&spawnExecutorCount) == 0) {
+        SlabFree(task);
+
+        // No executor to run it, so it runs here like any awaited machine.
+        atomic_fetch_or(&machineState->flags, MACHINE_RUNNING);
+        RunAsync(machineState);
+        return;
+    }
+
+    task->machine = machineState;
+    // Spawned from an executor, it's resumed on the worker of the machine that started it all.
+    task->io_handler = spawnCurrent != NULL ? spawnCurrent->io_handler : spawnIOHandler;
+
+    if (!PushSpawnTask(GetSpawnDeque(), task)) {
+        SlabFree(task);
+
+        atomic_fetch_or(&machineState->flags, MACHINE_RUNNING);
+        RunAsync(machineState);
+        return;
+    }
+
+    WakeExecutor();
+}
+
+// Called by RunAsync once a spawned machine finished, with the machine awaiting it.
+void ResumeSpawner(struct async_state *machineState) {
+    struct spawn_task *task = spawnCurrent;
+
+    // Spawned by another executor machine, or running on a worker already (after I/O, or inline).
+    if (task == NULL || task->io_handler == NULL || (atomic_load(&machineState->flags) & MACHINE_SPAWNED) != 0) {
+        ResumeFromAwait(machineState);
+        return;
+    }
+
+    InitIOOperation(&task->op, IO_SPAWN, machineState);
+    spawnPosted = true;
+
+    if (!ResolveIOOperation(task->io_handler, &task->op)) {
+        spawnPosted = false;
+        ResumeFromAwait(machineState);
+    }
+}
+
+// Called by the worker that dequeued the completion of a spawned machine.
+void CompleteSpawn(struct io_op *op) {
+    struct spawn_task *task = (struct spawn_task *)op;
+    struct async_state *machineState = op->data;
+
+    SlabFree(task);
+
+    ResumeFromAwait(machineState);
+}
\ No newline at end of file
@@ -2,6 +2,8 @@
 
 #ifdef _WIN32
 #include "./io_win.c"
+#elif defined(__linux__)
+#include "./io_linux.c"
 #else
 #error "Unsupported OS"
 #endif
\ No newline at end of file
@@ -0,0 +1,602 @@
+﻿#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <immintrin.h>
+#include "./atomics.c"
+
+// "LIOP" (Linux Operation) in hex
+#define IOOperationMagic 0x4c494f50
+
+#define IO_RING_ENTRIES 4096
+
+// Buffer group of the provided buffer ring, see uring_SetupBufferRing.
+#define IO_BUFFER_GROUP 0
+
+// Layout of the rings is dictated by the kernel (see io_uring_setup(2)), head/tail are shared with it.
+struct io_handler {
+    int ring_fd;
+
+    atomic_uint32 *sq_head;
+    atomic_uint32 *sq_tail;
+    uint32_t sq_mask;
+    uint32_t sq_entries;
+    uint32_t *sq_array;
+    struct io_uring_sqe *sqes;
+
+    atomic_uint32 *cq_head;
+    atomic_uint32 *cq_tail;
+    uint32_t cq_mask;
+    struct io_uring_cqe *cqes;
+
+    void *sq_ring;
+    size_t sq_ring_size;
+    void *cq_ring;
+    size_t cq_ring_size;
+    size_t sqes_size;
+
+    // The ring is shared by every worker, so SQE reservation must be serialized (IOCP does this internally).
+    atomic_uint32 sq_lock;
+
+    // Provided buffers, NULL if the kernel doesn't support them. Shared with the kernel like the rings,
+    // only the tail is written by workers, serialized like the SQ.
+    struct io_uring_buf_ring *buf_ring;
+    uint32_t buf_ring_mask;
+    size_t buf_ring_size;
+    atomic_uint32 buf_ring_lock;
+
+    // Waits can time out (5.11), without it RunIOBatch queues a timeout operation to end them instead.
+    bool ext_arg;
+};
+
+int uring_Setup(uint32_t entries, struct io_uring_params *params) {
+    return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+int uring_Enter(int ringFd, uint32_t toSubmit, uint32_t minComplete, uint32_t flags) {
+    return (int)syscall(__NR_io_uring_enter, ringFd, toSubmit, minComplete, flags, NULL, 0);
+}
+
+// Waits for minComplete completions, for at most timeout.
+int uring_EnterTimeout(int ringFd, uint32_t toSubmit, uint32_t minComplete, uint32_t flags, const struct __kernel_timespec *timeout) {
+    struct io_uring_getevents_arg arg = {
+        .sigmask = 0,
+        .sigmask_sz = 0,
+        .ts = (uintptr_t)timeout,
+    };
+
+    return (int)syscall(__NR_io_uring_enter, ringFd, toSubmit, minComplete, flags | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+}
+
+int uring_Register(int ringFd, uint32_t opcode, void *arg, uint32_t argCount) {
+    return (int)syscall(__NR_io_uring_register, ringFd, opcode, arg, argCount);
+}
+
+void CloseIOHandler(struct io_handler *ioHandler) {
+    if (ioHandler == NULL) return;
+    if (ioHandler->ring_fd < 0) return;
+
+    if (ioHandler->sqes != NULL) munmap(ioHandler->sqes, ioHandler->sqes_size);
+    if (ioHandler->cq_ring != NULL && ioHandler->cq_ring != ioHandler->sq_ring) munmap(ioHandler->cq_ring, ioHandler->cq_ring_size);
+    if (ioHandler->sq_ring != NULL) munmap(ioHandler->sq_ring, ioHandler->sq_ring_size);
+
+    // Closing the ring unregisters the buffer ring, the buffers themselves belong to whoever provided them.
+    if (ioHandler->buf_ring != NULL) munmap(ioHandler->buf_ring, ioHandler->buf_ring_size);
+
+    close(ioHandler->ring_fd);
+    ioHandler->ring_fd = -1;
+}
+
+void CleanupIOHandler(void *ioHandler) {
+    CloseIOHandler(ioHandler);
+}
+
+struct io_op {
+    uint32_t magic;
+    uint32_t type;
+    void *data;
+    // Set for operations from CreateIOOperation, embedded operations are owned by their container.
+    bool heapAllocated;
+};
+
+// Count of io_op structs ever taken from the heap. The connection I/O path embeds its operations, so this stays flat under steady load.
+atomic_uint64 ioOpHeapAllocations = 0;
+
+struct io_handler CreateIOHandler() {
+    struct io_handler ioHandler = { .ring_fd = -1 };
+    struct io_uring_params params = {};
+
+    int ringFd = uring_Setup(IO_RING_ENTRIES, &params);
+
+    if (ringFd < 0) {
+        fprintf(stderr, "error: io_uring_setup failed: %i\n", errno);
+        return ioHandler;
+    }
+
+    ioHandler.sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+    ioHandler.cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+
+    // Kernels with SINGLE_MMAP share one mapping for both rings.
+    if ((params.features & IORING_FEAT_SINGLE_MMAP) != 0) {
+        if (ioHandler.cq_ring_size > ioHandler.sq_ring_size) ioHandler.sq_ring_size = ioHandler.cq_ring_size;
+        ioHandler.cq_ring_size = ioHandler.sq_ring_size;
+    }
+
+    void *sqRing = mmap(NULL, ioHandler.sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQ_RING);
+    void *cqRing = sqRing;
+
+    if (sqRing != MAP_FAILED && (params.features & IORING_FEAT_SINGLE_MMAP) == 0) {
+        cqRing = mmap(NULL, ioHandler.cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_CQ_RING);
+    }
+
+    ioHandler.sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    void *sqes = mmap(NULL, ioHandler.sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQES);
+
+    if (sqRing == MAP_FAILED || cqRing == MAP_FAILED || sqes == MAP_FAILED) {
+        fprintf(stderr, "error: io_uring mmap failed: %i\n", errno);
+
+        if (sqes != MAP_FAILED) munmap(sqes, ioHandler.sqes_size);
+        if (cqRing != MAP_FAILED && cqRing != sqRing) munmap(cqRing, ioHandler.cq_ring_size);
+        if (sqRing != MAP_FAILED) munmap(sqRing, ioHandler.sq_ring_size);
+        close(ringFd);
+
+        return ioHandler;
+    }
+
+    ioHandler.ring_fd = ringFd;
+    ioHandler.sq_ring = sqRing;
+    ioHandler.cq_ring = cqRing;
+    ioHandler.sqes = sqes;
+
+    ioHandler.sq_head = (atomic_uint32 *)((uint8_t *)sqRing + params.sq_off.head);
+    ioHandler.sq_tail = (atomic_uint32 *)((uint8_t *)sqRing + params.sq_off.tail);
+    ioHandler.sq_mask = *(uint32_t *)((uint8_t *)sqRing + params.sq_off.ring_mask);
+    ioHandler.sq_entries = params.sq_entries;
+    ioHandler.sq_array = (uint32_t *)((uint8_t *)sqRing + params.sq_off.array);
+
+    ioHandler.cq_head = (atomic_uint32 *)((uint8_t *)cqRing + params.cq_off.head);
+    ioHandler.cq_tail = (atomic_uint32 *)((uint8_t *)cqRing + params.cq_off.tail);
+    ioHandler.cq_mask = *(uint32_t *)((uint8_t *)cqRing + params.cq_off.ring_mask);
+    ioHandler.cqes = (struct io_uring_cqe *)((uint8_t *)cqRing + params.cq_off.cqes);
+
+    ioHandler.sq_lock = 0;
+
+    ioHandler.buf_ring = NULL;
+    ioHandler.buf_ring_lock = 0;
+
+    ioHandler.ext_arg = (params.features & IORING_FEAT_EXT_ARG) != 0;
+
+    return ioHandler;
+}
+
+// Registers a ring of entries (a power of two, at most 32768) buffers the kernel picks from for
+// uring_QueueRecvSelect, so a receive only takes a buffer once data arrived. Buffers are added with
+// uring_ProvideBuffer. Returns false if the kernel doesn't support it (before 5.19).
+bool uring_SetupBufferRing(struct io_handler *ioHandler, uint32_t entries) {
+    size_t size = entries * sizeof(struct io_uring_buf);
+
+    // Must be page aligned.
+    void *ring = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+    if (ring == MAP_FAILED) return false;
+
+    struct io_uring_buf_reg reg = {
+        .ring_addr = (uintptr_t)ring,
+        .ring_entries = entries,
+        .bgid = IO_BUFFER_GROUP,
+    };
+
+    if (uring_Register(ioHandler->ring_fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        munmap(ring, size);
+        return false;
+    }
+
+    ioHandler->buf_ring = ring;
+    ioHandler->buf_ring_mask = entries - 1;
+    ioHandler->buf_ring_size = size;
+
+    return true;
+}
+
+// Hands buf back to the kernel, completions that picked it report id (see io_completion).
+void uring_ProvideBuffer(const struct io_handler *ioHandler, uint16_t id, void *buf, uint32_t len) {
+    struct io_handler *handler = (struct io_handler *)ioHandler;
+
+    for (;;) {
+        uint32_t unlocked = 0;
+        if (atomic_compare_exchange_weak(&handler->buf_ring_lock, &unlocked, 1)) break;
+        _mm_pause();
+    }
+
+    _Atomic(uint16_t) *tail = (_Atomic(uint16_t) *)&handler->buf_ring->tail;
+    uint16_t index = atomic_load_explicit(tail, memory_order_relaxed);
+
+    // Field by field, the reserved field of the first entry is the tail.
+    struct io_uring_buf *entry = &handler->buf_ring->bufs[index & handler->buf_ring_mask];
+    entry->addr = (uintptr_t)buf;
+    entry->len = len;
+    entry->bid = id;
+
+    atomic_store_explicit(tail, index + 1, memory_order_release);
+    atomic_store(&handler->buf_ring_lock, 0);
+}
+
+bool IsValidIOHandler(const struct io_handler *ioHandler) {
+    if (ioHandler == NULL) return false;
+
+    return ioHandler->ring_fd >= 0;
+}
+
+// Prepares an io_op embedded in a longer lived struct (e.g. the connection state) without allocating.
+// The op must not be reused until its previous completion has been dequeued.
+void InitIOOperation(struct io_op *op, uint32_t type, void *data) {
+    memset(op, 0, sizeof(struct io_op));
+    op->magic = IOOperationMagic;
+    op->type = type;
+    op->data = data;
+}
+
+struct io_op *CreateIOOperation(uint32_t type, void *data) {
+    struct io_op *op = malloc(sizeof(struct io_op));
+    if (op == NULL) return NULL;
+
+    InitIOOperation(op, type, data);
+    op->heapAllocated = true;
+
+    atomic_fetch_add_explicit(&ioOpHeapAllocations, 1, memory_order_relaxed);
+
+    return op;
+}
+
+// Must be called once the completion of op has been dequeued, only frees operations from CreateIOOperation.
+void ReleaseIOOperation(struct io_op *op) {
+    if (op == NULL || !op->heapAllocated) return;
+
+    op->magic = 0;
+    free(op);
+}
+
+// Number of SQEs published but not yet consumed by the kernel.
+uint32_t uring_PendingSubmissions(const struct io_handler *ioHandler) {
+    return atomic_load_explicit(ioHandler->sq_tail, memory_order_relaxed) - atomic_load_explicit(ioHandler->sq_head, memory_order_acquire);
+}
+
+// Pushes all published SQEs to the kernel without waiting.
+bool uring_Submit(const struct io_handler *ioHandler) {
+    for (;;) {
+        uint32_t pending = uring_PendingSubmissions(ioHandler);
+        if (pending == 0) return true;
+
+        int ret = uring_Enter(ioHandler->ring_fd, pending, 0, 0);
+
+        if (ret >= 0) return true;
+        if (errno == EINTR) continue;
+        // CQ is backed up, the SQEs stay published and will be submitted by the next RunIO.
+        if (errno == EBUSY || errno == EAGAIN) return true;
+
+        return false;
+    }
+}
+
+// Copies the SQE into the ring and publishes it.
+// Submission is deferred to the next RunIO of any worker, so an I/O queued from a subroutine costs no extra syscall.
+bool uring_Queue(const struct io_handler *ioHandler, const struct io_uring_sqe *sqe) {
+    struct io_handler *handler = (struct io_handler *)ioHandler;
+
+    if (handler == NULL || handler->ring_fd < 0) return false;
+
+    for (;;) {
+        uint32_t unlocked = 0;
+        if (atomic_compare_exchange_weak(&handler->sq_lock, &unlocked, 1)) break;
+        _mm_pause();
+    }
+
+    uint32_t tail = atomic_load_explicit(handler->sq_tail, memory_order_relaxed);
+
+    while (tail - atomic_load_explicit(handler->sq_head, memory_order_acquire) >= handler->sq_entries) {
+        // Ring is full, flush it so the kernel frees up entries.
+        if (!uring_Submit(handler)) {
+            atomic_store(&handler->sq_lock, 0);
+            return false;
+        }
+
+        _mm_pause();
+    }
+
+    uint32_t index = tail & handler->sq_mask;
+    handler->sqes[index] = *sqe;
+    handler->sq_array[index] = index;
+
+    atomic_store_explicit(handler->sq_tail, tail + 1, memory_order_release);
+    atomic_store(&handler->sq_lock, 0);
+
+    return true;
+}
+
+bool uring_QueueRecv(const struct io_handler *ioHandler, int fd, void *buf, uint32_t len, struct io_op *op) {
+    struct io_uring_sqe sqe = {
+        .opcode = IORING_OP_RECV,
+        .fd = fd,
+        .addr = (uintptr_t)buf,
+        .len = len,
+        .user_data = (uintptr_t)op,
+    };
+
+    return uring_Queue(ioHandler, &sqe);
+}
+
+// Receives into a buffer the kernel picks from the buffer ring once data arrived, nothing is held while waiting.
+// Fails with ENOBUFS if the ring ran out.
+bool uring_QueueRecvSelect(const struct io_handler *ioHandler, int fd, struct io_op *op) {
+    struct io_uring_sqe sqe = {
+        .opcode = IORING_OP_RECV,
+        .flags = IOSQE_BUFFER_SELECT,
+        .fd = fd,
+        .buf_group = IO_BUFFER_GROUP,
+        .user_data = (uintptr_t)op,
+    };
+
+    return uring_Queue(ioHandler, &sqe);
+}
+
+// Completes with the accepted socket. A multishot accept (5.19+) completes once per connection while more
+// is set on its completions, the same op is reported every time.
+bool uring_QueueAccept(const struct io_handler *ioHandler, int fd, bool multishot, struct io_op *op) {
+    struct io_uring_sqe sqe = {
+        .opcode = IORING_OP_ACCEPT,
+        .fd = fd,
+        .ioprio = multishot ? IORING_ACCEPT_MULTISHOT : 0,
+        .accept_flags = SOCK_CLOEXEC,
+        .user_data = (uintptr_t)op,
+    };
+
+    return uring_Queue(ioHandler, &sqe);
+}
+
+// MSG_NOSIGNAL, a peer that went away fails the send instead of raising SIGPIPE.
+// msg and the buffers it points to must stay valid until the completion.
+bool uring_QueueSendMsg(const struct io_handler *ioHandler, int fd, const struct msghdr *msg, struct io_op *op) {
+    struct io_uring_sqe sqe = {
+        .opcode = IORING_OP_SENDMSG,
+        .fd = fd,
+        .addr = (uintptr_t)msg,
+        .len = 1,
+        .msg_flags = MSG_NOSIGNAL,
+        .user_data = (uintptr_t)op,
+    };
+
+    return uring_Queue(ioHandler, &sqe);
+}
+
+// Moves len bytes from fdIn (at offIn, or -1 for pipes and sockets) to fdOut without passing through user space,
+// one side must be a pipe.
+bool uring_QueueSplice(const struct io_handler *ioHandler, int fdIn, int64_t offIn, int fdOut, uint32_t len, struct io_op *op) {
+    struct io_uring_sqe sqe = {
+        .opcode = IORING_OP_SPLICE,
+        .fd = fdOut,
+        .off = (uint64_t)-1,
+        .splice_off_in = (uint64_t)offIn,
+        .splice_fd_in = fdIn,
+        .len = len,
+        .user_data = (uintptr_t)op,
+    };
+
+    return uring_Queue(ioHandler, &sqe);
+}
+
+// Unlike I/O queued by workers, this is called from outside the worker loop, so it's submitted immediately.
+bool ResolveIOOperation(const struct io_handler *ioHandler, const struct io_op *op) {
+    struct io_uring_sqe sqe = {
+        .opcode = IORING_OP_NOP,
+        .fd = -1,
+        .user_data = (uintptr_t)op,
+    };
+
+    if (!uring_Queue(ioHandler, &sqe)) return false;
+
+    return uring_Submit(ioHandler);
+}
+
+#define IO_ERR_NULL_HANDLER 0
+#define IO_ERR_NULL_OUTPUT 1
+#define IO_ERR_CLOSED 2
+#define IO_ERR_TIMEOUT 3
+
+// Timeout of RunIOBatch, waits for a completion however long it takes.
+#define IO_WAIT_INFINITE UINT32_MAX
+
+// Read by the kernel once the timeout operation of RunIOBatch is submitted, which may be by a later call.
+_Thread_local struct __kernel_timespec uringWaitTimeout;
+
+struct io_completion {
+    struct io_op *op;
+    bool ok;
+    uint32_t bytesTransferred;
+    // errno of failed operations.
+    uint32_t error;
+    // Provided buffer the data was received into, -1 if none.
+    int32_t bufferId;
+    // A multishot operation stays armed and completes again.
+    bool more;
+};
+
+// Upper bound of completions dequeued by a single RunIOBatch call.
+#define IO_BATCH_MAX 64
+
+// Completions queued and not yet taken by a worker.
+uint32_t PendingCompletions(const struct io_handler *ioHandler) {
+    return atomic_load_explicit(ioHandler->cq_tail, memory_order_relaxed) - atomic_load_explicit(ioHandler->cq_head, memory_order_relaxed);
+}
+
+// Drains up to maxCompletions from the CQ, only entering the kernel when it is empty.
+// Returns the number of completions written, 0 on error, or with IO_ERR_TIMEOUT once timeoutMs passed without one.
+uint32_t RunIOBatch(const struct io_handler *ioHandler, struct io_completion *completions, uint32_t maxCompletions, uint32_t timeoutMs, uint32_t *error) {
+    if (ioHandler == NULL) {
+        if (error != NULL) *error = IO_ERR_NULL_HANDLER;
+        return 0;
+    }
+
+    if (ioHandler->ring_fd < 0) {
+        if (error != NULL) *error = IO_ERR_CLOSED;
+        return 0;
+    }
+
+    if (completions == NULL || maxCompletions == 0) {
+        if (error != NULL) *error = IO_ERR_NULL_OUTPUT;
+        return 0;
+    }
+
+    if (maxCompletions > IO_BATCH_MAX) maxCompletions = IO_BATCH_MAX;
+
+    // A wait that submitted something returns without a completion (and without ETIME), the next one only waits
+    // for what's left of the timeout.
+    struct timespec waitDeadline = { 0 };
+
+    if (timeoutMs != IO_WAIT_INFINITE) {
+        clock_gettime(CLOCK_MONOTONIC, &waitDeadline);
+
+        waitDeadline.tv_sec += timeoutMs / 1000;
+        waitDeadline.tv_nsec += (long)(timeoutMs % 1000) * 1000000;
+
+        if (waitDeadline.tv_nsec >= 1000000000) {
+            waitDeadline.tv_sec++;
+            waitDeadline.tv_nsec -= 1000000000;
+        }
+    }
+
+    for (;;) {
+        uint32_t head = atomic_load_explicit(ioHandler->cq_head, memory_order_acquire);
+        uint32_t tail = atomic_load_explicit(ioHandler->cq_tail, memory_order_acquire);
+
+        if (head == tail) {
+            // Submit whatever this (or any other) worker queued and wait in the same syscall.
+            int ret;
+
+            struct __kernel_timespec timeout = { 0 };
+            bool passed = false;
+
+            if (timeoutMs != IO_WAIT_INFINITE) {
+                struct timespec now;
+                clock_gettime(CLOCK_MONOTONIC, &now);
+
+                timeout.tv_sec = waitDeadline.tv_sec - now.tv_sec;
+                timeout.tv_nsec = waitDeadline.tv_nsec - now.tv_nsec;
+
+                if (timeout.tv_nsec < 0) {
+                    timeout.tv_sec--;
+                    timeout.tv_nsec += 1000000000;
+                }
+
+                passed = timeout.tv_sec < 0 || (timeout.tv_sec == 0 && timeout.tv_nsec == 0);
+
+                // Passed already, only submits and reaps what's there.
+                if (passed) {
+                    timeout.tv_sec = 0;
+                    timeout.tv_nsec = 0;
+                }
+            }
+
+            if (timeoutMs != IO_WAIT_INFINITE && ioHandler->ext_arg) {
+                ret = uring_EnterTimeout(ioHandler->ring_fd, uring_PendingSubmissions(ioHandler), 1, IORING_ENTER_GETEVENTS, &timeout);
+
+                if (ret < 0 && errno == ETIME) {
+                    if (error != NULL) *error = IO_ERR_TIMEOUT;
+                    return 0;
+                }
+            } else if (passed) {
+                ret = uring_Enter(ioHandler->ring_fd, uring_PendingSubmissions(ioHandler), 0, 0);
+
+                if (atomic_load_explicit(ioHandler->cq_tail, memory_order_acquire) == head) {
+                    if (error != NULL) *error = IO_ERR_TIMEOUT;
+                    return 0;
+                }
+            } else {
+                // Without EXT_ARG the wait can't time out itself. A timeout operation ends it instead, completing
+                // once the time passed or as soon as anything else completed (off = 1), it carries no io_op.
+                // On a ring shared by workers another one may reap it, this one then wakes with the next completion.
+                if (timeoutMs != IO_WAIT_INFINITE) {
+                    uringWaitTimeout = timeout;
+
+                    struct io_uring_sqe sqe = {
+                        .opcode = IORING_OP_TIMEOUT,
+                        .fd = -1,
+                        .addr = (uintptr_t)&uringWaitTimeout,
+                        .len = 1,
+                        .off = 1,
+                        .user_data = 0,
+                    };
+
+                    uring_Queue(ioHandler, &sqe);
+                }
+
+                ret = uring_Enter(ioHandler->ring_fd, uring_PendingSubmissions(ioHandler), 1, IORING_ENTER_GETEVENTS);
+            }
+
+            if (ret < 0 && errno != EINTR && errno != EBUSY && errno != EAGAIN) {
+                if (error != NULL) *error = IO_ERR_CLOSED;
+                return 0;
+            }
+
+            continue;
+        }
+
+        uint32_t available = tail - head;
+        if (available > maxCompletions) available = maxCompletions;
+
+        // Copy before claiming, the kernel can only reuse the slots once head moves past them.
+        for (uint32_t i = 0; i < available; i++) {
+            struct io_uring_cqe *cqe = &ioHandler->cqes[(head + i) & ioHandler->cq_mask];
+
+            completions[i] = (struct io_completion){
+                .op = (struct io_op *)(uintptr_t)cqe->user_data,
+                .ok = cqe->res >= 0,
+                .bytesTransferred = cqe->res >= 0 ? (uint32_t)cqe->res : 0,
+                .error = cqe->res < 0 ? (uint32_t)-cqe->res : 0,
+                .bufferId = (cqe->flags & IORING_CQE_F_BUFFER) != 0 ? (int32_t)(cqe->flags >> IORING_CQE_BUFFER_SHIFT) : -1,
+                .more = (cqe->flags & IORING_CQE_F_MORE) != 0
+            };
+        }
+
+        // Multiple workers reap the same ring, claim the whole range by advancing head.
+        if (!atomic_compare_exchange_weak(ioHandler->cq_head, &head, head + available)) continue;
+
+        uint32_t count = 0;
+
+        for (uint32_t i = 0; i < available; i++) {
+            // Internal SQEs (e.g. cancellations) carry no operation.
+            if (completions[i].op == NULL) continue;
+
+            if (completions[i].op->magic != IOOperationMagic) {
+                fprintf(stderr, "panic: received completion from io_uring that isn't a io_op struct.\n");
+                abort();
+            }
+
+            completions[count++] = completions[i];
+        }
+
+        if (count > 0) return count;
+    }
+}
+
+struct io_op *RunIO(const struct io_handler *ioHandler, bool *okOut, uint32_t *bytesTransferred, uint32_t *error) {
+    if (okOut == NULL || bytesTransferred == NULL) {
+        if (error != NULL) *error = IO_ERR_CLOSED;
+        return NULL;
+    }
+
+    struct io_completion completion;
+
+    if (RunIOBatch(ioHandler, &completion, 1, IO_WAIT_INFINITE, error) == 0) return NULL;
+
+    *okOut = completion.ok;
+    *bytesTransferred = completion.bytesTransferred;
+
+    return completion.op;
+}
\ No newline at end of file
@@ -1,6 +1,8 @@
 ﻿#include <windows.h>
 #include <stdio.h>
 #include <stdint.h>
+#include <string.h>
+#include <stdatomic.h>
 #include "./atomics.c"
 
 // "WIOP" (Windows Operation) in hex
@@ -26,8 +28,13 @@ struct io_op {
     uint32_t magic;
     uint32_t type;
     void *data;
+    // Set for operations from CreateIOOperation, embedded operations are owned by their container.
+    bool heapAllocated;
 };
 
+// Count of io_op structs ever taken from the heap. The connection I/O path embeds its operations, so this stays flat under steady load.
+atomic_uint64 ioOpHeapAllocations = 0;
+
 struct io_handler CreateIOHandler() {
     const HANDLE handle = CreateIoCompletionPort(
         INVALID_HANDLE_VALUE,
@@ -47,15 +54,35 @@ bool IsValidIOHandler(const struct io_handler *ioHandler) {
     return ioHandler->iocp_handle != NULL;
 }
 
-struct io_op *CreateIOOperation(uint32_t type, void *data) {
-    struct io_op *op = calloc(1, sizeof(struct io_op));
+// Prepares an io_op embedded in a longer lived struct (e.g. the connection state) without allocating.
+// The op must not be reused until its previous completion has been dequeued.
+void InitIOOperation(struct io_op *op, uint32_t type, void *data) {
+    memset(op, 0, sizeof(struct io_op));
     op->magic = IOOperationMagic;
     op->type = type;
     op->data = data;
+}
+
+struct io_op *CreateIOOperation(uint32_t type, void *data) {
+    struct io_op *op = malloc(sizeof(struct io_op));
+    if (op == NULL) return NULL;
+
+    InitIOOperation(op, type, data);
+    op->heapAllocated = true;
+
+    atomic_fetch_add_explicit(&ioOpHeapAllocations, 1, memory_order_relaxed);
 
     return op;
 }
 
+// Must be called once the completion of op has been dequeued, only frees operations from CreateIOOperation.
+void ReleaseIOOperation(struct io_op *op) {
+    if (op == NULL || !op->heapAllocated) return;
+
+    op->magic = 0;
+    free(op);
+}
+
 bool ResolveIOOperation(const struct io_handler *ioHandler, const struct io_op *op) {
     return PostQueuedCompletionStatus(ioHandler->iocp_handle, 0, 0, (OVERLAPPED*)op);
 }
@@ -72,6 +99,10 @@ HANDLE w32_CreateIOPort(const struct io_handler *ioHandler, const HANDLE fHandle
 #define IO_ERR_NULL_HANDLER 0
 #define IO_ERR_NULL_OUTPUT 1
 #define IO_ERR_CLOSED 2
+#define IO_ERR_TIMEOUT 3
+
+// Timeout of RunIOBatch, waits for a completion however long it takes (INFINITE).
+#define IO_WAIT_INFINITE UINT32_MAX
 
 struct io_op *RunIO(const struct io_handler *ioHandler, bool *okOut, DWORD *bytesTransferred, uint32_t *error) {
     if (ioHandler == NULL) {
@@ -121,4 +152,91 @@ struct io_op *RunIO(const struct io_handler *ioHandler, bool *okOut, DWORD *byte
     }
 
     return op;
+}
+
+struct io_completion {
+    struct io_op *op;
+    bool ok;
+    DWORD bytesTransferred;
+};
+
+// Upper bound of completions dequeued by a single RunIOBatch call.
+#define IO_BATCH_MAX 64
+
+// Completions queued and not yet taken by a worker, a completion port can't be asked so it's always 0.
+uint32_t PendingCompletions(const struct io_handler *ioHandler) {
+    return 0;
+}
+
+// Dequeues up to maxCompletions with one kernel transition, blocking until at least one is available.
+// Returns the number of completions written, 0 on error, or with IO_ERR_TIMEOUT once timeoutMs passed without one.
+uint32_t RunIOBatch(const struct io_handler *ioHandler, struct io_completion *completions, uint32_t maxCompletions, uint32_t timeoutMs, uint32_t *error) {
+    if (ioHandler == NULL) {
+        if (error != NULL) *error = IO_ERR_NULL_HANDLER;
+        return 0;
+    }
+
+    if (ioHandler->iocp_handle == NULL) {
+        if (error != NULL) *error = IO_ERR_CLOSED;
+        return 0;
+    }
+
+    if (completions == NULL || maxCompletions == 0) {
+        if (error != NULL) *error = IO_ERR_NULL_OUTPUT;
+        return 0;
+    }
+
+    if (maxCompletions > IO_BATCH_MAX) maxCompletions = IO_BATCH_MAX;
+
+    OVERLAPPED_ENTRY entries[IO_BATCH_MAX];
+
+    for (;;) {
+        ULONG removed = 0;
+
+        bool ok = GetQueuedCompletionStatusEx(
+            ioHandler->iocp_handle,
+            entries,
+            maxCompletions,
+            &removed,
+            timeoutMs,
+            FALSE
+        );
+
+        if (!ok) {
+            DWORD winErr = GetLastError();
+            if (winErr == WAIT_TIMEOUT) {
+                if (error != NULL) *error = IO_ERR_TIMEOUT;
+                return 0;
+            }
+
+            if (winErr == ERROR_ABANDONED_WAIT_0 || winErr == ERROR_INVALID_HANDLE) {
+                if (error != NULL) *error = IO_ERR_CLOSED;
+                return 0;
+            }
+
+            continue;
+        }
+
+        uint32_t count = 0;
+
+        for (ULONG i = 0; i < removed; i++) {
+            if (entries[i].lpOverlapped == NULL) continue;
+
+            struct io_op *op = (struct io_op*)entries[i].lpOverlapped;
+
+            if (op->magic != IOOperationMagic) {
+                fprintf(stderr, "panic: received overlapped from IOCP that isn't a io_op struct.\n");
+                abort();
+            }
+
+            // GetQueuedCompletionStatusEx doesn't report per-entry failure, the NTSTATUS is left in the OVERLAPPED.
+            completions[count++] = (struct io_completion){
+                .op = op,
+                .ok = (LONG)op->overlapped.Internal >= 0,
+                .bytesTransferred = entries[i].dwNumberOfBytesTransferred
+            };
+        }
+
+        if (count > 0) return count;
+    }
 }
\ No newline at end of file
@@ -0,0 +1,219 @@
+﻿// Load Generator
+
+// Closed-loop keep-alive client for comparing server modes (e.g. ASYNCHTTP_SHARDED set or not), POSIX only.
+// Each thread owns one connection and sends the next request once the previous response is read.
+//
+// loadgen [threads] [seconds] [path] [port]
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+struct load_thread {
+    pthread_t thread;
+    uint16_t port;
+    const char *path;
+    uint64_t deadline;
+
+    // Latency of every response, in nanoseconds.
+    uint64_t *samples;
+    size_t sampleCount;
+    size_t sampleCapacity;
+    uint64_t errors;
+};
+
+uint64_t NowNanos() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+int Connect(uint16_t port) {
+    int sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (sock < 0) return -1;
+
+    int noDelay = 1;
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay));
+
+    struct sockaddr_in endpoint = {
+        .sin_family = AF_INET,
+        .sin_port = htons(port),
+        .sin_addr.s_addr = inet_addr("127.0.0.1"),
+    };
+
+    if (connect(sock, (struct sockaddr *) &endpoint, sizeof(endpoint)) < 0) {
+        close(sock);
+        return -1;
+    }
+
+    return sock;
+}
+
+// Reads one response with a Content-Length body, nothing is pipelined so nothing is read past it.
+bool ReadResponse(int sock, char *buf, size_t capacity) {
+    size_t len = 0;
+    size_t headerEnd = 0;
+    size_t total = 0;
+
+    while (true) {
+        if (len == capacity) return false;
+
+        ssize_t n = recv(sock, buf + len, capacity - len, 0);
+        if (n <= 0) return false;
+
+        len += n;
+
+        if (headerEnd == 0) {
+            char *end = memmem(buf, len, "\r\n\r\n", 4);
+            if (end == NULL) continue;
+
+            headerEnd = end - buf + 4;
+
+            char *field = memmem(buf, headerEnd, "Content-Length: ", 16);
+            if (field == NULL) return false;
+
+            total = headerEnd + strtoull(field + 16, NULL, 10);
+        }
+
+        if (len >= total) return true;
+    }
+}
+
+void *RunLoadThread(void *arg) {
+    struct load_thread *load = arg;
+
+    int sock = Connect(load->port);
+
+    if (sock < 0) {
+        load->errors++;
+        return NULL;
+    }
+
+    char request[512];
+    int requestLen = snprintf(request, sizeof(request), "GET %s HTTP/1.1\r\nHost: 127.0.0.1\r\n\r\n", load->path);
+
+    char response[65536];
+
+    while (NowNanos() < load->deadline) {
+        uint64_t start = NowNanos();
+
+        if (send(sock, request, requestLen, 0) != requestLen || !ReadResponse(sock, response, sizeof(response))) {
+            load->errors++;
+            close(sock);
+
+            sock = Connect(load->port);
+            if (sock < 0) break;
+
+            continue;
+        }
+
+        if (load->sampleCount == load->sampleCapacity) {
+            size_t capacity = load->sampleCapacity == 0 ? 65536 : load->sampleCapacity * 2;
+            uint64_t *samples = realloc(load->samples, capacity * sizeof(uint64_t));
+            if (samples == NULL) break;
+
+            load->samples = samples;
+            load->sampleCapacity = capacity;
+        }
+
+        load->samples[load->sampleCount++] = NowNanos() - start;
+    }
+
+    if (sock >= 0) close(sock);
+    return NULL;
+}
+
+int CompareSamples(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+
+    return (x > y) - (x < y);
+}
+
+int main(int argc, char **argv) {
+    int threadCount = argc > 1 ? atoi(argv[1]) : 64;
+    int seconds = argc > 2 ? atoi(argv[2]) : 10;
+    const char *path = argc > 3 ? argv[3] : "/healthz";
+    uint16_t port = argc > 4 ? (uint16_t)atoi(argv[4]) : 6000;
+
+    if (threadCount <= 0 || seconds <= 0) {
+        fprintf(stderr, "usage: loadgen [threads] [seconds] [path] [port]\n");
+        return 1;
+    }
+
+    struct load_thread *threads = calloc(threadCount, sizeof(struct load_thread));
+
+    if (threads == NULL) {
+        fprintf(stderr, "panic: failed to allocate Load Threads.\n");
+        abort();
+    }
+
+    uint64_t start = NowNanos();
+
+    for (int i = 0; i < threadCount; i++) {
+        threads[i].port = port;
+        threads[i].path = path;
+        threads[i].deadline = start + (uint64_t)seconds * 1000000000ull;
+
+        if (pthread_create(&threads[i].thread, NULL, RunLoadThread, &threads[i]) != 0) {
+            fprintf(stderr, "panic: failed to create Load Thread.\n");
+            abort();
+        }
+    }
+
+    size_t total = 0;
+    uint64_t errors = 0;
+
+    for (int i = 0; i < threadCount; i++) {
+        pthread_join(threads[i].thread, NULL);
+
+        total += threads[i].sampleCount;
+        errors += threads[i].errors;
+    }
+
+    double elapsed = (double)(NowNanos() - start) / 1e9;
+
+    uint64_t *samples = malloc((total > 0 ? total : 1) * sizeof(uint64_t));
+
+    if (samples == NULL) {
+        fprintf(stderr, "panic: failed to allocate Samples.\n");
+        abort();
+    }
+
+    size_t offset = 0;
+
+    for (int i = 0; i < threadCount; i++) {
+        memcpy(samples + offset, threads[i].samples, threads[i].sampleCount * sizeof(uint64_t));
+        offset += threads[i].sampleCount;
+
+        free(threads[i].samples);
+    }
+
+    qsort(samples, total, sizeof(uint64_t), CompareSamples);
+
+    printf("%zu responses in %.2fs: %.0f req/s, %llu errors\n", total, elapsed, (double)total / elapsed, (unsigned long long)errors);
+
+    if (total > 0) {
+        printf("latency p50 %.1fus p99 %.1fus p99.9 %.1fus max %.1fus\n",
+            (double)samples[total / 2] / 1e3,
+            (double)samples[total * 99 / 100] / 1e3,
+            (double)samples[total * 999 / 1000] / 1e3,
+            (double)samples[total - 1] / 1e3);
+    }
+
+    free(samples);
+    free(threads);
+
+    return 0;
+}
\ No newline at end of file
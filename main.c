@@ -1,6 +1,31 @@
 ﻿#include "./tcp.h"
 
 int main() {
+    // Answered from the Response Cache, without dispatching.
+    ResponseCachePut(HTTP_METHOD_GET, "/healthz", 200, "Content-Type: text/plain\r\n", "ok", 2, 0);
+
+    // Metrics of every worker, in the Prometheus text format.
+    AddMetricsRoute("/metrics");
+
+    // Routes are added with AddRoute before this.
+    BuildRouter();
+
+    // One I/O handler per worker, instead of one shared by every worker.
+    shardedIO = getenv("ASYNCHTTP_SHARDED") != NULL;
+
+    // Admission limits (see tcp_common/admission.c), 0 disables one.
+    const char *limit;
+    if ((limit = getenv("ASYNCHTTP_MAX_CONNECTIONS")) != NULL) maxConnections = (uint32_t)strtoul(limit, NULL, 10);
+    if ((limit = getenv("ASYNCHTTP_MAX_IN_FLIGHT")) != NULL) maxInFlightPerWorker = (uint32_t)strtoul(limit, NULL, 10);
+    if ((limit = getenv("ASYNCHTTP_MAX_QUEUED")) != NULL) maxQueuedCompletions = (uint32_t)strtoul(limit, NULL, 10);
+
+    // Files under this directory are served for requests no route matches, see RespondFile.
+    const char *root = getenv("ASYNCHTTP_STATIC_ROOT");
+    if (root != NULL) staticFileRoot = root;
+
+    // Recording costs a branch with metrics disabled, /metrics then only has the gauges.
+    metricsEnabled = getenv("ASYNCHTTP_NO_METRICS") == NULL;
+
     StartServer("127.0.0.1", 6000);
     return 0;
 }
\ No newline at end of file
@@ -0,0 +1,322 @@
+﻿// Metrics
+
+#pragma once
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include "./atomics.c"
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+
+// Every thread recording metrics has its own, registered the first time it records and kept for good. Only that
+// thread writes them, as a plain load and store (relaxed, no locked instruction), so recording costs about what an
+// increment of a local does. A scrape reads every thread's and adds them up, it may miss what's being recorded.
+//
+// Histograms are log-bucketed like HDR histograms: HISTOGRAM_SUB_BUCKETS per power of two, so a bucket is within
+// 1 / HISTOGRAM_SUB_BUCKETS of its values. Values are nanoseconds.
+
+// Set before StartServer, with it cleared recording costs a branch.
+bool metricsEnabled = true;
+
+#define HISTOGRAM_SUB_BITS 3
+#define HISTOGRAM_SUB_BUCKETS (1 << HISTOGRAM_SUB_BITS)
+// Values from 2^HISTOGRAM_MAX_BITS (about 18 minutes) on land in the last bucket.
+#define HISTOGRAM_MAX_BITS 40
+#define HISTOGRAM_BUCKETS ((HISTOGRAM_MAX_BITS - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB_BUCKETS)
+
+enum metric_counter {
+    METRIC_CONNECTIONS_ACCEPTED,
+    METRIC_CONNECTIONS_SHED,
+    METRIC_ACCEPT_ERRORS,
+    METRIC_REQUESTS,
+    METRIC_REQUESTS_SHED,
+    METRIC_BYTES_IN,
+    METRIC_BYTES_OUT,
+    METRIC_PARSE_ERRORS,
+    METRIC_HANDLERS_TIMED_OUT,
+    METRIC_MACHINES_STARTED,
+    METRIC_MACHINES_FINISHED,
+    METRIC_COUNTER_COUNT
+};
+
+enum metric_histogram {
+    // From the request line being parsed until the request is answered and its body read.
+    METRIC_REQUEST_LATENCY,
+    // From the request line being parsed until the head is complete.
+    METRIC_PARSE_TIME,
+    // From a worker taking a batch of completions until every machine in it was resumed.
+    METRIC_BATCH_DISPATCH,
+    METRIC_HISTOGRAM_COUNT
+};
+
+struct histogram {
+    atomic_uint64 sum;
+    atomic_uint64 buckets[HISTOGRAM_BUCKETS];
+};
+
+// Aligned, so no two threads' metrics share a cache line.
+struct thread_metrics {
+    atomic_uint64 counters[METRIC_COUNTER_COUNT];
+    struct histogram histograms[METRIC_HISTOGRAM_COUNT];
+    struct thread_metrics *next;
+} __attribute__((aligned(64)));
+
+// Every thread's metrics, only ever pushed to.
+_Atomic(struct thread_metrics *) metricsThreads = NULL;
+
+_Thread_local struct thread_metrics *threadMetrics = NULL;
+
+struct thread_metrics *RegisterThreadMetrics() {
+    struct thread_metrics *metrics = aligned_alloc(alignof(struct thread_metrics), sizeof(struct thread_metrics));
+    if (metrics == NULL) return NULL;
+
+    memset(metrics, 0, sizeof(struct thread_metrics));
+
+    struct thread_metrics *head = atomic_load(&metricsThreads);
+
+    do {
+        metrics->next = head;
+    } while (!atomic_compare_exchange_weak(&metricsThreads, &head, metrics));
+
+    threadMetrics = metrics;
+    return metrics;
+}
+
+struct thread_metrics *ThreadMetrics() {
+    if (!metricsEnabled) return NULL;
+
+    struct thread_metrics *metrics = threadMetrics;
+    return metrics != NULL ? metrics : RegisterThreadMetrics();
+}
+
+// Only ever called by the thread owning the value.
+void MetricIncrement(atomic_uint64 *value, uint64_t n) {
+    atomic_store_explicit(value, atomic_load_explicit(value, memory_order_relaxed) + n, memory_order_relaxed);
+}
+
+void MetricAdd(enum metric_counter counter, uint64_t n) {
+    struct thread_metrics *metrics = ThreadMetrics();
+    if (metrics == NULL) return;
+
+    MetricIncrement(&metrics->counters[counter], n);
+}
+
+uint32_t HistogramBucket(uint64_t value) {
+    if (value < HISTOGRAM_SUB_BUCKETS) return (uint32_t)value;
+
+    uint32_t exponent = 63 - __builtin_clzll(value);
+    if (exponent >= HISTOGRAM_MAX_BITS) return HISTOGRAM_BUCKETS - 1;
+
+    uint32_t sub = (uint32_t)(value >> (exponent - HISTOGRAM_SUB_BITS)) & (HISTOGRAM_SUB_BUCKETS - 1);
+
+    return (exponent - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB_BUCKETS + sub;
+}
+
+// Highest value that lands in the bucket.
+uint64_t HistogramBucketLimit(uint32_t bucket) {
+    if (bucket < HISTOGRAM_SUB_BUCKETS) return bucket;
+
+    uint32_t exponent = bucket / HISTOGRAM_SUB_BUCKETS + HISTOGRAM_SUB_BITS - 1;
+    uint64_t sub = bucket % HISTOGRAM_SUB_BUCKETS;
+    uint32_t shift = exponent - HISTOGRAM_SUB_BITS;
+
+    return ((HISTOGRAM_SUB_BUCKETS + sub + 1) << shift) - 1;
+}
+
+void MetricRecord(enum metric_histogram histogram, uint64_t nanos) {
+    struct thread_metrics *metrics = ThreadMetrics();
+    if (metrics == NULL) return;
+
+    struct histogram *h = &metrics->histograms[histogram];
+
+    MetricIncrement(&h->sum, nanos);
+    MetricIncrement(&h->buckets[HistogramBucket(nanos)], 1);
+}
+
+// Monotonic nanoseconds, 0 while metrics are disabled, so a span started then isn't recorded.
+uint64_t MetricsNow() {
+    if (!metricsEnabled) return 0;
+
+#ifdef _WIN32
+    LARGE_INTEGER freq, counter;
+    QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&counter);
+
+    return (uint64_t)((double)counter.QuadPart * 1e9 / (double)freq.QuadPart);
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+#endif
+}
+
+// Clock of the worker's current batch, so what runs in it is timed without reading the clock again. 0 on
+// threads that don't run batches.
+_Thread_local uint64_t metricsBatchTime = 0;
+
+// Reads the clock as a worker takes a batch of completions, returns it (0 if metrics are disabled).
+uint64_t MetricsStartBatch() {
+    metricsBatchTime = MetricsNow();
+    return metricsBatchTime;
+}
+
+// Records how long the batch took to dispatch. The clock read also serves what runs after it, until the next batch.
+void MetricsEndBatch(uint64_t start) {
+    if (start == 0) return;
+
+    metricsBatchTime = MetricsNow();
+    MetricRecord(METRIC_BATCH_DISPATCH, metricsBatchTime - start);
+}
+
+// Time of the current batch on a worker, a clock read elsewhere (executors, tests).
+uint64_t MetricsBatchNow() {
+    return metricsBatchTime != 0 ? metricsBatchTime : MetricsNow();
+}
+
+// Records the time since start, if it was taken with metrics enabled. At batch granularity on workers, so a span
+// within one batch records 0.
+void MetricRecordSince(enum metric_histogram histogram, uint64_t start) {
+    if (start == 0) return;
+
+    uint64_t now = MetricsBatchNow();
+
+    // Started on another thread, after the batch this one is in.
+    MetricRecord(histogram, now > start ? now - start : 0);
+}
+
+// Sum of every thread's metrics.
+struct metrics_snapshot {
+    uint64_t counters[METRIC_COUNTER_COUNT];
+    uint64_t counts[METRIC_HISTOGRAM_COUNT];
+    uint64_t sums[METRIC_HISTOGRAM_COUNT];
+    uint64_t buckets[METRIC_HISTOGRAM_COUNT][HISTOGRAM_BUCKETS];
+};
+
+void SnapshotMetrics(struct metrics_snapshot *snapshot) {
+    memset(snapshot, 0, sizeof(struct metrics_snapshot));
+
+    for (struct thread_metrics *metrics = atomic_load(&metricsThreads); metrics != NULL; metrics = metrics->next) {
+        for (uint32_t i = 0; i < METRIC_COUNTER_COUNT; i++) snapshot->counters[i] += atomic_load_explicit(&metrics->counters[i], memory_order_relaxed);
+
+        for (uint32_t i = 0; i < METRIC_HISTOGRAM_COUNT; i++) {
+            struct histogram *h = &metrics->histograms[i];
+
+            snapshot->sums[i] += atomic_load_explicit(&h->sum, memory_order_relaxed);
+
+            for (uint32_t b = 0; b < HISTOGRAM_BUCKETS; b++) snapshot->buckets[i][b] += atomic_load_explicit(&h->buckets[b], memory_order_relaxed);
+        }
+    }
+
+    // Counted from the buckets read, so the count always matches them.
+    for (uint32_t i = 0; i < METRIC_HISTOGRAM_COUNT; i++) {
+        for (uint32_t b = 0; b < HISTOGRAM_BUCKETS; b++) snapshot->counts[i] += snapshot->buckets[i][b];
+    }
+}
+
+// Highest value of the bucket the quantile (0 to 1) falls in, 0 if nothing was recorded.
+uint64_t SnapshotQuantile(const struct metrics_snapshot *snapshot, enum metric_histogram histogram, double quantile) {
+    uint64_t total = snapshot->counts[histogram];
+    if (total == 0) return 0;
+
+    uint64_t rank = (uint64_t)(quantile * (double)(total - 1)) + 1;
+    uint64_t seen = 0;
+
+    for (uint32_t b = 0; b < HISTOGRAM_BUCKETS; b++) {
+        seen += snapshot->buckets[histogram][b];
+        if (seen >= rank) return HistogramBucketLimit(b);
+    }
+
+    return HistogramBucketLimit(HISTOGRAM_BUCKETS - 1);
+}
+
+// Counters without a name only go into gauges.
+const struct {
+    const char *name;
+    const char *help;
+} metricCounterInfo[METRIC_COUNTER_COUNT] = {
+    [METRIC_CONNECTIONS_ACCEPTED] = { "asynchttp_connections_accepted_total", "Connections accepted." },
+    [METRIC_CONNECTIONS_SHED] = { "asynchttp_connections_shed_total", "Connections answered with 503 and closed right after the accept." },
+    [METRIC_ACCEPT_ERRORS] = { "asynchttp_accept_errors_total", "Accepts that failed, those out of descriptors or memory back off before they're armed again." },
+    [METRIC_REQUESTS] = { "asynchttp_requests_total", "Requests whose head was parsed." },
+    [METRIC_REQUESTS_SHED] = { "asynchttp_requests_shed_total", "Requests for a route answered with 503." },
+    [METRIC_BYTES_IN] = { "asynchttp_received_bytes_total", "Bytes received from clients." },
+    [METRIC_BYTES_OUT] = { "asynchttp_sent_bytes_total", "Bytes of responses sent, file bodies included." },
+    [METRIC_PARSE_ERRORS] = { "asynchttp_parse_errors_total", "Requests refused as malformed (400) or too large a head (431)." },
+    [METRIC_HANDLERS_TIMED_OUT] = { "asynchttp_handler_timeouts_total", "Route handlers, body consumers and stream producers abandoned at their deadline, answered with 503 unless they had already." },
+    [METRIC_MACHINES_STARTED] = { NULL, NULL },
+    [METRIC_MACHINES_FINISHED] = { NULL, NULL },
+};
+
+const struct {
+    const char *name;
+    const char *help;
+} metricHistogramInfo[METRIC_HISTOGRAM_COUNT] = {
+    [METRIC_REQUEST_LATENCY] = { "asynchttp_request_duration_seconds", "From the request line being parsed until the request is answered and its body read, timed by the batches of the worker." },
+    [METRIC_PARSE_TIME] = { "asynchttp_request_parse_seconds", "From the request line being parsed until the head is complete, 0 when the whole head came in one batch." },
+    [METRIC_BATCH_DISPATCH] = { "asynchttp_batch_dispatch_seconds", "From a worker taking a batch of completions until every state machine in it was resumed." },
+};
+
+// Exported bucket bounds, powers of two from about 1us to about 68s. The finer buckets are only summed up into them.
+#define METRICS_EXPORT_MIN_BITS 10
+#define METRICS_EXPORT_MAX_BITS 36
+
+// Appends the metrics to buf in the Prometheus text format, returns the length written, or capacity if it didn't fit.
+size_t FormatMetrics(const struct metrics_snapshot *snapshot, char *buf, size_t capacity) {
+    size_t len = 0;
+
+#define METRICS_APPEND(...) do { \
+        int n = snprintf(buf + len, capacity - len, __VA_ARGS__); \
+        if (n < 0 || (size_t)n >= capacity - len) return capacity; \
+        len += n; \
+    } while (0)
+
+    for (uint32_t i = 0; i < METRIC_COUNTER_COUNT; i++) {
+        if (metricCounterInfo[i].name == NULL) continue;
+
+        METRICS_APPEND("# HELP %s %s\n# TYPE %s counter\n%s %llu\n",
+            metricCounterInfo[i].name, metricCounterInfo[i].help,
+            metricCounterInfo[i].name,
+            metricCounterInfo[i].name, (unsigned long long)snapshot->counters[i]);
+    }
+
+    // Started and finished on different threads, only their sums balance.
+    uint64_t started = snapshot->counters[METRIC_MACHINES_STARTED];
+    uint64_t finished = snapshot->counters[METRIC_MACHINES_FINISHED];
+
+    METRICS_APPEND("# HELP asynchttp_state_machines_active State machines created and not finished.\n"
+        "# TYPE asynchttp_state_machines_active gauge\nasynchttp_state_machines_active %llu\n",
+        (unsigned long long)(started > finished ? started - finished : 0));
+
+    for (uint32_t i = 0; i < METRIC_HISTOGRAM_COUNT; i++) {
+        const char *name = metricHistogramInfo[i].name;
+        uint64_t cumulative = 0;
+        uint32_t bucket = 0;
+
+        METRICS_APPEND("# HELP %s %s\n# TYPE %s histogram\n", name, metricHistogramInfo[i].help, name);
+
+        for (uint32_t bits = METRICS_EXPORT_MIN_BITS; bits <= METRICS_EXPORT_MAX_BITS; bits++) {
+            // Buckets below the one 2^bits lands in.
+            uint32_t end = HistogramBucket((uint64_t)1 << bits);
+            for (; bucket < end; bucket++) cumulative += snapshot->buckets[i][bucket];
+
+            METRICS_APPEND("%s_bucket{le=\"%.9g\"} %llu\n", name, (double)((uint64_t)1 << bits) / 1e9, (unsigned long long)cumulative);
+        }
+
+        METRICS_APPEND("%s_bucket{le=\"+Inf\"} %llu\n%s_sum %.9f\n%s_count %llu\n",
+            name, (unsigned long long)snapshot->counts[i],
+            name, (double)snapshot->sums[i] / 1e9,
+            name, (unsigned long long)snapshot->counts[i]);
+    }
+
+#undef METRICS_APPEND
+
+    return len;
+}
\ No newline at end of file
@@ -0,0 +1,79 @@
+﻿// Quiescent-State-Based Reclamation
+
+#pragma once
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdatomic.h>
+#include "./atomics.c"
+
+// Readers traverse shared structures without locks or reference counts. A writer that unlinks a node retires it
+// with the current epoch and may free it once every registered thread has been quiescent (or offline) since.
+// Threads are quiescent between batches of work, and offline while blocked waiting for I/O.
+
+#ifndef QSBR_MAX_THREADS
+#define QSBR_MAX_THREADS 256
+#endif
+
+#define QSBR_OFFLINE 0
+
+struct qsbr_thread {
+    // Last global epoch this thread observed while quiescent, QSBR_OFFLINE while it holds no references.
+    atomic_uint64 epoch;
+} __attribute__((aligned(64)));
+
+// Starts at 1, so no epoch is QSBR_OFFLINE.
+atomic_uint64 qsbrEpoch = 1;
+atomic_uint32 qsbrThreadCount = 0;
+struct qsbr_thread qsbrThreads[QSBR_MAX_THREADS];
+
+_Thread_local struct qsbr_thread *qsbrSelf = NULL;
+
+// Must be called once by a thread before it reads QSBR protected structures, slots are never given back.
+void QSBRRegister() {
+    if (qsbrSelf != NULL) return;
+
+    uint32_t index = atomic_fetch_add(&qsbrThreadCount, 1);
+
+    if (index >= QSBR_MAX_THREADS) {
+        fprintf(stderr, "panic: too many QSBR threads.\n");
+        abort();
+    }
+
+    qsbrSelf = &qsbrThreads[index];
+    atomic_store(&qsbrSelf->epoch, atomic_load(&qsbrEpoch));
+}
+
+// The thread holds no references to retired nodes at this point.
+void QSBRQuiescent() {
+    atomic_store_explicit(&qsbrSelf->epoch, atomic_load_explicit(&qsbrEpoch, memory_order_acquire), memory_order_release);
+}
+
+void QSBROffline() {
+    atomic_store_explicit(&qsbrSelf->epoch, QSBR_OFFLINE, memory_order_release);
+}
+
+// Full fence, so the epoch is published before any shared pointer is read.
+void QSBROnline() {
+    atomic_store(&qsbrSelf->epoch, atomic_load(&qsbrEpoch));
+}
+
+// Called after unlinking, returns the epoch the unlinked nodes are retired with.
+uint64_t QSBRRetire() {
+    return atomic_fetch_add(&qsbrEpoch, 1) + 1;
+}
+
+// Whether no thread can still reference nodes retired with retireEpoch.
+bool QSBRGracePassed(uint64_t retireEpoch) {
+    uint32_t count = atomic_load(&qsbrThreadCount);
+    if (count > QSBR_MAX_THREADS) count = QSBR_MAX_THREADS;
+
+    for (uint32_t i = 0; i < count; i++) {
+        uint64_t epoch = atomic_load(&qsbrThreads[i].epoch);
+
+        if (epoch != QSBR_OFFLINE && epoch < retireEpoch) return false;
+    }
+
+    return true;
+}
\ No newline at end of file
@@ -0,0 +1,324 @@
+﻿// Structural Scanning of HTTP heads
+
+#pragma once
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SCAN_X86
+#endif
+
+// A chunk is scanned once into one bit per byte for each mask, lines and tokens are then found with bit scans.
+enum scan_mask {
+    // '\n'
+    SCAN_LINE_END = 0,
+    // ' '
+    SCAN_SPACE = 1,
+    // ':'
+    SCAN_COLON = 2,
+    // Control characters other than HTAB, CR and LF, and DEL. Never valid in a request line or header.
+    SCAN_INVALID = 3,
+    SCAN_MASK_COUNT = 4
+};
+
+struct scan_index {
+    const uint8_t *base;
+    uint32_t len;
+    // Words allocated per mask.
+    uint32_t capacityWords;
+    // Whether any byte of the chunk is in SCAN_INVALID, so clean chunks skip per line checks.
+    bool hasInvalid;
+    // SCAN_MASK_COUNT consecutive arrays of capacityWords.
+    uint64_t *masks;
+};
+
+// Fills words [0, words) of every mask from words * 64 bytes at buf.
+typedef void (*scan_kernel)(const uint8_t *buf, uint32_t words, uint64_t *masks, uint32_t capacityWords);
+
+enum scan_class {
+    SCAN_CLASS_LINE_END = 1 << SCAN_LINE_END,
+    SCAN_CLASS_SPACE = 1 << SCAN_SPACE,
+    SCAN_CLASS_COLON = 1 << SCAN_COLON,
+    SCAN_CLASS_INVALID = 1 << SCAN_INVALID
+};
+
+uint8_t scanClasses[256];
+atomic_bool scanClassesReady = false;
+
+void InitScanClasses() {
+    if (atomic_load_explicit(&scanClassesReady, memory_order_acquire)) return;
+
+    for (uint32_t c = 0; c < 256; c++) {
+        uint8_t classes = 0;
+
+        if (c == '\n') classes |= SCAN_CLASS_LINE_END;
+        if (c == ' ') classes |= SCAN_CLASS_SPACE;
+        if (c == ':') classes |= SCAN_CLASS_COLON;
+        if ((c < 0x20 && c != '\t' && c != '\r' && c != '\n') || c == 0x7F) classes |= SCAN_CLASS_INVALID;
+
+        scanClasses[c] = classes;
+    }
+
+    atomic_store_explicit(&scanClassesReady, true, memory_order_release);
+}
+
+void ScanBlockScalar(const uint8_t *buf, uint32_t words, uint64_t *masks, uint32_t capacityWords) {
+    for (uint32_t w = 0; w < words; w++) {
+        const uint8_t *block = buf + (size_t)w * 64;
+        uint64_t lineEnd = 0, space = 0, colon = 0, invalid = 0;
+
+        for (uint32_t i = 0; i < 64; i++) {
+            uint64_t classes = scanClasses[block[i]];
+
+            lineEnd |= (classes & 1) << i;
+            space |= ((classes >> SCAN_SPACE) & 1) << i;
+            colon |= ((classes >> SCAN_COLON) & 1) << i;
+            invalid |= ((classes >> SCAN_INVALID) & 1) << i;
+        }
+
+        masks[SCAN_LINE_END * capacityWords + w] = lineEnd;
+        masks[SCAN_SPACE * capacityWords + w] = space;
+        masks[SCAN_COLON * capacityWords + w] = colon;
+        masks[SCAN_INVALID * capacityWords + w] = invalid;
+    }
+}
+
+#ifdef SCAN_X86
+
+// Masks of one vector (16 or 32 bytes), in the low bits.
+struct scan_vector_masks {
+    uint32_t lineEnd;
+    uint32_t space;
+    uint32_t colon;
+    uint32_t invalid;
+};
+
+__attribute__((target("sse2")))
+struct scan_vector_masks ScanVectorSSE2(const uint8_t *buf) {
+    const __m128i ctlMax = _mm_set1_epi8(0x1F);
+    __m128i v = _mm_loadu_si128((const __m128i *)buf);
+
+    __m128i isLineEnd = _mm_cmpeq_epi8(v, _mm_set1_epi8('\n'));
+    // Unsigned v <= 0x1F, as SSE2 only has signed compares.
+    __m128i isCtl = _mm_cmpeq_epi8(_mm_max_epu8(v, ctlMax), ctlMax);
+    __m128i isAllowedCtl = _mm_or_si128(isLineEnd, _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('\t')), _mm_cmpeq_epi8(v, _mm_set1_epi8('\r'))));
+    __m128i isInvalid = _mm_or_si128(_mm_andnot_si128(isAllowedCtl, isCtl), _mm_cmpeq_epi8(v, _mm_set1_epi8(0x7F)));
+
+    return (struct scan_vector_masks){
+        .lineEnd = (uint32_t)_mm_movemask_epi8(isLineEnd),
+        .space = (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8(' '))),
+        .colon = (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8(':'))),
+        .invalid = (uint32_t)_mm_movemask_epi8(isInvalid),
+    };
+}
+
+// Joins the masks of four consecutive 16 byte vectors into a word.
+uint64_t JoinVectorMasks(uint32_t a, uint32_t b, uint32_t c, uint32_t d) {
+    return (a | b << 16) | (uint64_t)(c | d << 16) << 32;
+}
+
+// Unrolled, so every mask lands with a constant shift (a shift by a variable count costs three uops on Intel, which
+// made the looped version lose to memchr). Flattened, the vector helpers are inlined.
+__attribute__((target("sse2"), flatten))
+void ScanBlockSSE2(const uint8_t *buf, uint32_t words, uint64_t *masks, uint32_t capacityWords) {
+    for (uint32_t w = 0; w < words; w++) {
+        const uint8_t *block = buf + (size_t)w * 64;
+
+        struct scan_vector_masks a = ScanVectorSSE2(block);
+        struct scan_vector_masks b = ScanVectorSSE2(block + 16);
+        struct scan_vector_masks c = ScanVectorSSE2(block + 32);
+        struct scan_vector_masks d = ScanVectorSSE2(block + 48);
+
+        masks[SCAN_LINE_END * capacityWords + w] = JoinVectorMasks(a.lineEnd, b.lineEnd, c.lineEnd, d.lineEnd);
+        masks[SCAN_SPACE * capacityWords + w] = JoinVectorMasks(a.space, b.space, c.space, d.space);
+        masks[SCAN_COLON * capacityWords + w] = JoinVectorMasks(a.colon, b.colon, c.colon, d.colon);
+        masks[SCAN_INVALID * capacityWords + w] = JoinVectorMasks(a.invalid, b.invalid, c.invalid, d.invalid);
+    }
+}
+
+__attribute__((target("avx2")))
+struct scan_vector_masks ScanVectorAVX2(const uint8_t *buf) {
+    const __m256i ctlMax = _mm256_set1_epi8(0x1F);
+    __m256i v = _mm256_loadu_si256((const __m256i *)buf);
+
+    __m256i isLineEnd = _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\n'));
+    __m256i isCtl = _mm256_cmpeq_epi8(_mm256_max_epu8(v, ctlMax), ctlMax);
+    __m256i isAllowedCtl = _mm256_or_si256(isLineEnd, _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('\t')), _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\r'))));
+    __m256i isInvalid = _mm256_or_si256(_mm256_andnot_si256(isAllowedCtl, isCtl), _mm256_cmpeq_epi8(v, _mm256_set1_epi8(0x7F)));
+
+    return (struct scan_vector_masks){
+        .lineEnd = (uint32_t)_mm256_movemask_epi8(isLineEnd),
+        .space = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, _mm256_set1_epi8(' '))),
+        .colon = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, _mm256_set1_epi8(':'))),
+        .invalid = (uint32_t)_mm256_movemask_epi8(isInvalid),
+    };
+}
+
+// Unrolled like the SSE2 kernel.
+__attribute__((target("avx2"), flatten))
+void ScanBlockAVX2(const uint8_t *buf, uint32_t words, uint64_t *masks, uint32_t capacityWords) {
+    for (uint32_t w = 0; w < words; w++) {
+        const uint8_t *block = buf + (size_t)w * 64;
+
+        struct scan_vector_masks lo = ScanVectorAVX2(block);
+        struct scan_vector_masks hi = ScanVectorAVX2(block + 32);
+
+        masks[SCAN_LINE_END * capacityWords + w] = lo.lineEnd | (uint64_t)hi.lineEnd << 32;
+        masks[SCAN_SPACE * capacityWords + w] = lo.space | (uint64_t)hi.space << 32;
+        masks[SCAN_COLON * capacityWords + w] = lo.colon | (uint64_t)hi.colon << 32;
+        masks[SCAN_INVALID * capacityWords + w] = lo.invalid | (uint64_t)hi.invalid << 32;
+    }
+}
+
+#endif
+
+_Atomic(scan_kernel) scanKernel = NULL;
+
+// AVX2 where the CPU has it, else SSE2 (every x86-64 does), else the table. Both kernels also validate every byte,
+// which the memchr per line split they replaced didn't. bench.c on the sandbox Xeon, ns per head for browser / curl /
+// health check heads, the minimum of 15 interleaved runs:
+//   memchr 395 / 116 / 115 (353 / 106 / 106 with glibc held to its SSE2 memchr, as on a CPU without AVX2)
+//   SSE2   316 /  84 /  81
+//   AVX2   253 /  67 /  67
+scan_kernel SelectScanKernel() {
+    scan_kernel kernel = atomic_load_explicit(&scanKernel, memory_order_acquire);
+    if (kernel != NULL) return kernel;
+
+    InitScanClasses();
+
+    kernel = ScanBlockScalar;
+
+#ifdef SCAN_X86
+    __builtin_cpu_init();
+
+    if (__builtin_cpu_supports("avx2")) {
+        kernel = ScanBlockAVX2;
+    } else if (__builtin_cpu_supports("sse2")) {
+        kernel = ScanBlockSSE2;
+    }
+#endif
+
+    atomic_store_explicit(&scanKernel, kernel, memory_order_release);
+    return kernel;
+}
+
+// Grows the mask storage, contents are not preserved.
+bool ReserveScanIndex(struct scan_index *index, uint32_t len) {
+    uint32_t words = (len + 63) / 64;
+    if (words <= index->capacityWords) return true;
+
+    uint64_t *masks = malloc((size_t)words * SCAN_MASK_COUNT * sizeof(uint64_t));
+    if (masks == NULL) return false;
+
+    free(index->masks);
+    index->masks = masks;
+    index->capacityWords = words;
+
+    return true;
+}
+
+// Bytes scanned by this thread, lets tests check that resumed parsing never rescans.
+_Thread_local uint64_t scannedBytes = 0;
+
+// Scans len bytes at buf with the given kernel, bits past len are left clear.
+bool ScanChunkWith(scan_kernel kernel, struct scan_index *index, const uint8_t *buf, uint32_t len) {
+    InitScanClasses();
+
+    if (!ReserveScanIndex(index, len)) return false;
+
+    scannedBytes += len;
+
+    index->base = buf;
+    index->len = len;
+
+    uint32_t fullWords = len / 64;
+
+    kernel(buf, fullWords, index->masks, index->capacityWords);
+
+    uint32_t rest = len % 64;
+
+    if (rest > 0) {
+        uint8_t block[64];
+        memcpy(block, buf + (size_t)fullWords * 64, rest);
+        memset(block + rest, 0, 64 - rest);
+
+        kernel(block, 1, index->masks + fullWords, index->capacityWords);
+
+        // Padding is NUL, which would otherwise be flagged as invalid.
+        uint64_t keep = ((uint64_t)1 << rest) - 1;
+
+        for (uint32_t m = 0; m < SCAN_MASK_COUNT; m++) {
+            index->masks[m * index->capacityWords + fullWords] &= keep;
+        }
+    }
+
+    const uint64_t *invalid = index->masks + (size_t)SCAN_INVALID * index->capacityWords;
+    uint64_t anyInvalid = 0;
+
+    for (uint32_t w = 0; w < (len + 63) / 64; w++) anyInvalid |= invalid[w];
+
+    index->hasInvalid = anyInvalid != 0;
+
+    return true;
+}
+
+bool ScanChunk(struct scan_index *index, const uint8_t *buf, uint32_t len) {
+    return ScanChunkWith(SelectScanKernel(), index, buf, len);
+}
+
+// Finds the first byte of mask in [from, to), positions are relative to the scanned chunk.
+bool ScanFind(const struct scan_index *index, enum scan_mask mask, uint32_t from, uint32_t to, uint32_t *pos) {
+    if (to > index->len) to = index->len;
+    if (from >= to) return false;
+
+    const uint64_t *words = index->masks + (size_t)mask * index->capacityWords;
+
+    uint32_t w = from / 64;
+    uint64_t word = words[w] & (~(uint64_t)0 << (from % 64));
+
+    for (;;) {
+        if (word != 0) {
+            uint32_t found = w * 64 + (uint32_t)__builtin_ctzll(word);
+            if (found >= to) return false;
+
+            *pos = found;
+            return true;
+        }
+
+        w++;
+        if (w * 64 >= to) return false;
+
+        word = words[w];
+    }
+}
+
+bool ScanAny(const struct scan_index *index, enum scan_mask mask, uint32_t from, uint32_t to) {
+    if (mask == SCAN_INVALID && !index->hasInvalid) return false;
+
+    uint32_t pos;
+    return ScanFind(index, mask, from, to, &pos);
+}
+
+// RFC 9110 tchar, used for methods and header names.
+bool IsTokenChar(uint8_t c) {
+    if (c >= 'a' && c <= 'z') return true;
+    if (c >= 'A' && c <= 'Z') return true;
+    if (c >= '0' && c <= '9') return true;
+
+    return c != 0 && strchr("!#$%&'*+-.^_`|~", c) != NULL;
+}
+
+bool IsToken(const uint8_t *buf, uint32_t len) {
+    if (len == 0) return false;
+
+    for (uint32_t i = 0; i < len; i++) {
+        if (!IsTokenChar(buf[i])) return false;
+    }
+
+    return true;
+}
\ No newline at end of file
@@ -0,0 +1,196 @@
+﻿// Size-Class Slab Allocator
+
+#pragma once
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include "./atomics.c"
+
+// "SLAB" in hex
+#define SLAB_MAGIC 0x534c4142
+
+// Smallest class is 1 << SLAB_MIN_SHIFT bytes (including the block header), each following class doubles.
+#define SLAB_MIN_SHIFT 6
+#define SLAB_CLASS_COUNT 10
+// Blocks bigger than the largest class go straight to malloc.
+#define SLAB_LARGE_CLASS SLAB_CLASS_COUNT
+
+// Memory is carved from chunks of this size (malloc alignment is enough), a chunk is never returned to the OS.
+#define SLAB_CHUNK_SIZE (256 * 1024)
+
+struct slab_cache;
+
+struct slab_block {
+    union {
+        // Cache of the thread that carved the block.
+        struct slab_cache *owner;
+        // Payload size of large blocks.
+        size_t largeSize;
+    };
+    uint32_t magic;
+    uint32_t sizeClass;
+} __attribute__((aligned(alignof(max_align_t))));
+
+static_assert(sizeof(struct slab_block) % alignof(max_align_t) == 0,
+    "Slab Block is misaligned.");
+
+// Overlays the payload of a free block.
+struct slab_free_node {
+    struct slab_block *next;
+};
+
+struct slab_cache {
+    // Only touched by the owning thread.
+    struct slab_block *freeList[SLAB_CLASS_COUNT];
+    uint64_t allocations[SLAB_CLASS_COUNT];
+
+    // Blocks freed by other threads, pushed lock-free and taken as a whole by the owner.
+    _Atomic(struct slab_block *) remoteFree;
+};
+
+// Bytes reserved from the OS by every cache, including large blocks.
+atomic_uint64 slabReservedBytes = 0;
+
+// Caches are intentionally never freed, blocks that outlive their thread can still be returned to it.
+_Thread_local struct slab_cache *slabCache = NULL;
+
+struct slab_free_node *SlabFreeNode(struct slab_block *block) {
+    return (struct slab_free_node *)(block + 1);
+}
+
+size_t SlabClassSize(uint32_t sizeClass) {
+    return (size_t)1 << (SLAB_MIN_SHIFT + sizeClass);
+}
+
+// Returns the class a payload of size fits in, or SLAB_LARGE_CLASS.
+uint32_t SlabSizeClass(size_t size) {
+    size_t total = size + sizeof(struct slab_block);
+    if (total <= SlabClassSize(0)) return 0;
+
+    // Bits of total - 1 is the exponent of the smallest power of two holding total.
+    uint32_t sizeClass = 64 - __builtin_clzll((uint64_t)total - 1) - SLAB_MIN_SHIFT;
+
+    return sizeClass < SLAB_CLASS_COUNT ? sizeClass : SLAB_LARGE_CLASS;
+}
+
+struct slab_cache *GetSlabCache() {
+    if (slabCache != NULL) return slabCache;
+
+    slabCache = calloc(1, sizeof(struct slab_cache));
+
+    if (slabCache == NULL) {
+        fprintf(stderr, "panic: failed to allocate Slab Cache.\n");
+        abort();
+    }
+
+    return slabCache;
+}
+
+// Moves every remotely freed block back to the local free lists.
+void ReclaimRemoteSlabs(struct slab_cache *cache) {
+    struct slab_block *block = atomic_exchange_explicit(&cache->remoteFree, NULL, memory_order_acquire);
+
+    while (block != NULL) {
+        struct slab_block *next = SlabFreeNode(block)->next;
+
+        SlabFreeNode(block)->next = cache->freeList[block->sizeClass];
+        cache->freeList[block->sizeClass] = block;
+
+        block = next;
+    }
+}
+
+bool RefillSlabClass(struct slab_cache *cache, uint32_t sizeClass) {
+    size_t blockSize = SlabClassSize(sizeClass);
+    size_t chunkSize = blockSize > SLAB_CHUNK_SIZE / 4 ? blockSize * 4 : SLAB_CHUNK_SIZE;
+
+    uint8_t *chunk = malloc(chunkSize);
+    if (chunk == NULL) return false;
+
+    atomic_fetch_add_explicit(&slabReservedBytes, chunkSize, memory_order_relaxed);
+
+    for (size_t offset = 0; offset + blockSize <= chunkSize; offset += blockSize) {
+        struct slab_block *block = (struct slab_block *)(chunk + offset);
+
+        block->owner = cache;
+        block->sizeClass = sizeClass;
+        block->magic = 0;
+
+        SlabFreeNode(block)->next = cache->freeList[sizeClass];
+        cache->freeList[sizeClass] = block;
+    }
+
+    return true;
+}
+
+// Payload is aligned to max_align_t and not zeroed.
+void *SlabAlloc(size_t size) {
+    uint32_t sizeClass = SlabSizeClass(size);
+
+    if (sizeClass == SLAB_LARGE_CLASS) {
+        struct slab_block *block = malloc(sizeof(struct slab_block) + size);
+        if (block == NULL) return NULL;
+
+        atomic_fetch_add_explicit(&slabReservedBytes, sizeof(struct slab_block) + size, memory_order_relaxed);
+
+        block->largeSize = size;
+        block->sizeClass = SLAB_LARGE_CLASS;
+        block->magic = SLAB_MAGIC;
+
+        return block + 1;
+    }
+
+    struct slab_cache *cache = GetSlabCache();
+
+    if (cache->freeList[sizeClass] == NULL) {
+        ReclaimRemoteSlabs(cache);
+
+        if (cache->freeList[sizeClass] == NULL && !RefillSlabClass(cache, sizeClass)) return NULL;
+    }
+
+    struct slab_block *block = cache->freeList[sizeClass];
+    cache->freeList[sizeClass] = SlabFreeNode(block)->next;
+    cache->allocations[sizeClass]++;
+
+    block->magic = SLAB_MAGIC;
+
+    return block + 1;
+}
+
+// Can be called from any thread, blocks go back to the cache of the thread that carved them.
+void SlabFree(void *ptr) {
+    if (ptr == NULL) return;
+
+    struct slab_block *block = (struct slab_block *)ptr - 1;
+
+    if (block->magic != SLAB_MAGIC) {
+        fprintf(stderr, "panic: Slab Block freed twice or corrupted.\n");
+        abort();
+    }
+
+    block->magic = 0;
+
+    if (block->sizeClass == SLAB_LARGE_CLASS) {
+        atomic_fetch_sub_explicit(&slabReservedBytes, sizeof(struct slab_block) + block->largeSize, memory_order_relaxed);
+        free(block);
+        return;
+    }
+
+    struct slab_cache *owner = block->owner;
+
+    if (owner == slabCache) {
+        SlabFreeNode(block)->next = owner->freeList[block->sizeClass];
+        owner->freeList[block->sizeClass] = block;
+        return;
+    }
+
+    // Push only, the owner takes the whole list at once, so there's no ABA.
+    struct slab_block *head = atomic_load_explicit(&owner->remoteFree, memory_order_relaxed);
+
+    do {
+        SlabFreeNode(block)->next = head;
+    } while (!atomic_compare_exchange_weak_explicit(&owner->remoteFree, &head, block, memory_order_release, memory_order_relaxed));
+}
\ No newline at end of file
@@ -8,13 +8,17 @@
 #include <stdatomic.h>
 #include <immintrin.h>
 #include "./atomics.c"
+#include "./slab.c"
+#include "./metrics.c"
 
-// First Parameter is a parameter that can be passed in.
-// Returns a ptr to be saved as Async State
+// First Parameter is the inline state when the descriptor declares a stateSize (zeroed unless the descriptor sets
+// constructsState), NULL otherwise.
+// Second Parameter is a parameter that can be passed in.
+// Returns a ptr to be saved as Async State (the inline state, if any)
 // Can pass in pointer to stack here, as constructor is called immediately on AwaitAsync.
-typedef void *(*async_constructor)(void *);
+typedef void *(*async_constructor)(void *, void *);
 
-// Parameter is ptr to Async State, this function is responsible for freeing
+// Parameter is ptr to Async State, this function is responsible for freeing it unless it is inline.
 typedef void (*async_destructor)(void *);
 
 // Parameter is ptr to Async State
@@ -25,6 +29,10 @@ struct async_descriptor {
     async_constructor constructor;
     async_destructor destructor;
     async_subroutine subroutine;
+    // Size of the state allocated inline after the async_state, 0 if the constructor allocates its own.
+    uint32_t stateSize;
+    // The constructor initializes every field of the inline state it relies on, so it isn't zeroed first.
+    bool constructsState;
 };
 
 enum machine_flags {
@@ -35,20 +43,44 @@ enum machine_flags {
     // State Machine is currently suspended waiting for another State Machine to finish.
     MACHINE_SUSPENDED_AWAIT = 1 << 2,
     // Will call KillAsync when it finishes, regardless of result. Used if catastrophic failure occurs
-    MACHINE_FORCE_DESTROY = 1 << 3
+    MACHINE_FORCE_DESTROY = 1 << 3,
+    // Awaited on an executor thread instead of inline, see SpawnAsync.
+    MACHINE_SPAWNED = 1 << 4,
+    // I/O completed while the subroutine that queued it was still running, the running thread resumes it itself
+    // instead of the completing thread waiting for it to return.
+    MACHINE_RESUME_PENDING = 1 << 5,
+    // Given up by the machine awaiting it (see AbortAsync). It's destroyed instead of running again, and never
+    // resumes that machine.
+    MACHINE_ABORTED = 1 << 6,
+    // Aborted while running, the running thread resumes the awaiting machine once the subroutine returned.
+    MACHINE_ABORT_HANDOFF = 1 << 7,
+    // Its subroutine finished (or it was killed), too late to abort it.
+    MACHINE_FINISHED = 1 << 8,
+    // Paused (see subroutine_pause) until it's awaited again, too late to abort this await.
+    MACHINE_PAUSED = 1 << 9
 };
 
 struct async_state {
     struct async_descriptor descriptor;
     void *state;
     struct async_state *awaiting;
+    // Next in the run queue of the thread running it.
+    struct async_state *runNext;
     atomic_uint32 flags;
-};
+    // Holders of the memory, the machine itself and whoever called RetainAsync. Destroying the machine only runs
+    // its destructor while there are others.
+    atomic_uint32 refs;
+} __attribute__((aligned(alignof(max_align_t))));
+
+// Inline state directly follows the header.
+static_assert(sizeof(struct async_state) % alignof(max_align_t) == 0,
+    "Async State is misaligned.");
 
 enum subroutine_result_type {
     SUBROUTINE_YIELD_IO,
     SUBROUTINE_AWAIT,
-    SUBROUTINE_FINISHED
+    SUBROUTINE_FINISHED,
+    SUBROUTINE_PAUSE
 };
 
 struct subroutine_result {
@@ -59,6 +91,8 @@ struct subroutine_result {
 
 const struct subroutine_result subroutine_yield_io = { .type = SUBROUTINE_YIELD_IO, .await = NULL };
 const struct subroutine_result subroutine_finish = { .type = SUBROUTINE_FINISHED, .await = NULL };
+// Resumes the awaiting machine without finishing, the machine runs again once that one awaits it again.
+const struct subroutine_result subroutine_pause = { .type = SUBROUTINE_PAUSE, .await = NULL };
 
 struct subroutine_result subroutine_await(struct async_state *state) {
     return (struct subroutine_result){ .type = SUBROUTINE_AWAIT, .await = state };
@@ -69,7 +103,9 @@ _Thread_local struct async_state *currentAsync = NULL;
 const struct async_descriptor nullAsync = {
     .constructor = NULL,
     .destructor = NULL,
-    .subroutine = NULL
+    .subroutine = NULL,
+    .stateSize = 0,
+    .constructsState = false
 };
 
 bool IsValidDescriptor(struct async_descriptor descriptor) {
@@ -80,47 +116,135 @@ bool IsValidDescriptor(struct async_descriptor descriptor) {
     return true;
 }
 
-void KillAsync(struct async_state *machineState) {
-    if (machineState == NULL) return;
-    if (!IsValidDescriptor(machineState->descriptor)) return;
-    if (machineState->state == NULL) return;
+// Keeps the memory of the machine after it's destroyed, so its flags can still be read (e.g. by AbortAsync).
+void RetainAsync(struct async_state *machineState) {
+    atomic_fetch_add(&machineState->refs, 1);
+}
 
-    // check if running, if so set to "force destroy"
-    uint32_t flags = atomic_load(&machineState->flags);
+void ReleaseAsync(struct async_state *machineState) {
+    if (atomic_fetch_sub(&machineState->refs, 1) == 1) SlabFree(machineState);
+}
+
+// Runs the destructor, the memory is freed once nothing retains it.
+void DestroyAsync(struct async_state *machineState) {
+    machineState->descriptor.destructor(machineState->state);
+    machineState->state = NULL;
+    MetricAdd(METRIC_MACHINES_FINISHED, 1);
+
+    ReleaseAsync(machineState);
+}
+
+extern void ResumeFromAwait(struct async_state *machineState);
 
-    if ((flags & MACHINE_RUNNING) != 0) {
-        printf("Failed to kill\n");
-        atomic_fetch_or(&machineState->flags, MACHINE_FORCE_DESTROY);
+// See executor.c
+extern void SpawnOnExecutor(struct async_state *machineState);
+extern void ResumeSpawner(struct async_state *machineState);
+
+// Resumes the machine awaiting one that finished, on its worker if that one was spawned.
+void ResumeAwaiting(struct async_state *awaiting, bool spawned) {
+    if (awaiting == NULL) return;
+
+    if (spawned) {
+        ResumeSpawner(awaiting);
         return;
     }
 
-    struct async_state *awaiting = machineState->awaiting;
+    ResumeFromAwait(awaiting);
+}
 
-    machineState->descriptor.destructor(machineState->state);
-    free(machineState);
+// Kills the machine and every machine awaiting it, up the chain.
+void KillAsync(struct async_state *machineState) {
+    while (machineState != NULL) {
+        if (!IsValidDescriptor(machineState->descriptor)) return;
+        if (machineState->state == NULL) return;
 
-    if (awaiting == NULL) return;
+        // check if running, if so set to "force destroy"
+        uint32_t flags = atomic_load(&machineState->flags);
+
+        if ((flags & MACHINE_RUNNING) != 0) {
+            printf("Failed to kill\n");
+            atomic_fetch_or(&machineState->flags, MACHINE_FORCE_DESTROY);
+            return;
+        }
+
+        struct async_state *awaiting = machineState->awaiting;
+
+        flags = atomic_fetch_or(&machineState->flags, MACHINE_FINISHED);
+        DestroyAsync(machineState);
 
-    KillAsync(awaiting);
+        // The machine that gave up on it lives on.
+        if ((flags & MACHINE_ABORTED) != 0) {
+            if ((flags & MACHINE_ABORT_HANDOFF) != 0) ResumeAwaiting(awaiting, (flags & MACHINE_SPAWNED) != 0);
+            return;
+        }
+
+        machineState = awaiting;
+    }
+}
+
+// Gives up on an awaited machine, e.g. once it ran past a deadline. It's destroyed the next time it would run, and
+// never resumes the machine awaiting it. Returns whether the caller has to resume that machine itself, false if the
+// machine finished already, or is running and resumes it once its subroutine returns.
+// The caller must retain the machine, it may be destroyed concurrently.
+bool AbortAsync(struct async_state *machineState) {
+    uint32_t flags = atomic_load(&machineState->flags);
+
+    for (;;) {
+        if ((flags & (MACHINE_FINISHED | MACHINE_PAUSED | MACHINE_ABORTED)) != 0) return false;
+
+        uint32_t newFlags = flags | MACHINE_ABORTED;
+        if ((flags & MACHINE_RUNNING) != 0) newFlags |= MACHINE_ABORT_HANDOFF;
+
+        if (atomic_compare_exchange_weak(&machineState->flags, &flags, newFlags)) return (flags & MACHINE_RUNNING) == 0;
+    }
 }
 
 // for IO operations structs must start with a io_result object
 
-extern void ResumeFromAwait(struct async_state *machineState);
+// Clears RUNNING after the subroutine yielded for I/O, released is set to the flags it was cleared from. Returns false
+// if the I/O already completed, the resume is then handed to this thread, which still holds RUNNING.
+bool ReleaseAfterYield(struct async_state *machineState, uint32_t *released) {
+    uint32_t flags = atomic_load(&machineState->flags);
 
-// Constraint: RunAsync assumes machine is not running, use only after being initalized or use ResumeFromAwait or Resume
-// Caller is responsible for setting RUNNING flag.
-void RunAsync(struct async_state *machineState) {
-    if (machineState == NULL) return;
-    if (!IsValidDescriptor(machineState->descriptor)) return;
-    if (machineState->state == NULL) return;
+    for (;;) {
+        if ((flags & MACHINE_RESUME_PENDING) != 0) {
+            if (atomic_compare_exchange_weak(&machineState->flags, &flags, flags & ~MACHINE_RESUME_PENDING)) return false;
+            continue;
+        }
 
-    // also check if already running
+        if (atomic_compare_exchange_weak(&machineState->flags, &flags, flags & ~(MACHINE_RUNNING | MACHINE_ABORT_HANDOFF))) {
+            *released = flags;
+            return true;
+        }
+    }
+}
 
-    // Expects no more than one more async to be
-    if (currentAsync != NULL) {
-        fprintf(stderr, "critical error: async called during running async.");
-        KillAsync(machineState);
+// Machines ready to run on this thread. Awaiting and resuming a machine enqueues it instead of running it
+// recursively, and the outermost RunAsync drains the queue, so the native stack stays flat however long the chain
+// of awaiting machines grows.
+struct async_run_queue {
+    struct async_state *head;
+    struct async_state *tail;
+    bool draining;
+};
+
+_Thread_local struct async_run_queue runQueue = { .head = NULL, .tail = NULL, .draining = false };
+
+void RunAsync(struct async_state *machineState);
+
+// Runs the subroutine once, and acts on its result. Only called by RunAsync while draining.
+void StepAsync(struct async_state *machineState) {
+    struct async_state *awaiting = machineState->awaiting;
+
+    Run:;
+    uint32_t runFlags = atomic_load(&machineState->flags);
+    bool spawned = (runFlags & MACHINE_SPAWNED) != 0;
+
+    if ((runFlags & MACHINE_ABORTED) != 0) {
+        atomic_fetch_or(&machineState->flags, MACHINE_FINISHED);
+        DestroyAsync(machineState);
+
+        if ((runFlags & MACHINE_ABORT_HANDOFF) != 0) ResumeAwaiting(awaiting, spawned);
         return;
     }
 
@@ -131,7 +255,7 @@ void RunAsync(struct async_state *machineState) {
     currentAsync = NULL;
 
     if ((atomic_load(&machineState->flags) & MACHINE_FORCE_DESTROY) != 0) {
-        atomic_store(&machineState->flags, 0);
+        atomic_fetch_and(&machineState->flags, MACHINE_ABORTED | MACHINE_ABORT_HANDOFF);
         KillAsync(machineState);
         return;
     }
@@ -139,11 +263,13 @@ void RunAsync(struct async_state *machineState) {
     switch (result.type) {
         case SUBROUTINE_YIELD_IO: {
             printf("Yield IO\n");
-            // for IO, have a PrepareIO/AbortIO command that is called before any IO operation is called.
-            // also have a CheckIO function that unsets the suspened IO flag and will return wether it was set.
-            // if CheckIO returns true, spinlock until no longer running (expected to be short.)
+            // PrepareIO set SUSPENDED_IO before the I/O was queued, its completion is either handed to this
+            // thread (RESUME_PENDING) or resumes the machine once RUNNING is cleared, see ResumeFromIO.
+            uint32_t released;
+            if (!ReleaseAfterYield(machineState, &released)) goto Run;
 
-            atomic_fetch_and(&machineState->flags, ~MACHINE_RUNNING);
+            // Aborted while it ran, the machine awaiting it was left to this thread.
+            if ((released & MACHINE_ABORT_HANDOFF) != 0) ResumeAwaiting(awaiting, spawned);
             break;
         }
         case SUBROUTINE_AWAIT: {
@@ -167,28 +293,82 @@ void RunAsync(struct async_state *machineState) {
                 return;
             }
 
-            // should make this atomic with CAS loop
-            atomic_fetch_or(&machineState->flags, MACHINE_SUSPENDED_AWAIT);
-            atomic_fetch_and(&machineState->flags, ~MACHINE_RUNNING);
+            uint32_t flags = atomic_load(&machineState->flags);
+            while (!atomic_compare_exchange_weak(&machineState->flags, &flags, (flags | MACHINE_SUSPENDED_AWAIT) & ~(MACHINE_RUNNING | MACHINE_ABORT_HANDOFF))) {}
+
+            // Awaited again after it paused.
+            if ((awaitFlags & MACHINE_PAUSED) != 0) atomic_fetch_and(&result.await->flags, ~MACHINE_PAUSED);
+
+            if ((awaitFlags & MACHINE_SPAWNED) != 0) {
+                SpawnOnExecutor(result.await);
+            } else {
+                // Caller is responsible for setting RUNNING flag.
+                atomic_fetch_or(&result.await->flags, MACHINE_RUNNING);
+                RunAsync(result.await);
+            }
 
-            RunAsync(result.await);
+            // Aborted while it ran, it's destroyed once the awaited machine resumes it.
+            if ((flags & MACHINE_ABORT_HANDOFF) != 0) ResumeAwaiting(awaiting, spawned);
 
             // check that await is not NULL, and that await's awaiting is currentAsync/machineState
             break;
         }
         case SUBROUTINE_FINISHED: {
             printf("Finished\n");
-            struct async_state *awaiting = machineState->awaiting;
+            uint32_t flags = atomic_fetch_or(&machineState->flags, MACHINE_FINISHED);
 
-            machineState->descriptor.destructor(machineState->state);
-            free(machineState);
+            DestroyAsync(machineState);
 
-            if (awaiting == NULL) return;
+            // Whoever aborted it resumed the awaiting machine, unless it was left to this thread.
+            if ((flags & MACHINE_ABORTED) != 0 && (flags & MACHINE_ABORT_HANDOFF) == 0) return;
 
-            ResumeFromAwait(awaiting);
+            ResumeAwaiting(awaiting, spawned);
             break;
         }
+        case SUBROUTINE_PAUSE: {
+            uint32_t flags = atomic_load(&machineState->flags);
+            while (!atomic_compare_exchange_weak(&machineState->flags, &flags, (flags | MACHINE_PAUSED) & ~(MACHINE_RUNNING | MACHINE_ABORT_HANDOFF))) {}
+
+            // Whoever aborted it resumed the awaiting machine, unless it was left to this thread.
+            if ((flags & MACHINE_ABORTED) != 0 && (flags & MACHINE_ABORT_HANDOFF) == 0) return;
+
+            ResumeAwaiting(awaiting, spawned);
+            break;
+        }
+    }
+}
+
+// Constraint: RunAsync assumes machine is not running, use only after being initalized or use ResumeFromAwait or Resume
+// Caller is responsible for setting RUNNING flag.
+// Called while a machine is running on this thread (from a subroutine, or when one awaits or finishes), the machine
+// only runs once the running one returned. Otherwise it runs before RunAsync returns, along with every machine
+// resumed by it.
+void RunAsync(struct async_state *machineState) {
+    if (machineState == NULL) return;
+    if (!IsValidDescriptor(machineState->descriptor)) return;
+    if (machineState->state == NULL) return;
+
+    machineState->runNext = NULL;
+
+    if (runQueue.tail == NULL) runQueue.head = machineState;
+    else runQueue.tail->runNext = machineState;
+
+    runQueue.tail = machineState;
+
+    if (runQueue.draining) return;
+
+    runQueue.draining = true;
+
+    while (runQueue.head != NULL) {
+        struct async_state *next = runQueue.head;
+
+        runQueue.head = next->runNext;
+        if (runQueue.head == NULL) runQueue.tail = NULL;
+
+        StepAsync(next);
     }
+
+    runQueue.draining = false;
 }
 
 void PrepareIO() {
@@ -209,24 +389,28 @@ void ResumeFromIO(struct async_state *machineState) {
     if (!IsValidDescriptor(machineState->descriptor)) return;
     if (machineState->state == NULL) return;
 
-    for (;;) {
-        uint32_t flags = atomic_load(&machineState->flags);
+    uint32_t flags = atomic_load(&machineState->flags);
 
+    for (;;) {
         if ((flags & MACHINE_SUSPENDED_IO) == 0) {
             printf("Resumed from IO when not expected\n");
             return;
         }
 
-        if (atomic_compare_exchange_weak(&machineState->flags, &flags, flags & ~MACHINE_SUSPENDED_IO)) break;
-    }
+        uint32_t newFlags = flags & ~MACHINE_SUSPENDED_IO;
 
-    while ((atomic_load(&machineState->flags) & MACHINE_RUNNING) != 0) {
-        _mm_pause();
-    }
+        // The I/O completed before the subroutine that queued it returned, leave the resume to its thread.
+        if ((flags & MACHINE_RUNNING) != 0) {
+            newFlags |= MACHINE_RESUME_PENDING;
 
-    atomic_fetch_or(&machineState->flags, MACHINE_RUNNING);
+            if (atomic_compare_exchange_weak(&machineState->flags, &flags, newFlags)) return;
+            continue;
+        }
 
-    // atomic unset bits
+        newFlags |= MACHINE_RUNNING;
+
+        if (atomic_compare_exchange_weak(&machineState->flags, &flags, newFlags)) break;
+    }
 
     RunAsync(machineState);
 }
@@ -259,22 +443,65 @@ void ResumeFromAwait(struct async_state *machineState) {
     RunAsync(machineState);
 }
 
+// Machines to resume where they can't run, e.g. from a timer callback that holds the lock of its wheel. The thread
+// resumes them once it's back in its loop, see RunDeferredResumes.
+_Thread_local struct async_run_queue deferredResumes = { .head = NULL, .tail = NULL, .draining = false };
+
+// Only for a machine suspended on an await nothing else will resume, it's linked through runNext until it runs.
+void DeferResumeFromAwait(struct async_state *machineState) {
+    machineState->runNext = NULL;
+
+    if (deferredResumes.tail == NULL) deferredResumes.head = machineState;
+    else deferredResumes.tail->runNext = machineState;
+
+    deferredResumes.tail = machineState;
+}
+
+void RunDeferredResumes() {
+    while (deferredResumes.head != NULL) {
+        struct async_state *next = deferredResumes.head;
+
+        deferredResumes.head = next->runNext;
+        if (deferredResumes.head == NULL) deferredResumes.tail = NULL;
+
+        ResumeFromAwait(next);
+    }
+}
+
 struct async_state *AwaitAsync(struct async_descriptor descriptor, void *constructParam) {
     if (!IsValidDescriptor(descriptor)) return NULL;
 
-    struct async_state *machineState = calloc(1, sizeof(struct async_state));
-    machineState->descriptor = descriptor;
+    // One allocation holds both the header and the inline state.
+    struct async_state *machineState = SlabAlloc(sizeof(struct async_state) + descriptor.stateSize);
+    if (machineState == NULL) return NULL;
+
+    *machineState = (struct async_state){ .descriptor = descriptor, .refs = 1 };
+    if (!descriptor.constructsState) memset(machineState + 1, 0, descriptor.stateSize);
 
     if (currentAsync != NULL) {
         machineState->awaiting = currentAsync;
     }
 
-    machineState->state = machineState->descriptor.constructor(constructParam);
+    void *inlineState = descriptor.stateSize > 0 ? machineState + 1 : NULL;
+
+    machineState->state = machineState->descriptor.constructor(inlineState, constructParam);
 
     if (machineState->state == NULL) {
-        free(machineState);
+        SlabFree(machineState);
         return NULL;
     }
 
+    MetricAdd(METRIC_MACHINES_STARTED, 1);
+    return machineState;
+}
+
+// Like AwaitAsync, but the machine runs on an executor thread once awaited, for CPU-bound work that would hold up
+// the I/O of the worker. The awaiting machine is resumed on its worker when it finishes.
+struct async_state *SpawnAsync(struct async_descriptor descriptor, void *constructParam) {
+    struct async_state *machineState = AwaitAsync(descriptor, constructParam);
+    if (machineState == NULL) return NULL;
+
+    atomic_fetch_or(&machineState->flags, MACHINE_SPAWNED);
+
     return machineState;
 }
\ No newline at end of file
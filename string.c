@@ -102,6 +102,13 @@ union string FromCStrUnsafe(const char *str) {
     return (union string){ .longStr = { .len = len, .buf = str } };
 }
 
+// Non-owning view of buf, always a long string so it keeps pointing at buf.
+union string SliceString(const uint8_t *buf, uint32_t len) {
+    if (len == 0) return nullString;
+
+    return (union string){ .longStr = { .len = len, .buf = (uint8_t *)buf } };
+}
+
 union string FromCStr(const char *str) {
     return CopyString(FromCStrUnsafe(str));
 }
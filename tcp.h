@@ -2,6 +2,8 @@
 
 #ifdef _WIN32
 #include "./tcp_win/server.c"
+#elif defined(__linux__)
+#include "./tcp_linux/server.c"
 #else
 #error "Unsupported OS"
 #endif
\ No newline at end of file
@@ -0,0 +1,161 @@
+﻿// Admission Control
+
+#pragma once
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdatomic.h>
+#include "../atomics.c"
+
+// Work is refused before it's taken on, so an overloaded server keeps answering what it did admit instead of
+// degrading until it runs out of memory. New connections are answered with SHED_RESPONSE and closed right after the
+// accept, requests for a route with 503 (and the connection closed) when their head is parsed. Cached responses and
+// static files are cheap enough to always be served.
+//
+// A worker is overloaded when any of the limits is reached, or, in the spirit of CoDel, once the completions it
+// dispatched kept having waited longer than ADMISSION_TARGET_MS for a whole ADMISSION_INTERVAL_MS: they then wait in
+// a standing queue, taking on more only makes every one of them wait longer. It recovers with the first batch under
+// the target. A long batch with nothing queued behind it is no queue, its completions were dispatched right away.
+
+// Limits, set before StartServer. 0 disables one.
+uint32_t maxConnections = 65536;
+uint32_t maxInFlightPerWorker = 1024;
+// Completions left in the queue after a worker took its batch. Only io_uring can tell, a completion port can't be
+// asked, so it's off on Windows (and StartServer ignores it there).
+#ifdef _WIN32
+uint32_t maxQueuedCompletions = 0;
+#else
+uint32_t maxQueuedCompletions = 2048;
+#endif
+
+#ifndef ADMISSION_TARGET_MS
+#define ADMISSION_TARGET_MS 5
+#endif
+
+#ifndef ADMISSION_INTERVAL_MS
+#define ADMISSION_INTERVAL_MS 100
+#endif
+
+// Seconds clients are asked to wait before retrying.
+#define ADMISSION_RETRY_AFTER "1"
+
+#define SHED_RESPONSE "HTTP/1.1 503 Service Unavailable\r\nRetry-After: " ADMISSION_RETRY_AFTER "\r\nContent-Length: 0\r\nConnection: close\r\n\r\n"
+
+// Of every worker, a cache line each.
+struct worker_admission {
+    // Route handlers started by this worker and not finished yet, they may finish on another one.
+    atomic_uint32 inFlight;
+    // Only written by the owner.
+    uint32_t backlog;
+    // When completions were first seen waiting behind a batch the worker took, 0 while none were.
+    uint64_t queuedSince;
+    // When the loop delay went above the target, 0 while it's below.
+    uint64_t aboveSince;
+    atomic_bool overloaded;
+} __attribute__((aligned(64)));
+
+atomic_uint32 openConnections = 0;
+
+// Of the worker, NULL on other threads (only the connection limit applies there).
+_Thread_local struct worker_admission *threadAdmission = NULL;
+
+struct worker_admission *CreateWorkerAdmission() {
+    struct worker_admission *admission = aligned_alloc(alignof(struct worker_admission), sizeof(struct worker_admission));
+    if (admission == NULL) return NULL;
+
+    atomic_init(&admission->inFlight, 0);
+    admission->backlog = 0;
+    admission->queuedSince = 0;
+    admission->aboveSince = 0;
+    atomic_init(&admission->overloaded, false);
+
+    return admission;
+}
+
+// Owner only. Delay is how long the completions of a batch waited to be dispatched, backlog the completions queued
+// behind it.
+void RecordLoopDelay(struct worker_admission *admission, uint64_t delay, uint64_t now, uint32_t backlog) {
+    if (admission == NULL) return;
+
+    admission->backlog = backlog;
+
+    if (delay < ADMISSION_TARGET_MS) {
+        admission->aboveSince = 0;
+        if (atomic_load_explicit(&admission->overloaded, memory_order_relaxed)) atomic_store_explicit(&admission->overloaded, false, memory_order_relaxed);
+
+        return;
+    }
+
+    // Only a delay that stays is a queue, a single long batch is a burst.
+    if (admission->aboveSince == 0) {
+        admission->aboveSince = now;
+        return;
+    }
+
+    if (now - admission->aboveSince >= ADMISSION_INTERVAL_MS && !atomic_load_explicit(&admission->overloaded, memory_order_relaxed)) {
+        atomic_store_explicit(&admission->overloaded, true, memory_order_relaxed);
+        fprintf(stderr, "warning: Worker overloaded, shedding new work.\n");
+    }
+}
+
+// Owner only, as the worker takes a batch (or wakes up without one) at now. Queued is whether completions were left
+// behind it, backlog how many if the platform can tell.
+// Those left behind the previous batch lead this one, they waited at least since the worker saw them, the rest of
+// the batch completed later. Without any, the worker was waiting for the batch and nothing in it waited.
+void RecordBatch(struct worker_admission *admission, uint64_t now, bool queued, uint32_t backlog) {
+    if (admission == NULL) return;
+
+    uint64_t sojourn = admission->queuedSince != 0 ? now - admission->queuedSince : 0;
+    admission->queuedSince = queued ? now : 0;
+
+    RecordLoopDelay(admission, sojourn, now, backlog);
+}
+
+bool WorkerOverloaded(const struct worker_admission *admission) {
+    if (admission == NULL) return false;
+
+    if (maxQueuedCompletions > 0 && admission->backlog >= maxQueuedCompletions) return true;
+
+    return atomic_load_explicit(&admission->overloaded, memory_order_relaxed);
+}
+
+// Counts the connection as open, false if it's to be shed instead. LeaveConnection follows once it's closed.
+bool AdmitConnection() {
+    if (WorkerOverloaded(threadAdmission)) return false;
+
+    uint32_t open = atomic_fetch_add_explicit(&openConnections, 1, memory_order_relaxed);
+
+    if (maxConnections > 0 && open >= maxConnections) {
+        atomic_fetch_sub_explicit(&openConnections, 1, memory_order_relaxed);
+        return false;
+    }
+
+    return true;
+}
+
+void LeaveConnection() {
+    atomic_fetch_sub_explicit(&openConnections, 1, memory_order_relaxed);
+}
+
+// Whether a handler may be started on this worker.
+bool AdmitRequest() {
+    struct worker_admission *admission = threadAdmission;
+    if (admission == NULL) return true;
+
+    if (maxInFlightPerWorker > 0 && atomic_load_explicit(&admission->inFlight, memory_order_relaxed) >= maxInFlightPerWorker) return false;
+
+    return !WorkerOverloaded(admission);
+}
+
+// Counts a handler as in flight on this worker, returns what ReleaseRequest takes once it finished (on any thread).
+struct worker_admission *EnterRequest() {
+    struct worker_admission *admission = threadAdmission;
+    if (admission != NULL) atomic_fetch_add_explicit(&admission->inFlight, 1, memory_order_relaxed);
+
+    return admission;
+}
+
+void ReleaseRequest(struct worker_admission *admission) {
+    if (admission != NULL) atomic_fetch_sub_explicit(&admission->inFlight, 1, memory_order_relaxed);
+}
\ No newline at end of file
@@ -0,0 +1,250 @@
+﻿// Chunked Transfer Coding
+
+#pragma once
+
+#include <stdint.h>
+#include "../scan.c"
+
+// Extensions and trailers are validated and read past, up to this many bytes per body.
+#ifndef CHUNK_META_MAX
+#define CHUNK_META_MAX 8192
+#endif
+
+enum chunk_stage {
+    // Hex digits of a chunk size line.
+    CHUNK_SIZE,
+    // Whitespace of the size line before an extension (its ";") or the line end.
+    CHUNK_EXTENSION,
+    // Name of an extension, lineLen bytes of it read so far.
+    CHUNK_EXT_NAME,
+    // Whitespace after the name of an extension, before its "=" if it has a value.
+    CHUNK_EXT_NAME_END,
+    // Token value of an extension, lineLen bytes of it read so far.
+    CHUNK_EXT_VALUE,
+    // Quoted string value of an extension, after the opening quote.
+    CHUNK_EXT_QUOTED,
+    // Byte escaped with a backslash in a quoted string.
+    CHUNK_EXT_QUOTED_PAIR,
+    // LF after the CR of a size line.
+    CHUNK_SIZE_LF,
+    // Data of the chunk, remaining bytes of it left.
+    CHUNK_DATA,
+    // CRLF after the data.
+    CHUNK_DATA_END,
+    // Lines after the last chunk, up to an empty one.
+    CHUNK_TRAILER,
+    // LF after the CR of a trailer line.
+    CHUNK_TRAILER_LF,
+    // The whole body was read.
+    CHUNK_DONE
+};
+
+struct chunk_decoder {
+    // Size being read in CHUNK_SIZE, data left in CHUNK_DATA.
+    uint64_t remaining;
+    enum chunk_stage stage;
+    uint32_t digits;
+    // Bytes of the current extension name or value or trailer line, or whether the CR after data was read.
+    uint32_t lineLen;
+    uint32_t metaBytes;
+};
+
+const struct chunk_decoder nullChunkDecoder = { .stage = CHUNK_SIZE, .remaining = 0, .digits = 0, .lineLen = 0, .metaBytes = 0 };
+
+int32_t HexDigitValue(uint8_t c) {
+    if (c >= '0' && c <= '9') return c - '0';
+
+    c |= 0x20;
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+
+    return -1;
+}
+
+// qdtext and the bytes a quoted-pair may escape (RFC 9110), besides the quote and backslash.
+bool IsQuotedTextChar(uint8_t c) {
+    return c == '\t' || (c >= ' ' && c != 0x7f);
+}
+
+// Reads framing from buf until chunk data starts, the body ends, or buf runs out. Stops at the first data byte,
+// which the caller reads itself, see ChunkDataRead. Returns false if the framing is malformed.
+//
+// A size line ends in CRLF or a bare LF, never a bare CR. Its extensions must be ";"-separated tokens, each with an
+// optional token or quoted string value, with optional whitespace around the separators (RFC 9112 chunk-ext).
+bool DecodeChunkFraming(struct chunk_decoder *decoder, const uint8_t *buf, uint32_t len, uint32_t *used) {
+    uint32_t pos = 0;
+
+    while (pos < len && decoder->stage != CHUNK_DATA && decoder->stage != CHUNK_DONE) {
+        uint8_t c = buf[pos++];
+
+        if (decoder->stage >= CHUNK_EXTENSION && decoder->stage <= CHUNK_EXT_QUOTED_PAIR) {
+            if (++decoder->metaBytes > CHUNK_META_MAX) return false;
+        }
+
+        switch (decoder->stage) {
+            case CHUNK_SIZE: {
+                int32_t digit = HexDigitValue(c);
+
+                if (digit >= 0) {
+                    // 15 digits can't overflow.
+                    if (++decoder->digits > 15) return false;
+
+                    decoder->remaining = decoder->remaining * 16 + digit;
+                    break;
+                }
+
+                if (decoder->digits == 0) return false;
+
+                decoder->stage = CHUNK_EXTENSION;
+                goto ExtensionSeparator;
+            }
+
+            case CHUNK_EXT_NAME: {
+                if (IsTokenChar(c)) {
+                    decoder->lineLen++;
+                    break;
+                }
+
+                if (c == ' ' || c == '\t') {
+                    if (decoder->lineLen > 0) decoder->stage = CHUNK_EXT_NAME_END;
+                    break;
+                }
+
+                if (decoder->lineLen == 0) return false;
+
+                decoder->stage = CHUNK_EXT_NAME_END;
+                goto ExtensionNameEnd;
+            }
+
+            case CHUNK_EXT_NAME_END: {
+                if (c == ' ' || c == '\t') break;
+
+                ExtensionNameEnd:
+                if (c == '=') {
+                    decoder->stage = CHUNK_EXT_VALUE;
+                    decoder->lineLen = 0;
+                    break;
+                }
+
+                goto ExtensionSeparator;
+            }
+
+            case CHUNK_EXT_VALUE: {
+                if (IsTokenChar(c)) {
+                    decoder->lineLen++;
+                    break;
+                }
+
+                if (decoder->lineLen == 0) {
+                    if (c == ' ' || c == '\t') break;
+                    if (c != '"') return false;
+
+                    decoder->stage = CHUNK_EXT_QUOTED;
+                    break;
+                }
+
+                decoder->stage = CHUNK_EXTENSION;
+                goto ExtensionSeparator;
+            }
+
+            case CHUNK_EXT_QUOTED: {
+                if (c == '"') decoder->stage = CHUNK_EXTENSION;
+                else if (c == '\\') decoder->stage = CHUNK_EXT_QUOTED_PAIR;
+                else if (!IsQuotedTextChar(c)) return false;
+
+                break;
+            }
+
+            case CHUNK_EXT_QUOTED_PAIR: {
+                if (!IsQuotedTextChar(c)) return false;
+
+                decoder->stage = CHUNK_EXT_QUOTED;
+                break;
+            }
+
+            case CHUNK_EXTENSION: {
+                ExtensionSeparator:
+                if (c == '\n') goto SizeLineEnd;
+
+                if (c == '\r') {
+                    decoder->stage = CHUNK_SIZE_LF;
+                    break;
+                }
+
+                if (c == ';') {
+                    decoder->stage = CHUNK_EXT_NAME;
+                    decoder->lineLen = 0;
+                    break;
+                }
+
+                if (c != ' ' && c != '\t') return false;
+
+                decoder->stage = CHUNK_EXTENSION;
+                break;
+            }
+
+            case CHUNK_SIZE_LF: {
+                if (c != '\n') return false;
+
+                goto SizeLineEnd;
+            }
+
+            case CHUNK_DATA_END: {
+                if (c == '\r' && decoder->lineLen == 0) {
+                    decoder->lineLen = 1;
+                    break;
+                }
+
+                if (c != '\n') return false;
+
+                decoder->stage = CHUNK_SIZE;
+                decoder->remaining = 0;
+                decoder->digits = 0;
+                break;
+            }
+
+            case CHUNK_TRAILER: {
+                if (c == '\n') goto TrailerLineEnd;
+                if (++decoder->metaBytes > CHUNK_META_MAX) return false;
+
+                if (c == '\r') {
+                    decoder->stage = CHUNK_TRAILER_LF;
+                    break;
+                }
+
+                decoder->lineLen++;
+                break;
+            }
+
+            case CHUNK_TRAILER_LF: {
+                if (c != '\n') return false;
+
+                TrailerLineEnd:
+                decoder->stage = decoder->lineLen == 0 ? CHUNK_DONE : CHUNK_TRAILER;
+                decoder->lineLen = 0;
+                break;
+            }
+
+            default: break;
+        }
+
+        continue;
+
+        SizeLineEnd:
+        // A size of zero is the last chunk, trailers follow.
+        decoder->stage = decoder->remaining > 0 ? CHUNK_DATA : CHUNK_TRAILER;
+        decoder->lineLen = 0;
+    }
+
+    *used = pos;
+    return true;
+}
+
+// Marks n bytes of the chunk data as read, n must not exceed what's remaining.
+void ChunkDataRead(struct chunk_decoder *decoder, uint64_t n) {
+    decoder->remaining -= n;
+
+    if (decoder->remaining > 0) return;
+
+    decoder->stage = CHUNK_DATA_END;
+    decoder->lineLen = 0;
+}
\ No newline at end of file
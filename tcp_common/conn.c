@@ -1,9 +1,50 @@
 ﻿#pragma once
 
+#include <stdio.h>
 #include <stdint.h>
 #include <string.h>
 #include "../string.c"
 #include "./http.c"
+#include "./recv_chain.c"
+#include "./response.c"
+#include "./file_cache.c"
+#include "./response_cache.c"
+#include "./stream.c"
+#include "./chunked.c"
+#include "./router.c"
+#include "../state_machine.c"
+#include "../scan.c"
+#include "../timer_wheel.c"
+#include "./admission.c"
+#include "../metrics.c"
+
+// Upper bound of the request line and headers of a single request, so a connection can't grow its buffers forever.
+#ifndef MAX_HEADER_SIZE
+#define MAX_HEADER_SIZE (64 * 1024)
+#endif
+
+// Deadlines in milliseconds, 0 disables one. The connection is closed once one passes (see ConnReadDeadline).
+// Whole request line and headers, from their first byte.
+#ifndef HEADER_TIMEOUT_MS
+#define HEADER_TIMEOUT_MS 10000
+#endif
+
+// Between two reads of the body.
+#ifndef BODY_TIMEOUT_MS
+#define BODY_TIMEOUT_MS 30000
+#endif
+
+// Waiting for the next request, with nothing of it received yet.
+#ifndef KEEPALIVE_TIMEOUT_MS
+#define KEEPALIVE_TIMEOUT_MS 5000
+#endif
+
+// Handler of a route (or a body consumer with a part of the body, or a stream producer with an emptied buffer), until
+// it returns. One that hasn't by then is abandoned, and the request answered with 503. A streamed body is cut off
+// instead, by closing the connection.
+#ifndef HANDLER_TIMEOUT_MS
+#define HANDLER_TIMEOUT_MS 60000
+#endif
 
 enum tcpState {
     // When expecting request line (new request)
@@ -22,119 +63,1033 @@ enum tcpState {
     // When body is sent as one whole by the write loop
     SEND_BODY = 5,
     // When body is sent as fragmented stream, rather than one.
-    SEND_BODY_STREAM = 6
+    SEND_BODY_STREAM = 6,
+    // When the connection closes once the queued responses are sent, anything received is ignored.
+    RECV_CLOSED = 7
+};
+
+// Request line needs two spaces, a third one is tracked to reject it.
+#define LINE_MAX_DELIMS 3
+
+// Progress on the unterminated line at the read cursor, so a resumed parse only scans newly received bytes.
+// Offsets are relative to the line start, which stays valid when RecvChainPrepare moves the line.
+struct line_scan {
+    // Bytes of the line already scanned, none of them a line ending or invalid.
+    uint32_t scanned;
+    // Spaces of a request line, or the colon of a header line, found so far.
+    uint32_t delimCount;
+    uint32_t delims[LINE_MAX_DELIMS];
+};
+
+const struct line_scan nullLineScan = { .scanned = 0, .delimCount = 0 };
+
+// Address of the client, filled in by the platform once accepted. Socket address layouts differ by platform.
+struct peer_address {
+    // 4 or 6, 0 if unknown.
+    uint8_t version;
+    uint16_t port;
+    // Network byte order, IPv4 addresses take the first 4 bytes.
+    uint8_t addr[16];
 };
 
+const struct peer_address nullPeerAddress = { .version = 0, .port = 0, .addr = { 0 } };
+
+// Longest FormatPeerAddress output, including the terminator.
+#define PEER_ADDRESS_MAX 48
+
+// Formats the address as "1.2.3.4:port" or "[1:2:3:4:5:6:7:8]:port", IPv6 groups aren't compressed.
+uint32_t FormatPeerAddress(const struct peer_address *peer, char *dest) {
+    const uint8_t *a = peer->addr;
+
+    if (peer->version == 4) return sprintf(dest, "%u.%u.%u.%u:%u", a[0], a[1], a[2], a[3], peer->port);
+    if (peer->version != 6) return sprintf(dest, "unknown");
+
+    uint32_t len = sprintf(dest, "[");
+
+    for (uint32_t i = 0; i < 16; i += 2) {
+        len += sprintf(dest + len, i == 0 ? "%x" : ":%x", (a[i] << 8) | a[i + 1]);
+    }
+
+    return len + sprintf(dest + len, "]:%u", peer->port);
+}
+
 struct tcpConnCommon {
-    unsigned char *recvBuf;
-    uint32_t recvOffset;
-    enum tcpState state;
+    struct recv_chain recv;
+    struct line_scan lineScan;
+    // Parsing stopped for a handler with the rest of the head segment in lineIndex, see ProcessLines.
+    bool lineIndexKept;
+    // Flags fill the padding after lineScan, and state the one after peer, so a connection fits a 2KB slab block.
+    // Whether the current request was answered (or its body taken, until the consumer takes over answering it).
+    bool answered;
+    bool bodyChunked;
+    bool keepAlive;
+    // Bytes of the current request line and headers consumed so far.
+    uint32_t headerBytes;
+    uint32_t maxHeaderSize;
     struct HTTPRequest currentReq;
+    // Cached response found for the current request line, answered with once the head is complete.
+    struct cached_response *cached;
+    // Handler of the current request's route, or the machine opening its file (retained), until it finished or was
+    // abandoned, see HandlerFinished.
+    struct async_state *handler;
+    // Body bytes of the current request still to be read, when it has a Content-Length.
+    uint64_t bodyRemaining;
+    struct chunk_decoder chunks;
+    // Takes the body of the current request (retained), NULL if it's dropped.
+    struct async_state *bodyConsumer;
+    uint64_t bodyLimit;
+    uint64_t bodyReceived;
+    // Responses waiting for ConnWrite, NULL while there are none.
+    struct send_queue *send;
+    // Body of the last queued response, sent from the file by the platform once the queue is flushed.
+    struct file_entry *file;
+    uint64_t fileOffset;
+    uint64_t fileRemaining;
+    // Body of the last queued response, produced by a state machine once the send queue is flushed.
+    struct body_stream stream;
+    struct peer_address peer;
+    enum tcpState state;
+    // Deadline of the pending read or handler, armed by the platform.
+    struct timer timer;
+    // Deadline of the current request's head, 0 until its first read.
+    uint64_t headDeadline;
+    // Batch the current request line was parsed in (see MetricsBatchNow), 0 if metrics are disabled.
+    uint64_t requestStart;
 };
 
-void SetupCommonConn(struct tcpConnCommon *conn, uint32_t recvLen) {
-    conn->recvBuf = calloc(recvLen, sizeof(char));
-    conn->recvOffset = 0;
+// Segments are taken lazily on the first receive. Initializes every field, the connection's state isn't zeroed.
+void SetupCommonConn(struct tcpConnCommon *conn, uint32_t maxHeaderSize) {
+    conn->recv = nullRecvChain;
+    conn->lineScan = nullLineScan;
+    conn->lineIndexKept = false;
+    conn->headerBytes = 0;
+    conn->maxHeaderSize = maxHeaderSize;
     conn->state = RECV_REQUEST_LINE;
+    // Only the fields read before the first request line, the header slots are behind knownMask and otherCount.
+    conn->currentReq.method = HTTP_METHOD_UNKNOWN;
+    conn->currentReq.version = HTTP_VERSION_1_0;
+    conn->currentReq.path = nullString;
+    conn->currentReq.paramCount = 0;
+    conn->currentReq.paramNames = NULL;
+    ResetHeaders(&conn->currentReq.headers);
+    conn->cached = NULL;
+    conn->handler = NULL;
+    conn->answered = false;
+    conn->bodyRemaining = 0;
+    conn->bodyChunked = false;
+    conn->chunks = nullChunkDecoder;
+    conn->bodyConsumer = NULL;
+    conn->bodyLimit = 0;
+    conn->bodyReceived = 0;
+    conn->keepAlive = false;
+    conn->send = NULL;
+    conn->file = NULL;
+    conn->fileOffset = 0;
+    conn->fileRemaining = 0;
+    conn->stream = nullBodyStream;
+    conn->peer = nullPeerAddress;
+    conn->timer = nullTimer;
+    conn->headDeadline = 0;
+    conn->requestStart = 0;
+}
+
+// Whether currentReq holds a request, from its request line until FinishRequest.
+bool HasCurrentRequest(const struct tcpConnCommon *conn) {
+    return conn->state == RECV_HEADER || conn->state == RECV_BODY;
+}
+
+// Drops the cached response of a request that isn't answered from it.
+void ReleaseCachedForRequest(struct tcpConnCommon *conn) {
+    if (conn->cached == NULL) return;
+
+    ReleaseCachedResponse(conn->cached);
+    conn->cached = NULL;
+}
+
+void FreeBodyConsumer(struct tcpConnCommon *conn) {
+    struct async_state *consumer = conn->bodyConsumer;
+    if (consumer == NULL) return;
+
+    conn->bodyConsumer = NULL;
+
+    // Killed unless it's gone already, or abandoned while still suspended (it's destroyed when it next runs).
+    uint32_t flags = atomic_load(&consumer->flags);
+
+    if (consumer->state != NULL && (flags & (MACHINE_RUNNING | MACHINE_SUSPENDED_IO | MACHINE_SUSPENDED_AWAIT)) == 0) {
+        consumer->awaiting = NULL;
+        KillAsync(consumer);
+    }
+
+    ReleaseAsync(consumer);
 }
 
 void CleanupCommonConn(struct tcpConnCommon *conn) {
-    free(conn->recvBuf);
+    // Headers point into the receive chain.
+    if (HasCurrentRequest(conn)) CleanupHTTPRequest(&conn->currentReq);
+    ReleaseCachedForRequest(conn);
+    FreeBodyConsumer(conn);
+    if (conn->handler != NULL) {
+        // Not awaited yet, killing it mustn't reach the connection. An abandoned one is destroyed when it next runs.
+        if (conn->handler->state != NULL && (atomic_load(&conn->handler->flags) & MACHINE_ABORTED) == 0) {
+            conn->handler->awaiting = NULL;
+            KillAsync(conn->handler);
+        }
+
+        ReleaseAsync(conn->handler);
+    }
+
+    FreeRecvChain(&conn->recv);
+    FreeSendQueue(&conn->send);
+    if (conn->file != NULL) ReleaseFileEntry(conn->file);
+    FreeBodyStream(&conn->stream);
+    CancelTimer(&conn->timer);
+}
+
+// Returns the buffer the next receive should fill.
+bool PrepareRecv(struct tcpConnCommon *conn, uint8_t **buf, uint32_t *len) {
+    bool inHead = conn->state == RECV_REQUEST_LINE || conn->state == RECV_HEADER;
+    uint32_t remainingHeader = conn->headerBytes < conn->maxHeaderSize ? conn->maxHeaderSize - conn->headerBytes : 0;
+
+    return RecvChainPrepare(&conn->recv, inHead, remainingHeader, buf, len);
+}
+
+void CommitRecv(struct tcpConnCommon *conn, uint32_t n) {
+    RecvChainCommit(&conn->recv, n);
+    MetricAdd(METRIC_BYTES_IN, n);
+}
+
+// Whether no received bytes are held. The platform then waits for data without a buffer, so idle connections
+// cost none, and takes one once data arrived (see AdoptRecv, ReleaseIdleRecv).
+bool RecvIdle(const struct tcpConnCommon *conn) {
+    return RecvChainEmpty(&conn->recv);
+}
+
+// Returns the deadline of the next read, 0 if it has none. Idle connections get the keep-alive timeout, a request's
+// head must be complete within the header timeout of its first read, and the body must keep arriving.
+uint64_t ConnReadDeadline(struct tcpConnCommon *conn, uint64_t now) {
+    switch (conn->state) {
+        case RECV_REQUEST_LINE:
+            if (RecvIdle(conn)) return KEEPALIVE_TIMEOUT_MS > 0 ? now + KEEPALIVE_TIMEOUT_MS : 0;
+            // fall through
+        case RECV_HEADER:
+            if (HEADER_TIMEOUT_MS == 0) return 0;
+            if (conn->headDeadline == 0) conn->headDeadline = now + HEADER_TIMEOUT_MS;
+
+            return conn->headDeadline;
+
+        case RECV_BODY:
+            return BODY_TIMEOUT_MS > 0 ? now + BODY_TIMEOUT_MS : 0;
+
+        default:
+            return 0;
+    }
+}
+
+// Returns the deadline of the handler, body consumer or stream producer awaited from now on, 0 if it has none.
+uint64_t ConnHandlerDeadline(uint64_t now) {
+    return HANDLER_TIMEOUT_MS > 0 ? now + HANDLER_TIMEOUT_MS : 0;
+}
+
+// Takes a segment n bytes were received into outside of PrepareRecv, only while RecvIdle.
+void AdoptRecv(struct tcpConnCommon *conn, struct recv_segment *segment, uint32_t n) {
+    segment->len = n;
+    RecvChainAdopt(&conn->recv, segment);
+    MetricAdd(METRIC_BYTES_IN, n);
+}
+
+// Gives back the buffer PrepareRecv took, if nothing was received into it after all.
+void ReleaseIdleRecv(struct tcpConnCommon *conn) {
+    struct recv_segment *head = conn->recv.head;
+
+    if (head != NULL && head->next == NULL && head->len == conn->recv.cursor) RecvChainConsume(&conn->recv, 0);
+}
+
+// Advances past n bytes, the bytes are left in place.
+void CommitRead(struct tcpConnCommon* conn, uint32_t n) {
+    RecvChainConsume(&conn->recv, n);
+}
+
+// Returns the vectors of the queued responses still to be sent, false if there are none.
+bool PrepareSend(struct tcpConnCommon *conn, struct send_vec **vecs, uint32_t *count) {
+    return SendQueuePending(conn->send, vecs, count);
+}
+
+// Partial writes leave the rest of the vectors queued.
+void CommitSend(struct tcpConnCommon *conn, uint32_t n) {
+    SendQueueCommit(&conn->send, n);
+    MetricAdd(METRIC_BYTES_OUT, n);
+}
+
+// Returns the file range still to be sent, false if there's no file body.
+bool PrepareFileSend(struct tcpConnCommon *conn, file_handle *handle, uint64_t *offset, uint64_t *remaining) {
+    if (conn->file == NULL) return false;
+
+    *handle = conn->file->handle;
+    *offset = conn->fileOffset;
+    *remaining = conn->fileRemaining;
+
+    return true;
+}
+
+// Advances by n bytes read (or sent) from the file, the entry is released once the whole body is.
+void CommitFileSend(struct tcpConnCommon *conn, uint64_t n) {
+    conn->fileOffset += n;
+    conn->fileRemaining -= n;
+    MetricAdd(METRIC_BYTES_OUT, n);
+
+    if (conn->fileRemaining > 0) return;
+
+    ReleaseFileEntry(conn->file);
+    conn->file = NULL;
+}
+
+// Whether a streamed body is still being produced or sent.
+bool HasBodyStream(const struct tcpConnCommon *conn) {
+    return conn->stream.buf != NULL;
+}
+
+// Returns the producer to await for the next part of the streamed body, only once the send queue is flushed, so the
+// buffer is free again. StreamProduced follows once it paused or finished. NULL after the last part was sent, the
+// stream is released then.
+struct async_state *TakeStreamProducer(struct tcpConnCommon *conn) {
+    struct async_state *producer = PrepareStreamPart(&conn->stream);
+    if (producer == NULL) FreeBodyStream(&conn->stream);
+
+    return producer;
+}
+
+// Queues the part the producer wrote. Returns false if the body can't be completed.
+bool StreamProduced(struct tcpConnCommon *conn) {
+    // The head is out, all that's left is to close the connection.
+    if ((atomic_load(&conn->stream.producer->flags) & MACHINE_ABORTED) != 0) {
+        printf("Stream Producer timed out\n");
+        MetricAdd(METRIC_HANDLERS_TIMED_OUT, 1);
+        return false;
+    }
+
+    if (!EndStreamPart(&conn->stream)) {
+        printf("Stream Producer failed\n");
+        return false;
+    }
+
+    // An unchunked body may end without a last part.
+    if (conn->stream.len == 0) return true;
+
+    return QueueSendData(&conn->send, conn->stream.buf, conn->stream.len);
+}
+
+// Answers the current request with a body produced by a state machine (see stream.c) constructed with param.
+// The producer only starts once everything queued before it is sent, and never for a status without a body.
+bool RespondStream(struct tcpConnCommon *conn, uint32_t status, const char *headers, struct async_descriptor producer, void *param) {
+    struct HTTPRequest *req = &conn->currentReq;
+    bool headOnly = req->method == HTTP_METHOD_HEAD || !StatusHasBody(status);
+    bool chunked = req->version == HTTP_VERSION_1_1;
+
+    // Without chunks, the end of the body is the end of the connection.
+    if (!chunked && !headOnly) conn->keepAlive = false;
+
+    if (!QueueStreamHead(&conn->send, status, headers, chunked, conn->keepAlive, req->version == HTTP_VERSION_1_0)) return false;
+
+    conn->answered = true;
+    if (headOnly) return true;
+
+    struct async_state *machine = AwaitAsync(producer, param);
+    if (machine == NULL) return false;
+
+    return StartBodyStream(&conn->stream, machine, chunked);
+}
+
+// Answers the current request, HEAD responses leave the body out but keep its length.
+bool Respond(struct tcpConnCommon *conn, uint32_t status, const char *headers, const void *body, uint64_t bodyLen) {
+    struct HTTPRequest *req = &conn->currentReq;
+    bool headOnly = req->method == HTTP_METHOD_HEAD;
+
+    if (!QueueResponse(&conn->send, status, headers, headOnly ? NULL : body, bodyLen, conn->keepAlive, req->version == HTTP_VERSION_1_0)) return false;
+
+    conn->answered = true;
+    return true;
+}
+
+// Ends the current request, the connection either waits for the next one or closes.
+void FinishRequest(struct tcpConnCommon *conn) {
+    MetricRecordSince(METRIC_REQUEST_LATENCY, conn->requestStart);
+
     CleanupHTTPRequest(&conn->currentReq);
+    RecvChainRelease(&conn->recv);
+    FreeBodyConsumer(conn);
+
+    conn->lineScan = nullLineScan;
+    conn->headerBytes = 0;
+    conn->headDeadline = 0;
+    conn->bodyRemaining = 0;
+    conn->bodyChunked = false;
+    conn->chunks = nullChunkDecoder;
+    conn->bodyReceived = 0;
+    conn->state = conn->keepAlive ? RECV_REQUEST_LINE : RECV_CLOSED;
 }
 
-bool GetLine(struct tcpConnCommon* conn, uint32_t offset, union string *str) {
-    if (offset >= conn->recvOffset) return false;
+// Answers a request that can't be parsed (or read) and closes the connection after the responses before it.
+void RejectRequest(struct tcpConnCommon *conn, uint32_t status) {
+    if (status == 400 || status == 431) MetricAdd(METRIC_PARSE_ERRORS, 1);
+
+    if (HasCurrentRequest(conn)) CleanupHTTPRequest(&conn->currentReq);
+    ReleaseCachedForRequest(conn);
+    FreeBodyConsumer(conn);
+    RecvChainRelease(&conn->recv);
 
-    unsigned char *buf = (unsigned char*)conn->recvBuf + offset;
-    unsigned char *bounds = memchr(buf, '\n', conn->recvOffset - offset);
+    conn->keepAlive = false;
+    conn->state = RECV_CLOSED;
 
-    if (bounds == NULL || bounds < buf) return false;
+    // Out of memory, the connection is closed either way.
+    QueueResponse(&conn->send, status, NULL, NULL, 0, false, false);
+}
+
+// Answers with the file of the entry, taking over its reference. Only the head is queued, the body follows
+// straight from the file once the send queue is flushed.
+bool RespondFileEntry(struct tcpConnCommon *conn, struct file_entry *entry) {
+    struct HTTPRequest *req = &conn->currentReq;
 
-    uint32_t size = (char*)bounds - (char*)buf;
+    if (!Respond(conn, 200, entry->contentType, NULL, entry->size)) {
+        ReleaseFileEntry(entry);
+        return false;
+    }
 
-    if (size > maxShortString || size == 0) {
-        *str = (union string){ .longStr = { .buf = buf, .len = size } };
+    if (req->method == HTTP_METHOD_HEAD || entry->size == 0) {
+        ReleaseFileEntry(entry);
         return true;
+    }
+
+    conn->file = entry;
+    conn->fileOffset = 0;
+    conn->fileRemaining = entry->size;
+
+    return true;
+}
+
+// Sends the cached response as it is, the queue takes over its reference.
+bool RespondCached(struct tcpConnCommon *conn) {
+    struct HTTPRequest *req = &conn->currentReq;
+    struct cached_response *entry = conn->cached;
+    bool headOnly = req->method == HTTP_METHOD_HEAD;
+
+    conn->cached = NULL;
+
+    conn->answered = QueuePreparedResponse(
+        &conn->send,
+        CachedResponseHead(entry), entry->headLen,
+        headOnly ? NULL : CachedResponseBody(entry), entry->bodyLen,
+        conn->keepAlive, req->version == HTTP_VERSION_1_0,
+        (struct send_ref){ .release = ReleaseCachedResponse, .ptr = entry }
+    );
+
+    return conn->answered;
+}
+
+// States of body consumers (see ReceiveBody) start with this, it's filled in before every run.
+struct body_async_state {
+    // Set while a part is handed to the consumer, until it pauses for the next one.
+    struct tcpConnCommon *conn;
+    // Next part of the body, a slice of the receive buffer that's valid until the consumer pauses or finishes.
+    union string data;
+    // Set on the last run, data holds the last part of the body (or nothing).
+    bool ended;
+};
+
+// Takes the body of the current request: a state machine constructed with param is awaited by the connection with
+// every part of it as it's received, and answers the request once it ended. The consumer returns subroutine_pause
+// for the next part, and subroutine_finish once it answered, whatever is left of the body is dropped then. It may
+// start I/O of its own in between, nothing more is read from the connection until it paused.
+// Bodies over limit bytes are refused with 413, before they're sent when their length is known up front, otherwise
+// once the chunk that exceeds it is announced.
+bool ReceiveBody(struct tcpConnCommon *conn, struct async_descriptor consumer, void *param, uint64_t limit) {
+    if (!conn->bodyChunked && conn->bodyRemaining > limit) {
+        conn->keepAlive = false;
+        return Respond(conn, 413, NULL, NULL, 0);
+    }
+
+    struct async_state *machine = AwaitAsync(consumer, param);
+    if (machine == NULL) return false;
+
+    // Awaited by the connection, see TakeBodyConsumer.
+    machine->awaiting = NULL;
+    ((struct body_async_state *)machine->state)->conn = NULL;
+
+    // Kept until FreeBodyConsumer, an abandoned consumer may be destroyed before the connection resumes.
+    RetainAsync(machine);
+
+    conn->bodyConsumer = machine;
+    conn->bodyLimit = limit;
+    conn->answered = true;
+
+    return true;
+}
+
+// Whether a part of the body waits for the consumer to take it.
+bool BodyPartHanded(const struct tcpConnCommon *conn) {
+    return conn->bodyConsumer != NULL && ((struct body_async_state *)conn->bodyConsumer->state)->conn != NULL;
+}
+
+// Hands the part of the body at the read cursor to the consumer, parsing stops until the platform awaited it.
+void HandBodyPart(struct tcpConnCommon *conn, const uint8_t *data, uint32_t len, bool ended) {
+    struct body_async_state *bodyState = conn->bodyConsumer->state;
+
+    bodyState->conn = conn;
+    bodyState->data = SliceString(data, len);
+    bodyState->ended = ended;
+}
+
+// Returns the part of the body at the read cursor, as far as it's received.
+uint32_t PeekBodyPart(struct tcpConnCommon *conn, const uint8_t **data, bool *ended) {
+    uint32_t available;
+    *data = RecvChainRead(&conn->recv, &available);
+
+    if (conn->bodyChunked) {
+        // The end of a chunked body is only known from the framing after it, it's handed on its own.
+        *ended = conn->chunks.stage == CHUNK_DONE;
+
+        return conn->chunks.remaining < available ? (uint32_t)conn->chunks.remaining : available;
+    }
+
+    uint32_t n = conn->bodyRemaining < available ? (uint32_t)conn->bodyRemaining : available;
+    *ended = conn->bodyRemaining == n;
+
+    return n;
+}
+
+// Advances past n bytes of body data.
+void ReadBodyPart(struct tcpConnCommon *conn, uint32_t n) {
+    if (conn->bodyChunked) ChunkDataRead(&conn->chunks, n);
+    else conn->bodyRemaining -= n;
+
+    conn->bodyReceived += n;
+    CommitRead(conn, n);
+}
+
+// Returns the body consumer to await for the part of the body parsing stopped at, if there's one. BodyConsumed
+// follows once it paused or finished.
+struct async_state *TakeBodyConsumer(struct tcpConnCommon *conn) {
+    if (!BodyPartHanded(conn)) return NULL;
+
+    conn->bodyConsumer->awaiting = currentAsync;
+    return conn->bodyConsumer;
+}
+
+// Reads past the part the consumer took, and finishes the request after the last one.
+void BodyConsumed(struct tcpConnCommon *conn) {
+    struct async_state *consumer = conn->bodyConsumer;
+    if (consumer == NULL) return;
+
+    if ((atomic_load(&consumer->flags) & MACHINE_ABORTED) != 0) {
+        printf("Body Consumer timed out\n");
+        MetricAdd(METRIC_HANDLERS_TIMED_OUT, 1);
+
+        if (!conn->answered) {
+            RejectRequest(conn, 503);
+            return;
+        }
+
+        conn->keepAlive = false;
+        FinishRequest(conn);
+        return;
+    }
+
+    const uint8_t *data;
+    bool ended;
+
+    ReadBodyPart(conn, PeekBodyPart(conn, &data, &ended));
+
+    // Finished, the rest of the body is dropped.
+    if (consumer->state == NULL) {
+        FreeBodyConsumer(conn);
+
+        if (!conn->answered) {
+            printf("Body Consumer didn't answer\n");
+            RejectRequest(conn, 500);
+            return;
+        }
     } else {
-        struct shortString shortStr = { .len = size };
-        memcpy(shortStr.buf, buf, size);
+        ((struct body_async_state *)consumer->state)->conn = NULL;
+
+        // Nothing is left to run it with.
+        if (ended) {
+            printf("Body Consumer failed\n");
+            RejectRequest(conn, 500);
+            return;
+        }
+    }
+
+    if (ended) FinishRequest(conn);
+}
+
+// Reads the body of the current request from buf, up to its end. Parts of it go to the consumer (or are dropped),
+// and the request is finished after the last one. Returns false if the framing is malformed.
+bool ProcessBody(struct tcpConnCommon *conn, const uint8_t *buf, uint32_t len, uint32_t *used) {
+    uint32_t pos = 0;
+
+    if (conn->bodyChunked && conn->chunks.stage != CHUNK_DATA) {
+        if (!DecodeChunkFraming(&conn->chunks, buf, len, &pos)) return false;
+
+        *used = pos;
+
+        if (conn->chunks.stage == CHUNK_DONE) {
+            if (conn->bodyConsumer != NULL) HandBodyPart(conn, buf + pos, 0, true);
+            else FinishRequest(conn);
 
-        *str = (union string){ .shortStr = shortStr };
+            return true;
+        }
+
+        if (conn->chunks.stage != CHUNK_DATA) return true;
+
+        // Refused as soon as the chunk that would exceed the limit is announced.
+        if (conn->bodyConsumer != NULL && conn->bodyReceived + conn->chunks.remaining > conn->bodyLimit) {
+            RejectRequest(conn, 413);
+            return true;
+        }
+
+        if (pos == len) return true;
+    }
+
+    uint64_t remaining = conn->bodyChunked ? conn->chunks.remaining : conn->bodyRemaining;
+    uint32_t n = remaining < len - pos ? (uint32_t)remaining : len - pos;
+
+    // The end of a chunked body is only known from the framing after it.
+    bool ended = !conn->bodyChunked && remaining == n;
+
+    // Lengths are checked against the limit before any of the data is read. The part is only read past once the
+    // consumer took it, see BodyConsumed.
+    if (conn->bodyConsumer != NULL) {
+        *used = pos;
+        HandBodyPart(conn, buf + pos, n, ended);
         return true;
     }
+
+    if (conn->bodyChunked) ChunkDataRead(&conn->chunks, n);
+    else conn->bodyRemaining -= n;
+
+    conn->bodyReceived += n;
+    *used = pos + n;
+
+    if (ended) FinishRequest(conn);
+
+    return true;
 }
 
-void TrimChar(union string *line, uint8_t c) {
-    if (line->shortStr.len > 0) {
-        if (line->shortStr.buf[line->shortStr.len - 1] == c) {
-            line->shortStr.len -= 1;
+// States of route handlers start with this, it's filled in before their first run. A handler answers with
+// Respond, RespondFile, RespondStream or ReceiveBody and finishes, it's answered with 500 if it didn't. One still running at its
+// deadline is abandoned (see AbortAsync), so its destructor mustn't touch the connection.
+struct handler_async_state {
+    struct tcpConnCommon *conn;
+    struct HTTPRequest *req;
+};
+
+#define CONTINUE_RESPONSE "HTTP/1.1 100 Continue\r\n\r\n"
+
+// Request is answered, reads its body, if any, for the consumer or to drop it.
+// Returns false if it can't be continued.
+bool ContinueRequest(struct tcpConnCommon *conn) {
+    struct HTTPRequest *req = &conn->currentReq;
+    union string value;
+
+    if (!conn->answered) return false;
+
+    // Answered by the consumer once it took the body.
+    if (conn->bodyConsumer != NULL) conn->answered = false;
+
+    bool hasBody = conn->bodyChunked || conn->bodyRemaining > 0;
+
+    if (hasBody && req->version == HTTP_VERSION_1_1 && GetHeader(&req->headers, HEADER_EXPECT, &value) && HeaderHasToken(value, "100-continue")) {
+        // The client waits for this before sending the body, an answer instead means it won't be read, so the
+        // connection can't be reused (the client may send it anyway).
+        if (conn->bodyConsumer != NULL) {
+            if (!QueueSendData(&conn->send, CONTINUE_RESPONSE, sizeof(CONTINUE_RESPONSE) - 1)) return false;
+        } else {
+            conn->keepAlive = false;
         }
-    } else {
-        if (line->longStr.len == 0) return;
-        
-        if (line->longStr.buf[line->longStr.len - 1] == c) {
-            line->longStr.len -= 1;
+    }
+
+    conn->state = RECV_BODY;
+
+    // Only the head has to stay in place, the body is handed out as it's read.
+    RecvChainEndRetain(&conn->recv);
+
+    if (!hasBody) {
+        if (conn->bodyConsumer != NULL) HandBodyPart(conn, (const uint8_t *)"", 0, true);
+        else FinishRequest(conn);
+    } else if (!conn->keepAlive && conn->bodyConsumer == NULL) {
+        // Nothing would read it.
+        FinishRequest(conn);
+    }
+
+    return true;
+}
+
+// Starts the handler of the route, it's awaited by the platform (see TakeHandler).
+struct file_opener_state {
+    struct handler_async_state handler;
+    uint32_t pathLen;
+    char path[FILE_PATH_MAX];
+};
+
+void *fileOpenerConstructor(struct file_opener_state *state, struct file_opener_state *param) {
+    state->handler = param->handler;
+    state->pathLen = param->pathLen;
+    memcpy(state->path, param->path, param->pathLen + 1);
+
+    return state;
+}
+
+void fileOpenerDestructor(struct file_opener_state *state) {}
+
+// Runs on an executor, while the connection awaits it.
+struct subroutine_result runFileOpener(struct file_opener_state *state) {
+    struct file_entry *entry = AcquireFile(state->path, state->pathLen);
+
+    if (entry == NULL) Respond(state->handler.conn, 404, NULL, NULL, 0);
+    else RespondFileEntry(state->handler.conn, entry);
+
+    return subroutine_finish;
+}
+
+const struct async_descriptor fileOpenerAsync = {
+    .constructor = (async_constructor)fileOpenerConstructor,
+    .destructor = (async_destructor)fileOpenerDestructor,
+    .subroutine = (async_subroutine)runFileOpener,
+    .stateSize = sizeof(struct file_opener_state),
+};
+
+// Answers the current request with the file under staticFileRoot that path maps to, 404 if there's none. Paths
+// without a leading "/" (e.g. a wildcard parameter) are taken from the root as well. A file that isn't cached is
+// opened on an executor, by a machine the connection awaits in place of the route handler (see TakeHandler), so
+// the handler finishes as it would after Respond. Returns false if the request can't be answered.
+bool RespondFile(struct tcpConnCommon *conn, union string path) {
+    const uint8_t *buf = GetStringBuf(&path);
+    uint32_t len = GetStringLen(&path);
+    char rooted[FILE_PATH_MAX];
+
+    if (len == 0 || buf[0] != '/') {
+        if (len + 1 >= FILE_PATH_MAX) return Respond(conn, 404, NULL, NULL, 0);
+
+        rooted[0] = '/';
+        memcpy(rooted + 1, buf, len);
+        buf = (const uint8_t *)rooted;
+        len++;
+    }
+
+    struct file_opener_state params = { .handler = { .conn = conn, .req = &conn->currentReq } };
+
+    if (!StaticFilesEnabled() || !ResolveStaticPath(buf, len, params.path, &params.pathLen)) return Respond(conn, 404, NULL, NULL, 0);
+
+    struct file_entry *entry = LookupFile(params.path, params.pathLen);
+    if (entry != NULL) return RespondFileEntry(conn, entry);
+
+    struct async_state *opener = SpawnAsync(fileOpenerAsync, &params);
+    if (opener == NULL) return false;
+
+    // Kept like a handler, the one calling this (if any) is let go, it's about to finish.
+    opener->awaiting = NULL;
+    RetainAsync(opener);
+
+    if (conn->handler != NULL) ReleaseAsync(conn->handler);
+    conn->handler = opener;
+
+    return true;
+}
+
+bool StartHandler(struct tcpConnCommon *conn, const struct route *route) {
+    struct async_state *handler = AwaitAsync(route->handler, route->param);
+    if (handler == NULL) return false;
+
+    struct handler_async_state *handlerState = handler->state;
+    handlerState->conn = conn;
+    handlerState->req = &conn->currentReq;
+
+    // Kept until HandlerFinished, an abandoned handler may be destroyed before the connection resumes.
+    RetainAsync(handler);
+    conn->handler = handler;
+    return true;
+}
+
+// Returns the handler to await for the current request, if there's one. ContinueRequest follows once it finished,
+// see HandlerFinished.
+struct async_state *TakeHandler(struct tcpConnCommon *conn) {
+    if (conn->handler != NULL) conn->handler->awaiting = currentAsync;
+
+    return conn->handler;
+}
+
+// Whether parsing stopped for a machine the platform has to await, see TakeHandler and TakeBodyConsumer.
+bool AwaitPending(const struct tcpConnCommon *conn) {
+    return conn->handler != NULL || BodyPartHanded(conn);
+}
+
+void HandlerFinished(struct tcpConnCommon *conn) {
+    struct async_state *handler = conn->handler;
+    bool aborted = false;
+
+    // Put in place of the handler by RespondFile and never run, it's awaited next.
+    if (handler != NULL && handler->state != NULL && (atomic_load(&handler->flags) & ~MACHINE_SPAWNED) == 0) return;
+
+    if (handler != NULL) {
+        aborted = (atomic_load(&handler->flags) & MACHINE_ABORTED) != 0;
+
+        ReleaseAsync(handler);
+        conn->handler = NULL;
+    }
+
+    if (!HasCurrentRequest(conn)) return;
+
+    if (aborted) {
+        printf("Handler timed out\n");
+        MetricAdd(METRIC_HANDLERS_TIMED_OUT, 1);
+
+        if (!conn->answered) {
+            RejectRequest(conn, 503);
+            return;
         }
+
+        // It stopped wherever it was, anything it started is cut short with the connection.
+        conn->keepAlive = false;
+    }
+
+    if (!ContinueRequest(conn)) {
+        printf("Handler didn't answer\n");
+        RejectRequest(conn, 500);
     }
 }
 
-void TrimLine(union string *line) {
-    TrimChar(line, '\n');
-    TrimChar(line, '\r');
+// Request head is parsed, decides how the body is framed and whether the connection persists, then answers it
+// from the Response Cache, a route, or the built-in handling (static files, 404).
+bool CompleteHead(struct tcpConnCommon *conn) {
+    struct HTTPRequest *req = &conn->currentReq;
+    union string value;
+
+    MetricAdd(METRIC_REQUESTS, 1);
+    MetricRecordSince(METRIC_PARSE_TIME, conn->requestStart);
+
+    uint64_t contentLength = 0;
+    bool hasContentLength = GetHeader(&req->headers, HEADER_CONTENT_LENGTH, &value);
+    if (hasContentLength && !ParseContentLength(value, &contentLength)) return false;
+
+    // Only chunked alone is understood. Both framings at once are refused, as they're how requests get smuggled.
+    bool chunked = GetHeader(&req->headers, HEADER_TRANSFER_ENCODING, &value);
+    if (chunked && (hasContentLength || GetStringLen(&value) != 7 || !HeaderHasToken(value, "chunked"))) return false;
+
+    bool hasConnection = GetHeader(&req->headers, HEADER_CONNECTION, &value);
+
+    if (req->version == HTTP_VERSION_1_1) {
+        conn->keepAlive = !hasConnection || !HeaderHasToken(value, "close");
+    } else {
+        conn->keepAlive = hasConnection && HeaderHasToken(value, "keep-alive");
+    }
+
+    conn->bodyRemaining = contentLength;
+    conn->bodyChunked = chunked;
+    conn->chunks = nullChunkDecoder;
+
+    printf("Request Done\n");
+
+    if (conn->cached != NULL) {
+        if (!RespondCached(conn)) return false;
+
+        return ContinueRequest(conn);
+    }
+
+    const char *allow;
+    const struct route *route = MatchRoute(req, &allow);
+
+    if (route != NULL) {
+        // Continued once the handler finished.
+        if (AdmitRequest()) return StartHandler(conn, route);
+
+        // Shed, the connection's next requests would most likely be too.
+        conn->keepAlive = false;
+        MetricAdd(METRIC_REQUESTS_SHED, 1);
+
+        if (!Respond(conn, 503, "Retry-After: " ADMISSION_RETRY_AFTER "\r\n", NULL, 0)) return false;
+
+        return ContinueRequest(conn);
+    }
+
+    bool answered;
+
+    if (allow != NULL) {
+        answered = Respond(conn, 405, allow, NULL, 0);
+    } else if (req->method == HTTP_METHOD_UNKNOWN) {
+        answered = Respond(conn, 501, NULL, NULL, 0);
+    } else if (StaticFilesEnabled() && (req->method == HTTP_METHOD_GET || req->method == HTTP_METHOD_HEAD)) {
+        answered = RespondFile(conn, req->path);
+
+        // Continued once the file was opened, like a handler.
+        if (answered && conn->handler != NULL) return true;
+    } else {
+        answered = Respond(conn, 404, NULL, NULL, 0);
+    }
+
+    if (!answered) return false;
+
+    return ContinueRequest(conn);
 }
 
-void CommitRead(struct tcpConnCommon* conn, uint32_t n) {
-    uint32_t remaining = n >= conn->recvOffset ? 0 : conn->recvOffset - n;
+// Scratch index for the chunk being parsed, only used within a single ProcessLines call, or kept for the next
+// one of the same connection while it awaits a handler.
+_Thread_local struct scan_index lineIndex = { .base = NULL, .len = 0, .capacityWords = 0, .masks = NULL };
+_Thread_local const struct tcpConnCommon *lineIndexOwner = NULL;
 
-    if (remaining == 0) {
-        conn->recvOffset = 0;
-        return;
+// Line is the content without the line ending, scan holds its delimiters.
+bool ProcessLine(struct tcpConnCommon* conn, const uint8_t *buf, uint32_t len, const struct line_scan *scan) {
+    union string line = SliceString(buf, len);
+
+    if (conn->state == RECV_REQUEST_LINE) {
+        // Clients may send an empty line before a request (e.g. after a body), it's ignored.
+        if (len == 0) return true;
+
+        // Exactly two spaces.
+        if (scan->delimCount != 2) return false;
+
+        if (!DecodeRequestLine(line, scan->delims[0], scan->delims[1], &conn->currentReq)) return false;
+
+        conn->state = RECV_HEADER;
+        conn->requestStart = MetricsBatchNow();
+        conn->answered = false;
+        conn->currentReq.paramCount = 0;
+        ResetHeaders(&conn->currentReq.headers);
+
+        // Headers are still read for framing and persistence, but a hit skips everything else about the request.
+        struct HTTPRequest *req = &conn->currentReq;
+
+        if (req->method == HTTP_METHOD_GET || req->method == HTTP_METHOD_HEAD) {
+            conn->cached = ResponseCacheLookup(HTTP_METHOD_GET, GetStringBuf(&req->path), GetStringLen(&req->path));
+        }
+
+        // Path and header slices must outlive the segments they're read from.
+        RecvChainRetain(&conn->recv);
+
+        return true;
     }
 
-    memmove(conn->recvBuf, (uint8_t *)conn->recvBuf + n, remaining);
-    conn->recvOffset = remaining;
+    if (len == 0) return CompleteHead(conn);
+
+    if (scan->delimCount == 0) return false;
+
+    uint32_t colon = scan->delims[0];
+
+    // Also rejects whitespace between the field name and colon.
+    if (!IsToken(buf, colon)) return false;
+
+    return AddHeader(&conn->currentReq.headers, buf, colon, buf + colon + 1, len - colon - 1);
+}
+
+// Records the delimiters of the current line kind in [from, to) of the chunk, the index covers the chunk from indexStart.
+void CollectLineDelims(const struct tcpConnCommon *conn, struct line_scan *scan, uint32_t indexStart, uint32_t lineStart, uint32_t from, uint32_t to) {
+    enum scan_mask mask = conn->state == RECV_REQUEST_LINE ? SCAN_SPACE : SCAN_COLON;
+    uint32_t maxDelims = conn->state == RECV_REQUEST_LINE ? LINE_MAX_DELIMS : 1;
+
+    uint32_t pos;
+
+    while (
+        scan->delimCount < maxDelims &&
+        ScanFind(&lineIndex, mask, from - indexStart, to - indexStart, &pos)
+    ) {
+        pos += indexStart;
+        scan->delims[scan->delimCount++] = pos - lineStart;
+        from = pos + 1;
+    }
 }
 
+// Parses every complete request received so far, pipelined requests get their responses queued in order.
 // Returns whether process lines was succesful
 bool ProcessLines(struct tcpConnCommon* conn) {
-    union string line;
-    uint32_t offset = 0;
+    for (;;) {
+        uint32_t available;
+        uint8_t *buf = RecvChainRead(&conn->recv, &available);
+
+        // The read cursor may be at the start of an unterminated line, whose first bytes were scanned by an earlier call.
+        // Nothing more is parsed while a handler or the body consumer is to be awaited.
+        if (available <= conn->lineScan.scanned || conn->state == RECV_CLOSED || AwaitPending(conn)) return true;
+
+        uint32_t pos = 0;
+        // The chunk is scanned once the first head line is reached, from there to its end.
+        bool scanned = false;
+        uint32_t indexStart = 0;
 
-    while ((conn->state == RECV_HEADER || conn->state == RECV_REQUEST_LINE) && GetLine(conn, offset, &line)) {
-        offset += GetStringLen(&line) + 1;
-        TrimLine(&line);
+        while (pos < available && conn->state != RECV_CLOSED && !AwaitPending(conn)) {
+            if (conn->state == RECV_BODY) {
+                uint32_t used;
+                if (!ProcessBody(conn, buf + pos, available - pos, &used)) return false;
+
+                pos += used;
+                continue;
+            }
 
-        if (conn->state == RECV_REQUEST_LINE) {
-            struct HTTPRequest req;
-            if (!DecodeRequestLine(line, &req)) return false;
+            struct line_scan *scan = &conn->lineScan;
 
+            // A new request needs room for its response, and for a rejection after it, and its response must not
+            // overtake a file or streamed body. The rest waits for the flush.
             if (
-                !StringEquals(req.version, FromCStrUnsafe("HTTP/1.0")) &&
-                !StringEquals(req.version, FromCStrUnsafe("HTTP/1.1"))
-            ) return false;
+                conn->state == RECV_REQUEST_LINE && scan->scanned == 0 &&
+                (!CanQueueResponses(conn->send, 2) || conn->file != NULL || HasBodyStream(conn))
+            ) break;
 
-            // Copy the strings, because the current string reference a soon to be teared down receive buffer.
-            req.method = CopyString(req.method);
-            req.path = CopyString(req.path);
-            req.version = CopyString(req.version);
+            // Only the line at the read cursor can have been scanned before.
+            uint32_t from = pos + scan->scanned;
 
-            conn->state = RECV_HEADER;
-            conn->currentReq = req;
-        } else {
-            if (GetStringLen(&line) == 0) {
-                // check if actually expecting body
-                conn->state = RECV_BODY;
-                printf("Request Done\n");
-                CommitRead(conn, offset);
-                return true;
-            } else {
-                printf("Header Line: %.*s\n", GetStringLen(&line), GetStringBuf(&line));
+            if (!scanned) {
+                bool kept = conn->lineIndexKept && lineIndexOwner == conn &&
+                    lineIndex.base <= buf + from && lineIndex.base + lineIndex.len == buf + available;
+
+                conn->lineIndexKept = false;
+
+                if (kept) {
+                    // Nothing was received since parsing stopped for the handler. The index starts before the
+                    // cursor, offsets into it wrap around.
+                    indexStart = (uint32_t)(lineIndex.base - buf);
+                } else {
+                    // Lines never span segments (see RecvChainPrepare), so every complete line of the head segment is found here.
+                    if (!ScanChunk(&lineIndex, buf + from, available - from)) return false;
+
+                    lineIndexOwner = conn;
+                    indexStart = from;
+                }
+
+                scanned = true;
             }
+
+            uint32_t lineEnd;
+
+            bool complete = ScanFind(&lineIndex, SCAN_LINE_END, from - indexStart, available - indexStart, &lineEnd);
+            if (complete) lineEnd += indexStart;
+
+            uint32_t to = complete ? lineEnd : available;
+
+            // CR isn't invalid, so checking up to the line ending is fine.
+            if (ScanAny(&lineIndex, SCAN_INVALID, from - indexStart, to - indexStart)) return false;
+            CollectLineDelims(conn, scan, indexStart, pos, from, to);
+
+            if (!complete) {
+                scan->scanned = available - pos;
+                break;
+            }
+
+            conn->headerBytes += lineEnd - pos + 1;
+            if (conn->headerBytes > conn->maxHeaderSize) return false;
+
+            uint32_t contentEnd = lineEnd;
+            if (contentEnd > pos && buf[contentEnd - 1] == '\r') contentEnd--;
+
+            if (!ProcessLine(conn, buf + pos, contentEnd - pos, scan)) return false;
+
+            // FinishRequest may have reset it already, that's fine.
+            *scan = nullLineScan;
+            pos = lineEnd + 1;
         }
-    }
 
-    CommitRead(conn, offset);
+        // Lines point into the head segment, only consume them once they're processed.
+        CommitRead(conn, pos);
 
-    return true;
+        // The connection only receives again once the awaited machine is done, so the rest of the chunk stays indexed.
+        if (AwaitPending(conn) && scanned && pos < available) conn->lineIndexKept = true;
+
+        // Either an unterminated line is left, the send queue is full, the connection is closing, or a machine is to be awaited.
+        if (pos < available || AwaitPending(conn)) return true;
+    }
 }
\ No newline at end of file
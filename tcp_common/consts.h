@@ -5,4 +5,21 @@
 #define IO_READ        1
 #define IO_WRITE       2
 #define IO_SPAWN       3
-#define IO_SUBROUTINE  4
\ No newline at end of file
+#define IO_SUBROUTINE  4
+#define IO_SENDFILE    5
+#define IO_ACCEPT      6
+
+// Accepts kept outstanding on the listening socket, more absorb bursts of new connections better.
+#ifndef ACCEPTS_OUTSTANDING
+#define ACCEPTS_OUTSTANDING 4
+#endif
+
+// An accept failing for lack of descriptors or memory waits this long before it's armed again, doubling up to the
+// maximum while it keeps failing.
+#ifndef ACCEPT_BACKOFF_MS
+#define ACCEPT_BACKOFF_MS 10
+#endif
+
+#ifndef ACCEPT_BACKOFF_MAX_MS
+#define ACCEPT_BACKOFF_MAX_MS 1000
+#endif
\ No newline at end of file
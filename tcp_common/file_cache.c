@@ -0,0 +1,369 @@
+﻿// Static File Cache
+
+#pragma once
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <stdatomic.h>
+#include <immintrin.h>
+#include "../atomics.c"
+#include "../slab.c"
+
+#ifdef _WIN32
+#include <windows.h>
+typedef HANDLE file_handle;
+#else
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+typedef int file_handle;
+#endif
+
+// Default of staticFileRoot.
+#ifndef STATIC_FILE_ROOT
+#define STATIC_FILE_ROOT ""
+#endif
+
+// Open files kept around, least recently used ones are closed first.
+#ifndef FILE_CACHE_ENTRIES
+#define FILE_CACHE_ENTRIES 256
+#endif
+
+// Entries are reopened after this long, so replaced or changed files are picked up.
+#ifndef FILE_CACHE_TTL_SECONDS
+#define FILE_CACHE_TTL_SECONDS 2
+#endif
+
+#define FILE_CACHE_BUCKETS 512
+#define FILE_PATH_MAX 1024
+
+struct file_entry {
+    file_handle handle;
+    uint64_t size;
+    const char *contentType;
+    time_t openedAt;
+
+    // One for the cache while the entry is listed, and one per response sending it.
+    atomic_uint32 refs;
+
+    struct file_entry *bucketNext;
+    struct file_entry *lruPrev;
+    struct file_entry *lruNext;
+
+    uint64_t hash;
+    uint32_t pathLen;
+    char path[];
+};
+
+struct file_cache {
+    // Only held for lookups and list updates, files are opened and closed outside of it.
+    atomic_uint32 lock;
+    uint32_t count;
+    struct file_entry *buckets[FILE_CACHE_BUCKETS];
+    // Most recently used first.
+    struct file_entry *lruHead;
+    struct file_entry *lruTail;
+};
+
+struct file_cache fileCache = { 0 };
+
+// Directory files are served from, empty disables static files. Set before the server starts.
+const char *staticFileRoot = STATIC_FILE_ROOT;
+
+bool StaticFilesEnabled() {
+    return staticFileRoot[0] != '\0';
+}
+
+void LockFileCache() {
+    for (;;) {
+        uint32_t unlocked = 0;
+        if (atomic_compare_exchange_weak(&fileCache.lock, &unlocked, 1)) break;
+        _mm_pause();
+    }
+}
+
+void UnlockFileCache() {
+    atomic_store(&fileCache.lock, 0);
+}
+
+// FNV-1a
+uint64_t HashFilePath(const char *path, uint32_t len) {
+    uint64_t hash = 0xcbf29ce484222325ull;
+
+    for (uint32_t i = 0; i < len; i++) {
+        hash ^= (uint8_t)path[i];
+        hash *= 0x100000001b3ull;
+    }
+
+    return hash;
+}
+
+#define CONTENT_TYPE(type) "Content-Type: " type "\r\n"
+
+const char *ContentTypeHeader(const char *path, uint32_t len) {
+    static const struct { const char *ext; const char *header; } types[] = {
+        { ".html", CONTENT_TYPE("text/html; charset=utf-8") },
+        { ".css", CONTENT_TYPE("text/css; charset=utf-8") },
+        { ".js", CONTENT_TYPE("text/javascript; charset=utf-8") },
+        { ".json", CONTENT_TYPE("application/json") },
+        { ".txt", CONTENT_TYPE("text/plain; charset=utf-8") },
+        { ".svg", CONTENT_TYPE("image/svg+xml") },
+        { ".png", CONTENT_TYPE("image/png") },
+        { ".jpg", CONTENT_TYPE("image/jpeg") },
+        { ".webp", CONTENT_TYPE("image/webp") },
+        { ".ico", CONTENT_TYPE("image/x-icon") },
+        { ".woff2", CONTENT_TYPE("font/woff2") },
+        { ".wasm", CONTENT_TYPE("application/wasm") },
+    };
+
+    for (uint32_t i = 0; i < sizeof(types) / sizeof(types[0]); i++) {
+        uint32_t extLen = strlen(types[i].ext);
+
+        if (len >= extLen && memcmp(path + len - extLen, types[i].ext, extLen) == 0) return types[i].header;
+    }
+
+    return CONTENT_TYPE("application/octet-stream");
+}
+
+// Maps a request path to a file under staticFileRoot. The query is dropped, directories get their index.html.
+// Anything that could leave the root (dot segments, backslashes, drive letters) or needs decoding is refused.
+bool ResolveStaticPath(const uint8_t *path, uint32_t len, char *out, uint32_t *outLen) {
+    for (uint32_t i = 0; i < len; i++) {
+        if (path[i] == '?') {
+            len = i;
+            break;
+        }
+    }
+
+    if (len == 0 || path[0] != '/') return false;
+
+    for (uint32_t i = 0; i < len; i++) {
+        uint8_t c = path[i];
+        if (c == '\\' || c == '%' || c == ':' || c < 0x20) return false;
+
+        // Segments starting with a dot, which covers "." and "..", and hidden files.
+        if (c == '.' && path[i - 1] == '/') return false;
+    }
+
+    const char *index = path[len - 1] == '/' ? "index.html" : "";
+    uint32_t rootLen = strlen(staticFileRoot);
+    uint32_t indexLen = strlen(index);
+
+    if (rootLen + len + indexLen >= FILE_PATH_MAX) return false;
+
+    memcpy(out, staticFileRoot, rootLen);
+    memcpy(out + rootLen, path, len);
+    memcpy(out + rootLen + len, index, indexLen + 1);
+
+    *outLen = rootLen + len + indexLen;
+    return true;
+}
+
+// Only regular files, the handle is shared by every response, so reads must use explicit offsets.
+bool OpenStaticFile(const char *path, file_handle *handle, uint64_t *size) {
+#ifdef _WIN32
+    // Directories can't be opened without FILE_FLAG_BACKUP_SEMANTICS. Overlapped, so TransmitFile takes its
+    // offset from the operation rather than a shared file pointer.
+    HANDLE file = CreateFileA(
+        path,
+        GENERIC_READ,
+        FILE_SHARE_READ | FILE_SHARE_DELETE,
+        NULL,
+        OPEN_EXISTING,
+        FILE_ATTRIBUTE_NORMAL | FILE_FLAG_OVERLAPPED | FILE_FLAG_SEQUENTIAL_SCAN,
+        NULL
+    );
+
+    if (file == INVALID_HANDLE_VALUE) return false;
+
+    LARGE_INTEGER fileSize;
+
+    if (!GetFileSizeEx(file, &fileSize)) {
+        CloseHandle(file);
+        return false;
+    }
+
+    *handle = file;
+    *size = (uint64_t)fileSize.QuadPart;
+#else
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return false;
+
+    struct stat st;
+
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+        close(fd);
+        return false;
+    }
+
+    *handle = fd;
+    *size = (uint64_t)st.st_size;
+#endif
+
+    return true;
+}
+
+void CloseStaticFile(file_handle handle) {
+#ifdef _WIN32
+    CloseHandle(handle);
+#else
+    close(handle);
+#endif
+}
+
+void ReleaseFileEntry(struct file_entry *entry) {
+    if (atomic_fetch_sub(&entry->refs, 1) != 1) return;
+
+    CloseStaticFile(entry->handle);
+    SlabFree(entry);
+}
+
+void UnlinkLRUFileEntry(struct file_entry *entry) {
+    if (entry->lruPrev != NULL) entry->lruPrev->lruNext = entry->lruNext;
+    else fileCache.lruHead = entry->lruNext;
+
+    if (entry->lruNext != NULL) entry->lruNext->lruPrev = entry->lruPrev;
+    else fileCache.lruTail = entry->lruPrev;
+}
+
+// Takes the entry off the lists, the caller releases the cache's reference after unlocking.
+void UnlinkFileEntry(struct file_entry *entry) {
+    struct file_entry **link = &fileCache.buckets[entry->hash % FILE_CACHE_BUCKETS];
+
+    while (*link != entry) link = &(*link)->bucketNext;
+    *link = entry->bucketNext;
+
+    UnlinkLRUFileEntry(entry);
+    fileCache.count--;
+}
+
+void PushFrontFileEntry(struct file_entry *entry) {
+    entry->lruPrev = NULL;
+    entry->lruNext = fileCache.lruHead;
+
+    if (fileCache.lruHead != NULL) fileCache.lruHead->lruPrev = entry;
+    else fileCache.lruTail = entry;
+
+    fileCache.lruHead = entry;
+}
+
+struct file_entry *FindFileEntry(const char *path, uint32_t len, uint64_t hash) {
+    for (struct file_entry *entry = fileCache.buckets[hash % FILE_CACHE_BUCKETS]; entry != NULL; entry = entry->bucketNext) {
+        if (entry->hash == hash && entry->pathLen == len && memcmp(entry->path, path, len) == 0) return entry;
+    }
+
+    return NULL;
+}
+
+// Returns a referenced entry for the file at path if it's cached and fresh, NULL otherwise. Never touches the disk.
+struct file_entry *LookupFile(const char *path, uint32_t len) {
+    uint64_t hash = HashFilePath(path, len);
+    time_t now = time(NULL);
+
+    LockFileCache();
+
+    struct file_entry *entry = FindFileEntry(path, len, hash);
+
+    if (entry == NULL || now - entry->openedAt >= FILE_CACHE_TTL_SECONDS) {
+        UnlockFileCache();
+        return NULL;
+    }
+
+    UnlinkLRUFileEntry(entry);
+    PushFrontFileEntry(entry);
+
+    atomic_fetch_add(&entry->refs, 1);
+    UnlockFileCache();
+
+    return entry;
+}
+
+// Returns a referenced entry for the file at path, or NULL if it can't be served. Release with ReleaseFileEntry.
+// Opening the file may block on the disk, so workers only call this off their loop, see RespondFile.
+struct file_entry *AcquireFile(const char *path, uint32_t len) {
+    uint64_t hash = HashFilePath(path, len);
+    time_t now = time(NULL);
+    struct file_entry *stale = NULL;
+
+    LockFileCache();
+
+    struct file_entry *entry = FindFileEntry(path, len, hash);
+
+    if (entry != NULL && now - entry->openedAt < FILE_CACHE_TTL_SECONDS) {
+        UnlinkLRUFileEntry(entry);
+        PushFrontFileEntry(entry);
+
+        atomic_fetch_add(&entry->refs, 1);
+        UnlockFileCache();
+
+        return entry;
+    }
+
+    if (entry != NULL) {
+        UnlinkFileEntry(entry);
+        stale = entry;
+    }
+
+    UnlockFileCache();
+
+    // Responses still sending the old file keep it open until they're done.
+    if (stale != NULL) ReleaseFileEntry(stale);
+
+    file_handle handle;
+    uint64_t size;
+
+    if (!OpenStaticFile(path, &handle, &size)) return NULL;
+
+    entry = SlabAlloc(sizeof(struct file_entry) + len + 1);
+
+    if (entry == NULL) {
+        CloseStaticFile(handle);
+        return NULL;
+    }
+
+    entry->handle = handle;
+    entry->size = size;
+    entry->contentType = ContentTypeHeader(path, len);
+    entry->openedAt = now;
+    entry->refs = 2;
+    entry->hash = hash;
+    entry->pathLen = len;
+    memcpy(entry->path, path, len);
+    entry->path[len] = '\0';
+
+    struct file_entry *evicted = NULL;
+
+    LockFileCache();
+
+    // Another worker may have opened the same file meanwhile, keep theirs.
+    struct file_entry *existing = FindFileEntry(path, len, hash);
+
+    if (existing != NULL) {
+        atomic_fetch_add(&existing->refs, 1);
+        UnlockFileCache();
+
+        entry->refs = 1;
+        ReleaseFileEntry(entry);
+
+        return existing;
+    }
+
+    struct file_entry **bucket = &fileCache.buckets[hash % FILE_CACHE_BUCKETS];
+    entry->bucketNext = *bucket;
+    *bucket = entry;
+    PushFrontFileEntry(entry);
+    fileCache.count++;
+
+    if (fileCache.count > FILE_CACHE_ENTRIES) {
+        evicted = fileCache.lruTail;
+        UnlinkFileEntry(evicted);
+    }
+
+    UnlockFileCache();
+
+    if (evicted != NULL) ReleaseFileEntry(evicted);
+
+    return entry;
+}
\ No newline at end of file
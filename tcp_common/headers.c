@@ -0,0 +1,245 @@
+﻿#pragma once
+
+#include <stdint.h>
+#include <string.h>
+#include "../string.c"
+
+// Header fields of a request, names and values are slices into the receive buffer (see RecvChainRetain).
+
+enum http_header_id {
+    HEADER_HOST,
+    HEADER_CONTENT_LENGTH,
+    HEADER_CONNECTION,
+    HEADER_TRANSFER_ENCODING,
+    HEADER_ACCEPT_ENCODING,
+    HEADER_CONTENT_TYPE,
+    HEADER_ACCEPT,
+    HEADER_USER_AGENT,
+    HEADER_COOKIE,
+    HEADER_EXPECT,
+    HEADER_IF_MODIFIED_SINCE,
+    HEADER_IF_NONE_MATCH,
+    HEADER_RANGE,
+    HEADER_AUTHORIZATION,
+    HEADER_UPGRADE,
+    HEADER_ACCEPT_LANGUAGE,
+    HEADER_REFERER,
+    HEADER_ORIGIN,
+    HEADER_CACHE_CONTROL,
+    HEADER_X_FORWARDED_FOR,
+    HEADER_KNOWN_COUNT,
+    // Returned by ClassifyHeader for any other name.
+    HEADER_UNKNOWN = HEADER_KNOWN_COUNT
+};
+
+static_assert(HEADER_KNOWN_COUNT <= 32, "Known headers don't fit the present mask.");
+
+// Headers that aren't well-known, more than this rejects the request.
+#ifndef MAX_OTHER_HEADERS
+#define MAX_OTHER_HEADERS 32
+#endif
+
+struct http_header {
+    union string name;
+    union string value;
+};
+
+struct http_headers {
+    // Bit per http_header_id set in known.
+    uint32_t knownMask;
+    union string known[HEADER_KNOWN_COUNT];
+    uint32_t otherCount;
+    // Other headers in arrival order, also repeats of well-known ones that may be repeated.
+    struct http_header others[MAX_OTHER_HEADERS];
+};
+
+struct known_header {
+    const char *name;
+    uint32_t len;
+    enum http_header_id id;
+};
+
+// Perfect hash over the lowercase first and last byte and the length, collision free for the names below.
+#define KNOWN_HEADER_SLOTS 32
+
+uint32_t KnownHeaderHash(const uint8_t *name, uint32_t len) {
+    return ((name[0] | 0x20) + (name[len - 1] | 0x20) * 8 + len * 23) & (KNOWN_HEADER_SLOTS - 1);
+}
+
+const struct known_header knownHeaders[KNOWN_HEADER_SLOTS] = {
+    [1] = { "x-forwarded-for", 15, HEADER_X_FORWARDED_FOR },
+    [2] = { "accept-language", 15, HEADER_ACCEPT_LANGUAGE },
+    [3] = { "referer", 7, HEADER_REFERER },
+    [4] = { "host", 4, HEADER_HOST },
+    [5] = { "content-length", 14, HEADER_CONTENT_LENGTH },
+    [9] = { "origin", 6, HEADER_ORIGIN },
+    [11] = { "accept", 6, HEADER_ACCEPT },
+    [13] = { "range", 5, HEADER_RANGE },
+    [14] = { "cache-control", 13, HEADER_CACHE_CONTROL },
+    [15] = { "expect", 6, HEADER_EXPECT },
+    [18] = { "accept-encoding", 15, HEADER_ACCEPT_ENCODING },
+    [19] = { "transfer-encoding", 17, HEADER_TRANSFER_ENCODING },
+    [20] = { "if-none-match", 13, HEADER_IF_NONE_MATCH },
+    [21] = { "cookie", 6, HEADER_COOKIE },
+    [24] = { "if-modified-since", 17, HEADER_IF_MODIFIED_SINCE },
+    [25] = { "connection", 10, HEADER_CONNECTION },
+    [27] = { "user-agent", 10, HEADER_USER_AGENT },
+    [28] = { "authorization", 13, HEADER_AUTHORIZATION },
+    [30] = { "upgrade", 7, HEADER_UPGRADE },
+    [31] = { "content-type", 12, HEADER_CONTENT_TYPE },
+};
+
+// Compares a token against a lowercase name of [a-z-], 8 bytes at a time.
+// OR-ing 0x20 only folds letters here, since name is a token (see IsToken).
+bool HeaderNameEquals(const uint8_t *name, const char *lower, uint32_t len) {
+    uint32_t i = 0;
+
+    for (; i + 8 <= len; i += 8) {
+        uint64_t a, b;
+        memcpy(&a, name + i, 8);
+        memcpy(&b, lower + i, 8);
+
+        if ((a | 0x2020202020202020ull) != b) return false;
+    }
+
+    for (; i < len; i++) {
+        if ((name[i] | 0x20) != (uint8_t)lower[i]) return false;
+    }
+
+    return true;
+}
+
+enum http_header_id ClassifyHeader(const uint8_t *name, uint32_t len) {
+    if (len == 0) return HEADER_UNKNOWN;
+
+    const struct known_header *entry = &knownHeaders[KnownHeaderHash(name, len)];
+
+    // Empty slots have len 0, which never matches.
+    if (entry->len != len || !HeaderNameEquals(name, entry->name, len)) return HEADER_UNKNOWN;
+
+    return entry->id;
+}
+
+// Framing and routing headers, a repeat could be read differently by a proxy in front of us.
+bool IsSingletonHeader(enum http_header_id id) {
+    return id == HEADER_HOST || id == HEADER_CONTENT_LENGTH || id == HEADER_TRANSFER_ENCODING;
+}
+
+void ResetHeaders(struct http_headers *headers) {
+    headers->knownMask = 0;
+    headers->otherCount = 0;
+}
+
+// Trims optional whitespace around the value, returns false if the request must be rejected.
+bool AddHeader(struct http_headers *headers, const uint8_t *name, uint32_t nameLen, const uint8_t *value, uint32_t valueLen) {
+    while (valueLen > 0 && (value[0] == ' ' || value[0] == '\t')) {
+        value++;
+        valueLen--;
+    }
+
+    while (valueLen > 0 && (value[valueLen - 1] == ' ' || value[valueLen - 1] == '\t')) valueLen--;
+
+    enum http_header_id id = ClassifyHeader(name, nameLen);
+
+    if (id != HEADER_UNKNOWN) {
+        uint32_t bit = (uint32_t)1 << id;
+
+        if ((headers->knownMask & bit) == 0) {
+            headers->known[id] = SliceString(value, valueLen);
+            headers->knownMask |= bit;
+            return true;
+        }
+
+        if (IsSingletonHeader(id)) return false;
+    }
+
+    if (headers->otherCount == MAX_OTHER_HEADERS) return false;
+
+    struct http_header *header = &headers->others[headers->otherCount++];
+    header->name = SliceString(name, nameLen);
+    header->value = SliceString(value, valueLen);
+
+    return true;
+}
+
+// Value of the first header with the given id.
+bool GetHeader(struct http_headers *headers, enum http_header_id id, union string *value) {
+    if ((headers->knownMask & ((uint32_t)1 << id)) == 0) return false;
+
+    *value = headers->known[id];
+    return true;
+}
+
+uint8_t LowerASCII(uint8_t c) {
+    return c >= 'A' && c <= 'Z' ? c + ('a' - 'A') : c;
+}
+
+// Value of the first header with the given name, case insensitive.
+bool FindHeader(struct http_headers *headers, const char *name, union string *value) {
+    uint32_t len = strlen(name);
+    enum http_header_id id = ClassifyHeader((const uint8_t *)name, len);
+
+    if (id != HEADER_UNKNOWN) return GetHeader(headers, id, value);
+
+    for (uint32_t i = 0; i < headers->otherCount; i++) {
+        struct http_header *header = &headers->others[i];
+        if (GetStringLen(&header->name) != len) continue;
+
+        uint8_t *other = GetStringBuf(&header->name);
+        uint32_t c = 0;
+
+        while (c < len && LowerASCII(other[c]) == LowerASCII((uint8_t)name[c])) c++;
+
+        if (c == len) {
+            *value = header->value;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+// Whether a comma separated list value (e.g. Connection) has token, case insensitive.
+bool HeaderHasToken(union string value, const char *token) {
+    uint8_t *buf = GetStringBuf(&value);
+    uint32_t len = GetStringLen(&value);
+    uint32_t tokenLen = strlen(token);
+    uint32_t pos = 0;
+
+    while (pos < len) {
+        while (pos < len && (buf[pos] == ' ' || buf[pos] == '\t' || buf[pos] == ',')) pos++;
+
+        uint32_t start = pos;
+        while (pos < len && buf[pos] != ',') pos++;
+
+        uint32_t end = pos;
+        while (end > start && (buf[end - 1] == ' ' || buf[end - 1] == '\t')) end--;
+
+        if (end - start != tokenLen) continue;
+
+        uint32_t c = 0;
+        while (c < tokenLen && LowerASCII(buf[start + c]) == LowerASCII((uint8_t)token[c])) c++;
+
+        if (c == tokenLen) return true;
+    }
+
+    return false;
+}
+
+// Content-Length is plain digits, anything else (signs, lists, overflow) is rejected.
+bool ParseContentLength(union string value, uint64_t *length) {
+    uint8_t *buf = GetStringBuf(&value);
+    uint32_t len = GetStringLen(&value);
+
+    if (len == 0 || len > 18) return false;
+
+    uint64_t result = 0;
+
+    for (uint32_t i = 0; i < len; i++) {
+        if (buf[i] < '0' || buf[i] > '9') return false;
+        result = result * 10 + (buf[i] - '0');
+    }
+
+    *length = result;
+    return true;
+}
\ No newline at end of file
@@ -1,32 +1,129 @@
 ﻿#pragma once
 
 #include <stdio.h>
+#include <string.h>
 #include "../string.c"
+#include "../scan.c"
+#include "./headers.c"
+
+enum http_method {
+    HTTP_METHOD_UNKNOWN = 0,
+    HTTP_METHOD_GET,
+    HTTP_METHOD_HEAD,
+    HTTP_METHOD_POST,
+    HTTP_METHOD_PUT,
+    HTTP_METHOD_DELETE,
+    HTTP_METHOD_CONNECT,
+    HTTP_METHOD_OPTIONS,
+    HTTP_METHOD_TRACE,
+    HTTP_METHOD_PATCH
+};
+
+enum http_version {
+    HTTP_VERSION_1_0,
+    HTTP_VERSION_1_1
+};
+
+// Parameters (and wildcard) a route pattern may capture.
+#ifndef MAX_ROUTE_PARAMS
+#define MAX_ROUTE_PARAMS 8
+#endif
 
 struct HTTPRequest {
-    union string method;
+    enum http_method method;
+    enum http_version version;
+    // Slice into the receive chain, valid as long as the request (see RecvChainRetain).
     union string path;
-    union string version;
+    struct http_headers headers;
+    // Captured by the matched route (see router.c), slices of path named by paramNames in pattern order.
+    uint32_t paramCount;
+    const char *const *paramNames;
+    union string params[MAX_ROUTE_PARAMS];
+};
+
+// Names are zero padded to a word, so a method compares as a single 8 byte load.
+const char httpMethodWords[][8] = {
+    [HTTP_METHOD_UNKNOWN] = "",
+    [HTTP_METHOD_GET] = "GET",
+    [HTTP_METHOD_HEAD] = "HEAD",
+    [HTTP_METHOD_POST] = "POST",
+    [HTTP_METHOD_PUT] = "PUT",
+    [HTTP_METHOD_DELETE] = "DELETE",
+    [HTTP_METHOD_CONNECT] = "CONNECT",
+    [HTTP_METHOD_OPTIONS] = "OPTIONS",
+    [HTTP_METHOD_TRACE] = "TRACE",
+    [HTTP_METHOD_PATCH] = "PATCH"
 };
 
+#define HTTP_METHOD_COUNT (sizeof(httpMethodWords) / sizeof(httpMethodWords[0]))
+
+const char *HTTPMethodName(enum http_method method) {
+    return method == HTTP_METHOD_UNKNOWN ? "UNKNOWN" : httpMethodWords[method];
+}
+
+const char *HTTPVersionName(enum http_version version) {
+    return version == HTTP_VERSION_1_1 ? "HTTP/1.1" : "HTTP/1.0";
+}
+
+uint64_t LoadWord(const void *buf) {
+    uint64_t word;
+    memcpy(&word, buf, sizeof(word));
+    return word;
+}
+
+// Methods are case sensitive, any token that isn't a standard one is HTTP_METHOD_UNKNOWN.
+enum http_method ClassifyMethod(const uint8_t *buf, uint32_t len) {
+    if (len >= 8) return HTTP_METHOD_UNKNOWN;
+
+    uint64_t word = 0;
+    memcpy(&word, buf, len);
+
+    for (uint32_t method = HTTP_METHOD_GET; method < HTTP_METHOD_COUNT; method++) {
+        if (word == LoadWord(httpMethodWords[method])) return method;
+    }
+
+    return HTTP_METHOD_UNKNOWN;
+}
+
+// Value of the route parameter (":name" or "*name" in its pattern), false if the route has none by that name.
+bool GetRouteParam(const struct HTTPRequest *req, const char *name, union string *value) {
+    for (uint32_t i = 0; i < req->paramCount; i++) {
+        if (strcmp(req->paramNames[i], name) == 0) {
+            *value = req->params[i];
+            return true;
+        }
+    }
+
+    return false;
+}
+
 void CleanupHTTPRequest(struct HTTPRequest *req) {
-    printf("Cleaning up:\n  Method: %.*s\n  Path: %.*s\n  Version: %.*s\n", GetStringLen(&req->method), GetStringBuf(&req->method), GetStringLen(&req->path), GetStringBuf(&req->path), GetStringLen(&req->version), GetStringBuf(&req->version));
-    FreeString(&req->method);
-    FreeString(&req->path);
-    FreeString(&req->version);
+    printf("Cleaning up:\n  Method: %s\n  Path: %.*s\n  Version: %s\n  Headers: %u\n", HTTPMethodName(req->method), GetStringLen(&req->path), GetStringBuf(&req->path), HTTPVersionName(req->version), __builtin_popcount(req->headers.knownMask) + req->headers.otherCount);
 }
 
-// Returns non-safe strings, strings must be copied with malloc after.
-bool DecodeRequestLine(union string str, struct HTTPRequest *req) {
-    union string method;
-    union string path;
+// Path is a slice into str, space positions are offsets into str, as found by the chunk scan.
+bool DecodeRequestLine(union string str, uint32_t firstSpace, uint32_t secondSpace, struct HTTPRequest *req) {
+    uint8_t *buf = GetStringBuf(&str);
+    uint32_t len = GetStringLen(&str);
+
+    if (firstSpace >= secondSpace || secondSpace >= len) return false;
+    if (!IsToken(buf, firstSpace)) return false;
+
+    // Version is exactly "HTTP/1.x", one word.
+    if (len - secondSpace - 1 != 8) return false;
+
+    uint64_t version = LoadWord(buf + secondSpace + 1);
 
-    if (!SplitString(&str, &method, ' ')) return false;
-    if (!SplitString(&str, &path, ' ')) return false;
+    if (version == LoadWord("HTTP/1.1")) {
+        req->version = HTTP_VERSION_1_1;
+    } else if (version == LoadWord("HTTP/1.0")) {
+        req->version = HTTP_VERSION_1_0;
+    } else {
+        return false;
+    }
 
-    req->method = method;
-    req->path = path;
-    req->version = str;
+    req->method = ClassifyMethod(buf, firstSpace);
+    req->path = SliceString(buf + firstSpace + 1, secondSpace - firstSpace - 1);
 
     return true;
 }
\ No newline at end of file
@@ -0,0 +1,96 @@
+﻿// Metrics Endpoint
+
+#pragma once
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../state_machine.c"
+#include "../metrics.c"
+#include "./response.c"
+#include "./admission.c"
+#include "./router.c"
+#include "./conn.c"
+
+// Every scrape formats the metrics of every thread (see metrics.c) anew, into a buffer that's freed once sent.
+
+#define METRICS_CONTENT_TYPE "Content-Type: text/plain; version=0.0.4\r\n"
+
+// Room for the status line and headers in front of the body.
+#define METRICS_HEAD_SIZE 256
+#define METRICS_BODY_SIZE 16384
+
+struct metrics_route_state {
+    struct handler_async_state handler;
+};
+
+void *MetricsRouteConstructor(struct metrics_route_state *state, void *param) {
+    (void)param;
+    return state;
+}
+
+void MetricsRouteDestructor(struct metrics_route_state *state) {
+    (void)state;
+}
+
+// Answers 500 (by not answering) if out of memory, or if the metrics outgrew the buffer.
+struct subroutine_result RunMetricsRoute(struct metrics_route_state *state) {
+    struct tcpConnCommon *conn = state->handler.conn;
+    struct HTTPRequest *req = state->handler.req;
+
+    struct metrics_snapshot *snapshot = malloc(sizeof(struct metrics_snapshot));
+    char *buf = malloc(METRICS_HEAD_SIZE + METRICS_BODY_SIZE);
+
+    if (snapshot == NULL || buf == NULL) {
+        free(snapshot);
+        free(buf);
+        return subroutine_finish;
+    }
+
+    SnapshotMetrics(snapshot);
+
+    char *body = buf + METRICS_HEAD_SIZE;
+    size_t bodyLen = FormatMetrics(snapshot, body, METRICS_BODY_SIZE);
+
+    free(snapshot);
+
+    if (bodyLen < METRICS_BODY_SIZE) {
+        int n = snprintf(body + bodyLen, METRICS_BODY_SIZE - bodyLen,
+            "# HELP asynchttp_connections_open Connections admitted and not closed.\n"
+            "# TYPE asynchttp_connections_open gauge\nasynchttp_connections_open %u\n",
+            atomic_load_explicit(&openConnections, memory_order_relaxed));
+
+        bodyLen = n < 0 || (size_t)n >= METRICS_BODY_SIZE - bodyLen ? METRICS_BODY_SIZE : bodyLen + n;
+    }
+
+    if (bodyLen >= METRICS_BODY_SIZE) {
+        fprintf(stderr, "warning: Metrics don't fit METRICS_BODY_SIZE.\n");
+        free(buf);
+        return subroutine_finish;
+    }
+
+    uint32_t headLen = snprintf(buf, METRICS_HEAD_SIZE, "%s" SERVER_HEADERS METRICS_CONTENT_TYPE "Content-Length: %zu\r\n", StatusLine(200), bodyLen);
+
+    conn->answered = QueuePreparedResponse(
+        &conn->send,
+        buf, headLen,
+        req->method == HTTP_METHOD_HEAD ? NULL : body, bodyLen,
+        conn->keepAlive, req->version == HTTP_VERSION_1_0,
+        (struct send_ref){ .release = free, .ptr = buf }
+    );
+
+    return subroutine_finish;
+}
+
+const struct async_descriptor metricsRouteAsync = {
+    .constructor = (async_constructor)MetricsRouteConstructor,
+    .destructor = (async_destructor)MetricsRouteDestructor,
+    .subroutine = (async_subroutine)RunMetricsRoute,
+    .stateSize = sizeof(struct metrics_route_state),
+};
+
+// Serves the metrics in the Prometheus text format at path, before BuildRouter.
+void AddMetricsRoute(const char *path) {
+    AddRoute(HTTP_METHOD_GET, path, metricsRouteAsync, NULL);
+}
\ No newline at end of file
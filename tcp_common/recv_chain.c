@@ -0,0 +1,214 @@
+﻿#pragma once
+
+#include <stdint.h>
+#include <string.h>
+#include "../slab.c"
+
+// Regular segments are sized to fill one slab block exactly, so the slab per-thread caches act as the segment pool.
+#define RECV_SEGMENT_BLOCK 4096
+
+struct recv_segment {
+    struct recv_segment *next;
+    // Bytes of buf holding received data.
+    uint32_t len;
+    uint32_t capacity;
+    uint8_t buf[];
+};
+
+#define RECV_SEGMENT_CAPACITY (uint32_t)(RECV_SEGMENT_BLOCK - sizeof(struct slab_block) - sizeof(struct recv_segment))
+
+// Received bytes are read from head at cursor, and received into the free space of tail.
+// Reading only advances the cursor, bytes are never moved once received, except for the line fragment
+// described in RecvChainPrepare. Once every byte is read the chain holds no segment, so idle connections
+// cost no buffer.
+struct recv_chain {
+    struct recv_segment *head;
+    struct recv_segment *tail;
+    uint32_t cursor;
+    // While set, segments that are done with are kept in retained instead of being freed or rewound,
+    // so slices of already read bytes stay valid until RecvChainRelease.
+    bool retainRead;
+    struct recv_segment *retained;
+    // Segment holding the last retained bytes, kept when done with after RecvChainEndRetain.
+    struct recv_segment *retainLast;
+};
+
+const struct recv_chain nullRecvChain = { .head = NULL, .tail = NULL, .cursor = 0, .retainRead = false, .retained = NULL, .retainLast = NULL };
+
+struct recv_segment *CreateRecvSegment(uint32_t capacity) {
+    struct recv_segment *segment = SlabAlloc(sizeof(struct recv_segment) + capacity);
+    if (segment == NULL) return NULL;
+
+    segment->next = NULL;
+    segment->len = 0;
+    segment->capacity = capacity;
+
+    return segment;
+}
+
+void FreeRecvSegments(struct recv_segment *segment) {
+    while (segment != NULL) {
+        struct recv_segment *next = segment->next;
+        SlabFree(segment);
+        segment = next;
+    }
+}
+
+void FreeRecvChain(struct recv_chain *chain) {
+    FreeRecvSegments(chain->head);
+    FreeRecvSegments(chain->retained);
+
+    *chain = nullRecvChain;
+}
+
+// Segment is no longer part of the chain, free it unless read bytes are being retained.
+void RetireRecvSegment(struct recv_chain *chain, struct recv_segment *segment) {
+    if (!chain->retainRead && segment != chain->retainLast) {
+        SlabFree(segment);
+        return;
+    }
+
+    if (segment == chain->retainLast) chain->retainLast = NULL;
+
+    segment->next = chain->retained;
+    chain->retained = segment;
+}
+
+// Keeps every byte read from now on in place, until RecvChainRelease.
+void RecvChainRetain(struct recv_chain *chain) {
+    chain->retainRead = true;
+}
+
+// Stops retaining bytes read from now on, those read before the cursor stay valid until RecvChainRelease.
+// Long bodies are read this way without keeping every segment.
+void RecvChainEndRetain(struct recv_chain *chain) {
+    if (!chain->retainRead) return;
+
+    chain->retainRead = false;
+    chain->retainLast = chain->head;
+}
+
+// Frees the segments kept since RecvChainRetain, slices into them must not be used anymore.
+void RecvChainRelease(struct recv_chain *chain) {
+    FreeRecvSegments(chain->retained);
+
+    chain->retained = NULL;
+    chain->retainRead = false;
+    chain->retainLast = NULL;
+}
+
+// Returns the unread bytes of the head segment.
+uint8_t *RecvChainRead(const struct recv_chain *chain, uint32_t *available) {
+    if (chain->head == NULL) {
+        *available = 0;
+        return NULL;
+    }
+
+    *available = chain->head->len - chain->cursor;
+    return chain->head->buf + chain->cursor;
+}
+
+// Advances the cursor by n bytes of the head segment, n must not exceed what RecvChainRead returned.
+void RecvChainConsume(struct recv_chain *chain, uint32_t n) {
+    struct recv_segment *head = chain->head;
+    if (head == NULL) return;
+
+    chain->cursor += n;
+
+    if (chain->cursor < head->len) return;
+
+    if (head->next == NULL) {
+        // Only segment and fully read, it goes back to the slab until more data arrives.
+        RetireRecvSegment(chain, head);
+
+        chain->head = NULL;
+        chain->tail = NULL;
+        chain->cursor = 0;
+
+        return;
+    }
+
+    chain->head = head->next;
+    chain->cursor = 0;
+    RetireRecvSegment(chain, head);
+}
+
+// Finds space in the tail to receive into, appending a segment when the tail is full.
+// When lineContiguous is set, the unread bytes of the tail are an unterminated line and are moved into the new
+// segment, so every line can be parsed from a single segment. That line may not grow to maxLine bytes.
+// Returns false if out of memory or the line is too long.
+bool RecvChainPrepare(struct recv_chain *chain, bool lineContiguous, uint32_t maxLine, uint8_t **buf, uint32_t *len) {
+    if (chain->tail == NULL) {
+        struct recv_segment *segment = CreateRecvSegment(RECV_SEGMENT_CAPACITY);
+        if (segment == NULL) return false;
+
+        chain->head = segment;
+        chain->tail = segment;
+        chain->cursor = 0;
+    }
+
+    struct recv_segment *tail = chain->tail;
+
+    if (tail->len < tail->capacity) {
+        *buf = tail->buf + tail->len;
+        *len = tail->capacity - tail->len;
+        return true;
+    }
+
+    struct recv_segment *segment;
+
+    if (lineContiguous && tail == chain->head) {
+        uint32_t fragmentLen = tail->len - chain->cursor;
+        if (fragmentLen >= maxLine) return false;
+
+        // Lines longer than a regular segment (large cookies, tokens) get a larger one.
+        uint32_t capacity = RECV_SEGMENT_CAPACITY;
+        while (capacity < fragmentLen * 2) capacity *= 2;
+        if (capacity > maxLine) capacity = maxLine;
+
+        segment = CreateRecvSegment(capacity);
+        if (segment == NULL) return false;
+
+        // Only the unterminated line is copied, once per segment boundary.
+        memcpy(segment->buf, tail->buf + chain->cursor, fragmentLen);
+        segment->len = fragmentLen;
+
+        RetireRecvSegment(chain, tail);
+
+        chain->head = segment;
+        chain->tail = segment;
+        chain->cursor = 0;
+    } else {
+        segment = CreateRecvSegment(RECV_SEGMENT_CAPACITY);
+        if (segment == NULL) return false;
+
+        tail->next = segment;
+        chain->tail = segment;
+    }
+
+    *buf = segment->buf + segment->len;
+    *len = segment->capacity - segment->len;
+    return true;
+}
+
+// Whether every received byte was read, so the next receive can wait without a buffer (see RecvChainAdopt).
+bool RecvChainEmpty(const struct recv_chain *chain) {
+    return chain->head == NULL;
+}
+
+// Takes a regular segment bytes were received into without RecvChainPrepare, e.g. a buffer picked by the kernel.
+// Only while the chain is empty, so lines still never span segments.
+void RecvChainAdopt(struct recv_chain *chain, struct recv_segment *segment) {
+    segment->next = NULL;
+
+    chain->head = segment;
+    chain->tail = segment;
+    chain->cursor = 0;
+}
+
+// Marks n bytes of the area returned by RecvChainPrepare as received.
+void RecvChainCommit(struct recv_chain *chain, uint32_t n) {
+    if (chain->tail == NULL) return;
+
+    chain->tail->len += n;
+}
\ No newline at end of file
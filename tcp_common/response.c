@@ -0,0 +1,307 @@
+﻿#pragma once
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include "../slab.c"
+
+// Laid out as the platform's scatter/gather element (WSABUF, struct iovec), so queued vectors are handed to
+// WSASend/sendmsg as they are. The platform conn.c asserts the layout.
+#ifdef _WIN32
+struct send_vec {
+    unsigned long len;
+    uint8_t *buf;
+};
+#else
+struct send_vec {
+    uint8_t *buf;
+    size_t len;
+};
+#endif
+
+// Responses queued before a flush, pipelined requests past this wait for the flush to complete.
+#ifndef SEND_MAX_RESPONSES
+#define SEND_MAX_RESPONSES 16
+#endif
+
+// Interim 100 Continue, status line, server headers, caller headers, dynamic headers, connection and end of head, body.
+#define SEND_VECS_PER_RESPONSE 7
+#define SEND_MAX_VECS (SEND_MAX_RESPONSES * SEND_VECS_PER_RESPONSE)
+
+// Room for the per-response header values, "Date: <29 bytes>\r\nContent-Length: <20 digits>\r\n".
+#define SEND_DYNAMIC_SIZE 96
+
+// Keeps memory a queued response points into alive, released once the queue is sent or freed.
+struct send_ref {
+    void (*release)(void *ptr);
+    void *ptr;
+};
+
+struct send_queue {
+    struct send_vec vecs[SEND_MAX_VECS];
+    uint32_t vecCount;
+    // Vectors written completely, the next one may be partially written (its buf and len are advanced).
+    uint32_t vecSent;
+    uint32_t responseCount;
+    uint32_t refCount;
+    struct send_ref refs[SEND_MAX_RESPONSES];
+    char dynamic[SEND_MAX_RESPONSES][SEND_DYNAMIC_SIZE];
+};
+
+// Headers every response starts with.
+#define SERVER_HEADERS "Server: AsyncHTTP\r\n"
+
+const char *StatusLine(uint32_t status) {
+    switch (status) {
+        case 200: return "HTTP/1.1 200 OK\r\n";
+        case 204: return "HTTP/1.1 204 No Content\r\n";
+        case 301: return "HTTP/1.1 301 Moved Permanently\r\n";
+        case 304: return "HTTP/1.1 304 Not Modified\r\n";
+        case 400: return "HTTP/1.1 400 Bad Request\r\n";
+        case 403: return "HTTP/1.1 403 Forbidden\r\n";
+        case 404: return "HTTP/1.1 404 Not Found\r\n";
+        case 405: return "HTTP/1.1 405 Method Not Allowed\r\n";
+        case 413: return "HTTP/1.1 413 Content Too Large\r\n";
+        case 431: return "HTTP/1.1 431 Request Header Fields Too Large\r\n";
+        case 500: return "HTTP/1.1 500 Internal Server Error\r\n";
+        case 501: return "HTTP/1.1 501 Not Implemented\r\n";
+        case 503: return "HTTP/1.1 503 Service Unavailable\r\n";
+        default: return "HTTP/1.1 500 Internal Server Error\r\n";
+    }
+}
+
+struct date_cache {
+    time_t second;
+    char line[40];
+    uint32_t len;
+};
+
+// Formatted at most once per second per worker.
+_Thread_local struct date_cache dateCache = { .second = 0, .len = 0 };
+
+const char *CachedDateLine(uint32_t *len) {
+    time_t now = time(NULL);
+
+    if (now != dateCache.second || dateCache.len == 0) {
+        struct tm tm;
+
+#ifdef _WIN32
+        gmtime_s(&tm, &now);
+#else
+        gmtime_r(&now, &tm);
+#endif
+
+        dateCache.len = strftime(dateCache.line, sizeof(dateCache.line), "Date: %a, %d %b %Y %H:%M:%S GMT\r\n", &tm);
+        dateCache.second = now;
+    }
+
+    *len = dateCache.len;
+    return dateCache.line;
+}
+
+// 1xx, 204 and 304 responses never have a body, nor a Content-Length (a 304's would describe the representation
+// instead of the response, which clients misread).
+bool StatusHasBody(uint32_t status) {
+    return status >= 200 && status != 204 && status != 304;
+}
+
+// Writes "Content-Length: n\r\n" to dest, returns its length.
+uint32_t FormatContentLength(char *dest, uint64_t n) {
+    char digits[20];
+    uint32_t count = 0;
+
+    do {
+        digits[count++] = '0' + n % 10;
+        n /= 10;
+    } while (n > 0);
+
+    memcpy(dest, "Content-Length: ", 16);
+
+    for (uint32_t i = 0; i < count; i++) dest[16 + i] = digits[count - 1 - i];
+
+    dest[16 + count] = '\r';
+    dest[17 + count] = '\n';
+
+    return 18 + count;
+}
+
+bool CanQueueResponses(const struct send_queue *queue, uint32_t count) {
+    return queue == NULL || queue->responseCount + count <= SEND_MAX_RESPONSES;
+}
+
+void PushSendVec(struct send_queue *queue, const void *buf, size_t len) {
+    if (len == 0) return;
+
+    queue->vecs[queue->vecCount++] = (struct send_vec){ .buf = (uint8_t *)buf, .len = len };
+}
+
+// Only taken while there's something to send.
+bool AllocSendQueue(struct send_queue **queuePtr) {
+    if (*queuePtr != NULL) return true;
+
+    *queuePtr = SlabAlloc(sizeof(struct send_queue));
+    if (*queuePtr == NULL) return false;
+
+    (*queuePtr)->vecCount = 0;
+    (*queuePtr)->vecSent = 0;
+    (*queuePtr)->responseCount = 0;
+    (*queuePtr)->refCount = 0;
+
+    return true;
+}
+
+// Takes the slot of the next response and returns its dynamic buffer, NULL if out of memory or the queue is full.
+char *ReserveResponse(struct send_queue **queuePtr) {
+    if (!AllocSendQueue(queuePtr)) return NULL;
+
+    struct send_queue *queue = *queuePtr;
+    if (queue->responseCount == SEND_MAX_RESPONSES) return NULL;
+
+    return queue->dynamic[queue->responseCount++];
+}
+
+// Copies the date line to dest, the cache may change before the response is sent.
+uint32_t CopyDateLine(char *dest) {
+    uint32_t dateLen;
+    const char *date = CachedDateLine(&dateLen);
+
+    memcpy(dest, date, dateLen);
+    return dateLen;
+}
+
+const char *EndOfHead(bool keepAlive, bool explicitKeepAlive) {
+    return !keepAlive ? "Connection: close\r\n\r\n" : explicitKeepAlive ? "Connection: keep-alive\r\n\r\n" : "\r\n";
+}
+
+// Queues a response without copying any of it. headers are complete header lines (or NULL), body has no copy
+// either, so both must stay valid until the response is sent, which static data does.
+// A NULL body with a bodyLen sends only the head, as HEAD responses do. Statuses without a body drop both.
+bool QueueResponse(struct send_queue **queuePtr, uint32_t status, const char *headers, const void *body, uint64_t bodyLen, bool keepAlive, bool explicitKeepAlive) {
+    char *dynamic = ReserveResponse(queuePtr);
+    if (dynamic == NULL) return false;
+
+    struct send_queue *queue = *queuePtr;
+
+    if (!StatusHasBody(status)) body = NULL;
+
+    uint32_t dynamicLen = CopyDateLine(dynamic);
+    if (StatusHasBody(status)) dynamicLen += FormatContentLength(dynamic + dynamicLen, bodyLen);
+
+    const char *end = EndOfHead(keepAlive, explicitKeepAlive);
+
+    PushSendVec(queue, StatusLine(status), strlen(StatusLine(status)));
+    PushSendVec(queue, SERVER_HEADERS, sizeof(SERVER_HEADERS) - 1);
+    if (headers != NULL) PushSendVec(queue, headers, strlen(headers));
+    PushSendVec(queue, dynamic, dynamicLen);
+    PushSendVec(queue, end, strlen(end));
+    if (body != NULL) PushSendVec(queue, body, bodyLen);
+
+    return true;
+}
+
+// Queues the head of a response whose body is streamed after it, in chunks unless the client can't take them.
+// Unchunked bodies end when the connection closes, so keepAlive must be false for them.
+bool QueueStreamHead(struct send_queue **queuePtr, uint32_t status, const char *headers, bool chunked, bool keepAlive, bool explicitKeepAlive) {
+    char *dynamic = ReserveResponse(queuePtr);
+    if (dynamic == NULL) return false;
+
+    struct send_queue *queue = *queuePtr;
+    uint32_t dynamicLen = CopyDateLine(dynamic);
+
+    if (chunked && StatusHasBody(status)) {
+        memcpy(dynamic + dynamicLen, "Transfer-Encoding: chunked\r\n", 28);
+        dynamicLen += 28;
+    }
+
+    const char *end = EndOfHead(keepAlive, explicitKeepAlive);
+
+    PushSendVec(queue, StatusLine(status), strlen(StatusLine(status)));
+    PushSendVec(queue, SERVER_HEADERS, sizeof(SERVER_HEADERS) - 1);
+    if (headers != NULL) PushSendVec(queue, headers, strlen(headers));
+    PushSendVec(queue, dynamic, dynamicLen);
+    PushSendVec(queue, end, strlen(end));
+
+    return true;
+}
+
+// Queues bytes that continue the last response (a streamed body), they must stay valid until sent.
+bool QueueSendData(struct send_queue **queuePtr, const void *buf, size_t len) {
+    if (!AllocSendQueue(queuePtr)) return false;
+
+    struct send_queue *queue = *queuePtr;
+    if (queue->vecCount == SEND_MAX_VECS) return false;
+
+    PushSendVec(queue, buf, len);
+    return true;
+}
+
+// Queues a response serialized ahead of time, only the date and connection lines are added. head is everything
+// before them (status line and headers), body may be NULL as with QueueResponse. For a status without a body, the
+// head has no Content-Length and body is NULL (see ResponseCachePut).
+// ref is released once the response is sent, the queue owns it even when queueing fails.
+bool QueuePreparedResponse(struct send_queue **queuePtr, const void *head, uint32_t headLen, const void *body, uint64_t bodyLen, bool keepAlive, bool explicitKeepAlive, struct send_ref ref) {
+    char *dynamic = ReserveResponse(queuePtr);
+
+    if (dynamic == NULL) {
+        ref.release(ref.ptr);
+        return false;
+    }
+
+    struct send_queue *queue = *queuePtr;
+    uint32_t dynamicLen = CopyDateLine(dynamic);
+
+    const char *end = EndOfHead(keepAlive, explicitKeepAlive);
+
+    queue->refs[queue->refCount++] = ref;
+
+    PushSendVec(queue, head, headLen);
+    PushSendVec(queue, dynamic, dynamicLen);
+    PushSendVec(queue, end, strlen(end));
+    if (body != NULL) PushSendVec(queue, body, bodyLen);
+
+    return true;
+}
+
+void FreeSendQueue(struct send_queue **queuePtr) {
+    struct send_queue *queue = *queuePtr;
+    if (queue == NULL) return;
+
+    for (uint32_t i = 0; i < queue->refCount; i++) queue->refs[i].release(queue->refs[i].ptr);
+
+    SlabFree(queue);
+    *queuePtr = NULL;
+}
+
+// Returns the vectors still to be sent, false if there are none.
+bool SendQueuePending(struct send_queue *queue, struct send_vec **vecs, uint32_t *count) {
+    if (queue == NULL || queue->vecSent == queue->vecCount) return false;
+
+    *vecs = queue->vecs + queue->vecSent;
+    *count = queue->vecCount - queue->vecSent;
+
+    return true;
+}
+
+// Advances through the vectors by n written bytes, the queue is released once everything is sent.
+void SendQueueCommit(struct send_queue **queuePtr, size_t n) {
+    struct send_queue *queue = *queuePtr;
+    if (queue == NULL) return;
+
+    while (n > 0 && queue->vecSent < queue->vecCount) {
+        struct send_vec *vec = &queue->vecs[queue->vecSent];
+
+        if (n < vec->len) {
+            vec->buf += n;
+            vec->len -= n;
+            return;
+        }
+
+        n -= vec->len;
+        queue->vecSent++;
+    }
+
+    if (queue->vecSent < queue->vecCount) return;
+
+    FreeSendQueue(queuePtr);
+}
\ No newline at end of file
@@ -0,0 +1,267 @@
+﻿// Serialized Response Cache
+
+#pragma once
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <stdatomic.h>
+#include <immintrin.h>
+#include "../atomics.c"
+#include "../slab.c"
+#include "../qsbr.c"
+#include "./http.c"
+#include "./response.c"
+
+// Responses are kept serialized, keyed by method and path, and are sent as they are on a hit.
+// Readers walk the buckets without a lock, under QSBR (see qsbr.c). Writers take the lock, entries are never
+// changed once listed, a replaced or invalidated entry is unlinked and freed after a grace period.
+
+#define RESPONSE_CACHE_BUCKETS 256
+
+struct cached_response {
+    _Atomic(struct cached_response *) bucketNext;
+
+    // One for the cache until a grace period after the entry is unlinked, and one per response sending it.
+    atomic_uint32 refs;
+
+    // 0 if the entry never expires.
+    time_t expiresAt;
+
+    uint64_t hash;
+    enum http_method method;
+    uint32_t pathLen;
+    // Status line and headers, including Content-Length but not Date or Connection.
+    uint32_t headLen;
+    uint64_t bodyLen;
+
+    // Only used by writers, once unlinked.
+    uint64_t retireEpoch;
+    struct cached_response *retiredNext;
+
+    // Path, then head, then body.
+    uint8_t data[];
+};
+
+struct response_cache {
+    atomic_uint32 lock;
+    _Atomic(struct cached_response *) buckets[RESPONSE_CACHE_BUCKETS];
+    // Unlinked entries waiting for their grace period, the count is also read without the lock.
+    struct cached_response *retired;
+    atomic_uint32 retiredCount;
+};
+
+struct response_cache responseCache = { 0 };
+
+void LockResponseCache() {
+    for (;;) {
+        uint32_t unlocked = 0;
+        if (atomic_compare_exchange_weak(&responseCache.lock, &unlocked, 1)) break;
+        _mm_pause();
+    }
+}
+
+void UnlockResponseCache() {
+    atomic_store(&responseCache.lock, 0);
+}
+
+// FNV-1a over the path, seeded by the method.
+uint64_t HashResponseKey(enum http_method method, const uint8_t *path, uint32_t len) {
+    uint64_t hash = 0xcbf29ce484222325ull ^ (uint64_t)method;
+    hash *= 0x100000001b3ull;
+
+    for (uint32_t i = 0; i < len; i++) {
+        hash ^= path[i];
+        hash *= 0x100000001b3ull;
+    }
+
+    return hash;
+}
+
+const uint8_t *CachedResponsePath(const struct cached_response *entry) {
+    return entry->data;
+}
+
+const uint8_t *CachedResponseHead(const struct cached_response *entry) {
+    return entry->data + entry->pathLen;
+}
+
+const uint8_t *CachedResponseBody(const struct cached_response *entry) {
+    return entry->data + entry->pathLen + entry->headLen;
+}
+
+void ReleaseCachedResponse(void *ptr) {
+    struct cached_response *entry = ptr;
+    if (atomic_fetch_sub(&entry->refs, 1) != 1) return;
+
+    SlabFree(entry);
+}
+
+bool CachedResponseMatches(const struct cached_response *entry, uint64_t hash, enum http_method method, const uint8_t *path, uint32_t len) {
+    return entry->hash == hash && entry->method == method && entry->pathLen == len && memcmp(CachedResponsePath(entry), path, len) == 0;
+}
+
+// Returns a referenced entry for method and path, or NULL on a miss or if it expired.
+// The calling thread must be registered with QSBR and online. Release with ReleaseCachedResponse.
+struct cached_response *ResponseCacheLookup(enum http_method method, const uint8_t *path, uint32_t len) {
+    if (qsbrSelf == NULL) {
+        fprintf(stderr, "panic: Response Cache read by a thread not registered with QSBR.\n");
+        abort();
+    }
+
+    uint64_t hash = HashResponseKey(method, path, len);
+    struct cached_response *entry = atomic_load_explicit(&responseCache.buckets[hash % RESPONSE_CACHE_BUCKETS], memory_order_acquire);
+
+    while (entry != NULL) {
+        if (CachedResponseMatches(entry, hash, method, path, len)) {
+            if (entry->expiresAt != 0 && time(NULL) >= entry->expiresAt) return NULL;
+
+            // The cache's reference can't be dropped before this thread is quiescent, so the entry is alive.
+            atomic_fetch_add(&entry->refs, 1);
+            return entry;
+        }
+
+        entry = atomic_load_explicit(&entry->bucketNext, memory_order_acquire);
+    }
+
+    return NULL;
+}
+
+// Drops the cache's reference of retired entries no reader can still see. Cheap when there are none.
+void ResponseCacheReclaim() {
+    if (atomic_load_explicit(&responseCache.retiredCount, memory_order_relaxed) == 0) return;
+
+    LockResponseCache();
+
+    struct cached_response *done = NULL;
+    struct cached_response **link = &responseCache.retired;
+
+    while (*link != NULL) {
+        struct cached_response *entry = *link;
+
+        if (QSBRGracePassed(entry->retireEpoch)) {
+            *link = entry->retiredNext;
+            entry->retiredNext = done;
+            done = entry;
+
+            atomic_fetch_sub_explicit(&responseCache.retiredCount, 1, memory_order_relaxed);
+        } else {
+            link = &entry->retiredNext;
+        }
+    }
+
+    UnlockResponseCache();
+
+    while (done != NULL) {
+        struct cached_response *next = done->retiredNext;
+        ReleaseCachedResponse(done);
+        done = next;
+    }
+}
+
+// Must be called with the lock held, after the entry is unlinked.
+void RetireCachedResponse(struct cached_response *entry) {
+    entry->retireEpoch = QSBRRetire();
+    entry->retiredNext = responseCache.retired;
+    responseCache.retired = entry;
+
+    atomic_fetch_add_explicit(&responseCache.retiredCount, 1, memory_order_relaxed);
+}
+
+// Finds the link pointing to the entry for method and path, must be called with the lock held.
+_Atomic(struct cached_response *) *FindResponseLink(uint64_t hash, enum http_method method, const uint8_t *path, uint32_t len) {
+    _Atomic(struct cached_response *) *link = &responseCache.buckets[hash % RESPONSE_CACHE_BUCKETS];
+
+    for (;;) {
+        struct cached_response *entry = atomic_load_explicit(link, memory_order_relaxed);
+        if (entry == NULL || CachedResponseMatches(entry, hash, method, path, len)) return link;
+
+        link = &entry->bucketNext;
+    }
+}
+
+// Serializes a response and caches it for method and path, replacing any entry there. headers are complete header
+// lines (or NULL) and body is copied. A ttlSeconds of 0 keeps the entry until it's invalidated.
+// HEAD requests are answered from the GET entry. Statuses without a body drop it and its Content-Length.
+// Returns false if out of memory.
+bool ResponseCachePut(enum http_method method, const char *path, uint32_t status, const char *headers, const void *body, uint64_t bodyLen, uint32_t ttlSeconds) {
+    uint32_t pathLen = strlen(path);
+    const char *statusLine = StatusLine(status);
+    uint32_t statusLen = strlen(statusLine);
+    uint32_t headersLen = headers != NULL ? strlen(headers) : 0;
+
+    if (!StatusHasBody(status)) bodyLen = 0;
+
+    char contentLength[SEND_DYNAMIC_SIZE];
+    uint32_t contentLengthLen = StatusHasBody(status) ? FormatContentLength(contentLength, bodyLen) : 0;
+
+    uint32_t headLen = statusLen + sizeof(SERVER_HEADERS) - 1 + headersLen + contentLengthLen;
+
+    struct cached_response *entry = SlabAlloc(sizeof(struct cached_response) + pathLen + headLen + bodyLen);
+    if (entry == NULL) return false;
+
+    entry->refs = 1;
+    entry->expiresAt = ttlSeconds != 0 ? time(NULL) + ttlSeconds : 0;
+    entry->hash = HashResponseKey(method, (const uint8_t *)path, pathLen);
+    entry->method = method;
+    entry->pathLen = pathLen;
+    entry->headLen = headLen;
+    entry->bodyLen = bodyLen;
+    entry->retiredNext = NULL;
+
+    uint8_t *dest = entry->data;
+
+    memcpy(dest, path, pathLen);
+    dest += pathLen;
+    memcpy(dest, statusLine, statusLen);
+    dest += statusLen;
+    memcpy(dest, SERVER_HEADERS, sizeof(SERVER_HEADERS) - 1);
+    dest += sizeof(SERVER_HEADERS) - 1;
+    if (headersLen > 0) memcpy(dest, headers, headersLen);
+    dest += headersLen;
+    memcpy(dest, contentLength, contentLengthLen);
+    dest += contentLengthLen;
+    if (bodyLen > 0) memcpy(dest, body, bodyLen);
+
+    LockResponseCache();
+
+    _Atomic(struct cached_response *) *link = FindResponseLink(entry->hash, method, (const uint8_t *)path, pathLen);
+    struct cached_response *replaced = atomic_load_explicit(link, memory_order_relaxed);
+
+    // Readers see either the replaced entry or this one, never a partially written one.
+    atomic_store_explicit(&entry->bucketNext, replaced != NULL ? atomic_load_explicit(&replaced->bucketNext, memory_order_relaxed) : NULL, memory_order_relaxed);
+    atomic_store_explicit(link, entry, memory_order_release);
+
+    if (replaced != NULL) RetireCachedResponse(replaced);
+
+    UnlockResponseCache();
+
+    ResponseCacheReclaim();
+
+    return true;
+}
+
+// Removes the entry for method and path, responses already sending it are unaffected.
+// Returns whether there was one.
+bool ResponseCacheInvalidate(enum http_method method, const char *path) {
+    uint32_t pathLen = strlen(path);
+    uint64_t hash = HashResponseKey(method, (const uint8_t *)path, pathLen);
+
+    LockResponseCache();
+
+    _Atomic(struct cached_response *) *link = FindResponseLink(hash, method, (const uint8_t *)path, pathLen);
+    struct cached_response *entry = atomic_load_explicit(link, memory_order_relaxed);
+
+    if (entry != NULL) {
+        // Readers already on the entry still reach the rest of the bucket through it.
+        atomic_store_explicit(link, atomic_load_explicit(&entry->bucketNext, memory_order_relaxed), memory_order_release);
+        RetireCachedResponse(entry);
+    }
+
+    UnlockResponseCache();
+
+    ResponseCacheReclaim();
+
+    return entry != NULL;
+}
\ No newline at end of file
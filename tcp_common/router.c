@@ -0,0 +1,410 @@
+﻿// Radix Tree Router
+
+#pragma once
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../string.c"
+#include "../state_machine.c"
+#include "./http.c"
+
+// Routes are added at startup, then BuildRouter compacts them into flat arrays that are only read afterwards.
+// Patterns are paths whose segments may be ":name", capturing the segment, or "*name" as the last segment,
+// capturing the rest of the path. Static segments take precedence over parameters, parameters over wildcards.
+
+struct route {
+    struct async_descriptor handler;
+    void *param;
+    uint32_t paramCount;
+    const char *paramNames[MAX_ROUTE_PARAMS];
+};
+
+// Routes ending at a node, by method.
+#define ROUTE_NONE UINT32_MAX
+
+struct route_slot {
+    uint32_t routes[HTTP_METHOD_COUNT];
+    // "Allow: ...\r\n" header for 405 responses.
+    char *allow;
+};
+
+struct route_node {
+    // Static bytes matched by the node, in routerBytes.
+    uint32_t prefix;
+    uint16_t prefixLen;
+    uint16_t staticCount;
+    // Static children are contiguous, from here. Their first bytes are in routerFirstBytes at the same indices.
+    uint32_t firstStatic;
+    // Node indices, 0 if none (the root is never a child).
+    uint32_t param;
+    uint32_t wildcard;
+    uint32_t slot;
+};
+
+struct router {
+    struct route_node *nodes;
+    uint8_t *firstBytes;
+    uint8_t *bytes;
+    struct route_slot *slots;
+    uint32_t nodeCount;
+    uint32_t slotCount;
+};
+
+// Only used while routes are added.
+struct route_build_node {
+    uint8_t *prefix;
+    uint32_t prefixLen;
+    struct route_build_node **children;
+    uint32_t childCount;
+    struct route_build_node *param;
+    struct route_build_node *wildcard;
+    uint32_t routes[HTTP_METHOD_COUNT];
+    bool hasRoutes;
+};
+
+struct route *routes = NULL;
+uint32_t routeCount = 0;
+struct route_build_node *routeTree = NULL;
+
+struct router router = { 0 };
+
+void *RouterAlloc(size_t size) {
+    void *ptr = calloc(1, size);
+
+    if (ptr == NULL) {
+        fprintf(stderr, "panic: failed to allocate Router.\n");
+        abort();
+    }
+
+    return ptr;
+}
+
+struct route_build_node *CreateRouteBuildNode(const uint8_t *prefix, uint32_t prefixLen) {
+    struct route_build_node *node = RouterAlloc(sizeof(struct route_build_node));
+
+    node->prefix = RouterAlloc(prefixLen + 1);
+    if (prefixLen > 0) memcpy(node->prefix, prefix, prefixLen);
+    node->prefixLen = prefixLen;
+
+    for (uint32_t method = 0; method < HTTP_METHOD_COUNT; method++) node->routes[method] = ROUTE_NONE;
+
+    return node;
+}
+
+void AddRouteChild(struct route_build_node *node, struct route_build_node *child) {
+    node->children = realloc(node->children, (node->childCount + 1) * sizeof(struct route_build_node *));
+
+    if (node->children == NULL) {
+        fprintf(stderr, "panic: failed to allocate Router.\n");
+        abort();
+    }
+
+    node->children[node->childCount++] = child;
+}
+
+void InvalidRoute(const char *pattern, const char *reason) {
+    fprintf(stderr, "panic: invalid route %s: %s.\n", pattern, reason);
+    abort();
+}
+
+// Inserts the rest of the pattern below node, whose prefix is already matched.
+void InsertRoute(struct route_build_node *node, const char *pattern, const char *rest, enum http_method method, uint32_t index) {
+    struct route *route = &routes[index];
+
+    if (*rest == '\0') {
+        if (node->routes[method] != ROUTE_NONE) InvalidRoute(pattern, "already added");
+
+        node->routes[method] = index;
+        node->hasRoutes = true;
+        return;
+    }
+
+    if (*rest == ':' || *rest == '*') {
+        bool wildcard = *rest == '*';
+        const char *name = rest + 1;
+        uint32_t nameLen = strcspn(name, "/");
+
+        if (rest[-1] != '/') InvalidRoute(pattern, "parameters must start a segment");
+        if (nameLen == 0) InvalidRoute(pattern, "parameters need a name");
+        if (wildcard && name[nameLen] != '\0') InvalidRoute(pattern, "wildcards must be last");
+        if (route->paramCount == MAX_ROUTE_PARAMS) InvalidRoute(pattern, "too many parameters");
+
+        char *copy = RouterAlloc(nameLen + 1);
+        memcpy(copy, name, nameLen);
+        route->paramNames[route->paramCount++] = copy;
+
+        struct route_build_node **child = wildcard ? &node->wildcard : &node->param;
+        if (*child == NULL) *child = CreateRouteBuildNode(NULL, 0);
+
+        InsertRoute(*child, pattern, name + nameLen, method, index);
+        return;
+    }
+
+    uint32_t runLen = strcspn(rest, ":*");
+    if (runLen > UINT16_MAX) InvalidRoute(pattern, "too long");
+
+    for (uint32_t i = 0; i < node->childCount; i++) {
+        struct route_build_node *child = node->children[i];
+        if (child->prefix[0] != (uint8_t)rest[0]) continue;
+
+        uint32_t common = 0;
+        while (common < child->prefixLen && common < runLen && child->prefix[common] == (uint8_t)rest[common]) common++;
+
+        if (common < child->prefixLen) {
+            // Splits the child at the first differing byte.
+            struct route_build_node *split = CreateRouteBuildNode(child->prefix, common);
+
+            memmove(child->prefix, child->prefix + common, child->prefixLen - common);
+            child->prefixLen -= common;
+
+            AddRouteChild(split, child);
+            node->children[i] = split;
+            child = split;
+        }
+
+        InsertRoute(child, pattern, rest + common, method, index);
+        return;
+    }
+
+    struct route_build_node *child = CreateRouteBuildNode((const uint8_t *)rest, runLen);
+    AddRouteChild(node, child);
+
+    InsertRoute(child, pattern, rest + runLen, method, index);
+}
+
+// Routes requests for method and pattern to a handler, constructed with param, see handler_async_state.
+// HEAD requests are routed to GET routes unless they have their own. Only before BuildRouter, invalid or
+// duplicate patterns panic.
+void AddRoute(enum http_method method, const char *pattern, struct async_descriptor handler, void *param) {
+    if (method == HTTP_METHOD_UNKNOWN) InvalidRoute(pattern, "unknown method");
+    if (pattern[0] != '/') InvalidRoute(pattern, "must start with /");
+
+    routes = realloc(routes, (routeCount + 1) * sizeof(struct route));
+
+    if (routes == NULL) {
+        fprintf(stderr, "panic: failed to allocate Router.\n");
+        abort();
+    }
+
+    uint32_t index = routeCount++;
+
+    routes[index] = (struct route){ .handler = handler, .param = param, .paramCount = 0 };
+
+    if (routeTree == NULL) routeTree = CreateRouteBuildNode(NULL, 0);
+
+    InsertRoute(routeTree, pattern, pattern, method, index);
+}
+
+void FreeRouteBuildNode(struct route_build_node *node) {
+    if (node == NULL) return;
+
+    for (uint32_t i = 0; i < node->childCount; i++) FreeRouteBuildNode(node->children[i]);
+    FreeRouteBuildNode(node->param);
+    FreeRouteBuildNode(node->wildcard);
+
+    free(node->children);
+    free(node->prefix);
+    free(node);
+}
+
+void CountRouteBuildNodes(const struct route_build_node *node, uint32_t *nodes, uint32_t *bytes, uint32_t *slots) {
+    if (node == NULL) return;
+
+    (*nodes)++;
+    *bytes += node->prefixLen;
+    if (node->hasRoutes) (*slots)++;
+
+    for (uint32_t i = 0; i < node->childCount; i++) CountRouteBuildNodes(node->children[i], nodes, bytes, slots);
+    CountRouteBuildNodes(node->param, nodes, bytes, slots);
+    CountRouteBuildNodes(node->wildcard, nodes, bytes, slots);
+}
+
+char *FormatAllowHeader(const uint32_t *slotRoutes) {
+    char allow[128] = "Allow: ";
+    uint32_t len = 7;
+
+    for (uint32_t method = HTTP_METHOD_GET; method < HTTP_METHOD_COUNT; method++) {
+        bool allowed = slotRoutes[method] != ROUTE_NONE ||
+            (method == HTTP_METHOD_HEAD && slotRoutes[HTTP_METHOD_GET] != ROUTE_NONE);
+
+        if (allowed) len += sprintf(allow + len, "%s%s", len > 7 ? ", " : "", httpMethodWords[method]);
+    }
+
+    memcpy(allow + len, "\r\n", 3);
+
+    char *header = RouterAlloc(len + 3);
+    memcpy(header, allow, len + 3);
+
+    return header;
+}
+
+// Compacts the routes added, breadth first, so the children of a node are next to each other.
+// Called once, after every AddRoute and before the server starts.
+void BuildRouter() {
+    if (routeTree == NULL) routeTree = CreateRouteBuildNode(NULL, 0);
+
+    uint32_t nodeCount = 0, byteCount = 0, slotCount = 0;
+    CountRouteBuildNodes(routeTree, &nodeCount, &byteCount, &slotCount);
+
+    struct router built = {
+        .nodes = RouterAlloc(nodeCount * sizeof(struct route_node)),
+        .firstBytes = RouterAlloc(nodeCount),
+        .bytes = RouterAlloc(byteCount + 1),
+        .slots = RouterAlloc((slotCount + 1) * sizeof(struct route_slot)),
+        .nodeCount = nodeCount,
+        .slotCount = 0,
+    };
+
+    // Build nodes in index order, the queue of the breadth first walk.
+    struct route_build_node **order = RouterAlloc(nodeCount * sizeof(struct route_build_node *));
+    uint32_t ordered = 1;
+    uint32_t bytes = 0;
+
+    order[0] = routeTree;
+
+    for (uint32_t index = 0; index < nodeCount; index++) {
+        struct route_build_node *source = order[index];
+        struct route_node *node = &built.nodes[index];
+
+        node->prefix = bytes;
+        node->prefixLen = source->prefixLen;
+        memcpy(built.bytes + bytes, source->prefix, source->prefixLen);
+        bytes += source->prefixLen;
+
+        built.firstBytes[index] = source->prefixLen > 0 ? source->prefix[0] : 0;
+
+        node->firstStatic = ordered;
+        node->staticCount = source->childCount;
+        for (uint32_t i = 0; i < source->childCount; i++) order[ordered++] = source->children[i];
+
+        node->param = 0;
+        if (source->param != NULL) {
+            node->param = ordered;
+            order[ordered++] = source->param;
+        }
+
+        node->wildcard = 0;
+        if (source->wildcard != NULL) {
+            node->wildcard = ordered;
+            order[ordered++] = source->wildcard;
+        }
+
+        node->slot = ROUTE_NONE;
+        if (source->hasRoutes) {
+            struct route_slot *slot = &built.slots[built.slotCount];
+
+            memcpy(slot->routes, source->routes, sizeof(slot->routes));
+            slot->allow = FormatAllowHeader(slot->routes);
+
+            node->slot = built.slotCount++;
+        }
+    }
+
+    free(order);
+
+    FreeRouteBuildNode(routeTree);
+    routeTree = NULL;
+
+    router = built;
+}
+
+// Route for method at slot, HEAD falls back to GET.
+uint32_t RouteForMethod(const struct route_slot *slot, enum http_method method) {
+    uint32_t index = slot->routes[method];
+    if (index == ROUTE_NONE && method == HTTP_METHOD_HEAD) index = slot->routes[HTTP_METHOD_GET];
+
+    return index;
+}
+
+// Matches path[pos, len) below the node, whose prefix is matched already, and captures parameters into req.
+// Returns the route for the method, or ROUTE_NONE. *pathSlot is set to the first slot the path matched, whatever
+// its methods, for 405 responses.
+uint32_t MatchRouteNode(uint32_t index, const uint8_t *path, uint32_t pos, uint32_t len, enum http_method method, struct HTTPRequest *req, const struct route_slot **pathSlot) {
+    const struct route_node *node = &router.nodes[index];
+
+    if (pos == len && node->slot != ROUTE_NONE) {
+        const struct route_slot *slot = &router.slots[node->slot];
+        uint32_t route = RouteForMethod(slot, method);
+
+        if (route != ROUTE_NONE) return route;
+        if (*pathSlot == NULL) *pathSlot = slot;
+    }
+
+    if (pos < len && node->staticCount > 0) {
+        const uint8_t *first = memchr(router.firstBytes + node->firstStatic, path[pos], node->staticCount);
+
+        if (first != NULL) {
+            uint32_t childIndex = first - router.firstBytes;
+            const struct route_node *child = &router.nodes[childIndex];
+
+            if (len - pos >= child->prefixLen && memcmp(path + pos, router.bytes + child->prefix, child->prefixLen) == 0) {
+                uint32_t route = MatchRouteNode(childIndex, path, pos + child->prefixLen, len, method, req, pathSlot);
+                if (route != ROUTE_NONE) return route;
+            }
+        }
+    }
+
+    if (node->param != 0 && pos < len && path[pos] != '/' && req->paramCount < MAX_ROUTE_PARAMS) {
+        const uint8_t *slash = memchr(path + pos, '/', len - pos);
+        uint32_t end = slash != NULL ? (uint32_t)(slash - path) : len;
+
+        req->params[req->paramCount++] = SliceString(path + pos, end - pos);
+
+        uint32_t route = MatchRouteNode(node->param, path, end, len, method, req, pathSlot);
+        if (route != ROUTE_NONE) return route;
+
+        req->paramCount--;
+    }
+
+    if (node->wildcard != 0 && req->paramCount < MAX_ROUTE_PARAMS) {
+        const struct route_node *wildcard = &router.nodes[node->wildcard];
+        if (wildcard->slot == ROUTE_NONE) return ROUTE_NONE;
+
+        const struct route_slot *slot = &router.slots[wildcard->slot];
+        uint32_t route = RouteForMethod(slot, method);
+
+        if (route == ROUTE_NONE) {
+            if (*pathSlot == NULL) *pathSlot = slot;
+            return ROUTE_NONE;
+        }
+
+        req->params[req->paramCount++] = SliceString(path + pos, len - pos);
+        return route;
+    }
+
+    return ROUTE_NONE;
+}
+
+// Returns the route for the request, capturing its parameters, or NULL. If only other methods are routed for
+// the path, *allow is set to their Allow header.
+const struct route *MatchRoute(struct HTTPRequest *req, const char **allow) {
+    *allow = NULL;
+    req->paramCount = 0;
+
+    if (router.nodeCount == 0) return NULL;
+
+    const uint8_t *path = GetStringBuf(&req->path);
+    uint32_t len = GetStringLen(&req->path);
+
+    // The query isn't part of the route.
+    const uint8_t *query = memchr(path, '?', len);
+    if (query != NULL) len = query - path;
+
+    const struct route_slot *pathSlot = NULL;
+    // The root has no prefix.
+    uint32_t index = MatchRouteNode(0, path, 0, len, req->method, req, &pathSlot);
+
+    if (index == ROUTE_NONE) {
+        req->paramCount = 0;
+        if (pathSlot != NULL) *allow = pathSlot->allow;
+
+        return NULL;
+    }
+
+    const struct route *route = &routes[index];
+    req->paramNames = route->paramNames;
+
+    return route;
+}
\ No newline at end of file
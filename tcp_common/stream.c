@@ -0,0 +1,161 @@
+﻿// Streamed Response Bodies
+
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+#include "../slab.c"
+#include "../state_machine.c"
+
+// A streamed body is produced by a state machine, awaited by the connection whenever its send queue is flushed. Its
+// state starts with stream_async_state. The producer writes with StreamWrite until it's refused, then returns
+// subroutine_pause and is awaited again once what it wrote is sent. It returns subroutine_finish after the last
+// write. Only that much is ever buffered, however long the body is. It may start I/O of its own in between, the
+// connection waits for it meanwhile.
+
+// Body bytes buffered per connection between flushes, including chunk framing.
+#ifndef STREAM_BUFFER_SIZE
+#define STREAM_BUFFER_SIZE (16 * 1024)
+#endif
+
+// "<8 hex digits>\r\n" before a chunk, "\r\n" after it.
+#define STREAM_CHUNK_OVERHEAD 12
+
+// "0\r\n\r\n" after the last chunk.
+#define STREAM_LAST_CHUNK "0\r\n\r\n"
+#define STREAM_LAST_CHUNK_LEN 5
+
+struct body_stream {
+    // NULL once the producer finished (or if there's no stream).
+    struct async_state *producer;
+    // Taken when the stream starts and kept until its last bytes are sent, NULL while there's no stream.
+    uint8_t *buf;
+    uint32_t len;
+    // HTTP/1.0 clients get the body as it is, ended by closing the connection.
+    bool chunked;
+};
+
+const struct body_stream nullBodyStream = { .producer = NULL, .buf = NULL, .len = 0, .chunked = false };
+
+struct stream_async_state {
+    // Set while the producer may write, until it pauses or finishes.
+    struct body_stream *stream;
+};
+
+// Takes over the producer, it's destroyed if the buffer can't be taken.
+bool StartBodyStream(struct body_stream *stream, struct async_state *producer, bool chunked) {
+    stream->buf = SlabAlloc(STREAM_BUFFER_SIZE);
+
+    if (stream->buf == NULL) {
+        KillAsync(producer);
+        return false;
+    }
+
+    // Awaited by the connection, see PrepareStreamPart.
+    producer->awaiting = NULL;
+    ((struct stream_async_state *)producer->state)->stream = NULL;
+
+    // Kept until FreeBodyStream, an abandoned producer may be destroyed before the connection resumes.
+    RetainAsync(producer);
+
+    stream->producer = producer;
+    stream->len = 0;
+    stream->chunked = chunked;
+
+    return true;
+}
+
+void FreeBodyStream(struct body_stream *stream) {
+    struct async_state *producer = stream->producer;
+
+    if (producer != NULL) {
+        // Killed unless it's gone already, or abandoned while still suspended (it's destroyed when it next runs).
+        uint32_t flags = atomic_load(&producer->flags);
+
+        if (producer->state != NULL && (flags & (MACHINE_RUNNING | MACHINE_SUSPENDED_IO | MACHINE_SUSPENDED_AWAIT)) == 0) {
+            producer->awaiting = NULL;
+            KillAsync(producer);
+        }
+
+        ReleaseAsync(producer);
+    }
+
+    SlabFree(stream->buf);
+
+    *stream = nullBodyStream;
+}
+
+// Appends as much of data as fits (as one chunk), returns how much that was. Anything less than len means the
+// buffer is full, and the producer should pause and write the rest when run again. Only for producers, with their
+// own state.
+uint32_t StreamWrite(struct stream_async_state *producer, const void *data, uint32_t len) {
+    struct body_stream *stream = producer->stream;
+    if (stream == NULL || len == 0) return 0;
+
+    // Room is kept for the last chunk.
+    uint32_t overhead = stream->chunked ? STREAM_CHUNK_OVERHEAD + STREAM_LAST_CHUNK_LEN : 0;
+    uint32_t space = STREAM_BUFFER_SIZE - stream->len;
+
+    if (space <= overhead) return 0;
+
+    uint32_t n = len < space - overhead ? len : space - overhead;
+    uint8_t *dest = stream->buf + stream->len;
+
+    if (!stream->chunked) {
+        memcpy(dest, data, n);
+        stream->len += n;
+        return n;
+    }
+
+    static const char hex[] = "0123456789abcdef";
+
+    uint32_t digits = 1;
+    while (digits < 8 && (n >> (digits * 4)) != 0) digits++;
+
+    for (uint32_t i = 0; i < digits; i++) dest[i] = hex[(n >> ((digits - 1 - i) * 4)) & 0xf];
+
+    dest[digits] = '\r';
+    dest[digits + 1] = '\n';
+    memcpy(dest + digits + 2, data, n);
+    dest[digits + 2 + n] = '\r';
+    dest[digits + 3 + n] = '\n';
+
+    stream->len += digits + 4 + n;
+    return n;
+}
+
+// Empties the buffer for the producer and returns it, to be awaited for the next part. NULL if it finished.
+struct async_state *PrepareStreamPart(struct body_stream *stream) {
+    struct async_state *producer = stream->producer;
+    if (producer == NULL) return NULL;
+
+    stream->len = 0;
+
+    ((struct stream_async_state *)producer->state)->stream = stream;
+    producer->awaiting = currentAsync;
+
+    return producer;
+}
+
+// Ends the part the awaited producer wrote, with the last chunk if it finished. Returns false if it paused without
+// writing anything, the body can't be completed then.
+bool EndStreamPart(struct body_stream *stream) {
+    struct async_state *producer = stream->producer;
+
+    if (producer->state != NULL) {
+        ((struct stream_async_state *)producer->state)->stream = NULL;
+
+        // Nothing would ever send the buffer and run it again.
+        return stream->len > 0;
+    }
+
+    stream->producer = NULL;
+    ReleaseAsync(producer);
+
+    if (stream->chunked) {
+        memcpy(stream->buf + stream->len, STREAM_LAST_CHUNK, STREAM_LAST_CHUNK_LEN);
+        stream->len += STREAM_LAST_CHUNK_LEN;
+    }
+
+    return true;
+}
\ No newline at end of file
@@ -0,0 +1,486 @@
+﻿#pragma once
+
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <stddef.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "../tcp_common/conn.c"
+
+#include "../state_machine.c"
+#include "../io.h"
+#include "./io_async.c"
+#include "./recv_pool.c"
+#include "../tcp_common/consts.h"
+
+static_assert(sizeof(struct send_vec) == sizeof(struct iovec) &&
+    offsetof(struct send_vec, buf) == offsetof(struct iovec, iov_base) &&
+    offsetof(struct send_vec, len) == offsetof(struct iovec, iov_len),
+    "send_vec must be laid out as struct iovec.");
+
+enum connStage {
+    SetupConn,
+    ConnRead,
+    ConnProcess,
+    ConnPoolReceived,
+    ConnParse,
+    ConnWrite,
+    ConnWritten,
+    ConnSendFile,
+    ConnFileFilled,
+    ConnFileSent,
+    ConnStream,
+    ConnStreamed,
+    ConnHandled,
+    ConnConsumed,
+};
+
+// Requested size of the pipe file bodies are spliced through, the kernel may give less.
+#define FILE_PIPE_SIZE (1024 * 1024)
+
+// Only declared with _GNU_SOURCE, which would have to precede the first system header of the build.
+#ifndef F_SETPIPE_SZ
+#define F_SETPIPE_SZ 1031
+#define F_GETPIPE_SZ 1032
+#endif
+
+struct connState {
+    struct io_async_state io_state;
+
+    struct tcpConnCommon common;
+    int sock;
+    enum connStage stage;
+    struct io_handler *io_handler;
+    // Receive Pool of the handler.
+    struct recv_pool *recvPool;
+    // Reused by every I/O of the connection, a connection never has more than one operation in flight.
+    struct io_op ioOp;
+    // Worker the awaited handler counts against, NULL while there's none.
+    struct worker_admission *admission;
+    // Points at the send queue vectors, must stay put until the send completes.
+    struct msghdr sendMsg;
+    // File bodies go file -> pipe -> socket, created on the first one.
+    int pipeFds[2];
+    uint32_t pipeCapacity;
+    // Spliced into the pipe, but not yet out to the socket.
+    uint32_t pipeBytes;
+    // The Receive Pool ran dry, the next read takes a segment of its own.
+    bool poolBypass;
+};
+
+struct connSetupParams {
+    struct io_handler *io_handler;
+    int sock;
+    struct recv_pool *recvPool;
+    struct peer_address peer;
+};
+
+// Params is a stack pointer from Event Loop
+void *connConstructor(struct connState *state, void *param) {
+    struct connSetupParams params = *(struct connSetupParams *)param;
+
+    state->io_state = nullIOAsyncState;
+    state->sock = params.sock;
+    state->io_handler = params.io_handler;
+    state->recvPool = params.recvPool;
+    state->stage = SetupConn;
+    state->admission = NULL;
+    state->pipeFds[0] = -1;
+    state->pipeFds[1] = -1;
+    state->pipeCapacity = 0;
+    state->pipeBytes = 0;
+    state->poolBypass = false;
+
+    SetupCommonConn(&state->common, MAX_HEADER_SIZE);
+    state->common.peer = params.peer;
+
+    char peer[PEER_ADDRESS_MAX];
+    FormatPeerAddress(&state->common.peer, peer);
+
+    printf("Conn Setup: %s\n", peer);
+
+    return state;
+}
+
+void connDestructor(struct connState *state) {
+    // Not running once this returns, even on another worker.
+    CancelTimer(&state->common.timer);
+    ReleaseRequest(state->admission);
+    LeaveConnection();
+    close(state->sock);
+    if (state->pipeFds[0] >= 0) close(state->pipeFds[0]);
+    if (state->pipeFds[1] >= 0) close(state->pipeFds[1]);
+    CleanupCommonConn(&state->common);
+
+    printf("Conn Destroy\n");
+}
+
+// Runs on the worker whose wheel it was armed on. Shutting the socket down fails the pending read (or the writes after
+// the handler), so the connection finishes the usual way.
+void ConnTimedOut(struct timer *timer) {
+    struct connState *state = (struct connState *)((uint8_t *)timer - offsetof(struct connState, common.timer));
+
+    shutdown(state->sock, SHUT_RDWR);
+}
+
+// Runs on the worker whose wheel it was armed on, with the wheel locked, so the connection resumes once the worker is
+// back in its loop. It answers for the abandoned machine in ConnHandled, ConnConsumed or ConnStreamed.
+void ConnAwaitTimedOut(struct timer *timer) {
+    struct connState *state = (struct connState *)((uint8_t *)timer - offsetof(struct connState, common.timer));
+
+    // Retained by the connection, the stage doesn't change while it awaits.
+    struct async_state *awaited = state->common.stream.producer;
+
+    if (state->stage == ConnHandled) awaited = state->common.handler;
+    if (state->stage == ConnConsumed) awaited = state->common.bodyConsumer;
+
+    if (AbortAsync(awaited)) DeferResumeFromAwait(awaited->awaiting);
+}
+
+// Arms the deadline on the wheel of the running worker, until the connection resumes.
+void ArmConnTimer(struct connState *state, uint64_t deadline, timer_callback callback) {
+    if (deadline == 0) return;
+
+    ArmTimer(threadTimers, &state->common.timer, deadline, callback);
+}
+
+struct subroutine_result connSubroutine(struct connState *state) {
+    // Verify Current Async is "this"
+    if (currentAsync == NULL || currentAsync->state != state) return subroutine_finish;
+
+    // Whatever the connection waited for happened in time.
+    CancelTimer(&state->common.timer);
+
+    StageSwitch:
+    switch (state->stage) {
+        case SetupConn: {
+            // io_uring needs neither a non-blocking socket nor a per-socket port association.
+            state->stage = ConnRead;
+            goto StageSwitch;
+        }
+
+        case ConnRead: {
+            // Idle connections wait without a buffer, the kernel picks one from the Receive Pool once data arrives.
+            if (state->recvPool->enabled && !state->poolBypass && RecvIdle(&state->common)) {
+                state->stage = ConnPoolReceived;
+
+                ArmConnTimer(state, ConnReadDeadline(&state->common, NowMillis()), ConnTimedOut);
+
+                PrepareIO();
+
+                InitIOOperation(&state->ioOp, IO_READ, currentAsync);
+
+                if (!uring_QueueRecvSelect(state->io_handler, state->sock, &state->ioOp)) {
+                    printf("Instant Read Error\n");
+                    CancelIO();
+
+                    return subroutine_finish;
+                }
+
+                return subroutine_yield_io;
+            }
+
+            state->poolBypass = false;
+            state->stage = ConnProcess;
+
+            // Before the buffer is taken, which makes the connection look busy.
+            uint64_t deadline = ConnReadDeadline(&state->common, NowMillis());
+
+            uint8_t *recvBuf;
+            uint32_t recvLen;
+
+            if (!PrepareRecv(&state->common, &recvBuf, &recvLen)) {
+                RejectRequest(&state->common, 431);
+
+                state->stage = ConnWrite;
+                goto StageSwitch;
+            }
+
+            ArmConnTimer(state, deadline, ConnTimedOut);
+
+            PrepareIO();
+
+            InitIOOperation(&state->ioOp, IO_READ, currentAsync);
+
+            bool queued = uring_QueueRecv(
+                state->io_handler,
+                state->sock,
+                recvBuf,
+                recvLen,
+                &state->ioOp
+            );
+
+            if (!queued) {
+                printf("Instant Read Error\n");
+                CancelIO();
+
+                return subroutine_finish;
+            }
+
+            return subroutine_yield_io;
+        }
+
+        case ConnProcess: {
+            if (
+                !state->io_state.ok ||
+                state->io_state.bytesTransferred == 0
+            ) return subroutine_finish;
+
+            CommitRecv(&state->common, state->io_state.bytesTransferred);
+
+            state->stage = ConnParse;
+            goto StageSwitch;
+        }
+
+        case ConnPoolReceived: {
+            if (!state->io_state.ok) {
+                if (state->io_state.error != ENOBUFS) return subroutine_finish;
+
+                state->poolBypass = true;
+                state->stage = ConnRead;
+                goto StageSwitch;
+            }
+
+            int32_t bufferId = state->io_state.bufferId;
+            if (bufferId < 0) return subroutine_finish;
+
+            if (state->io_state.bytesTransferred == 0) {
+                RecycleRecvPoolBuffer(state->recvPool, state->io_handler, bufferId);
+                return subroutine_finish;
+            }
+
+            struct recv_segment *segment = TakeRecvPoolSegment(state->recvPool, state->io_handler, bufferId);
+            if (segment == NULL) return subroutine_finish;
+
+            AdoptRecv(&state->common, segment, state->io_state.bytesTransferred);
+
+            state->stage = ConnParse;
+            goto StageSwitch;
+        }
+
+        case ConnParse: {
+            if (!ProcessLines(&state->common)) RejectRequest(&state->common, 400);
+
+            // Parsing stopped at a routed request, its handler runs before anything else.
+            struct async_state *handler = TakeHandler(&state->common);
+
+            if (handler != NULL) {
+                state->stage = ConnHandled;
+                state->admission = EnterRequest();
+
+                ArmConnTimer(state, ConnHandlerDeadline(NowMillis()), ConnAwaitTimedOut);
+                return subroutine_await(handler);
+            }
+
+            // Or at a part of a body, nothing more is read until the consumer took it.
+            struct async_state *consumer = TakeBodyConsumer(&state->common);
+
+            if (consumer != NULL) {
+                state->stage = ConnConsumed;
+
+                ArmConnTimer(state, ConnHandlerDeadline(NowMillis()), ConnAwaitTimedOut);
+                return subroutine_await(consumer);
+            }
+
+            // Responses of every request parsed above go out together.
+            state->stage = ConnWrite;
+            goto StageSwitch;
+        }
+
+        case ConnWrite: {
+            struct send_vec *sendVecs;
+            uint32_t sendCount;
+
+            if (!PrepareSend(&state->common, &sendVecs, &sendCount)) {
+                state->stage = ConnSendFile;
+                goto StageSwitch;
+            }
+
+            state->stage = ConnWritten;
+
+            PrepareIO();
+
+            InitIOOperation(&state->ioOp, IO_WRITE, currentAsync);
+
+            state->sendMsg = (struct msghdr){
+                .msg_iov = (struct iovec *)sendVecs,
+                .msg_iovlen = sendCount,
+            };
+
+            bool queued = uring_QueueSendMsg(
+                state->io_handler,
+                state->sock,
+                &state->sendMsg,
+                &state->ioOp
+            );
+
+            if (!queued) {
+                printf("Instant Write Error\n");
+                CancelIO();
+
+                return subroutine_finish;
+            }
+
+            return subroutine_yield_io;
+        }
+
+        case ConnWritten: {
+            if (
+                !state->io_state.ok ||
+                state->io_state.bytesTransferred == 0
+            ) return subroutine_finish;
+
+            // Partial sends continue where they left off.
+            CommitSend(&state->common, state->io_state.bytesTransferred);
+
+            // Requests held back by a full send queue are parsed before anything new is read.
+            state->stage = ConnParse;
+            goto StageSwitch;
+        }
+
+        case ConnSendFile: {
+            // Only set if there's a file, the pipe may still be draining without one.
+            file_handle file = -1;
+            uint64_t offset = 0, remaining = 0;
+
+            bool hasFile = PrepareFileSend(&state->common, &file, &offset, &remaining);
+
+            if (!hasFile && state->pipeBytes == 0) {
+                if (HasBodyStream(&state->common)) {
+                    state->stage = ConnStream;
+                    goto StageSwitch;
+                }
+
+                if (state->common.state == RECV_CLOSED) return subroutine_finish;
+
+                state->stage = ConnRead;
+                goto StageSwitch;
+            }
+
+            if (state->pipeFds[0] < 0) {
+                if (pipe(state->pipeFds) != 0) {
+                    fprintf(stderr, "error: Failed to create File Pipe: %i\n", errno);
+                    return subroutine_finish;
+                }
+
+                int capacity = fcntl(state->pipeFds[1], F_SETPIPE_SZ, FILE_PIPE_SIZE);
+                if (capacity <= 0) capacity = fcntl(state->pipeFds[1], F_GETPIPE_SZ);
+
+                state->pipeCapacity = capacity > 0 ? (uint32_t)capacity : 65536;
+            }
+
+            PrepareIO();
+
+            InitIOOperation(&state->ioOp, IO_SENDFILE, currentAsync);
+
+            bool queued;
+
+            // The pipe is drained before it's filled again, so its contents are always known.
+            if (state->pipeBytes > 0) {
+                state->stage = ConnFileSent;
+                queued = uring_QueueSplice(state->io_handler, state->pipeFds[0], -1, state->sock, state->pipeBytes, &state->ioOp);
+            } else {
+                uint32_t chunk = remaining < state->pipeCapacity ? (uint32_t)remaining : state->pipeCapacity;
+
+                state->stage = ConnFileFilled;
+                queued = uring_QueueSplice(state->io_handler, file, (int64_t)offset, state->pipeFds[1], chunk, &state->ioOp);
+            }
+
+            if (!queued) {
+                printf("Instant Send File Error\n");
+                CancelIO();
+
+                return subroutine_finish;
+            }
+
+            return subroutine_yield_io;
+        }
+
+        case ConnFileFilled: {
+            // Zero means the file shrank after its length was sent, the response can't be completed.
+            if (
+                !state->io_state.ok ||
+                state->io_state.bytesTransferred == 0
+            ) return subroutine_finish;
+
+            CommitFileSend(&state->common, state->io_state.bytesTransferred);
+            state->pipeBytes += state->io_state.bytesTransferred;
+
+            state->stage = ConnSendFile;
+            goto StageSwitch;
+        }
+
+        case ConnFileSent: {
+            if (
+                !state->io_state.ok ||
+                state->io_state.bytesTransferred == 0
+            ) return subroutine_finish;
+
+            state->pipeBytes -= state->io_state.bytesTransferred;
+
+            // Requests held back behind the file body are parsed once it's out.
+            bool bodyDone = state->pipeBytes == 0 && state->common.file == NULL;
+
+            state->stage = bodyDone ? ConnParse : ConnSendFile;
+            goto StageSwitch;
+        }
+
+        case ConnStream: {
+            // Only reached with the send queue flushed, the producer writes the next part into the emptied buffer.
+            struct async_state *producer = TakeStreamProducer(&state->common);
+
+            if (producer != NULL) {
+                state->stage = ConnStreamed;
+
+                ArmConnTimer(state, ConnHandlerDeadline(NowMillis()), ConnAwaitTimedOut);
+                return subroutine_await(producer);
+            }
+
+            // Requests held back behind the streamed body are parsed once it's done.
+            state->stage = ConnParse;
+            goto StageSwitch;
+        }
+
+        case ConnStreamed: {
+            if (!StreamProduced(&state->common)) return subroutine_finish;
+
+            // Whatever it wrote goes out with the next write.
+            state->stage = ConnParse;
+            goto StageSwitch;
+        }
+
+        case ConnHandled: {
+            ReleaseRequest(state->admission);
+            state->admission = NULL;
+
+            HandlerFinished(&state->common);
+
+            // Continues with the body of the request, or the requests after it.
+            state->stage = ConnParse;
+            goto StageSwitch;
+        }
+
+        case ConnConsumed: {
+            BodyConsumed(&state->common);
+
+            // Continues with the rest of the body, or the requests after it.
+            state->stage = ConnParse;
+            goto StageSwitch;
+        }
+
+        default: {
+            printf("Unknown Stage\n");
+            return subroutine_finish;
+        }
+    }
+}
+
+const struct async_descriptor connAsync = {
+    .constructor = (async_constructor)connConstructor,
+    .destructor = (async_destructor)connDestructor,
+    .subroutine = (async_subroutine)connSubroutine,
+    .stateSize = sizeof(struct connState),
+    // Most of it is the request's header slots, which needn't be zeroed.
+    .constructsState = true,
+};
\ No newline at end of file
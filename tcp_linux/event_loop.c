@@ -0,0 +1,141 @@
+﻿#pragma once
+
+// Globals
+#include <pthread.h>
+#include <stdio.h>
+
+// Local External
+#include "../io.h"
+#include "../safe_pointer.c"
+#include "../atomics.c"
+#include "../qsbr.c"
+#include "../executor.c"
+#include "../timer_wheel.c"
+#include "../metrics.c"
+
+// Local Internal
+#include "../tcp_common/consts.h"
+#include "./conn.c"
+#include "./io_async.c"
+#include "./listener.c"
+
+void *StartWorker(void *param) {
+    struct shared_ptr *ptr = param;
+    __attribute__((__cleanup__(ReleaseShared))) struct shared_retainer ioHandler_retainer = RetainerFromShared(ptr);
+
+    if (ioHandler_retainer.ptr == NULL) {
+        fprintf(stderr, "panic: Error restoring retainer IO Handler for thread.\n");
+        abort();
+    }
+
+    struct io_handler *ioHandler = ioHandler_retainer.ptr;
+
+    struct io_completion completions[IO_BATCH_MAX];
+
+    // Machines spawned from this worker are resumed on it.
+    spawnIOHandler = ioHandler;
+
+    // Deadlines of the connections served by this worker.
+    threadTimers = CreateTimerWheel(NowMillis());
+
+    if (threadTimers == NULL) {
+        fprintf(stderr, "panic: failed to allocate Timer Wheel.\n");
+        abort();
+    }
+
+    // Load of this worker, for shedding new work.
+    threadAdmission = CreateWorkerAdmission();
+
+    if (threadAdmission == NULL) {
+        fprintf(stderr, "panic: failed to allocate Worker Admission.\n");
+        abort();
+    }
+
+    // Workers read the Response Cache, they hold no references to it between batches.
+    QSBRRegister();
+
+    for (;;) {
+        uint32_t err;
+
+        // Offline while blocked, so a worker waiting for I/O never holds up reclamation.
+        QSBROffline();
+        // Wakes up for the next deadline even if no I/O completes before it.
+        uint32_t count = RunIOBatch(ioHandler, completions, IO_BATCH_MAX, NextTimerTimeout(threadTimers, NowMillis()), &err);
+        QSBROnline();
+
+        uint64_t woke = NowMillis();
+        uint64_t batchStart = MetricsStartBatch();
+
+        if (count == 0 && err == IO_ERR_TIMEOUT) {
+            // Idle, nothing waited.
+            RecordBatch(threadAdmission, woke, false, 0);
+            ExpireTimers(threadTimers, woke);
+            RunDeferredResumes();
+            continue;
+        }
+
+        if (count == 0) {
+            if (err == IO_ERR_CLOSED) {
+                printf("RunIO finished\n");
+                return NULL;
+            }
+
+            fprintf(stderr, "panic: RunIO failed: %u\n", err);
+            abort();
+        }
+
+        // A full batch may have left completions behind, even where they can't be counted.
+        uint32_t backlog = PendingCompletions(ioHandler);
+        RecordBatch(threadAdmission, woke, count == IO_BATCH_MAX || backlog > 0, backlog);
+
+        // Dispatch the whole batch before going back to the kernel.
+        for (uint32_t i = 0; i < count; i++) {
+            struct io_op *op = completions[i].op;
+
+            if (op->type == IO_ACCEPT) {
+                CompleteAccept(op, &completions[i]);
+                continue;
+            }
+
+            if (op->type == IO_SPAWN) {
+                CompleteSpawn(op);
+                continue;
+            }
+
+            struct async_state *asyncState = op->data;
+            struct io_async_state *ioAsyncState = asyncState->state;
+
+            ioAsyncState->ok = completions[i].ok;
+            ioAsyncState->bytesTransferred = completions[i].bytesTransferred;
+            ioAsyncState->error = completions[i].error;
+            ioAsyncState->bufferId = completions[i].bufferId;
+
+            ReleaseIOOperation(op);
+
+            ResumeFromIO(asyncState);
+        }
+
+        MetricsEndBatch(batchStart);
+
+        uint64_t now = NowMillis();
+
+        ExpireTimers(threadTimers, now);
+        RunDeferredResumes();
+
+        ResponseCacheReclaim();
+    }
+
+    return NULL;
+}
+
+void SpawnWorker(struct shared_ptr *ptr) {
+    pthread_t thread;
+    int err = pthread_create(&thread, NULL, StartWorker, ptr);
+
+    if (err != 0) {
+        fprintf(stderr, "panic: pthread_create failed: %i\n", err);
+        abort();
+    }
+
+    pthread_detach(thread);
+}
\ No newline at end of file
@@ -0,0 +1,15 @@
+﻿#pragma once
+
+#include <stdint.h>
+
+#include "../state_machine.c"
+
+struct io_async_state {
+    bool ok;
+    uint32_t bytesTransferred;
+    uint32_t error;
+    // Provided buffer the data was received into, -1 if none (see recv_pool.c).
+    int32_t bufferId;
+};
+
+const struct io_async_state nullIOAsyncState = { .ok = false, .bytesTransferred = 0, .error = 0, .bufferId = -1 };
\ No newline at end of file
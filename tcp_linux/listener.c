@@ -0,0 +1,192 @@
+﻿// Listener
+
+#pragma once
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "../io.h"
+#include "../state_machine.c"
+#include "../tcp_common/consts.h"
+#include "../timer_wheel.c"
+#include "./conn.c"
+
+// One outstanding accept, the op comes first so the slot is found from the completion.
+struct accept_slot {
+    struct io_op op;
+    // Armed on the wheel of the worker that reaped the failure, while the accept waits to be armed again.
+    struct timer backoff;
+    // Wait before the next attempt, 0 until an accept runs out of descriptors.
+    uint32_t backoffMs;
+};
+
+// Accepts complete like any other I/O, on whichever worker reaps them, so connection setup is spread over the
+// workers. Every outstanding accept is a multishot accept, armed again once the kernel ends it.
+struct listener {
+    int sock;
+    struct io_handler *io_handler;
+    // Of the handler, handed to the connections accepted.
+    struct recv_pool *recvPool;
+    // Cleared if the kernel has no multishot accepts (before 5.19), every accept then completes once.
+    bool multishot;
+    struct accept_slot slots[ACCEPTS_OUTSTANDING];
+};
+
+struct peer_address PeerFromSockaddr(const struct sockaddr_storage *addr) {
+    struct peer_address peer = nullPeerAddress;
+
+    if (addr->ss_family == AF_INET) {
+        const struct sockaddr_in *in = (const struct sockaddr_in *)addr;
+
+        peer.version = 4;
+        peer.port = ntohs(in->sin_port);
+        memcpy(peer.addr, &in->sin_addr, 4);
+    } else if (addr->ss_family == AF_INET6) {
+        const struct sockaddr_in6 *in6 = (const struct sockaddr_in6 *)addr;
+
+        peer.version = 6;
+        peer.port = ntohs(in6->sin6_port);
+        memcpy(peer.addr, &in6->sin6_addr, 16);
+    }
+
+    return peer;
+}
+
+bool ArmAccept(struct listener *listener, struct io_op *op) {
+    InitIOOperation(op, IO_ACCEPT, listener);
+
+    return uring_QueueAccept(listener->io_handler, listener->sock, listener->multishot, op);
+}
+
+// Arms every accept on the handler, the listener must outlive the workers. Connections accepted stay on the
+// handler.
+void StartListener(struct listener *listener, struct io_handler *ioHandler, struct recv_pool *recvPool, int sock) {
+    listener->sock = sock;
+    listener->io_handler = ioHandler;
+    listener->recvPool = recvPool;
+    listener->multishot = true;
+
+    for (uint32_t i = 0; i < ACCEPTS_OUTSTANDING; i++) {
+        listener->slots[i].backoff = nullTimer;
+        listener->slots[i].backoffMs = 0;
+
+        if (!ArmAccept(listener, &listener->slots[i].op)) {
+            fprintf(stderr, "panic: failed to queue accept.\n");
+            abort();
+        }
+    }
+
+    // Workers may already be waiting in the kernel, they'd only submit with their next I/O.
+    if (!uring_Submit(ioHandler)) {
+        fprintf(stderr, "panic: failed to submit accepts.\n");
+        abort();
+    }
+}
+
+// Answers a connection that isn't admitted without reading its request, and closes it.
+void ShedConn(int sock) {
+    send(sock, SHED_RESPONSE, sizeof(SHED_RESPONSE) - 1, MSG_DONTWAIT | MSG_NOSIGNAL);
+
+    // Unread data makes close reset the connection, possibly before the response got out.
+    shutdown(sock, SHUT_WR);
+
+    uint8_t drain[1024];
+    recv(sock, drain, sizeof(drain), MSG_DONTWAIT);
+
+    close(sock);
+}
+
+// Runs the new connection on this worker right away.
+void StartConn(struct listener *listener, int sock) {
+    if (!AdmitConnection()) {
+        MetricAdd(METRIC_CONNECTIONS_SHED, 1);
+        ShedConn(sock);
+        return;
+    }
+
+    MetricAdd(METRIC_CONNECTIONS_ACCEPTED, 1);
+
+    struct connSetupParams params = {
+        .io_handler = listener->io_handler,
+        .sock = sock,
+        .recvPool = listener->recvPool,
+        .peer = nullPeerAddress,
+    };
+
+    // A multishot accept has nowhere to put the address of every connection, so it's asked for.
+    struct sockaddr_storage addr;
+    socklen_t addrLen = sizeof(addr);
+
+    if (getpeername(sock, (struct sockaddr *)&addr, &addrLen) == 0) params.peer = PeerFromSockaddr(&addr);
+
+    struct async_state *connState = AwaitAsync(connAsync, &params);
+
+    if (connState == NULL) {
+        LeaveConnection();
+        close(sock);
+        return;
+    }
+
+    // Caller is responsible for setting RUNNING flag.
+    atomic_fetch_or(&connState->flags, MACHINE_RUNNING);
+    RunAsync(connState);
+}
+
+// Queues the accept again, the worker submits it with its next batch.
+void AcceptBackoffExpired(struct timer *timer) {
+    struct accept_slot *slot = (struct accept_slot *)((uint8_t *)timer - offsetof(struct accept_slot, backoff));
+
+    if (!ArmAccept(slot->op.data, &slot->op)) {
+        fprintf(stderr, "panic: failed to queue accept.\n");
+        abort();
+    }
+}
+
+// Out of descriptors or memory, accepting again right away would fail the same way until connections close.
+bool IsAcceptExhausted(uint32_t error) {
+    return error == EMFILE || error == ENFILE || error == ENOBUFS || error == ENOMEM;
+}
+
+// Called by the worker that reaped a completion of one of the accepts.
+void CompleteAccept(struct io_op *op, const struct io_completion *completion) {
+    struct listener *listener = op->data;
+    struct accept_slot *slot = (struct accept_slot *)op;
+    bool exhausted = false;
+
+    if (completion->ok) {
+        slot->backoffMs = 0;
+        StartConn(listener, (int)completion->bytesTransferred);
+    } else if (completion->error == EINVAL && listener->multishot) {
+        listener->multishot = false;
+    } else if (IsAcceptExhausted(completion->error)) {
+        MetricAdd(METRIC_ACCEPT_ERRORS, 1);
+        exhausted = true;
+
+        // Once per episode, not once per attempt.
+        if (slot->backoffMs == 0) fprintf(stderr, "Server accept failed: %u, backing off\n", completion->error);
+    } else {
+        MetricAdd(METRIC_ACCEPT_ERRORS, 1);
+        fprintf(stderr, "Server accept failed: %u\n", completion->error);
+    }
+
+    // Still armed.
+    if (completion->more) return;
+
+    if (exhausted) {
+        slot->backoffMs = slot->backoffMs == 0 ? ACCEPT_BACKOFF_MS : slot->backoffMs * 2;
+        if (slot->backoffMs > ACCEPT_BACKOFF_MAX_MS) slot->backoffMs = ACCEPT_BACKOFF_MAX_MS;
+
+        ArmTimer(threadTimers, &slot->backoff, NowMillis() + slot->backoffMs, AcceptBackoffExpired);
+        return;
+    }
+
+    if (!ArmAccept(listener, op)) {
+        fprintf(stderr, "panic: failed to queue accept.\n");
+        abort();
+    }
+}
\ No newline at end of file
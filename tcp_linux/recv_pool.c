@@ -0,0 +1,75 @@
+﻿// Receive Pool
+
+#pragma once
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "../io.h"
+#include "../slab.c"
+#include "../tcp_common/recv_chain.c"
+
+// Segments provided to the kernel through the buffer ring of an I/O handler. Idle connections wait on a receive
+// that picks one of them once data arrives, so they hold no buffer while waiting. The pool is shared by every
+// connection of the handler, a connection that finds it empty receives into a segment of its own instead.
+#ifndef RECV_POOL_SIZE
+#define RECV_POOL_SIZE 1024
+#endif
+
+static_assert((RECV_POOL_SIZE & (RECV_POOL_SIZE - 1)) == 0 && RECV_POOL_SIZE <= 32768,
+    "Receive Pool size must be a power of two, at most 32768.");
+
+struct recv_pool {
+    bool enabled;
+    // By buffer id, replaced as soon as the kernel picked one.
+    struct recv_segment *segments[RECV_POOL_SIZE];
+};
+
+// Fills the buffer ring of the handler, called once before the workers start. Without kernel support every read
+// takes a segment of its own, as before.
+void SetupRecvPool(struct recv_pool *pool, struct io_handler *ioHandler) {
+    pool->enabled = false;
+
+    if (!uring_SetupBufferRing(ioHandler, RECV_POOL_SIZE)) {
+        fprintf(stderr, "warning: io_uring provided buffers unsupported, idle connections keep a receive buffer.\n");
+        return;
+    }
+
+    for (uint32_t id = 0; id < RECV_POOL_SIZE; id++) {
+        struct recv_segment *segment = CreateRecvSegment(RECV_SEGMENT_CAPACITY);
+
+        if (segment == NULL) {
+            fprintf(stderr, "panic: failed to allocate Receive Pool.\n");
+            abort();
+        }
+
+        pool->segments[id] = segment;
+        uring_ProvideBuffer(ioHandler, id, segment->buf, segment->capacity);
+    }
+
+    pool->enabled = true;
+}
+
+// Takes the segment the kernel received into, a new one is provided in its place. If that can't be allocated,
+// the segment goes back to the kernel and NULL is returned, the data is lost.
+struct recv_segment *TakeRecvPoolSegment(struct recv_pool *pool, const struct io_handler *ioHandler, uint16_t id) {
+    struct recv_segment *segment = pool->segments[id];
+    struct recv_segment *replacement = CreateRecvSegment(RECV_SEGMENT_CAPACITY);
+
+    if (replacement == NULL) {
+        uring_ProvideBuffer(ioHandler, id, segment->buf, segment->capacity);
+        return NULL;
+    }
+
+    pool->segments[id] = replacement;
+    uring_ProvideBuffer(ioHandler, id, replacement->buf, replacement->capacity);
+
+    return segment;
+}
+
+// Gives a buffer the kernel picked back unused, e.g. for a receive that found the connection closed.
+void RecycleRecvPoolBuffer(struct recv_pool *pool, const struct io_handler *ioHandler, uint16_t id) {
+    struct recv_segment *segment = pool->segments[id];
+
+    uring_ProvideBuffer(ioHandler, id, segment->buf, segment->capacity);
+}
\ No newline at end of file
@@ -0,0 +1,142 @@
+﻿#pragma once
+
+// Globals
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <signal.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdio.h>
+
+// Local External
+#include "../safe_pointer.c"
+#include "../io.h"
+#include "../state_machine.c"
+
+// // Local Internal
+#include "./event_loop.c"
+#include "../tcp_common/metrics_endpoint.c"
+#include "../tcp_common/consts.h"
+
+long CountLogicalProcessors() {
+    long count = sysconf(_SC_NPROCESSORS_ONLN);
+
+    return count > 0 ? count : 1;
+}
+
+// One I/O handler per worker instead of one shared by every worker, set before StartServer. A connection stays on
+// the handler that accepted it, so its completions are only ever handled by that worker.
+bool shardedIO = false;
+
+// An I/O handler along with what's bound to it.
+struct io_shard {
+    struct shared_retainer handler;
+    struct recv_pool recvPool;
+    struct listener listener;
+};
+
+void CreateShard(struct io_shard *shard) {
+    shard->handler = MakeShared(sizeof(struct io_handler), CleanupIOHandler);
+    struct io_handler *ioHandler = shard->handler.ptr;
+
+    if (ioHandler == NULL) {
+        fprintf(stderr, "panic: IO Handler allocation failed.\n");
+        abort();
+    }
+
+    *ioHandler = CreateIOHandler();
+
+    if (!IsValidIOHandler(ioHandler)) {
+        fprintf(stderr, "panic: IO Handler creation failed.\n");
+        abort();
+    }
+
+    SetupRecvPool(&shard->recvPool, ioHandler);
+}
+
+void RunShardWorker(struct io_shard *shard, bool spawn) {
+    if (RetainShared(shard->handler).ptr == NULL) {
+        fprintf(stderr, "panic: Error retaining IO Handler for thread.\n");
+        abort();
+    }
+
+    if (spawn) SpawnWorker(SharedFromRetainer(shard->handler));
+    else StartWorker(SharedFromRetainer(shard->handler));
+}
+
+void StartServer(const char *addr, uint16_t port) {
+    // A peer closing mid-send must surface as an error on the operation, not kill the process.
+    signal(SIGPIPE, SIG_IGN);
+
+    long workerCount = CountLogicalProcessors();
+    long shardCount = shardedIO ? workerCount : 1;
+
+    // Lives as long as the workers, this thread being one of them.
+    struct io_shard *shards = calloc(shardCount, sizeof(struct io_shard));
+
+    if (shards == NULL) {
+        fprintf(stderr, "panic: IO Shard allocation failed.\n");
+        abort();
+    }
+
+    for (long i = 0; i < shardCount; i++) {
+        CreateShard(&shards[i]);
+    }
+
+    int serverSock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+
+    if (serverSock < 0) {
+        fprintf(stderr, "panic: Server Socket creation failed: %i\n", errno);
+        abort();
+    }
+
+    int reuseAddr = 1;
+    int err = setsockopt(serverSock, SOL_SOCKET, SO_REUSEADDR, &reuseAddr, sizeof(reuseAddr));
+
+    if (err < 0) {
+        fprintf(stderr, "panic: Server Socket setoption (Reuse Address) failed: %i\n", errno);
+        abort();
+    }
+
+    struct sockaddr_in endpoint = {
+        .sin_family = AF_INET,
+        .sin_port = htons(port),
+        .sin_addr.s_addr = inet_addr(addr),
+    };
+
+    err = bind(serverSock, (struct sockaddr *) &endpoint, sizeof(endpoint));
+
+    if (err < 0) {
+        fprintf(stderr, "panic: Server Socket bind failed: %i\n", errno);
+        abort();
+    }
+
+    err = listen(serverSock, SOMAXCONN);
+
+    if (err < 0) {
+        fprintf(stderr, "panic: Server Socket listen failed: %i\n", errno);
+        abort();
+    }
+
+    // Every shard accepts from the same socket, the kernel wakes one of them per connection.
+    for (long i = 0; i < shardCount; i++) {
+        StartListener(&shards[i].listener, shards[i].handler.ptr, &shards[i].recvPool, serverSock);
+    }
+
+    printf("Listening (%li I/O handlers)\n", shardCount);
+
+    // Machines spawned with SpawnAsync run there, as many as there are cores to run them.
+    StartExecutors(workerCount);
+
+    // The calling thread is the last worker.
+    for (long i = 0; i < workerCount - 1; i++) {
+        RunShardWorker(&shards[i % shardCount], true);
+    }
+
+    RunShardWorker(&shards[(workerCount - 1) % shardCount], false);
+
+    for (long i = 0; i < shardCount; i++) {
+        ReleaseShared(&shards[i].handler);
+    }
+}
\ No newline at end of file
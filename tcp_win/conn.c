@@ -1,6 +1,8 @@
 ﻿#pragma once
 
 #include <winsock2.h>
+#include <mswsock.h>
+#include <stddef.h>
 
 #include "../tcp_common/conn.c"
 
@@ -9,60 +11,121 @@
 #include "./io_async.c"
 #include "../tcp_common/consts.h"
 
-#define RECV_LEN 1024
+static_assert(sizeof(struct send_vec) == sizeof(WSABUF) &&
+    offsetof(struct send_vec, len) == offsetof(WSABUF, len) &&
+    offsetof(struct send_vec, buf) == offsetof(WSABUF, buf),
+    "send_vec must be laid out as WSABUF.");
 
 enum connStage {
     SetupConn,
     ConnRead,
     ConnProcess,
+    ConnReadable,
+    ConnParse,
+    ConnWrite,
+    ConnWritten,
+    ConnSendFile,
+    ConnFileSent,
+    ConnStream,
+    ConnStreamed,
+    ConnHandled,
+    ConnConsumed,
 };
 
+// TransmitFile sends at most 2^31 - 2 bytes per call.
+#define TRANSMIT_FILE_CHUNK (1u << 30)
+
 struct connState {
     struct io_async_state io_state;
 
     struct tcpConnCommon common;
     SOCKET sock;
     struct io_handler *io_handler;
+    // Reused by every I/O of the connection, a connection never has more than one operation in flight.
+    struct io_op ioOp;
     enum connStage stage;
     DWORD flags;
     WSABUF WSArecvBuf;
+    // Worker the awaited handler counts against, NULL while there's none.
+    struct worker_admission *admission;
 };
 
 struct connSetupParams {
     struct io_handler *io_handler;
     SOCKET sock;
+    struct peer_address peer;
 };
 
 // Params is a stack pointer from Event Loop
-void *connConstructor(void *param) {
+void *connConstructor(struct connState *state, void *param) {
     struct connSetupParams params = *(struct connSetupParams *)param;
 
-    struct connState *state = calloc(1, sizeof(struct connState));
-
     state->io_state = nullIOAsyncState;
     state->sock = params.sock;
     state->io_handler = params.io_handler;
     state->stage = SetupConn;
+    state->admission = NULL;
+
+    SetupCommonConn(&state->common, MAX_HEADER_SIZE);
+    state->common.peer = params.peer;
 
-    SetupCommonConn(&state->common, RECV_LEN);
+    char peer[PEER_ADDRESS_MAX];
+    FormatPeerAddress(&state->common.peer, peer);
 
-    printf("Conn Setup\n");
+    printf("Conn Setup: %s\n", peer);
 
     return state;
 }
 
 void connDestructor(struct connState *state) {
+    // Not running once this returns, even on another worker.
+    CancelTimer(&state->common.timer);
+    ReleaseRequest(state->admission);
+    LeaveConnection();
     closesocket(state->sock);
     CleanupCommonConn(&state->common);
-    free(state);
 
     printf("Conn Destroy\n");
 }
 
+// Runs on the worker whose wheel it was armed on. Shutting the socket down fails the pending read (or the writes after
+// the handler), so the connection finishes the usual way.
+void ConnTimedOut(struct timer *timer) {
+    struct connState *state = (struct connState *)((uint8_t *)timer - offsetof(struct connState, common.timer));
+
+    shutdown(state->sock, SD_BOTH);
+    // A zero byte read isn't completed by the shutdown.
+    CancelIoEx((HANDLE)state->sock, NULL);
+}
+
+// Runs on the worker whose wheel it was armed on, with the wheel locked, so the connection resumes once the worker is
+// back in its loop. It answers for the abandoned machine in ConnHandled, ConnConsumed or ConnStreamed.
+void ConnAwaitTimedOut(struct timer *timer) {
+    struct connState *state = (struct connState *)((uint8_t *)timer - offsetof(struct connState, common.timer));
+
+    // Retained by the connection, the stage doesn't change while it awaits.
+    struct async_state *awaited = state->common.stream.producer;
+
+    if (state->stage == ConnHandled) awaited = state->common.handler;
+    if (state->stage == ConnConsumed) awaited = state->common.bodyConsumer;
+
+    if (AbortAsync(awaited)) DeferResumeFromAwait(awaited->awaiting);
+}
+
+// Arms the deadline on the wheel of the running worker, until the connection resumes.
+void ArmConnTimer(struct connState *state, uint64_t deadline, timer_callback callback) {
+    if (deadline == 0) return;
+
+    ArmTimer(threadTimers, &state->common.timer, deadline, callback);
+}
+
 struct subroutine_result connSubroutine(struct connState *state) {
     // Verify Current Async is "this"
     if (currentAsync == NULL || currentAsync->state != state) return subroutine_finish;
 
+    // Whatever the connection waited for happened in time.
+    CancelTimer(&state->common.timer);
+
     StageSwitch:
     switch (state->stage) {
         case SetupConn: {
@@ -86,17 +149,32 @@ struct subroutine_result connSubroutine(struct connState *state) {
         }
 
         case ConnRead: {
-            state->stage = ConnProcess;
+            uint8_t *recvBuf = NULL;
+            uint32_t recvLen = 0;
+
+            if (RecvIdle(&state->common)) {
+                // Idle connections wait with a zero byte read, a buffer is only taken once data arrived.
+                state->stage = ConnReadable;
+            } else if (PrepareRecv(&state->common, &recvBuf, &recvLen)) {
+                state->stage = ConnProcess;
+            } else {
+                RejectRequest(&state->common, 431);
+
+                state->stage = ConnWrite;
+                goto StageSwitch;
+            }
 
             state->flags = 0;
             state->WSArecvBuf = (WSABUF){
-                .len = RECV_LEN - state->common.recvOffset,
-                .buf = (uint8_t *)state->common.recvBuf + state->common.recvOffset,
+                .len = recvLen,
+                .buf = recvBuf,
             };
 
+            ArmConnTimer(state, ConnReadDeadline(&state->common, NowMillis()), ConnTimedOut);
+
             PrepareIO();
 
-            struct io_op *op = CreateIOOperation(0, currentAsync);
+            InitIOOperation(&state->ioOp, IO_READ, currentAsync);
 
             int err = WSARecv(
                 state->sock,
@@ -104,7 +182,7 @@ struct subroutine_result connSubroutine(struct connState *state) {
                 1,
                 NULL,
                 &state->flags,
-                (OVERLAPPED*)op,
+                (OVERLAPPED*)&state->ioOp,
                 NULL
             );
 
@@ -113,7 +191,6 @@ struct subroutine_result connSubroutine(struct connState *state) {
 
                 if (wsaErr != WSA_IO_PENDING) {
                     printf("Instant Read Error: %i\n", wsaErr);
-                    free(op);
                     CancelIO();
 
                     return subroutine_finish;
@@ -129,11 +206,230 @@ struct subroutine_result connSubroutine(struct connState *state) {
                 state->io_state.bytesTransferred == 0
             ) return subroutine_finish;
 
-            state->common.recvOffset += state->io_state.bytesTransferred;
+            CommitRecv(&state->common, state->io_state.bytesTransferred);
 
-            if (!ProcessLines(&state->common)) return subroutine_finish;
+            state->stage = ConnParse;
+            goto StageSwitch;
+        }
 
-            state->stage = ConnRead;
+        case ConnReadable: {
+            if (!state->io_state.ok) return subroutine_finish;
+
+            uint8_t *recvBuf;
+            uint32_t recvLen;
+
+            // Only fails if out of memory, the chain is empty.
+            if (!PrepareRecv(&state->common, &recvBuf, &recvLen)) return subroutine_finish;
+
+            // The socket is non-blocking, whatever arrived is copied right away without another completion.
+            int received = recv(state->sock, (char *)recvBuf, (int)recvLen, 0);
+
+            if (received == SOCKET_ERROR) {
+                if (WSAGetLastError() != WSAEWOULDBLOCK) return subroutine_finish;
+
+                // Nothing to read after all, back to waiting without the buffer.
+                ReleaseIdleRecv(&state->common);
+
+                state->stage = ConnRead;
+                goto StageSwitch;
+            }
+
+            // Closed by the peer.
+            if (received == 0) return subroutine_finish;
+
+            CommitRecv(&state->common, (uint32_t)received);
+
+            state->stage = ConnParse;
+            goto StageSwitch;
+        }
+
+        case ConnParse: {
+            if (!ProcessLines(&state->common)) RejectRequest(&state->common, 400);
+
+            // Parsing stopped at a routed request, its handler runs before anything else.
+            struct async_state *handler = TakeHandler(&state->common);
+
+            if (handler != NULL) {
+                state->stage = ConnHandled;
+                state->admission = EnterRequest();
+
+                ArmConnTimer(state, ConnHandlerDeadline(NowMillis()), ConnAwaitTimedOut);
+                return subroutine_await(handler);
+            }
+
+            // Or at a part of a body, nothing more is read until the consumer took it.
+            struct async_state *consumer = TakeBodyConsumer(&state->common);
+
+            if (consumer != NULL) {
+                state->stage = ConnConsumed;
+
+                ArmConnTimer(state, ConnHandlerDeadline(NowMillis()), ConnAwaitTimedOut);
+                return subroutine_await(consumer);
+            }
+
+            // Responses of every request parsed above go out together.
+            state->stage = ConnWrite;
+            goto StageSwitch;
+        }
+
+        case ConnWrite: {
+            struct send_vec *sendVecs;
+            uint32_t sendCount;
+
+            if (!PrepareSend(&state->common, &sendVecs, &sendCount)) {
+                state->stage = ConnSendFile;
+                goto StageSwitch;
+            }
+
+            state->stage = ConnWritten;
+
+            PrepareIO();
+
+            InitIOOperation(&state->ioOp, IO_WRITE, currentAsync);
+
+            int err = WSASend(
+                state->sock,
+                (WSABUF *)sendVecs,
+                sendCount,
+                NULL,
+                0,
+                (OVERLAPPED*)&state->ioOp,
+                NULL
+            );
+
+            if (err == SOCKET_ERROR) {
+                int wsaErr = WSAGetLastError();
+
+                if (wsaErr != WSA_IO_PENDING) {
+                    printf("Instant Write Error: %i\n", wsaErr);
+                    CancelIO();
+
+                    return subroutine_finish;
+                }
+            }
+
+            return subroutine_yield_io;
+        }
+
+        case ConnWritten: {
+            if (
+                !state->io_state.ok ||
+                state->io_state.bytesTransferred == 0
+            ) return subroutine_finish;
+
+            // Partial sends continue where they left off.
+            CommitSend(&state->common, state->io_state.bytesTransferred);
+
+            // Requests held back by a full send queue are parsed before anything new is read.
+            state->stage = ConnParse;
+            goto StageSwitch;
+        }
+
+        case ConnSendFile: {
+            file_handle file;
+            uint64_t offset, remaining;
+
+            if (!PrepareFileSend(&state->common, &file, &offset, &remaining)) {
+                if (HasBodyStream(&state->common)) {
+                    state->stage = ConnStream;
+                    goto StageSwitch;
+                }
+
+                if (state->common.state == RECV_CLOSED) return subroutine_finish;
+
+                state->stage = ConnRead;
+                goto StageSwitch;
+            }
+
+            state->stage = ConnFileSent;
+
+            DWORD chunk = remaining < TRANSMIT_FILE_CHUNK ? (DWORD)remaining : TRANSMIT_FILE_CHUNK;
+
+            PrepareIO();
+
+            InitIOOperation(&state->ioOp, IO_SENDFILE, currentAsync);
+
+            // The handle is shared and overlapped, so the offset comes from the operation.
+            state->ioOp.overlapped.Offset = (DWORD)offset;
+            state->ioOp.overlapped.OffsetHigh = (DWORD)(offset >> 32);
+
+            BOOL sent = TransmitFile(
+                state->sock,
+                file,
+                chunk,
+                0,
+                (OVERLAPPED*)&state->ioOp,
+                NULL,
+                0
+            );
+
+            if (!sent) {
+                int wsaErr = WSAGetLastError();
+
+                if (wsaErr != WSA_IO_PENDING && wsaErr != ERROR_IO_PENDING) {
+                    printf("Instant Send File Error: %i\n", wsaErr);
+                    CancelIO();
+
+                    return subroutine_finish;
+                }
+            }
+
+            return subroutine_yield_io;
+        }
+
+        case ConnFileSent: {
+            if (
+                !state->io_state.ok ||
+                state->io_state.bytesTransferred == 0
+            ) return subroutine_finish;
+
+            CommitFileSend(&state->common, state->io_state.bytesTransferred);
+
+            // Requests held back behind the file body are parsed once it's out.
+            state->stage = state->common.file == NULL ? ConnParse : ConnSendFile;
+            goto StageSwitch;
+        }
+
+        case ConnStream: {
+            // Only reached with the send queue flushed, the producer writes the next part into the emptied buffer.
+            struct async_state *producer = TakeStreamProducer(&state->common);
+
+            if (producer != NULL) {
+                state->stage = ConnStreamed;
+
+                ArmConnTimer(state, ConnHandlerDeadline(NowMillis()), ConnAwaitTimedOut);
+                return subroutine_await(producer);
+            }
+
+            // Requests held back behind the streamed body are parsed once it's done.
+            state->stage = ConnParse;
+            goto StageSwitch;
+        }
+
+        case ConnStreamed: {
+            if (!StreamProduced(&state->common)) return subroutine_finish;
+
+            // Whatever it wrote goes out with the next write.
+            state->stage = ConnParse;
+            goto StageSwitch;
+        }
+
+        case ConnHandled: {
+            ReleaseRequest(state->admission);
+            state->admission = NULL;
+
+            HandlerFinished(&state->common);
+
+            // Continues with the body of the request, or the requests after it.
+            state->stage = ConnParse;
+            goto StageSwitch;
+        }
+
+        case ConnConsumed: {
+            BodyConsumed(&state->common);
+
+            // Continues with the rest of the body, or the requests after it.
+            state->stage = ConnParse;
             goto StageSwitch;
         }
 
@@ -145,7 +441,20 @@ struct subroutine_result connSubroutine(struct connState *state) {
 }
 
 const struct async_descriptor connAsync = {
-    .constructor = connConstructor,
+    .constructor = (async_constructor)connConstructor,
     .destructor = (async_destructor)connDestructor,
     .subroutine = (async_subroutine)connSubroutine,
-};
\ No newline at end of file
+    .stateSize = sizeof(struct connState),
+    // Most of it is the request's header slots, which needn't be zeroed.
+    .constructsState = true,
+};
+
+// The operation used to post the initial completion that starts a newly accepted connection on the worker of
+// another I/O handler.
+struct io_op *ConnStartOperation(struct async_state *connMachine) {
+    struct connState *state = connMachine->state;
+
+    InitIOOperation(&state->ioOp, IO_STARTCLIENT, connMachine);
+
+    return &state->ioOp;
+}
\ No newline at end of file
@@ -0,0 +1,235 @@
+﻿// Listener
+
+#pragma once
+
+#include <stdatomic.h>
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#include <mswsock.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "../io.h"
+#include "../state_machine.c"
+#include "../tcp_common/consts.h"
+#include "../timer_wheel.c"
+#include "./conn.c"
+
+// AcceptEx needs room for each address plus 16 bytes.
+#define ACCEPT_ADDRESS_SIZE (sizeof(struct sockaddr_in6) + 16)
+
+// One outstanding AcceptEx, the op comes first so the slot is found from the completion.
+struct accept_slot {
+    struct io_op op;
+    SOCKET sock;
+    // Local then remote address, written by AcceptEx.
+    uint8_t addresses[2 * ACCEPT_ADDRESS_SIZE];
+    // Armed on the wheel of the worker whose post failed, until the slot is tried again.
+    struct timer backoff;
+    // Wait before the next attempt, 0 while posting succeeds.
+    uint32_t backoffMs;
+};
+
+// Accepts complete like any other I/O, on whichever worker dequeues them, so connection setup is spread over
+// the workers.
+// With one I/O handler per worker, accepted connections are handed round-robin to every handler, the socket is
+// bound to the port of that handler so the connection stays on its worker.
+struct listener {
+    SOCKET sock;
+    struct io_handler *io_handler;
+    struct io_handler **shards;
+    uint32_t shardCount;
+    atomic_uint nextShard;
+    struct accept_slot slots[ACCEPTS_OUTSTANDING];
+};
+
+struct peer_address PeerFromSockaddr(const struct sockaddr *addr) {
+    struct peer_address peer = nullPeerAddress;
+
+    if (addr->sa_family == AF_INET) {
+        const struct sockaddr_in *in = (const struct sockaddr_in *)addr;
+
+        peer.version = 4;
+        peer.port = ntohs(in->sin_port);
+        memcpy(peer.addr, &in->sin_addr, 4);
+    } else if (addr->sa_family == AF_INET6) {
+        const struct sockaddr_in6 *in6 = (const struct sockaddr_in6 *)addr;
+
+        peer.version = 6;
+        peer.port = ntohs(in6->sin6_port);
+        memcpy(peer.addr, &in6->sin6_addr, 16);
+    }
+
+    return peer;
+}
+
+// Posts an AcceptEx into the slot, with a new socket to accept into. Returns false if it couldn't be posted,
+// the slot then stays unused.
+bool ArmAccept(struct listener *listener, struct accept_slot *slot) {
+    slot->sock = WSASocketW(AF_INET, SOCK_STREAM, IPPROTO_TCP, NULL, 0, WSA_FLAG_OVERLAPPED);
+
+    if (slot->sock == INVALID_SOCKET) {
+        fprintf(stderr, "Server accept socket creation failed: %i\n", WSAGetLastError());
+        return false;
+    }
+
+    InitIOOperation(&slot->op, IO_ACCEPT, listener);
+
+    DWORD received;
+    // No data is received with the connection, so it completes as soon as one is accepted.
+    bool accepted = AcceptEx(
+        listener->sock,
+        slot->sock,
+        slot->addresses,
+        0,
+        ACCEPT_ADDRESS_SIZE,
+        ACCEPT_ADDRESS_SIZE,
+        &received,
+        (OVERLAPPED*)&slot->op
+    );
+
+    if (!accepted && WSAGetLastError() != ERROR_IO_PENDING) {
+        fprintf(stderr, "Server AcceptEx failed: %i\n", WSAGetLastError());
+
+        closesocket(slot->sock);
+        slot->sock = INVALID_SOCKET;
+
+        return false;
+    }
+
+    return true;
+}
+
+// Posts every accept on ioHandler, the listener must outlive the workers. Connections are handed to the shards.
+void StartListener(struct listener *listener, struct io_handler *ioHandler, struct io_handler **shards, uint32_t shardCount, SOCKET sock) {
+    listener->sock = sock;
+    listener->io_handler = ioHandler;
+    listener->shards = shards;
+    listener->shardCount = shardCount;
+    atomic_init(&listener->nextShard, 0);
+
+    if (w32_CreateIOPort(ioHandler, (HANDLE)sock) != ioHandler->iocp_handle) {
+        fprintf(stderr, "panic: Server Socket IOCP Port is invalid.\n");
+        abort();
+    }
+
+    for (uint32_t i = 0; i < ACCEPTS_OUTSTANDING; i++) {
+        listener->slots[i].backoff = nullTimer;
+        listener->slots[i].backoffMs = 0;
+
+        if (!ArmAccept(listener, &listener->slots[i])) {
+            fprintf(stderr, "panic: failed to post accept.\n");
+            abort();
+        }
+    }
+}
+
+// Answers a connection that isn't admitted without reading its request, and closes it.
+void ShedConn(SOCKET sock) {
+    // Still blocking, the response fits the empty send buffer.
+    send(sock, SHED_RESPONSE, sizeof(SHED_RESPONSE) - 1, 0);
+
+    // Unread data makes closing reset the connection, possibly before the response got out.
+    shutdown(sock, SD_SEND);
+
+    unsigned long nonBlocking = 1;
+    ioctlsocket(sock, FIONBIO, &nonBlocking);
+
+    char drain[1024];
+    recv(sock, drain, sizeof(drain), 0);
+
+    closesocket(sock);
+}
+
+// Runs the new connection on this worker right away, or posts it to the worker of its shard.
+void StartConn(struct listener *listener, struct accept_slot *slot) {
+    // Until then, the socket isn't fully set up (getpeername, shutdown and the like fail).
+    setsockopt(slot->sock, SOL_SOCKET, SO_UPDATE_ACCEPT_CONTEXT, (char *)&listener->sock, sizeof(listener->sock));
+
+    if (!AdmitConnection()) {
+        MetricAdd(METRIC_CONNECTIONS_SHED, 1);
+        ShedConn(slot->sock);
+        return;
+    }
+
+    MetricAdd(METRIC_CONNECTIONS_ACCEPTED, 1);
+
+    struct sockaddr *local, *remote;
+    int localLen, remoteLen;
+
+    GetAcceptExSockaddrs(slot->addresses, 0, ACCEPT_ADDRESS_SIZE, ACCEPT_ADDRESS_SIZE, &local, &localLen, &remote, &remoteLen);
+
+    uint32_t shard = atomic_fetch_add_explicit(&listener->nextShard, 1, memory_order_relaxed) % listener->shardCount;
+    struct io_handler *ioHandler = listener->shards[shard];
+
+    struct connSetupParams params = {
+        .io_handler = ioHandler,
+        .sock = slot->sock,
+        .peer = PeerFromSockaddr(remote),
+    };
+
+    struct async_state *connState = AwaitAsync(connAsync, &params);
+
+    if (connState == NULL) {
+        LeaveConnection();
+        closesocket(slot->sock);
+        return;
+    }
+
+    if (ioHandler != listener->io_handler) {
+        // Resumed by the completion on the other port, like any I/O.
+        atomic_fetch_or(&connState->flags, MACHINE_SUSPENDED_IO);
+
+        if (ResolveIOOperation(ioHandler, ConnStartOperation(connState))) return;
+
+        // Its completions are still dequeued by its own worker, only setup happens here.
+        atomic_fetch_and(&connState->flags, ~MACHINE_SUSPENDED_IO);
+    }
+
+    // Caller is responsible for setting RUNNING flag.
+    atomic_fetch_or(&connState->flags, MACHINE_RUNNING);
+    RunAsync(connState);
+}
+
+// Timer callbacks can't arm timers, so the retry is posted as a completion of the slot, without a socket.
+void AcceptBackoffExpired(struct timer *timer) {
+    struct accept_slot *slot = (struct accept_slot *)((uint8_t *)timer - offsetof(struct accept_slot, backoff));
+    struct listener *listener = slot->op.data;
+
+    InitIOOperation(&slot->op, IO_ACCEPT, listener);
+
+    if (!ResolveIOOperation(listener->io_handler, &slot->op)) {
+        fprintf(stderr, "panic: failed to post accept retry.\n");
+        abort();
+    }
+}
+
+// Called by the worker that dequeued the completion of one of the accepts, or the retry of a slot backing off.
+void CompleteAccept(struct io_op *op, const struct io_completion *completion) {
+    struct listener *listener = op->data;
+    struct accept_slot *slot = (struct accept_slot *)op;
+
+    if (slot->sock != INVALID_SOCKET) {
+        if (completion->ok) {
+            slot->backoffMs = 0;
+            StartConn(listener, slot);
+        } else {
+            MetricAdd(METRIC_ACCEPT_ERRORS, 1);
+            fprintf(stderr, "Server accept failed\n");
+            closesocket(slot->sock);
+        }
+
+        slot->sock = INVALID_SOCKET;
+    }
+
+    if (ArmAccept(listener, slot)) return;
+
+    // Posting fails while sockets are exhausted, the slot is tried again once some may have closed.
+    MetricAdd(METRIC_ACCEPT_ERRORS, 1);
+
+    slot->backoffMs = slot->backoffMs == 0 ? ACCEPT_BACKOFF_MS : slot->backoffMs * 2;
+    if (slot->backoffMs > ACCEPT_BACKOFF_MAX_MS) slot->backoffMs = ACCEPT_BACKOFF_MAX_MS;
+
+    ArmTimer(threadTimers, &slot->backoff, NowMillis() + slot->backoffMs, AcceptBackoffExpired);
+}
\ No newline at end of file
@@ -12,6 +12,7 @@
 
 // // Local Internal
 #include "./event_loop.c"
+#include "../tcp_common/metrics_endpoint.c"
 #include "../tcp_common/consts.h"
 
 #define WSA_UNINITIALIZED 0
@@ -56,21 +57,58 @@ DWORD CountLogicalProcessors() {
     return sysInfo.dwNumberOfProcessors;
 }
 
-void StartServer(const char *addr, uint16_t port) {
-    InitWSA();
+// One I/O Completion Port per worker instead of one shared by every worker, set before StartServer. A connection
+// stays on the port it was handed to, so its completions are only ever dequeued by that worker.
+bool shardedIO = false;
 
-    __attribute__((__cleanup__(ReleaseShared))) struct shared_retainer ioHandler_retainer = MakeShared(sizeof(struct io_handler), CleanupIOHandler);
+struct shared_retainer CreateShard() {
+    struct shared_retainer ioHandler_retainer = MakeShared(sizeof(struct io_handler), CleanupIOHandler);
     struct io_handler *ioHandler = ioHandler_retainer.ptr;
 
+    if (ioHandler == NULL) {
+        fprintf(stderr, "panic: IO Handler allocation failed.\n");
+        abort();
+    }
+
     *ioHandler = CreateIOHandler();
 
-    for (int i = 0; i < CountLogicalProcessors(); i++) {
-        if (RetainShared(ioHandler_retainer).ptr == NULL) {
-            fprintf(stderr, "panic: Error retaining IO Handler for thread.\n");
-            abort();
-        }
+    return ioHandler_retainer;
+}
+
+void RunShardWorker(struct shared_retainer ioHandler_retainer, bool spawn) {
+    if (RetainShared(ioHandler_retainer).ptr == NULL) {
+        fprintf(stderr, "panic: Error retaining IO Handler for thread.\n");
+        abort();
+    }
+
+    if (spawn) SpawnWorker(SharedFromRetainer(ioHandler_retainer));
+    else StartWorker(SharedFromRetainer(ioHandler_retainer));
+}
+
+void StartServer(const char *addr, uint16_t port) {
+    InitWSA();
+
+    // A completion port can't be asked how many completions it holds, see PendingCompletions.
+    if (maxQueuedCompletions > 0) {
+        fprintf(stderr, "warning: The queued completions limit isn't supported on Windows, ignoring it.\n");
+        maxQueuedCompletions = 0;
+    }
 
-        SpawnWorker(SharedFromRetainer(ioHandler_retainer));
+    DWORD workerCount = CountLogicalProcessors();
+    DWORD shardCount = shardedIO ? workerCount : 1;
+
+    // Live as long as the workers, this thread being one of them.
+    struct shared_retainer *shards = calloc(shardCount, sizeof(struct shared_retainer));
+    struct io_handler **shardHandlers = calloc(shardCount, sizeof(struct io_handler *));
+
+    if (shards == NULL || shardHandlers == NULL) {
+        fprintf(stderr, "panic: IO Shard allocation failed.\n");
+        abort();
+    }
+
+    for (DWORD i = 0; i < shardCount; i++) {
+        shards[i] = CreateShard();
+        shardHandlers[i] = shards[i].ptr;
     }
 
     SOCKET serverSock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
@@ -116,29 +154,23 @@ void StartServer(const char *addr, uint16_t port) {
         abort();
     }
 
-    printf("Listening\n");
-
-    for (;;) {
-        // for future we might want the IP Address
-        SOCKET client = accept(serverSock, NULL, NULL);
+    // A socket is bound to one port, so the accepts complete on the first shard which hands connections out.
+    struct listener listener;
+    StartListener(&listener, shardHandlers[0], shardHandlers, shardCount, serverSock);
 
-        if (client == INVALID_SOCKET) {
-            fprintf(stderr, "Server accept failed: %i\n", WSAGetLastError());
-            continue;
-        }
-
-        struct connSetupParams params = {
-            .io_handler = ioHandler,
-            .sock = client
-        };
+    printf("Listening (%lu I/O handlers)\n", shardCount);
 
-        struct async_state *connState = AwaitAsync(connAsync, &params);
+    // Machines spawned with SpawnAsync run there, as many as there are cores to run them.
+    StartExecutors(workerCount);
 
-        if (connState == NULL) continue;
+    // The calling thread is the last worker.
+    for (DWORD i = 0; i < workerCount - 1; i++) {
+        RunShardWorker(shards[i % shardCount], true);
+    }
 
-        connState->flags |= MACHINE_SUSPENDED_IO;
+    RunShardWorker(shards[(workerCount - 1) % shardCount], false);
 
-        struct io_op *op = CreateIOOperation(0, connState);
-        ResolveIOOperation(ioHandler, op);
+    for (DWORD i = 0; i < shardCount; i++) {
+        ReleaseShared(&shards[i]);
     }
 }
\ No newline at end of file
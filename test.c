@@ -1,6 +1,15 @@
 ﻿#include "./state_machine.c"
+#include "./tcp_common/conn.c"
+#include "./executor.c"
 #include <stdio.h>
 #include <stdlib.h>
+#include <time.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#endif
 
 enum httpStage {
     A,
@@ -12,22 +21,19 @@ struct otherState {
     uint32_t nesting;
 };
 
-void *otherConstructor(void *param) {
-    struct otherState *state = calloc(1, sizeof(struct otherState));
-
+// Inline state, allocated together with the async_state.
+void *otherConstructor(struct otherState *state, void *param) {
     state->stage = A;
     state->nesting = *(uint32_t *)param;
 
     return state;
 }
 
-void otherDestructor(void *state) {
-    return free(state);
-}
+void otherDestructor(void *state) {}
 
 extern const struct async_descriptor otherAsync;
 
-bool runOther(struct otherState *state) {
+struct subroutine_result runOther(struct otherState *state) {
     switch (state->stage) {
         case A: {
             state->stage = B;
@@ -36,33 +42,34 @@ bool runOther(struct otherState *state) {
             printf("Running Other\n");
             if (nesting > 0) {
                 uint32_t nextNesting = state->nesting - 1;
-                AwaitAsync(otherAsync, &nextNesting);
-                return false;
+                return subroutine_await(AwaitAsync(otherAsync, &nextNesting));
             }
 
             printf("Finished Other Instant\n");
-            return true;
+            return subroutine_finish;
         }
         case B: {
             printf("Finished Other\n");
-            return true;
+            return subroutine_finish;
         }
     }
 
-    return true;
+    return subroutine_finish;
 }
 
 const struct async_descriptor otherAsync = {
-    .constructor = otherConstructor,
+    .constructor = (async_constructor)otherConstructor,
     .destructor = otherDestructor,
-    .subroutine = runOther,
+    .subroutine = (async_subroutine)runOther,
+    .stateSize = sizeof(struct otherState),
 };
 
 struct httpState {
     enum httpStage stage;
 };
 
-void *httpConstructor(void *param) {
+// Heap state, owned by the constructor/destructor.
+void *httpConstructor(void *inlineState, void *param) {
     struct httpState *state = calloc(1, sizeof(struct httpState));
     state->stage = A;
 
@@ -74,31 +81,2246 @@ void httpDestructor(void *state) {
     return free(state);
 }
 
-bool runHttp(struct httpState *state) {
+struct subroutine_result runHttp(struct httpState *state) {
     printf("Stage: %u\n", state->stage);
 
     switch (state->stage) {
         case A: {
             state->stage = B;
             uint32_t nesting = 5;
-            AwaitAsync(otherAsync, &nesting);
-            return false;
+            return subroutine_await(AwaitAsync(otherAsync, &nesting));
         }
 
         case B: {
-            return true;
+            return subroutine_finish;
         }
     }
+
+    return subroutine_finish;
 }
 
 const struct async_descriptor httpAsync = {
     .constructor = httpConstructor,
     .destructor = httpDestructor,
-    .subroutine = runHttp,
+    .subroutine = (async_subroutine)runHttp,
+    .stateSize = 0,
 };
 
-int main(void) {
-    printf("Starting %p\n", httpAsync.subroutine);
-    AwaitAsync(httpAsync, NULL);
+// Split Request Parsing
+
+struct parseResult {
+    bool ok;
+    enum tcpState state;
+    // Request still being parsed when the data ran out, heads without their blank line stop there.
+    char method[16];
+    char path[256];
+    char version[16];
+    char host[64];
+    char cookie[64];
+    uint32_t headerCount;
+    // Queued responses, in request order.
+    char responses[2048];
+    uint32_t unread;
+    uint64_t scanned;
+};
+
+void CopyResultString(char *dest, size_t size, union string *str) {
+    snprintf(dest, size, "%.*s", GetStringLen(str), GetStringBuf(str));
+}
+
+// Runs the handler or body consumer ProcessLines stopped for, as the platform awaits it. Returns false if there's none.
+bool RunPendingMachine(struct tcpConnCommon *conn) {
+    struct async_state *handler = TakeHandler(conn);
+    struct async_state *machine = handler != NULL ? handler : TakeBodyConsumer(conn);
+    if (machine == NULL) return false;
+
+    // Caller is responsible for setting RUNNING flag.
+    atomic_fetch_or(&machine->flags, MACHINE_RUNNING);
+    RunAsync(machine);
+
+    if (handler != NULL) HandlerFinished(conn);
+    else BodyConsumed(conn);
+
+    return true;
+}
+
+// Receives data as if the socket delivered it in pieces ending at each cut, then at len.
+struct parseResult ParseSplit(const char *data, const uint32_t *cuts, uint32_t cutCount) {
+    struct tcpConnCommon conn;
+    memset(&conn, 0, sizeof(conn));
+    SetupCommonConn(&conn, MAX_HEADER_SIZE);
+
+    struct parseResult result;
+    memset(&result, 0, sizeof(result));
+    result.ok = true;
+
+    uint64_t scannedBefore = scannedBytes;
+    uint32_t len = strlen(data);
+    uint32_t pos = 0;
+
+    for (uint32_t i = 0; i <= cutCount && result.ok; i++) {
+        uint32_t pieceEnd = i < cutCount ? cuts[i] : len;
+
+        while (pos < pieceEnd && result.ok) {
+            uint8_t *buf;
+            uint32_t bufLen;
+
+            if (!PrepareRecv(&conn, &buf, &bufLen)) {
+                result.ok = false;
+                break;
+            }
+
+            uint32_t n = pieceEnd - pos < bufLen ? pieceEnd - pos : bufLen;
+            memcpy(buf, data + pos, n);
+            CommitRecv(&conn, n);
+            pos += n;
+
+            result.ok = ProcessLines(&conn);
+            while (result.ok && RunPendingMachine(&conn)) result.ok = ProcessLines(&conn);
+        }
+    }
+
+    result.state = conn.state;
+    result.scanned = scannedBytes - scannedBefore;
+
+    if (conn.state == RECV_HEADER) {
+        snprintf(result.method, sizeof(result.method), "%s", HTTPMethodName(conn.currentReq.method));
+        CopyResultString(result.path, sizeof(result.path), &conn.currentReq.path);
+        snprintf(result.version, sizeof(result.version), "%s", HTTPVersionName(conn.currentReq.version));
+
+        struct http_headers *headers = &conn.currentReq.headers;
+        union string value;
+
+        if (GetHeader(headers, HEADER_HOST, &value)) CopyResultString(result.host, sizeof(result.host), &value);
+        if (FindHeader(headers, "cookie", &value)) CopyResultString(result.cookie, sizeof(result.cookie), &value);
+
+        result.headerCount = __builtin_popcount(headers->knownMask) + headers->otherCount;
+    }
+
+    struct send_vec *vecs;
+    uint32_t vecCount;
+
+    if (PrepareSend(&conn, &vecs, &vecCount)) {
+        size_t used = 0;
+
+        for (uint32_t i = 0; i < vecCount && used < sizeof(result.responses); i++) {
+            used += snprintf(result.responses + used, sizeof(result.responses) - used, "%.*s", (int)vecs[i].len, vecs[i].buf);
+        }
+
+        // Parses being compared may straddle a second.
+        for (char *date = strstr(result.responses, "Date: "); date != NULL; date = strstr(date + 1, "Date: ")) {
+            memset(date + 6, '*', 29);
+        }
+    }
+
+    for (struct recv_segment *segment = conn.recv.head; segment != NULL; segment = segment->next) {
+        result.unread += segment->len - (segment == conn.recv.head ? conn.recv.cursor : 0);
+    }
+
+    CleanupCommonConn(&conn);
+    return result;
+}
+
+bool SameParseResult(const struct parseResult *a, const struct parseResult *b) {
+    if (a->ok != b->ok) return false;
+    // Failed parses stop at the first error, wherever the pieces happened to end.
+    if (!a->ok) return true;
+
+    return a->state == b->state &&
+        a->unread == b->unread &&
+        strcmp(a->method, b->method) == 0 &&
+        strcmp(a->path, b->path) == 0 &&
+        strcmp(a->version, b->version) == 0 &&
+        strcmp(a->host, b->host) == 0 &&
+        strcmp(a->cookie, b->cookie) == 0 &&
+        a->headerCount == b->headerCount &&
+        strcmp(a->responses, b->responses) == 0;
+}
+
+uint32_t CountOccurrences(const char *haystack, const char *needle) {
+    uint32_t count = 0;
+
+    for (const char *found = strstr(haystack, needle); found != NULL; found = strstr(found + 1, needle)) count++;
+
+    return count;
+}
+
+// Parses data whole, split in two at every offset, and one byte at a time, all must agree with the whole parse.
+// Every received byte may be scanned at most once, however the request was split.
+bool TestSplitRequest(const char *name, const char *data, bool expectOk, uint32_t expectResponses, bool everyTwoWaySplit) {
+    uint32_t len = strlen(data);
+    struct parseResult whole = ParseSplit(data, NULL, 0);
+
+    if (whole.ok != expectOk || (expectOk && CountOccurrences(whole.responses, "HTTP/1.1 ") != expectResponses)) {
+        printf("FAIL %s: whole parse ok=%d responses:\n%s\n", name, whole.ok, whole.responses);
+        return false;
+    }
+
+    if (everyTwoWaySplit) {
+        for (uint32_t cut = 1; cut < len; cut++) {
+            struct parseResult split = ParseSplit(data, &cut, 1);
+
+            if (!SameParseResult(&whole, &split) || split.scanned > len) {
+                printf("FAIL %s: split at %u differs (scanned %llu of %u)\n", name, cut, (unsigned long long)split.scanned, len);
+                return false;
+            }
+        }
+    }
+
+    uint32_t *cuts = malloc(len * sizeof(uint32_t));
+    for (uint32_t i = 0; i < len; i++) cuts[i] = i + 1;
+
+    struct parseResult trickled = ParseSplit(data, cuts, len);
+    free(cuts);
+
+    if (!SameParseResult(&whole, &trickled) || trickled.scanned > len) {
+        printf("FAIL %s: byte at a time differs (scanned %llu of %u)\n", name, (unsigned long long)trickled.scanned, len);
+        return false;
+    }
+
+    printf("PASS %s\n", name);
+    return true;
+}
+
+bool TestSplitRequests() {
+    bool ok = true;
+
+    // Heads without their blank line, so the request is still there to compare.
+    ok &= TestSplitRequest("open head",
+        "GET /index.html HTTP/1.1\r\nHost: localhost\r\nAccept: */*\r\n", true, 0, true);
+    ok &= TestSplitRequest("colon in value",
+        "GET / HTTP/1.1\r\nHost: localhost:6000\r\nReferer: http://a/b?c=d:e\r\nCookie:  a=b \t\r\n", true, 0, true);
+    ok &= TestSplitRequest("unknown method head",
+        "BREW /pot HTTP/1.1\r\nHost: localhost\r\n", true, 0, true);
+
+    ok &= TestSplitRequest("simple",
+        "GET /index.html HTTP/1.1\r\nHost: localhost\r\nAccept: */*\r\n\r\n", true, 1, true);
+    ok &= TestSplitRequest("bare LF",
+        "GET / HTTP/1.0\nHost: localhost\n\n", true, 1, true);
+    ok &= TestSplitRequest("body skipped",
+        "POST /submit HTTP/1.1\r\nHost: localhost\r\nContent-Length: 5\r\n\r\nhello", true, 1, true);
+    ok &= TestSplitRequest("unknown method",
+        "BREW /pot HTTP/1.1\r\nHost: localhost\r\n\r\n", true, 1, true);
+    ok &= TestSplitRequest("unsupported version",
+        "GET / HTTP/2.0\r\nHost: localhost\r\n\r\n", false, 0, true);
+    ok &= TestSplitRequest("short version",
+        "GET / HTTP/1\r\nHost: localhost\r\n\r\n", false, 0, true);
+    ok &= TestSplitRequest("extra space",
+        "GET / HTTP/1.1 x\r\nHost: localhost\r\n\r\n", false, 0, true);
+    ok &= TestSplitRequest("space before colon",
+        "GET / HTTP/1.1\r\nHost : localhost\r\n\r\n", false, 0, true);
+    ok &= TestSplitRequest("missing colon",
+        "GET / HTTP/1.1\r\nHost localhost\r\n\r\n", false, 0, true);
+    ok &= TestSplitRequest("duplicate host",
+        "GET / HTTP/1.1\r\nHost: a\r\nhost: b\r\n\r\n", false, 0, true);
+    ok &= TestSplitRequest("bad content length",
+        "POST / HTTP/1.1\r\nHost: a\r\nContent-Length: -1\r\n\r\n", false, 0, true);
+    ok &= TestSplitRequest("control byte",
+        "GET / HTTP/1.1\r\nHost: local\x01host\r\n\r\n", false, 0, true);
+
+    // Pipelining, every complete request is answered in order.
+    ok &= TestSplitRequest("pipelined",
+        "GET /a HTTP/1.1\r\nHost: localhost\r\n\r\n"
+        "POST /b HTTP/1.1\r\nHost: localhost\r\nContent-Length: 11\r\n\r\nhello world"
+        "\r\n"
+        "GET /c HTTP/1.1\r\nHost: localhost\r\n\r\n"
+        "GET /d HTTP/1.1\r\nHost: local", true, 3, true);
+    ok &= TestSplitRequest("pipelined close",
+        "GET /a HTTP/1.1\r\nHost: localhost\r\nConnection: keep-alive, close\r\n\r\n"
+        "GET /b HTTP/1.1\r\nHost: localhost\r\n\r\n", true, 1, true);
+    ok &= TestSplitRequest("1.0 keep-alive",
+        "GET /a HTTP/1.0\r\nConnection: Keep-Alive\r\n\r\n"
+        "GET /b HTTP/1.0\r\n\r\n"
+        "GET /c HTTP/1.0\r\n\r\n", true, 2, true);
+
+    // More pipelined requests than the send queue holds, the rest are parsed after the flush.
+    char *many = malloc(SEND_MAX_RESPONSES * 2 * 64);
+    many[0] = 0;
+    for (uint32_t i = 0; i < SEND_MAX_RESPONSES * 2; i++) strcat(many, "GET / HTTP/1.1\r\nHost: localhost\r\n\r\n");
+
+    ok &= TestSplitRequest("pipelined past the queue", many, true, SEND_MAX_RESPONSES - 1, false);
+    free(many);
+
+    // Cookie line outgrows a regular segment, so it's moved while partially scanned.
+    size_t cookieLen = 3 * RECV_SEGMENT_CAPACITY;
+    char *large = malloc(cookieLen + 128);
+    int prefix = sprintf(large, "GET /large HTTP/1.1\r\nHost: localhost\r\nCookie: ");
+    memset(large + prefix, 'a', cookieLen);
+    strcpy(large + prefix + cookieLen, "\r\nAccept: */*\r\n");
+
+    ok &= TestSplitRequest("large cookie", large, true, 0, false);
+    free(large);
+
+    return ok;
+}
+
+// Writes the queued vectors in uneven pieces, as partial sends would, the bytes must come out unchanged.
+bool TestPartialSend() {
+    struct send_queue *queue = NULL;
+    static const char body[] = "{\"ok\":true}";
+
+    if (
+        !QueueResponse(&queue, 200, "Content-Type: application/json\r\n", body, sizeof(body) - 1, true, false) ||
+        !QueueResponse(&queue, 404, NULL, NULL, 0, true, true) ||
+        !QueueResponse(&queue, 200, NULL, NULL, sizeof(body) - 1, false, false)
+    ) {
+        printf("FAIL partial send: queue\n");
+        return false;
+    }
+
+    char expected[1024], written[1024];
+    uint32_t expectedLen = 0, writtenLen = 0;
+
+    struct send_vec *vecs;
+    uint32_t count;
+
+    if (!SendQueuePending(queue, &vecs, &count)) {
+        printf("FAIL partial send: nothing pending\n");
+        return false;
+    }
+
+    for (uint32_t i = 0; i < count; i++) {
+        memcpy(expected + expectedLen, vecs[i].buf, vecs[i].len);
+        expectedLen += vecs[i].len;
+    }
+
+    uint32_t piece = 1;
+
+    while (SendQueuePending(queue, &vecs, &count)) {
+        // A send never writes past what it was given.
+        uint32_t n = 0;
+
+        for (uint32_t i = 0; i < count && n < piece; i++) {
+            uint32_t take = vecs[i].len < piece - n ? vecs[i].len : piece - n;
+            memcpy(written + writtenLen + n, vecs[i].buf, take);
+            n += take;
+        }
+
+        writtenLen += n;
+        SendQueueCommit(&queue, n);
+        piece = piece * 3 % 37 + 1;
+    }
+
+    if (queue != NULL || writtenLen != expectedLen || memcmp(written, expected, expectedLen) != 0) {
+        printf("FAIL partial send: bytes differ\n");
+        return false;
+    }
+
+    printf("PASS partial send\n");
+    return true;
+}
+
+// 204, 304 and 1xx responses go out without Content-Length or body, whatever they were given.
+bool TestBodylessStatus() {
+    struct send_queue *queue = NULL;
+
+    if (!QueueResponse(&queue, 204, NULL, "gone", 4, true, false) || !QueueResponse(&queue, 304, "ETag: \"1\"\r\n", NULL, 512, true, false)) {
+        printf("FAIL bodyless status: queue\n");
+        return false;
+    }
+
+    char written[1024];
+    uint32_t writtenLen = 0;
+
+    struct send_vec *vecs;
+    uint32_t count;
+
+    while (SendQueuePending(queue, &vecs, &count)) {
+        uint32_t n = 0;
+
+        for (uint32_t i = 0; i < count; i++) {
+            memcpy(written + writtenLen + n, vecs[i].buf, vecs[i].len);
+            n += vecs[i].len;
+        }
+
+        writtenLen += n;
+        SendQueueCommit(&queue, n);
+    }
+
+    written[writtenLen] = '\0';
+
+    ResponseCachePut(HTTP_METHOD_GET, "/unchanged", 304, "ETag: \"1\"\r\n", "stale", 5, 0);
+    struct parseResult cached = ParseSplit("GET /unchanged HTTP/1.1\r\n\r\n", NULL, 0);
+    ResponseCacheInvalidate(HTTP_METHOD_GET, "/unchanged");
+
+    if (
+        strstr(written, "Content-Length") != NULL || strstr(written, "gone") != NULL ||
+        strstr(written, "HTTP/1.1 304 Not Modified\r\n") == NULL || written[writtenLen - 1] != '\n' || written[writtenLen - 3] != '\n'
+    ) {
+        printf("FAIL bodyless status: queued\n%s\n", written);
+        return false;
+    }
+
+    if (!cached.ok || strstr(cached.responses, "304 Not Modified") == NULL || strstr(cached.responses, "Content-Length") != NULL || strstr(cached.responses, "stale") != NULL) {
+        printf("FAIL bodyless status: cached\n%s\n", cached.responses);
+        return false;
+    }
+
+    printf("PASS bodyless status\n");
+    return true;
+}
+
+// Request paths must never resolve outside the static root.
+bool TestStaticPaths() {
+    struct { const char *path; const char *resolved; } cases[] = {
+        { "/", "/index.html" },
+        { "/docs/", "/docs/index.html" },
+        { "/app.js?v=3", "/app.js" },
+        { "/a/b.c.json", "/a/b.c.json" },
+        { "/../etc/passwd", NULL },
+        { "/a/../../b", NULL },
+        { "/a/./b", NULL },
+        { "/.env", NULL },
+        { "/a%2e%2e/b", NULL },
+        { "/a\\b", NULL },
+        { "/C:/b", NULL },
+        { "a/b", NULL },
+        { "?x", NULL },
+    };
+
+    for (uint32_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+        char out[FILE_PATH_MAX];
+        uint32_t outLen;
+
+        bool ok = ResolveStaticPath((const uint8_t *)cases[i].path, strlen(cases[i].path), out, &outLen);
+
+        if (ok != (cases[i].resolved != NULL) || (ok && strcmp(out, cases[i].resolved) != 0)) {
+            printf("FAIL static path %s\n", cases[i].path);
+            return false;
+        }
+    }
+
+    printf("PASS static paths\n");
+    return true;
+}
+
+// Hits are sent exactly as stored, replaced and invalidated entries stay alive while referenced.
+bool TestResponseCache() {
+    static const char request[] = "GET /cached HTTP/1.1\r\nHost: a\r\n\r\n";
+    static const char expected[] =
+        "HTTP/1.1 200 OK\r\nServer: AsyncHTTP\r\nContent-Type: text/plain\r\nContent-Length: 3\r\n"
+        "Date: *****************************\r\n\r\nhit";
+
+    ResponseCachePut(HTTP_METHOD_GET, "/cached", 200, "Content-Type: text/plain\r\n", "hit", 3, 0);
+
+    struct parseResult hit = ParseSplit(request, NULL, 0);
+    struct parseResult head = ParseSplit("HEAD /cached HTTP/1.0\r\n\r\n", NULL, 0);
+
+    if (!hit.ok || strcmp(hit.responses, expected) != 0) {
+        printf("FAIL response cache: hit\n%s\n", hit.responses);
+        return false;
+    }
+
+    if (!head.ok || strstr(head.responses, "Content-Length: 3\r\n") == NULL || strstr(head.responses, "hit") != NULL) {
+        printf("FAIL response cache: head\n%s\n", head.responses);
+        return false;
+    }
+
+    struct cached_response *held = ResponseCacheLookup(HTTP_METHOD_GET, (const uint8_t *)"/cached", 7);
+    ResponseCachePut(HTTP_METHOD_GET, "/cached", 200, NULL, "new", 3, 0);
+
+    // Both readers (this thread, holding a reference) are done with the old entry now.
+    QSBRQuiescent();
+    ResponseCacheReclaim();
+
+    struct parseResult replaced = ParseSplit(request, NULL, 0);
+
+    if (
+        held == NULL || memcmp(CachedResponseBody(held), "hit", 3) != 0 ||
+        atomic_load(&responseCache.retiredCount) != 0 || strstr(replaced.responses, "new") == NULL
+    ) {
+        printf("FAIL response cache: replace\n");
+        return false;
+    }
+
+    ReleaseCachedResponse(held);
+
+    struct cached_response *entry = ResponseCacheLookup(HTTP_METHOD_GET, (const uint8_t *)"/cached", 7);
+    entry->expiresAt = time(NULL) - 1;
+    ReleaseCachedResponse(entry);
+
+    bool expired = ResponseCacheLookup(HTTP_METHOD_GET, (const uint8_t *)"/cached", 7) == NULL;
+    bool invalidated = ResponseCacheInvalidate(HTTP_METHOD_GET, "/cached") && !ResponseCacheInvalidate(HTTP_METHOD_GET, "/cached");
+
+    QSBRQuiescent();
+    ResponseCacheReclaim();
+
+    struct parseResult miss = ParseSplit(request, NULL, 0);
+
+    if (!expired || !invalidated || strstr(miss.responses, "404 Not Found") == NULL) {
+        printf("FAIL response cache: expiry and invalidation\n");
+        return false;
+    }
+
+    printf("PASS response cache\n");
+    return true;
+}
+
+// Request Bodies
+
+struct uploadState {
+    struct body_async_state body;
+    uint64_t received;
+    char start[16];
+};
+
+void *uploadConstructor(struct uploadState *state, void *param) {
+    return state;
+}
+
+void uploadDestructor(void *state) {}
+
+// Answers 200 if the body starts with "hello world", 400 otherwise.
+struct subroutine_result runUpload(struct uploadState *state) {
+    uint32_t len = GetStringLen(&state->body.data);
+
+    for (uint32_t i = 0; i < len && state->received + i < sizeof(state->start); i++) {
+        state->start[state->received + i] = GetStringBuf(&state->body.data)[i];
+    }
+
+    state->received += len;
+    if (!state->body.ended) return subroutine_pause;
+
+    bool hello = state->received >= 11 && memcmp(state->start, "hello world", 11) == 0;
+    Respond(state->body.conn, hello ? 200 : 400, NULL, NULL, 0);
+
+    return subroutine_finish;
+}
+
+const struct async_descriptor uploadAsync = {
+    .constructor = (async_constructor)uploadConstructor,
+    .destructor = uploadDestructor,
+    .subroutine = (async_subroutine)runUpload,
+    .stateSize = sizeof(struct uploadState),
+};
+
+struct uploadRouteState {
+    struct handler_async_state handler;
+    uint64_t limit;
+};
+
+void *uploadRouteConstructor(struct uploadRouteState *state, uint64_t *limit) {
+    state->limit = *limit;
+    return state;
+}
+
+// POST /upload takes bodies up to 64 bytes, /big up to 1GB.
+struct subroutine_result runUploadRoute(struct uploadRouteState *state) {
+    ReceiveBody(state->handler.conn, uploadAsync, NULL, state->limit);
+    return subroutine_finish;
+}
+
+const struct async_descriptor uploadRouteAsync = {
+    .constructor = (async_constructor)uploadRouteConstructor,
+    .destructor = uploadDestructor,
+    .subroutine = (async_subroutine)runUploadRoute,
+    .stateSize = sizeof(struct uploadRouteState),
+};
+
+// Feeds a body much larger than a segment in pieces, only the head and a couple of segments may be held at once.
+bool TestLargeUpload() {
+    struct tcpConnCommon conn;
+    memset(&conn, 0, sizeof(conn));
+    SetupCommonConn(&conn, MAX_HEADER_SIZE);
+
+    uint64_t bodyLen = 64ull * 1024 * 1024;
+    char head[128];
+    uint32_t headLen = sprintf(head, "POST /big HTTP/1.1\r\nContent-Length: %llu\r\n\r\nhello world", (unsigned long long)bodyLen);
+
+    static uint8_t piece[64 * 1024];
+    memset(piece, 'x', sizeof(piece));
+
+    uint64_t total = headLen - 11 + bodyLen;
+    uint64_t sent = 0;
+    uint32_t maxSegments = 0;
+    bool ok = true;
+
+    while (sent < total && ok) {
+        uint8_t *buf;
+        uint32_t bufLen;
+
+        if (!PrepareRecv(&conn, &buf, &bufLen)) {
+            ok = false;
+            break;
+        }
+
+        uint32_t n = total - sent < bufLen ? (uint32_t)(total - sent) : bufLen;
+
+        for (uint32_t i = 0; i < n; i++) {
+            uint64_t at = sent + i;
+            buf[i] = at < headLen ? head[at] : piece[at % sizeof(piece)];
+        }
+
+        CommitRecv(&conn, n);
+        sent += n;
+
+        ok = ProcessLines(&conn);
+        while (ok && RunPendingMachine(&conn)) ok = ProcessLines(&conn);
+
+        uint32_t segments = 0;
+        for (struct recv_segment *segment = conn.recv.head; segment != NULL; segment = segment->next) segments++;
+        for (struct recv_segment *segment = conn.recv.retained; segment != NULL; segment = segment->next) segments++;
+
+        if (segments > maxSegments) maxSegments = segments;
+    }
+
+    struct send_vec *vecs;
+    uint32_t count;
+
+    ok = ok && maxSegments <= 3 && conn.state == RECV_REQUEST_LINE &&
+        PrepareSend(&conn, &vecs, &count) && memcmp(vecs[0].buf, "HTTP/1.1 200", 12) == 0;
+
+    CleanupCommonConn(&conn);
+
+    if (!ok) {
+        printf("FAIL large upload: %u segments held\n", maxSegments);
+        return false;
+    }
+
+    printf("PASS large upload\n");
+    return true;
+}
+
+bool TestRequestBodies() {
+    bool ok = true;
+
+    ok &= TestSplitRequest("content length body",
+        "POST /upload HTTP/1.1\r\nContent-Length: 11\r\n\r\nhello world"
+        "GET / HTTP/1.1\r\n\r\n", true, 2, true);
+    ok &= TestSplitRequest("empty body",
+        "POST /upload HTTP/1.1\r\nContent-Length: 0\r\n\r\n", true, 1, true);
+    ok &= TestSplitRequest("chunked body",
+        "POST /upload HTTP/1.1\r\nTransfer-Encoding: chunked\r\n\r\n"
+        "5;name=value\r\nhello\r\n6\r\n world\r\n0\r\nX-Trailer: a\r\n\r\n"
+        "GET / HTTP/1.1\r\n\r\n", true, 2, true);
+    ok &= TestSplitRequest("chunked body dropped",
+        "POST /other HTTP/1.1\r\nTransfer-Encoding: chunked\r\n\r\nA\nhelloworld\n0\n\n"
+        "GET / HTTP/1.1\r\n\r\n", true, 2, true);
+    ok &= TestSplitRequest("expect continue",
+        "POST /upload HTTP/1.1\r\nExpect: 100-continue\r\nContent-Length: 11\r\n\r\nhello world", true, 2, true);
+    ok &= TestSplitRequest("expect continue refused",
+        "POST /upload HTTP/1.1\r\nExpect: 100-continue\r\nContent-Length: 65\r\n\r\n"
+        "GET / HTTP/1.1\r\n\r\n", true, 1, true);
+    ok &= TestSplitRequest("chunked body too large",
+        "POST /upload HTTP/1.1\r\nTransfer-Encoding: chunked\r\n\r\n"
+        "30\r\n000000000000000000000000000000000000000000000000\r\n"
+        "30\r\n000000000000000000000000000000000000000000000000\r\n0\r\n\r\n", true, 1, true);
+    ok &= TestSplitRequest("bad chunk size",
+        "POST /upload HTTP/1.1\r\nTransfer-Encoding: chunked\r\n\r\nzz\r\n", false, 0, true);
+    ok &= TestSplitRequest("chunk extensions",
+        "POST /upload HTTP/1.1\r\nTransfer-Encoding: chunked\r\n\r\n"
+        "5 ; a = \"x\\\"y;z\" ;b\t\r\nhello\r\n6;c=d\n world\r\n0\r\n\r\n"
+        "GET / HTTP/1.1\r\n\r\n", true, 2, true);
+    ok &= TestSplitRequest("bare CR after chunk size",
+        "POST /upload HTTP/1.1\r\nTransfer-Encoding: chunked\r\n\r\n5\rhello\r\n0\r\n\r\n", false, 0, true);
+    ok &= TestSplitRequest("bad chunk extension",
+        "POST /upload HTTP/1.1\r\nTransfer-Encoding: chunked\r\n\r\n5;a b\r\nhello\r\n0\r\n\r\n", false, 0, true);
+    ok &= TestSplitRequest("unterminated chunk extension",
+        "POST /upload HTTP/1.1\r\nTransfer-Encoding: chunked\r\n\r\n5;a=\"b\r\nhello\r\n0\r\n\r\n", false, 0, true);
+    ok &= TestSplitRequest("bare CR in trailer",
+        "POST /upload HTTP/1.1\r\nTransfer-Encoding: chunked\r\n\r\n0\r\nX: a\rb\r\n\r\n", false, 0, true);
+    ok &= TestSplitRequest("missing chunk end",
+        "POST /upload HTTP/1.1\r\nTransfer-Encoding: chunked\r\n\r\n1\r\nab\r\n", false, 0, true);
+    ok &= TestSplitRequest("length and chunked",
+        "POST /upload HTTP/1.1\r\nContent-Length: 3\r\nTransfer-Encoding: chunked\r\n\r\n0\r\n\r\n", false, 0, true);
+    ok &= TestSplitRequest("other coding",
+        "POST /upload HTTP/1.1\r\nTransfer-Encoding: gzip, chunked\r\n\r\n0\r\n\r\n", false, 0, true);
+
+    struct parseResult refused = ParseSplit(
+        "POST /upload HTTP/1.1\r\nExpect: 100-continue\r\nContent-Length: 65\r\n\r\n", NULL, 0);
+    struct parseResult accepted = ParseSplit(
+        "POST /upload HTTP/1.1\r\nExpect: 100-continue\r\nContent-Length: 11\r\n\r\nhello world", NULL, 0);
+
+    if (
+        strstr(refused.responses, "413") == NULL || strstr(refused.responses, "100 Continue") != NULL ||
+        strncmp(accepted.responses, CONTINUE_RESPONSE, sizeof(CONTINUE_RESPONSE) - 1) != 0 ||
+        strstr(accepted.responses, "HTTP/1.1 200 OK") == NULL
+    ) {
+        printf("FAIL expect continue responses\n%s\n%s\n", refused.responses, accepted.responses);
+        ok = false;
+    }
+
+    ok &= TestLargeUpload();
+
+    return ok;
+}
+
+// Routing
+
+struct echoRouteState {
+    struct handler_async_state handler;
+    const char *label;
+};
+
+void *echoRouteConstructor(struct echoRouteState *state, const char *label) {
+    state->label = label;
+    return state;
+}
+
+// Bodies are sent after the handler is gone, a few requests per parse is all the tests make.
+char echoBodies[8][128];
+uint32_t echoNext = 0;
+
+// Answers with the route label and the parameters captured, as "label name=value...".
+struct subroutine_result runEchoRoute(struct echoRouteState *state) {
+    struct HTTPRequest *req = state->handler.req;
+    char *body = echoBodies[echoNext++ % 8];
+    uint32_t len = snprintf(body, 128, "%s", state->label);
+
+    for (uint32_t i = 0; i < req->paramCount; i++) {
+        len += snprintf(body + len, 128 - len, " %s=%.*s", req->paramNames[i], GetStringLen(&req->params[i]), GetStringBuf(&req->params[i]));
+    }
+
+    Respond(state->handler.conn, 200, NULL, body, len);
+    return subroutine_finish;
+}
+
+const struct async_descriptor echoRouteAsync = {
+    .constructor = (async_constructor)echoRouteConstructor,
+    .destructor = uploadDestructor,
+    .subroutine = (async_subroutine)runEchoRoute,
+    .stateSize = sizeof(struct echoRouteState),
+};
+
+uint64_t uploadLimit = 64;
+uint64_t bigUploadLimit = 1ull << 30;
+
+// See TestHandlerTimeout, TestConsumerIO and TestStaticFiles.
+extern const struct async_descriptor stalledRouteAsync;
+extern const struct async_descriptor slowUploadRouteAsync;
+extern const struct async_descriptor staticRouteAsync;
+
+void AddTestRoutes() {
+    AddRoute(HTTP_METHOD_POST, "/upload", uploadRouteAsync, &uploadLimit);
+    AddRoute(HTTP_METHOD_POST, "/big", uploadRouteAsync, &bigUploadLimit);
+
+    AddRoute(HTTP_METHOD_GET, "/users/:id", echoRouteAsync, "user");
+    AddRoute(HTTP_METHOD_DELETE, "/users/:id", echoRouteAsync, "delete");
+    AddRoute(HTTP_METHOD_GET, "/users/me", echoRouteAsync, "me");
+    AddRoute(HTTP_METHOD_GET, "/users/me/settings", echoRouteAsync, "settings");
+    AddRoute(HTTP_METHOD_GET, "/users/:id/posts/:post", echoRouteAsync, "post");
+    AddRoute(HTTP_METHOD_GET, "/files/*path", echoRouteAsync, "file");
+    AddRoute(HTTP_METHOD_GET, "/filesystem", echoRouteAsync, "filesystem");
+    AddRoute(HTTP_METHOD_GET, "/stalled", stalledRouteAsync, NULL);
+    AddRoute(HTTP_METHOD_POST, "/slow", slowUploadRouteAsync, NULL);
+    AddRoute(HTTP_METHOD_GET, "/static/*path", staticRouteAsync, NULL);
+
+    BuildRouter();
+}
+
+bool TestRoute(const char *request, const char *expect, const char *absent) {
+    struct parseResult result = ParseSplit(request, NULL, 0);
+
+    if (!result.ok || strstr(result.responses, expect) == NULL || (absent != NULL && strstr(result.responses, absent) != NULL)) {
+        printf("FAIL route %s\n%s\n", request, result.responses);
+        return false;
+    }
+
+    return true;
+}
+
+bool TestRouter() {
+    bool ok = true;
+
+    ok &= TestRoute("GET /users/42 HTTP/1.1\r\n\r\n", "\r\n\r\nuser id=42", NULL);
+    ok &= TestRoute("GET /users/me HTTP/1.1\r\n\r\n", "\r\n\r\nme", "id=");
+    ok &= TestRoute("GET /users/42/posts/7?sort=new HTTP/1.1\r\n\r\n", "\r\n\r\npost id=42 post=7", NULL);
+    // Static "me" matches, then has nothing for the rest, so the parameter is tried.
+    ok &= TestRoute("GET /users/me/posts/7 HTTP/1.1\r\n\r\n", "\r\n\r\npost id=me post=7", NULL);
+    ok &= TestRoute("GET /files/a/b/c.txt HTTP/1.1\r\n\r\n", "\r\n\r\nfile path=a/b/c.txt", NULL);
+    ok &= TestRoute("GET /files/ HTTP/1.1\r\n\r\n", "Content-Length: 10\r\n", NULL);
+    ok &= TestRoute("GET /filesystem HTTP/1.1\r\n\r\n", "\r\n\r\nfilesystem", NULL);
+    ok &= TestRoute("HEAD /users/42 HTTP/1.1\r\n\r\n", "HTTP/1.1 200 OK", "user");
+    ok &= TestRoute("DELETE /users/42 HTTP/1.1\r\n\r\n", "\r\n\r\ndelete id=42", NULL);
+    ok &= TestRoute("PUT /users/42 HTTP/1.1\r\n\r\n", "Allow: GET, HEAD, DELETE\r\n", NULL);
+    ok &= TestRoute("PUT /users/42 HTTP/1.1\r\n\r\n", "HTTP/1.1 405", NULL);
+    ok &= TestRoute("POST /users/me/settings HTTP/1.1\r\n\r\n", "Allow: GET, HEAD\r\n", NULL);
+    ok &= TestRoute("GET /users/42/comments HTTP/1.1\r\n\r\n", "HTTP/1.1 404", NULL);
+    ok &= TestRoute("GET /users/ HTTP/1.1\r\n\r\n", "HTTP/1.1 404", NULL);
+
+    // Parsing stops at each routed request until its handler ran.
+    ok &= TestSplitRequest("routed pipeline",
+        "GET /users/1 HTTP/1.1\r\n\r\nGET /users/2/posts/3 HTTP/1.1\r\n\r\nGET /files/x HTTP/1.1\r\n\r\n", true, 3, true);
+
+    struct parseResult pipelined = ParseSplit("GET /users/1 HTTP/1.1\r\n\r\nGET /users/2 HTTP/1.1\r\n\r\n", NULL, 0);
+    char *first = strstr(pipelined.responses, "user id=1");
+    char *second = strstr(pipelined.responses, "user id=2");
+
+    if (first == NULL || second == NULL || second < first) {
+        printf("FAIL routed pipeline order\n%s\n", pipelined.responses);
+        ok = false;
+    }
+
+    if (ok) printf("PASS router\n");
+    return ok;
+}
+
+// Admission Control
+
+bool TestAdmission() {
+    bool ok = true;
+    uint32_t inFlightLimit = maxInFlightPerWorker;
+
+    threadAdmission = CreateWorkerAdmission();
+    maxInFlightPerWorker = 1;
+
+    // Routed requests are shed once the worker is at its limit, the rest are still answered.
+    struct worker_admission *held = EnterRequest();
+
+    ok &= TestRoute("GET /users/42 HTTP/1.1\r\n\r\n", "HTTP/1.1 503", "user");
+    ok &= TestRoute("GET /users/42 HTTP/1.1\r\n\r\n", "Retry-After: 1\r\n", NULL);
+    ok &= TestRoute("GET /users/42 HTTP/1.1\r\n\r\n", "Connection: close\r\n", NULL);
+    ok &= TestRoute("GET /users/ HTTP/1.1\r\n\r\n", "HTTP/1.1 404", NULL);
+
+    ReleaseRequest(held);
+    ok &= TestRoute("GET /users/42 HTTP/1.1\r\n\r\n", "\r\n\r\nuser id=42", "503");
+
+    // A delay above the target sheds once it lasted the interval, a single slow batch doesn't.
+    struct worker_admission *admission = threadAdmission;
+
+    RecordLoopDelay(admission, ADMISSION_TARGET_MS * 10, 1000, 0);
+    RecordLoopDelay(admission, 0, 1001, 0);
+    RecordLoopDelay(admission, ADMISSION_TARGET_MS * 10, 1000 + ADMISSION_INTERVAL_MS, 0);
+    bool burstShed = WorkerOverloaded(admission);
+
+    RecordLoopDelay(admission, 0, 2000, 0);
+    RecordLoopDelay(admission, ADMISSION_TARGET_MS, 2001, 0);
+    RecordLoopDelay(admission, ADMISSION_TARGET_MS, 2001 + ADMISSION_INTERVAL_MS / 2, 0);
+    burstShed |= WorkerOverloaded(admission);
+
+    RecordLoopDelay(admission, ADMISSION_TARGET_MS, 2001 + ADMISSION_INTERVAL_MS, 0);
+    bool standingShed = WorkerOverloaded(admission) && !AdmitRequest() && !AdmitConnection();
+
+    RecordLoopDelay(admission, ADMISSION_TARGET_MS - 1, 2002 + ADMISSION_INTERVAL_MS, 0);
+    bool recovered = !WorkerOverloaded(admission) && AdmitRequest();
+
+    // Off by default on Windows.
+    uint32_t queuedLimit = maxQueuedCompletions;
+    maxQueuedCompletions = 16;
+
+    RecordLoopDelay(admission, 0, 3000, maxQueuedCompletions);
+    bool backlogShed = WorkerOverloaded(admission);
+
+    maxQueuedCompletions = queuedLimit;
+
+    // Long batches with nothing queued behind them are no queue, completions left behind every batch are.
+    RecordBatch(admission, 4000, false, 0);
+
+    for (uint64_t now = 4000; now <= 4000 + 2 * ADMISSION_INTERVAL_MS; now += ADMISSION_TARGET_MS * 10) RecordBatch(admission, now, false, 0);
+    bool drainedShed = WorkerOverloaded(admission);
+
+    for (uint64_t now = 5000; now <= 5000 + 2 * ADMISSION_INTERVAL_MS; now += ADMISSION_TARGET_MS * 10) RecordBatch(admission, now, true, 0);
+    bool queuedShed = WorkerOverloaded(admission);
+
+    RecordBatch(admission, 6000, false, 0);
+    RecordBatch(admission, 6000 + ADMISSION_TARGET_MS * 10, false, 0);
+    bool queueRecovered = !WorkerOverloaded(admission);
+
+    if (burstShed || !standingShed || !recovered || !backlogShed || drainedShed || !queuedShed || !queueRecovered) {
+        printf("FAIL admission: burst %u standing %u recovered %u backlog %u drained %u queued %u recovered %u\n", burstShed, standingShed, recovered, backlogShed, drainedShed, queuedShed, queueRecovered);
+        ok = false;
+    }
+
+    free(admission);
+    threadAdmission = NULL;
+    maxInFlightPerWorker = inFlightLimit;
+
+    // Connections count against the limit until they're closed.
+    uint32_t connectionLimit = maxConnections;
+    maxConnections = 2;
+
+    bool admitted = AdmitConnection() && AdmitConnection() && !AdmitConnection();
+    LeaveConnection();
+    admitted &= AdmitConnection();
+
+    LeaveConnection();
+    LeaveConnection();
+    maxConnections = connectionLimit;
+
+    if (!admitted || openConnections != 0) {
+        printf("FAIL admission: connection limit\n");
+        ok = false;
+    }
+
+    if (ok) printf("PASS admission\n");
+    return ok;
+}
+
+// Handler Deadlines
+
+// Set to abandon the stalled handler from within its run, as if its deadline passed on another worker meanwhile.
+bool stalledAbortWhileRunning = false;
+bool stalledAbortResumes = false;
+uint32_t stalledRuns = 0;
+uint32_t stalledDestroyed = 0;
+// Retained, so it can be checked after the connection let go of it.
+struct async_state *stalledMachine = NULL;
+
+// Handlers without parameters.
+void *plainRouteConstructor(struct handler_async_state *state, void *param) {
+    return state;
+}
+
+void stalledRouteDestructor(void *state) {
+    stalledDestroyed++;
+}
+
+// Waits for I/O that never completes, so it never answers.
+struct subroutine_result runStalledRoute(struct handler_async_state *state) {
+    stalledRuns++;
+    stalledMachine = currentAsync;
+    RetainAsync(stalledMachine);
+
+    if (stalledAbortWhileRunning) stalledAbortResumes = AbortAsync(currentAsync);
+
+    PrepareIO();
+    return subroutine_yield_io;
+}
+
+const struct async_descriptor stalledRouteAsync = {
+    .constructor = (async_constructor)plainRouteConstructor,
+    .destructor = stalledRouteDestructor,
+    .subroutine = (async_subroutine)runStalledRoute,
+    .stateSize = sizeof(struct handler_async_state),
+};
+
+struct platformState {
+    struct tcpConnCommon *conn;
+    bool awaitsHandler;
+    bool awaitsConsumer;
+    bool *finished;
+};
+
+void *platformConstructor(struct platformState *state, struct platformState *param) {
+    *state = *param;
+    return state;
+}
+
+// Parses and awaits handlers and body consumers as the platform does, finishes once it would have to read.
+struct subroutine_result runPlatform(struct platformState *state) {
+    if (state->awaitsHandler) HandlerFinished(state->conn);
+    if (state->awaitsConsumer) BodyConsumed(state->conn);
+
+    struct async_state *handler = NULL;
+    struct async_state *consumer = NULL;
+
+    if (ProcessLines(state->conn)) {
+        handler = TakeHandler(state->conn);
+        if (handler == NULL) consumer = TakeBodyConsumer(state->conn);
+    }
+
+    state->awaitsHandler = handler != NULL;
+    state->awaitsConsumer = consumer != NULL;
+
+    if (handler != NULL) return subroutine_await(handler);
+    if (consumer != NULL) return subroutine_await(consumer);
+
+    *state->finished = true;
+    return subroutine_finish;
+}
+
+const struct async_descriptor platformAsync = {
+    .constructor = (async_constructor)platformConstructor,
+    .destructor = otherDestructor,
+    .subroutine = (async_subroutine)runPlatform,
+    .stateSize = sizeof(struct platformState),
+};
+
+// Receives data and runs the platform machine on it, finished is set once it wants to read again.
+bool RunPlatform(struct tcpConnCommon *conn, const char *data, bool *finished) {
+    uint8_t *buf;
+    uint32_t len;
+
+    if (!PrepareRecv(conn, &buf, &len)) return false;
+
+    memcpy(buf, data, strlen(data));
+    CommitRecv(conn, strlen(data));
+
+    *finished = false;
+
+    struct platformState params = { .conn = conn, .awaitsHandler = false, .awaitsConsumer = false, .finished = finished };
+    struct async_state *platform = AwaitAsync(platformAsync, &params);
+
+    // Caller is responsible for setting RUNNING flag.
+    atomic_fetch_or(&platform->flags, MACHINE_RUNNING);
+    RunAsync(platform);
+
+    return true;
+}
+
+// Appends the queued responses to dest and sends them.
+void DrainResponses(struct tcpConnCommon *conn, char *dest, size_t size) {
+    size_t used = strlen(dest);
+    struct send_vec *vecs;
+    uint32_t count;
+
+    while (PrepareSend(conn, &vecs, &count)) {
+        uint32_t n = 0;
+
+        for (uint32_t i = 0; i < count; i++) {
+            if (used < size) used += snprintf(dest + used, size - used, "%.*s", (int)vecs[i].len, vecs[i].buf);
+            n += vecs[i].len;
+        }
+
+        CommitSend(conn, n);
+    }
+}
+
+// A handler that never answers is abandoned at its deadline, whether it's suspended or running then. The connection
+// answers 503 and closes, and the handler is destroyed when its I/O completes instead of running again.
+bool TestHandlerTimeout(bool whileRunning) {
+    const char *name = whileRunning ? "handler timeout while running" : "handler timeout";
+
+    struct tcpConnCommon conn;
+    memset(&conn, 0, sizeof(conn));
+    SetupCommonConn(&conn, MAX_HEADER_SIZE);
+
+    stalledAbortWhileRunning = whileRunning;
+    stalledAbortResumes = false;
+    stalledRuns = 0;
+    stalledDestroyed = 0;
+    stalledMachine = NULL;
+
+    bool finished;
+    if (!RunPlatform(&conn, "GET /stalled HTTP/1.1\r\n\r\nGET /users/42 HTTP/1.1\r\n\r\n", &finished)) return false;
+
+    struct async_state *handler = stalledMachine;
+    bool ok = handler != NULL && !stalledAbortResumes;
+
+    if (handler != NULL) {
+        // The timer of the worker can't run the connection, it's resumed once the worker is back in its loop.
+        if (!whileRunning) {
+            ok &= !finished && AbortAsync(handler);
+            DeferResumeFromAwait(handler->awaiting);
+            RunDeferredResumes();
+        }
+
+        ResumeFromIO(handler);
+        ok &= handler->state == NULL && !AbortAsync(handler);
+        ReleaseAsync(handler);
+    }
+
+    char responses[1024] = { 0 };
+    DrainResponses(&conn, responses, sizeof(responses));
+
+    ok &= finished && conn.handler == NULL && stalledRuns == 1 && stalledDestroyed == 1 &&
+        strncmp(responses, "HTTP/1.1 503", 12) == 0 && strstr(responses, "Connection: close\r\n") != NULL &&
+        strstr(responses, "user id=42") == NULL;
+
+    CleanupCommonConn(&conn);
+
+    if (!ok) {
+        printf("FAIL %s: runs %u destroyed %u finished %u\n%s\n", name, stalledRuns, stalledDestroyed, finished, responses);
+        return false;
+    }
+
+    printf("PASS %s\n", name);
+    return true;
+}
+
+// The consumer currently waiting for I/O.
+struct async_state *slowUploadMachine = NULL;
+
+struct slowUploadState {
+    struct uploadState upload;
+    bool waited;
+};
+
+// Waits for I/O before taking each part.
+struct subroutine_result runSlowUpload(struct slowUploadState *state) {
+    if (!state->waited) {
+        state->waited = true;
+        slowUploadMachine = currentAsync;
+
+        PrepareIO();
+        return subroutine_yield_io;
+    }
+
+    state->waited = false;
+    slowUploadMachine = NULL;
+
+    return runUpload(&state->upload);
+}
+
+const struct async_descriptor slowUploadAsync = {
+    .constructor = (async_constructor)uploadConstructor,
+    .destructor = uploadDestructor,
+    .subroutine = (async_subroutine)runSlowUpload,
+    .stateSize = sizeof(struct slowUploadState),
+};
+
+// POST /slow takes bodies up to 64 bytes.
+struct subroutine_result runSlowUploadRoute(struct handler_async_state *state) {
+    ReceiveBody(state->conn, slowUploadAsync, NULL, uploadLimit);
+    return subroutine_finish;
+}
+
+const struct async_descriptor slowUploadRouteAsync = {
+    .constructor = (async_constructor)plainRouteConstructor,
+    .destructor = uploadDestructor,
+    .subroutine = (async_subroutine)runSlowUploadRoute,
+    .stateSize = sizeof(struct handler_async_state),
+};
+
+// A consumer may do I/O while it holds a part. The connection waits for it meanwhile, without reading past the part,
+// and reads on once the consumer paused for the next one.
+bool TestConsumerIO() {
+    struct tcpConnCommon conn;
+    memset(&conn, 0, sizeof(conn));
+    SetupCommonConn(&conn, MAX_HEADER_SIZE);
+
+    slowUploadMachine = NULL;
+
+    bool finished;
+    if (!RunPlatform(&conn, "POST /slow HTTP/1.1\r\nContent-Length: 11\r\n\r\nhello", &finished)) return false;
+
+    struct send_vec *vecs;
+    uint32_t count;
+
+    bool ok = !finished && slowUploadMachine != NULL && !PrepareSend(&conn, &vecs, &count) && conn.bodyRemaining == 11;
+
+    if (slowUploadMachine != NULL) ResumeFromIO(slowUploadMachine);
+    ok &= finished && slowUploadMachine == NULL && conn.bodyRemaining == 6;
+
+    if (!RunPlatform(&conn, " worldGET /users/42 HTTP/1.1\r\n\r\n", &finished)) return false;
+    ok &= !finished && slowUploadMachine != NULL;
+
+    if (slowUploadMachine != NULL) ResumeFromIO(slowUploadMachine);
+
+    char responses[1024] = { 0 };
+    DrainResponses(&conn, responses, sizeof(responses));
+
+    ok &= finished && conn.bodyConsumer == NULL && strncmp(responses, "HTTP/1.1 200", 12) == 0 &&
+        strstr(responses, "user id=42") != NULL;
+
+    CleanupCommonConn(&conn);
+
+    if (!ok) {
+        printf("FAIL consumer io: finished %u\n%s\n", finished, responses);
+        return false;
+    }
+
+    printf("PASS consumer io\n");
+    return true;
+}
+
+// Static Files
+
+// GET /static/*path answers with the file at path.
+struct subroutine_result runStaticRoute(struct handler_async_state *state) {
+    RespondFile(state->conn, state->req->params[0]);
+    return subroutine_finish;
+}
+
+const struct async_descriptor staticRouteAsync = {
+    .constructor = (async_constructor)plainRouteConstructor,
+    .destructor = uploadDestructor,
+    .subroutine = (async_subroutine)runStaticRoute,
+    .stateSize = sizeof(struct handler_async_state),
+};
+
+// Files that aren't cached yet are opened by a machine the connection awaits in place of a handler, for routes
+// answering with RespondFile and requests no route matches alike. Pipelined requests are answered in order.
+bool TestStaticFiles() {
+    const char *name = "asynchttp_static.txt";
+    FILE *file = fopen(name, "wb");
+    if (file == NULL) return false;
+
+    fputs("static body", file);
+    fclose(file);
+
+    staticFileRoot = ".";
+
+    struct tcpConnCommon conn;
+    memset(&conn, 0, sizeof(conn));
+    SetupCommonConn(&conn, MAX_HEADER_SIZE);
+
+    bool cachedBefore = LookupFile("./asynchttp_static.txt", 22) != NULL;
+
+    bool finished;
+    bool ok = RunPlatform(&conn,
+        "HEAD /static/asynchttp_static.txt HTTP/1.1\r\n\r\n"
+        "HEAD /asynchttp_static.txt HTTP/1.1\r\n\r\n"
+        "HEAD /missing.txt HTTP/1.1\r\n\r\n"
+        "GET /asynchttp_static.txt HTTP/1.1\r\n\r\n", &finished);
+
+    char responses[2048] = { 0 };
+    DrainResponses(&conn, responses, sizeof(responses));
+
+    const char *routed = strstr(responses, "HTTP/1.1 200");
+    const char *unrouted = routed != NULL ? strstr(routed + 1, "HTTP/1.1 200") : NULL;
+    const char *missing = unrouted != NULL ? strstr(unrouted + 1, "HTTP/1.1 404") : NULL;
+    const char *body = missing != NULL ? strstr(missing + 1, "HTTP/1.1 200") : NULL;
+
+    ok = ok && !cachedBefore && finished && body != NULL && conn.handler == NULL &&
+        strstr(routed, "Content-Type: text/plain; charset=utf-8\r\n") != NULL && strstr(routed, "Content-Length: 11\r\n") != NULL &&
+        conn.file != NULL && conn.fileRemaining == 11;
+
+    CleanupCommonConn(&conn);
+
+    staticFileRoot = "";
+    remove(name);
+
+    if (!ok) {
+        printf("FAIL static files\n%s\n", responses);
+        return false;
+    }
+
+    printf("PASS static files\n");
+    return true;
+}
+
+// Idle Connections
+
+// Feeds data and sends every queued response, as the platform would.
+bool ReceiveAndDrain(struct tcpConnCommon *conn, const char *data) {
+    uint8_t *buf;
+    uint32_t len;
+
+    if (!PrepareRecv(conn, &buf, &len)) return false;
+
+    memcpy(buf, data, strlen(data));
+    CommitRecv(conn, strlen(data));
+
+    bool ok = ProcessLines(conn);
+    while (ok && RunPendingMachine(conn)) ok = ProcessLines(conn);
+
+    struct send_vec *vecs;
+    uint32_t count;
+
+    while (PrepareSend(conn, &vecs, &count)) {
+        uint32_t n = 0;
+        for (uint32_t i = 0; i < count; i++) n += vecs[i].len;
+
+        CommitSend(conn, n);
+    }
+
+    return ok;
+}
+
+// A connection waiting for its next request holds no buffer, one waiting for the rest of a line keeps it.
+bool TestIdleBuffers() {
+    struct tcpConnCommon conn;
+    memset(&conn, 0, sizeof(conn));
+    SetupCommonConn(&conn, MAX_HEADER_SIZE);
+
+    bool ok = ReceiveAndDrain(&conn, "GET /users/1 HTTP/1.1\r\n\r\nGET /users/2 HTTP/1.1\r\n\r\n");
+    bool idleAfterRequests = RecvIdle(&conn) && conn.send == NULL && conn.recv.retained == NULL;
+
+    ok = ok && ReceiveAndDrain(&conn, "GET /users/3 HTTP/1.1\r\nHost: loc");
+    bool heldForLine = !RecvIdle(&conn);
+
+    ok = ok && ReceiveAndDrain(&conn, "alhost\r\n\r\n");
+    bool idleAfterLine = RecvIdle(&conn) && conn.send == NULL;
+
+    // A wakeup with nothing to read gives the buffer back.
+    uint8_t *buf;
+    uint32_t len;
+
+    ok = ok && PrepareRecv(&conn, &buf, &len);
+    ReleaseIdleRecv(&conn);
+
+    bool idleAfterWakeup = RecvIdle(&conn);
+
+    CleanupCommonConn(&conn);
+
+    if (!ok || !idleAfterRequests || !heldForLine || !idleAfterLine || !idleAfterWakeup) {
+        printf("FAIL idle buffers: %d %d %d %d %d\n", ok, idleAfterRequests, heldForLine, idleAfterLine, idleAfterWakeup);
+        return false;
+    }
+
+    printf("PASS idle buffers\n");
+    return true;
+}
+
+// Peer Addresses
+
+bool TestPeerAddress() {
+    struct peer_address v4 = { .version = 4, .port = 6000, .addr = { 192, 168, 0, 10 } };
+    struct peer_address v6 = { .version = 6, .port = 443, .addr = { 0x20, 0x01, 0x0d, 0xb8, [15] = 1 } };
+
+    char v4Text[PEER_ADDRESS_MAX], v6Text[PEER_ADDRESS_MAX], unknownText[PEER_ADDRESS_MAX];
+    FormatPeerAddress(&v4, v4Text);
+    FormatPeerAddress(&v6, v6Text);
+    FormatPeerAddress(&nullPeerAddress, unknownText);
+
+    if (
+        strcmp(v4Text, "192.168.0.10:6000") != 0 ||
+        strcmp(v6Text, "[2001:db8:0:0:0:0:0:1]:443") != 0 ||
+        strcmp(unknownText, "unknown") != 0
+    ) {
+        printf("FAIL peer address: %s %s %s\n", v4Text, v6Text, unknownText);
+        return false;
+    }
+
+    printf("PASS peer address\n");
+    return true;
+}
+
+// Streamed Bodies
+
+struct reportState {
+    struct stream_async_state stream;
+    uint32_t row;
+    uint32_t rows;
+    // Bytes of the current row already written.
+    uint32_t written;
+    char line[64];
+    uint32_t lineLen;
+};
+
+void *reportConstructor(struct reportState *state, void *param) {
+    state->rows = *(uint32_t *)param;
+    return state;
+}
+
+void reportDestructor(void *state) {}
+
+uint32_t FormatReportRow(char *dest, uint32_t row) {
+    return sprintf(dest, "row %u,%u\n", row, row * 7919);
+}
+
+// Writes rows until the stream is full, then resumes within the row it stopped at.
+struct subroutine_result runReport(struct reportState *state) {
+    while (state->row < state->rows) {
+        if (state->written == 0) state->lineLen = FormatReportRow(state->line, state->row);
+
+        state->written += StreamWrite(&state->stream, state->line + state->written, state->lineLen - state->written);
+        if (state->written < state->lineLen) return subroutine_pause;
+
+        state->written = 0;
+        state->row++;
+    }
+
+    return subroutine_finish;
+}
+
+const struct async_descriptor reportAsync = {
+    .constructor = (async_constructor)reportConstructor,
+    .destructor = reportDestructor,
+    .subroutine = (async_subroutine)runReport,
+    .stateSize = sizeof(struct reportState),
+};
+
+// Awaits the producer for the next part of the stream as the platform would, once the send queue is flushed.
+bool RunStreamProducer(struct tcpConnCommon *conn) {
+    struct async_state *producer = TakeStreamProducer(conn);
+    if (producer == NULL) return true;
+
+    // Caller is responsible for setting RUNNING flag.
+    atomic_fetch_or(&producer->flags, MACHINE_RUNNING);
+    RunAsync(producer);
+
+    return StreamProduced(conn);
+}
+
+// Streams a report far larger than the stream buffer, flushing as the platform would, and decodes the chunks.
+// Nothing queued at once may exceed the buffer, and the body must come out whole.
+bool TestStreamedBody(enum http_version version) {
+    const char *name = version == HTTP_VERSION_1_1 ? "streamed body" : "streamed body unchunked";
+
+    struct tcpConnCommon conn;
+    memset(&conn, 0, sizeof(conn));
+    SetupCommonConn(&conn, MAX_HEADER_SIZE);
+
+    conn.currentReq.method = HTTP_METHOD_GET;
+    conn.currentReq.version = version;
+    conn.keepAlive = true;
+
+    uint32_t rows = 20000;
+    char *expected = malloc(rows * 32);
+    char *body = malloc(rows * 32);
+    uint32_t expectedLen = 0, bodyLen = 0;
+
+    for (uint32_t row = 0; row < rows; row++) expectedLen += FormatReportRow(expected + expectedLen, row);
+
+    bool ok = RespondStream(&conn, 200, "Content-Type: text/csv\r\n", reportAsync, &rows);
+
+    char head[1024] = { 0 };
+    size_t headLen = 0;
+    size_t maxQueued = 0;
+    bool inHead = true;
+    bool ended = false;
+
+    while (ok) {
+        struct send_vec *vecs;
+        uint32_t count;
+        size_t queued = 0;
+
+        while (PrepareSend(&conn, &vecs, &count)) {
+            for (uint32_t i = 0; i < count; i++) {
+                uint8_t *buf = vecs[i].buf;
+                size_t len = vecs[i].len;
+
+                queued += len;
+
+                if (inHead) {
+                    memcpy(head + headLen, buf, len);
+                    headLen += len;
+                    inHead = strstr(head, "\r\n\r\n") == NULL;
+                    continue;
+                }
+
+                if (version == HTTP_VERSION_1_0) {
+                    memcpy(body + bodyLen, buf, len);
+                    bodyLen += len;
+                    continue;
+                }
+
+                // Vectors of a stream hold whole chunks.
+                for (size_t pos = 0; pos < len && ok;) {
+                    char *end;
+                    uint32_t chunkLeft = strtoul((char *)buf + pos, &end, 16);
+                    pos = (uint8_t *)end - buf + 2;
+
+                    if (chunkLeft == 0) {
+                        ended = pos + 2 == len && memcmp(buf + pos, "\r\n", 2) == 0;
+                        break;
+                    }
+
+                    memcpy(body + bodyLen, buf + pos, chunkLeft);
+                    bodyLen += chunkLeft;
+                    pos += chunkLeft + 2;
+                }
+            }
+
+            CommitSend(&conn, queued);
+        }
+
+        if (!inHead && queued > maxQueued) maxQueued = queued;
+        if (!HasBodyStream(&conn)) break;
+
+        ok = RunStreamProducer(&conn);
+    }
+
+    bool chunked = strstr(head, "Transfer-Encoding: chunked\r\n") != NULL;
+
+    ok = ok &&
+        chunked == (version == HTTP_VERSION_1_1) &&
+        (chunked ? ended && conn.keepAlive : !conn.keepAlive && strstr(head, "Connection: close\r\n") != NULL) &&
+        maxQueued <= STREAM_BUFFER_SIZE &&
+        bodyLen == expectedLen && memcmp(body, expected, expectedLen) == 0;
+
+    free(expected);
+    free(body);
+    CleanupCommonConn(&conn);
+
+    if (!ok) {
+        printf("FAIL %s: %u of %u bytes, %zu queued at most\n", name, bodyLen, expectedLen, maxQueued);
+        return false;
+    }
+
+    printf("PASS %s\n", name);
+    return true;
+}
+
+struct slowStreamState {
+    struct stream_async_state stream;
+    bool waited;
+};
+
+void *slowStreamConstructor(struct slowStreamState *state, void *param) {
+    return state;
+}
+
+// The producer currently waiting for I/O.
+struct async_state *slowStreamMachine = NULL;
+
+// Waits for I/O before it writes its only part.
+struct subroutine_result runSlowStream(struct slowStreamState *state) {
+    if (!state->waited) {
+        state->waited = true;
+        slowStreamMachine = currentAsync;
+
+        PrepareIO();
+        return subroutine_yield_io;
+    }
+
+    slowStreamMachine = NULL;
+    StreamWrite(&state->stream, "hello", 5);
+
+    return subroutine_finish;
+}
+
+const struct async_descriptor slowStreamAsync = {
+    .constructor = (async_constructor)slowStreamConstructor,
+    .destructor = reportDestructor,
+    .subroutine = (async_subroutine)runSlowStream,
+    .stateSize = sizeof(struct slowStreamState),
+};
+
+// A producer may do I/O before it writes, the part it wrote is only taken once it finished (or paused).
+bool TestStreamProducerIO() {
+    struct tcpConnCommon conn;
+    memset(&conn, 0, sizeof(conn));
+    SetupCommonConn(&conn, MAX_HEADER_SIZE);
+
+    conn.currentReq.method = HTTP_METHOD_GET;
+    conn.currentReq.version = HTTP_VERSION_1_1;
+    conn.keepAlive = true;
+
+    slowStreamMachine = NULL;
+
+    char responses[1024] = { 0 };
+    bool ok = RespondStream(&conn, 200, NULL, slowStreamAsync, NULL);
+
+    DrainResponses(&conn, responses, sizeof(responses));
+
+    struct async_state *producer = ok ? TakeStreamProducer(&conn) : NULL;
+    ok &= producer != NULL;
+
+    if (producer != NULL) {
+        atomic_fetch_or(&producer->flags, MACHINE_RUNNING);
+        RunAsync(producer);
+
+        struct send_vec *vecs;
+        uint32_t count;
+
+        ok &= slowStreamMachine == producer && producer->state != NULL && !PrepareSend(&conn, &vecs, &count);
+
+        ResumeFromIO(producer);
+        ok &= StreamProduced(&conn);
+    }
+
+    DrainResponses(&conn, responses, sizeof(responses));
+
+    ok &= TakeStreamProducer(&conn) == NULL && !HasBodyStream(&conn) &&
+        strstr(responses, "\r\n\r\n5\r\nhello\r\n0\r\n\r\n") != NULL;
+
+    CleanupCommonConn(&conn);
+
+    if (!ok) {
+        printf("FAIL stream producer io\n%s\n", responses);
+        return false;
+    }
+
+    printf("PASS stream producer io\n");
+    return true;
+}
+
+// Deep Nesting
+
+struct deepState {
+    uint32_t nesting;
+    bool awaited;
+    uintptr_t *low;
+    uintptr_t *high;
+};
+
+void *deepConstructor(struct deepState *state, struct deepState *param) {
+    *state = *param;
+    return state;
+}
+
+extern const struct async_descriptor deepAsync;
+
+struct subroutine_result runDeep(struct deepState *state) {
+    uintptr_t sp = (uintptr_t)&state;
+    if (sp < *state->low) *state->low = sp;
+    if (sp > *state->high) *state->high = sp;
+
+    if (state->awaited || state->nesting == 0) return subroutine_finish;
+
+    state->awaited = true;
+
+    struct deepState next = { .nesting = state->nesting - 1, .low = state->low, .high = state->high };
+    return subroutine_await(AwaitAsync(deepAsync, &next));
+}
+
+const struct async_descriptor deepAsync = {
+    .constructor = (async_constructor)deepConstructor,
+    .destructor = otherDestructor,
+    .subroutine = (async_subroutine)runDeep,
+    .stateSize = sizeof(struct deepState),
+};
+
+// Like the nesting of otherAsync, but deep enough to overflow the stack if awaits recursed. Every subroutine of
+// the chain must run at the same depth, and the whole chain must finish before RunAsync returns.
+bool TestDeepNesting() {
+    uintptr_t low = UINTPTR_MAX, high = 0;
+
+    struct deepState params = { .nesting = 200000, .low = &low, .high = &high };
+    struct async_state *root = AwaitAsync(deepAsync, &params);
+
+    // Caller is responsible for setting RUNNING flag.
+    atomic_fetch_or(&root->flags, MACHINE_RUNNING);
+    RunAsync(root);
+
+    if (high - low > 256 || runQueue.head != NULL || runQueue.draining) {
+        printf("FAIL deep nesting: stack span %llu bytes\n", (unsigned long long)(high - low));
+        return false;
+    }
+
+    printf("PASS deep nesting\n");
+    return true;
+}
+
+// Spawned Machines
+
+struct hashState {
+    uint32_t seed;
+    // Spawns another hash first while above 0, from the executor.
+    uint32_t depth;
+    uint64_t *out;
+    bool spawned;
+    uint64_t inner;
+};
+
+void *hashConstructor(struct hashState *state, void *param) {
+    *state = *(struct hashState *)param;
+    return state;
+}
+
+extern const struct async_descriptor hashAsync;
+
+uint64_t HashRounds(uint32_t seed) {
+    uint64_t hash = 14695981039346656037ull ^ seed;
+    for (uint32_t i = 0; i < 20000; i++) hash = (hash ^ (i & 0xff)) * 1099511628211ull;
+
+    return hash;
+}
+
+struct subroutine_result runHash(struct hashState *state) {
+    // Only the executors run spawned machines, the spawning thread is never one.
+    if (spawnCurrent == NULL) {
+        *state->out = 0;
+        return subroutine_finish;
+    }
+
+    if (!state->spawned && state->depth > 0) {
+        state->spawned = true;
+
+        struct hashState inner = { .seed = state->seed + 1, .depth = state->depth - 1, .out = &state->inner };
+        return subroutine_await(SpawnAsync(hashAsync, &inner));
+    }
+
+    *state->out = HashRounds(state->seed) ^ state->inner;
+    return subroutine_finish;
+}
+
+const struct async_descriptor hashAsync = {
+    .constructor = (async_constructor)hashConstructor,
+    .destructor = otherDestructor,
+    .subroutine = (async_subroutine)runHash,
+    .stateSize = sizeof(struct hashState),
+};
+
+struct spawnerState {
+    uint32_t seed;
+    bool awaited;
+    uint64_t hash;
+    uint64_t *out;
+    atomic_uint32 *done;
+};
+
+void *spawnerConstructor(struct spawnerState *state, void *param) {
+    *state = *(struct spawnerState *)param;
+    return state;
+}
+
+struct subroutine_result runSpawner(struct spawnerState *state) {
+    if (!state->awaited) {
+        state->awaited = true;
+
+        struct hashState hash = { .seed = state->seed, .depth = state->seed % 3, .out = &state->hash };
+        return subroutine_await(SpawnAsync(hashAsync, &hash));
+    }
+
+    *state->out = state->hash;
+    atomic_fetch_add(state->done, 1);
+
+    return subroutine_finish;
+}
+
+const struct async_descriptor spawnerAsync = {
+    .constructor = (async_constructor)spawnerConstructor,
+    .destructor = otherDestructor,
+    .subroutine = (async_subroutine)runSpawner,
+    .stateSize = sizeof(struct spawnerState),
+};
+
+// Spawned machines (and the ones they spawn) run on the executors, and every spawner is resumed exactly once with
+// their result. Outside of a worker, spawners are resumed on the executor.
+bool TestSpawn() {
+    enum { SPAWNERS = 2000 };
+
+    StartExecutors(4);
+
+    uint64_t *results = calloc(SPAWNERS, sizeof(uint64_t));
+    atomic_uint32 done = 0;
+
+    for (uint32_t i = 0; i < SPAWNERS; i++) {
+        struct spawnerState params = { .seed = i, .out = &results[i], .done = &done };
+        struct async_state *spawner = AwaitAsync(spawnerAsync, &params);
+
+        // Caller is responsible for setting RUNNING flag.
+        atomic_fetch_or(&spawner->flags, MACHINE_RUNNING);
+        RunAsync(spawner);
+    }
+
+    time_t deadline = time(NULL) + 20;
+    while (atomic_load(&done) < SPAWNERS && time(NULL) < deadline) _mm_pause();
+
+    bool ok = atomic_load(&done) == SPAWNERS;
+
+    for (uint32_t i = 0; ok && i < SPAWNERS; i++) {
+        uint64_t expected = 0;
+        for (uint32_t depth = i % 3 + 1; depth-- > 0;) expected = HashRounds(i + depth) ^ expected;
+
+        ok = results[i] == expected;
+    }
+
+    free(results);
+
+    if (!ok) {
+        printf("FAIL spawn: %u of %u spawners resumed\n", atomic_load(&done), SPAWNERS);
+        return false;
+    }
+
+    printf("PASS spawn\n");
+    return true;
+}
+
+// Resume Handoff
+
+#define RACE_MACHINES 4
+#define RACE_ROUNDS 20000
+
+struct raceState {
+    uint32_t slot;
+    uint32_t rounds;
+    // Threads inside the subroutine, never more than one.
+    atomic_uint32 inside;
+};
+
+// Machines that queued their "I/O", taken by the completer threads.
+_Atomic(struct async_state *) raceCompletions[RACE_MACHINES];
+atomic_uint32 raceFinished = 0;
+atomic_uint32 raceOverlaps = 0;
+
+void *raceConstructor(struct raceState *state, void *param) {
+    return state;
+}
+
+struct subroutine_result runRace(struct raceState *state) {
+    if (atomic_fetch_add(&state->inside, 1) != 0) atomic_fetch_add(&raceOverlaps, 1);
+
+    if (++state->rounds == RACE_ROUNDS) {
+        atomic_fetch_sub(&state->inside, 1);
+        atomic_fetch_add(&raceFinished, 1);
+
+        return subroutine_finish;
+    }
+
+    PrepareIO();
+    atomic_store(&raceCompletions[state->slot], currentAsync);
+
+    // Varies which side of the return the completion lands on.
+    for (uint32_t i = state->rounds % 64; i > 0; i--) _mm_pause();
+
+    atomic_fetch_sub(&state->inside, 1);
+    return subroutine_yield_io;
+}
+
+const struct async_descriptor raceAsync = {
+    .constructor = (async_constructor)raceConstructor,
+    .destructor = otherDestructor,
+    .subroutine = (async_subroutine)runRace,
+    .stateSize = sizeof(struct raceState),
+};
+
+// Completes every queued "I/O" as soon as it's seen, often before the subroutine returned.
+#ifdef _WIN32
+DWORD RunRaceCompleter(void *param) {
+#else
+void *RunRaceCompleter(void *param) {
+#endif
+    while (atomic_load(&raceFinished) < RACE_MACHINES) {
+        for (uint32_t i = 0; i < RACE_MACHINES; i++) {
+            struct async_state *machine = atomic_exchange(&raceCompletions[i], NULL);
+            if (machine != NULL) ResumeFromIO(machine);
+        }
+    }
+
+    return 0;
+}
+
+// Completions racing the return of the subroutine that queued them. Each machine must run every round exactly
+// once, never on two threads at a time, and no completion may be lost.
+bool TestResumeHandoff() {
+    enum { COMPLETERS = 3 };
+
+    for (uint32_t i = 0; i < RACE_MACHINES; i++) {
+        struct async_state *machine = AwaitAsync(raceAsync, NULL);
+        ((struct raceState *)machine->state)->slot = i;
+
+        // Caller is responsible for setting RUNNING flag.
+        atomic_fetch_or(&machine->flags, MACHINE_RUNNING);
+        RunAsync(machine);
+    }
+
+#ifdef _WIN32
+    HANDLE threads[COMPLETERS];
+    for (uint32_t i = 0; i < COMPLETERS; i++) threads[i] = CreateThread(NULL, 0, RunRaceCompleter, NULL, 0, NULL);
+#else
+    pthread_t threads[COMPLETERS];
+    for (uint32_t i = 0; i < COMPLETERS; i++) pthread_create(&threads[i], NULL, RunRaceCompleter, NULL);
+#endif
+
+    time_t deadline = time(NULL) + 30;
+    while (atomic_load(&raceFinished) < RACE_MACHINES && time(NULL) < deadline) _mm_pause();
+
+    bool ok = atomic_load(&raceFinished) == RACE_MACHINES && atomic_load(&raceOverlaps) == 0;
+
+    if (!ok) {
+        printf("FAIL resume handoff: %u of %u finished, %u overlapping runs\n", atomic_load(&raceFinished), RACE_MACHINES, atomic_load(&raceOverlaps));
+        return false;
+    }
+
+#ifdef _WIN32
+    WaitForMultipleObjects(COMPLETERS, threads, TRUE, INFINITE);
+#else
+    for (uint32_t i = 0; i < COMPLETERS; i++) pthread_join(threads[i], NULL);
+#endif
+
+    printf("PASS resume handoff\n");
+    return true;
+}
+
+// Timer Wheel
+
+#define TEST_TIMERS 20000
+
+struct test_timer {
+    struct timer timer;
+    uint64_t deadline;
+    // Wheel time the timer fired at, 0 until then.
+    uint64_t firedAt;
+    bool cancelled;
+};
+
+uint64_t testTimerNow;
+
+void TestTimerFired(struct timer *timer) {
+    // First member.
+    struct test_timer *test = (struct test_timer *)timer;
+    test->firedAt = testTimerNow;
+}
+
+// Timers must fire in the step their deadline passed in, never before it, and never once cancelled. The wait
+// NextTimerTimeout asks for must not pass any deadline.
+bool TestTimerWheel() {
+    struct test_timer *timers = malloc(TEST_TIMERS * sizeof(struct test_timer));
+    uint64_t start = 1000000;
+    struct timer_wheel *wheel = CreateTimerWheel(start);
+
+    if (timers == NULL || wheel == NULL) {
+        printf("FAIL timer wheel: out of memory\n");
+        return false;
+    }
+
+    srand(23);
+
+    for (uint32_t i = 0; i < TEST_TIMERS; i++) {
+        struct test_timer *test = &timers[i];
+
+        test->timer = nullTimer;
+        test->firedAt = 0;
+        test->cancelled = false;
+        // Mostly within the first three levels, some cascade from far ahead.
+        test->deadline = start + 1 + (i % 10 == 0 ? (uint64_t)rand() * 64 % 20000000 : (uint64_t)rand() % 300000);
+
+        ArmTimer(wheel, &test->timer, test->deadline, TestTimerFired);
+    }
+
+    // Re-armed ones only fire at their new deadline.
+    for (uint32_t i = 1; i < TEST_TIMERS; i += 7) {
+        timers[i].deadline = start + 1 + (uint64_t)rand() % 300000;
+        ArmTimer(wheel, &timers[i].timer, timers[i].deadline, TestTimerFired);
+    }
+
+    for (uint32_t i = 2; i < TEST_TIMERS; i += 5) {
+        CancelTimer(&timers[i].timer);
+        timers[i].cancelled = true;
+    }
+
+    uint64_t now = start;
+    uint64_t end = start + 20000000;
+
+    while (now < end && wheel->armed > 0) {
+        uint32_t timeout = NextTimerTimeout(wheel, now);
+        uint64_t earliest = UINT64_MAX;
+
+        for (uint32_t i = 0; i < TEST_TIMERS; i++) {
+            if (timers[i].firedAt == 0 && !timers[i].cancelled && timers[i].deadline < earliest) earliest = timers[i].deadline;
+        }
+
+        if (timeout == TIMER_NO_DEADLINE || now + timeout > earliest) {
+            printf("FAIL timer wheel: waits %u at %llu, next deadline %llu\n", timeout, (unsigned long long)now, (unsigned long long)earliest);
+            return false;
+        }
+
+        // Workers wake up late too.
+        uint64_t step = timeout + (uint64_t)rand() % 3 * (rand() % 500);
+        uint64_t previous = now;
+
+        now += step > 0 ? step : 1;
+        testTimerNow = now;
+        ExpireTimers(wheel, now);
+
+        for (uint32_t i = 0; i < TEST_TIMERS; i++) {
+            struct test_timer *test = &timers[i];
+            bool due = test->deadline > previous && test->deadline <= now;
+
+            if (test->cancelled ? test->firedAt != 0 : (test->firedAt == now) != due) {
+                printf("FAIL timer wheel: timer %u due %llu fired at %llu\n", i, (unsigned long long)test->deadline, (unsigned long long)test->firedAt);
+                return false;
+            }
+        }
+    }
+
+    for (uint32_t i = 0; i < TEST_TIMERS; i++) {
+        if (!timers[i].cancelled && timers[i].firedAt == 0) {
+            printf("FAIL timer wheel: timer %u due %llu never fired\n", i, (unsigned long long)timers[i].deadline);
+            return false;
+        }
+    }
+
+    if (wheel->armed != 0 || NextTimerTimeout(wheel, now) != TIMER_NO_DEADLINE) {
+        printf("FAIL timer wheel: %llu still armed\n", (unsigned long long)wheel->armed);
+        return false;
+    }
+
+    free(wheel);
+    free(timers);
+
+    printf("PASS timer wheel\n");
+    return true;
+}
+
+// A timer firing on its worker while another one cancels it, as when the connection resumed at its deadline.
+atomic_bool testTimerFiring = false;
+atomic_bool testTimerReturned = false;
+
+void TestSlowTimerFired(struct timer *timer) {
+    atomic_store(&testTimerFiring, true);
+
+    uint64_t until = NowMillis() + 20;
+    while (NowMillis() < until) _mm_pause();
+
+    atomic_store(&testTimerReturned, true);
+}
+
+void *TestExpireThread(void *arg) {
+    ExpireTimers(arg, 2);
+    return NULL;
+}
+
+// CancelTimer must not return while the callback is still running.
+bool TestTimerCancelWaits() {
+    struct timer_wheel *wheel = CreateTimerWheel(0);
+    struct timer timer = nullTimer;
+
+    if (wheel == NULL) {
+        printf("FAIL timer cancel: out of memory\n");
+        return false;
+    }
+
+    ArmTimer(wheel, &timer, 1, TestSlowTimerFired);
+
+    pthread_t thread;
+    pthread_create(&thread, NULL, TestExpireThread, wheel);
+
+    while (!atomic_load(&testTimerFiring)) _mm_pause();
+
+    CancelTimer(&timer);
+    bool returned = atomic_load(&testTimerReturned);
+
+    pthread_join(thread, NULL);
+    free(wheel);
+
+    if (!returned || atomic_load(&timer.wheel) != NULL) {
+        printf("FAIL timer cancel: returned while the callback ran\n");
+        return false;
+    }
+
+    printf("PASS timer cancel\n");
+    return true;
+}
+
+// Metrics
+
+// A value must land in the bucket whose limit is the first at or above it, within an eighth of it.
+bool TestHistogramBucket(uint64_t value) {
+    uint32_t bucket = HistogramBucket(value);
+    uint64_t limit = HistogramBucketLimit(bucket);
+
+    if (bucket == HISTOGRAM_BUCKETS - 1) return value >= (1ull << HISTOGRAM_MAX_BITS) || value <= limit;
+    if (value > limit || (bucket > 0 && value <= HistogramBucketLimit(bucket - 1))) return false;
+
+    return limit - value <= value / HISTOGRAM_SUB_BUCKETS;
+}
+
+void *TestMetricsThread(void *arg) {
+    for (uint64_t i = 1; i <= 1000; i++) MetricRecord(METRIC_BATCH_DISPATCH, i * 1000);
+    MetricAdd(METRIC_CONNECTIONS_SHED, 1000);
+
+    return NULL;
+}
+
+bool TestMetrics() {
+    bool ok = true;
+
+    srand(25);
+
+    for (uint64_t value = 0; value < 100000; value++) {
+        if (!TestHistogramBucket(value)) {
+            printf("FAIL metrics: %llu in bucket %u\n", (unsigned long long)value, HistogramBucket(value));
+            return false;
+        }
+    }
+
+    for (uint32_t i = 0; i < 100000; i++) {
+        uint64_t value = ((uint64_t)rand() << 31 | (uint64_t)rand()) >> (rand() % 62);
+
+        if (!TestHistogramBucket(value)) {
+            printf("FAIL metrics: %llu in bucket %u\n", (unsigned long long)value, HistogramBucket(value));
+            return false;
+        }
+    }
+
+    struct metrics_snapshot *before = malloc(sizeof(struct metrics_snapshot));
+    struct metrics_snapshot *after = malloc(sizeof(struct metrics_snapshot));
+    char *text = malloc(16384);
+
+    if (before == NULL || after == NULL || text == NULL) {
+        printf("FAIL metrics: out of memory\n");
+        return false;
+    }
+
+    SnapshotMetrics(before);
+
+    ok &= TestRoute("GET /users/42 HTTP/1.1\r\n\r\n", "\r\n\r\nuser id=42", NULL);
+    ok &= TestRoute("GET /users/ HTTP/1.1\r\n\r\n", "HTTP/1.1 404", NULL);
+
+    // Another thread's metrics are added to this one's.
+    pthread_t thread;
+    pthread_create(&thread, NULL, TestMetricsThread, NULL);
+    pthread_join(thread, NULL);
+
+    SnapshotMetrics(after);
+
+    uint64_t requests = after->counters[METRIC_REQUESTS] - before->counters[METRIC_REQUESTS];
+    uint64_t answered = after->counts[METRIC_REQUEST_LATENCY] - before->counts[METRIC_REQUEST_LATENCY];
+    uint64_t parsed = after->counts[METRIC_PARSE_TIME] - before->counts[METRIC_PARSE_TIME];
+    uint64_t shed = after->counters[METRIC_CONNECTIONS_SHED] - before->counters[METRIC_CONNECTIONS_SHED];
+
+    if (requests != 2 || answered != 2 || parsed != 2 || shed != 1000) {
+        printf("FAIL metrics: %llu requests, %llu answered, %llu parsed, %llu shed\n", (unsigned long long)requests, (unsigned long long)answered, (unsigned long long)parsed, (unsigned long long)shed);
+        ok = false;
+    }
+
+    // Only the other thread recorded resume delays, 1us to 1ms.
+    uint64_t median = SnapshotQuantile(after, METRIC_BATCH_DISPATCH, 0.5);
+    uint64_t top = SnapshotQuantile(after, METRIC_BATCH_DISPATCH, 1);
+
+    if (after->counts[METRIC_BATCH_DISPATCH] != 1000 || median < 500000 || median > 500000 + 500000 / HISTOGRAM_SUB_BUCKETS || top < 1000000 || top > 1000000 + 1000000 / HISTOGRAM_SUB_BUCKETS) {
+        printf("FAIL metrics: median %llu, top %llu of %llu\n", (unsigned long long)median, (unsigned long long)top, (unsigned long long)after->counts[METRIC_BATCH_DISPATCH]);
+        ok = false;
+    }
+
+    size_t len = FormatMetrics(after, text, 16384);
+
+    if (
+        len == 16384 || strlen(text) != len ||
+        strstr(text, "# TYPE asynchttp_requests_total counter\n") == NULL ||
+        strstr(text, "asynchttp_batch_dispatch_seconds_bucket{le=\"0.000131072\"} 131\n") == NULL ||
+        strstr(text, "asynchttp_batch_dispatch_seconds_bucket{le=\"+Inf\"} 1000\n") == NULL ||
+        strstr(text, "asynchttp_batch_dispatch_seconds_count 1000\n") == NULL ||
+        FormatMetrics(after, text, 1024) != 1024
+    ) {
+        printf("FAIL metrics text:\n%s\n", text);
+        ok = false;
+    }
+
+    free(before);
+    free(after);
+    free(text);
+
+    if (ok) printf("PASS metrics\n");
+    return ok;
+}
+
+// Structural Scanning
+
+#define SCAN_TEST_MAX 1000
+
+// Every kernel must produce the same masks as a byte at a time check, whatever the length, including the bits
+// of the padded last word.
+bool TestScanKernels() {
+    struct { const char *name; scan_kernel kernel; } kernels[] = {
+        { "scalar", ScanBlockScalar },
+#ifdef SCAN_X86
+        { "sse2", __builtin_cpu_supports("sse2") ? ScanBlockSSE2 : NULL },
+        { "avx2", __builtin_cpu_supports("avx2") ? ScanBlockAVX2 : NULL },
+#endif
+    };
+
+    // Bytes at the edges of the classes, mixed in with random ones.
+    static const uint8_t edges[] = { '\t', '\r', '\n', ' ', ':', 0x00, 0x1F, 0x7E, 0x7F, 0x80, 0xFF, 'A' };
+
+    static uint8_t buf[SCAN_TEST_MAX];
+    static uint64_t expected[SCAN_MASK_COUNT][(SCAN_TEST_MAX + 63) / 64];
+
+    struct scan_index index = { .base = NULL, .len = 0, .capacityWords = 0, .masks = NULL };
+
+    srand(6);
+
+    for (uint32_t round = 0; round < 200; round++) {
+        // Mostly lengths that aren't a multiple of 16, 32 or 64.
+        uint32_t len = round < 100 ? round + 1 : 1 + (uint32_t)rand() % SCAN_TEST_MAX;
+        uint32_t words = (len + 63) / 64;
+
+        for (uint32_t i = 0; i < len; i++) buf[i] = rand() % 2 == 0 ? edges[rand() % sizeof(edges)] : (uint8_t)rand();
+
+        memset(expected, 0, sizeof(expected));
+
+        for (uint32_t i = 0; i < len; i++) {
+            uint8_t c = buf[i];
+            uint64_t bit = 1ull << (i % 64);
+
+            if (c == '\n') expected[SCAN_LINE_END][i / 64] |= bit;
+            if (c == ' ') expected[SCAN_SPACE][i / 64] |= bit;
+            if (c == ':') expected[SCAN_COLON][i / 64] |= bit;
+            if ((c < 0x20 && c != '\t' && c != '\r' && c != '\n') || c == 0x7F) expected[SCAN_INVALID][i / 64] |= bit;
+        }
+
+        for (uint32_t k = 0; k < sizeof(kernels) / sizeof(kernels[0]); k++) {
+            if (kernels[k].kernel == NULL) continue;
+
+            if (!ScanChunkWith(kernels[k].kernel, &index, buf, len)) {
+                printf("FAIL scan kernels: out of memory\n");
+                return false;
+            }
+
+            for (uint32_t m = 0; m < SCAN_MASK_COUNT; m++) {
+                for (uint32_t w = 0; w < words; w++) {
+                    uint64_t got = index.masks[m * index.capacityWords + w];
+
+                    if (got != expected[m][w]) {
+                        printf("FAIL scan kernels: %s, length %u, mask %u word %u is %016llx, not %016llx\n", kernels[k].name, len, m, w, (unsigned long long)got, (unsigned long long)expected[m][w]);
+                        return false;
+                    }
+                }
+            }
+        }
+    }
+
+    free(index.masks);
+
+    printf("PASS scan kernels\n");
+    return true;
+}
+
+// Every size must land in the smallest class that holds it with the block header.
+bool TestSlabSizeClass() {
+    size_t largest = SlabClassSize(SLAB_CLASS_COUNT - 1) - sizeof(struct slab_block);
+
+    for (size_t size = 0; size <= largest + 64; size++) {
+        uint32_t expected = SLAB_LARGE_CLASS;
+
+        for (uint32_t sizeClass = 0; sizeClass < SLAB_CLASS_COUNT; sizeClass++) {
+            if (size + sizeof(struct slab_block) <= SlabClassSize(sizeClass)) {
+                expected = sizeClass;
+                break;
+            }
+        }
+
+        if (SlabSizeClass(size) != expected) {
+            printf("FAIL slab size class of %zu: %u, expected %u\n", size, SlabSizeClass(size), expected);
+            return false;
+        }
+    }
+
+    if (SlabSizeClass(SIZE_MAX / 2) != SLAB_LARGE_CLASS) {
+        printf("FAIL slab size class of a huge size\n");
+        return false;
+    }
+
+    printf("PASS slab size class\n");
+    return true;
+}
+
+// Every well-known name must land on its own slot, in any case.
+bool TestKnownHeaders() {
+    for (uint32_t slot = 0; slot < KNOWN_HEADER_SLOTS; slot++) {
+        const struct known_header *entry = &knownHeaders[slot];
+        if (entry->len == 0) continue;
+
+        char upper[32];
+        for (uint32_t i = 0; i <= entry->len; i++) upper[i] = entry->name[i] >= 'a' && entry->name[i] <= 'z' ? entry->name[i] - 32 : entry->name[i];
+
+        if (
+            KnownHeaderHash((const uint8_t *)entry->name, entry->len) != slot ||
+            ClassifyHeader((const uint8_t *)entry->name, entry->len) != entry->id ||
+            ClassifyHeader((const uint8_t *)upper, entry->len) != entry->id
+        ) {
+            printf("FAIL known header %s\n", entry->name);
+            return false;
+        }
+    }
+
+    const char *unknown[] = { "x-request-id", "hast", "content-lengths", "accept-encodinh", "dnt" };
+
+    for (uint32_t i = 0; i < sizeof(unknown) / sizeof(unknown[0]); i++) {
+        if (ClassifyHeader((const uint8_t *)unknown[i], strlen(unknown[i])) != HEADER_UNKNOWN) {
+            printf("FAIL unknown header %s\n", unknown[i]);
+            return false;
+        }
+    }
+
+    printf("PASS known headers\n");
+    return true;
+}
+
+int main(void) {
+    // Parsing reads the Response Cache.
+    QSBRRegister();
+    AddTestRoutes();
+
+    if (!TestScanKernels()) return 1;
+    if (!TestKnownHeaders()) return 1;
+    if (!TestSlabSizeClass()) return 1;
+    if (!TestSplitRequests()) return 1;
+    if (!TestPartialSend()) return 1;
+    if (!TestBodylessStatus()) return 1;
+    if (!TestStaticPaths()) return 1;
+    if (!TestResponseCache()) return 1;
+    if (!TestRequestBodies()) return 1;
+    if (!TestRouter()) return 1;
+    if (!TestAdmission()) return 1;
+    if (!TestHandlerTimeout(false)) return 1;
+    if (!TestHandlerTimeout(true)) return 1;
+    if (!TestConsumerIO()) return 1;
+    if (!TestStaticFiles()) return 1;
+    if (!TestIdleBuffers()) return 1;
+    if (!TestPeerAddress()) return 1;
+    if (!TestDeepNesting()) return 1;
+    if (!TestSpawn()) return 1;
+    if (!TestResumeHandoff()) return 1;
+    if (!TestTimerWheel()) return 1;
+    if (!TestTimerCancelWaits()) return 1;
+    if (!TestMetrics()) return 1;
+    if (!TestStreamedBody(HTTP_VERSION_1_1)) return 1;
+    if (!TestStreamedBody(HTTP_VERSION_1_0)) return 1;
+    if (!TestStreamProducerIO()) return 1;
+
+    printf("Starting %p\n", httpAsync.subroutine);
+    struct async_state *http = AwaitAsync(httpAsync, NULL);
+
+    // Caller is responsible for setting RUNNING flag.
+    atomic_fetch_or(&http->flags, MACHINE_RUNNING);
+    RunAsync(http);
+
     return 0;
 }
@@ -0,0 +1,322 @@
+﻿// Hierarchical Timer Wheel
+
+#pragma once
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdatomic.h>
+#include <immintrin.h>
+#include "./atomics.c"
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+
+// Every worker owns a wheel, timers are armed on the wheel of the thread arming them and expire on it. Each level
+// has TIMER_SLOTS slots, a slot of level l spans TIMER_SLOTS^l ticks (milliseconds), so the six levels reach over
+// two years ahead. A timer sits in the slot of the lowest level its deadline fits in, and moves down a level when
+// the wheel reaches that slot (cascading), until it expires from level 0.
+//
+// Timers are intrusive and doubly linked, arming and cancelling is O(1) and allocates nothing.
+
+#define TIMER_SLOT_BITS 6
+#define TIMER_SLOTS (1 << TIMER_SLOT_BITS)
+#define TIMER_LEVELS 6
+
+// Returned by NextTimerTimeout when nothing is armed.
+#define TIMER_NO_DEADLINE UINT32_MAX
+
+struct timer;
+struct timer_wheel;
+
+// Called on the thread owning the wheel, with the wheel locked, so it must neither arm nor cancel timers.
+// Cancelling a timer from another thread waits for its callback to return, the timer stays on the wheel until then. Timers are embedded in what they time,
+// the callback finds it from the timer's offset.
+typedef void (*timer_callback)(struct timer *);
+
+struct timer {
+    struct timer *next;
+    struct timer *prev;
+    // Wheel the timer is armed on (or firing on), NULL while disarmed. Only changed with that wheel locked.
+    _Atomic(struct timer_wheel *) wheel;
+    uint64_t deadline;
+    uint32_t level;
+    uint32_t slot;
+    timer_callback callback;
+};
+
+const struct timer nullTimer = { .next = NULL, .prev = NULL, .wheel = NULL, .deadline = 0, .level = 0, .slot = 0, .callback = NULL };
+
+struct timer_wheel {
+    // Last tick expired, every armed deadline is after it.
+    uint64_t now;
+    uint64_t armed;
+    // Cancels may come from other threads, arming and expiring only from the owner.
+    atomic_uint32 lock;
+    // Bit i is set while slot i of the level holds a timer.
+    uint64_t occupied[TIMER_LEVELS];
+    // List heads, only next and prev are used.
+    struct timer slots[TIMER_LEVELS][TIMER_SLOTS];
+};
+
+// Wheel of the worker, NULL on other threads (timers armed there are ignored).
+_Thread_local struct timer_wheel *threadTimers = NULL;
+
+uint64_t NowMillis() {
+#ifdef _WIN32
+    return GetTickCount64();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+#endif
+}
+
+struct timer_wheel *CreateTimerWheel(uint64_t now) {
+    struct timer_wheel *wheel = malloc(sizeof(struct timer_wheel));
+    if (wheel == NULL) return NULL;
+
+    wheel->now = now;
+    wheel->armed = 0;
+    atomic_init(&wheel->lock, 0);
+
+    for (uint32_t level = 0; level < TIMER_LEVELS; level++) {
+        wheel->occupied[level] = 0;
+
+        for (uint32_t slot = 0; slot < TIMER_SLOTS; slot++) {
+            struct timer *head = &wheel->slots[level][slot];
+
+            head->next = head;
+            head->prev = head;
+        }
+    }
+
+    return wheel;
+}
+
+void LockTimerWheel(struct timer_wheel *wheel) {
+    for (;;) {
+        uint32_t unlocked = 0;
+        if (atomic_compare_exchange_weak(&wheel->lock, &unlocked, 1)) break;
+        _mm_pause();
+    }
+}
+
+void UnlockTimerWheel(struct timer_wheel *wheel) {
+    atomic_store(&wheel->lock, 0);
+}
+
+uint32_t TimerLevelShift(uint32_t level) {
+    return level * TIMER_SLOT_BITS;
+}
+
+uint32_t TimerSlotIndex(uint64_t tick, uint32_t level) {
+    return (tick >> TimerLevelShift(level)) & (TIMER_SLOTS - 1);
+}
+
+// Links the timer into the slot its deadline falls in, relative to the current tick. A deadline of the current tick
+// lands in the level 0 slot that's about to expire, only cascades do that.
+void InsertTimer(struct timer_wheel *wheel, struct timer *timer) {
+    // Lowest level whose slots reach the deadline within one rotation. Never the slot the wheel is in (unless on level
+    // 0), it was cascaded already.
+    uint32_t level = 0;
+
+    while (level < TIMER_LEVELS - 1 && (timer->deadline >> TimerLevelShift(level)) - (wheel->now >> TimerLevelShift(level)) >= TIMER_SLOTS) level++;
+
+    uint32_t slot = TimerSlotIndex(timer->deadline, level);
+    struct timer *head = &wheel->slots[level][slot];
+
+    timer->level = level;
+    timer->slot = slot;
+
+    timer->next = head;
+    timer->prev = head->prev;
+    head->prev->next = timer;
+    head->prev = timer;
+
+    wheel->occupied[level] |= 1ull << slot;
+}
+
+void UnlinkTimer(struct timer_wheel *wheel, struct timer *timer) {
+    timer->prev->next = timer->next;
+    timer->next->prev = timer->prev;
+
+    struct timer *head = &wheel->slots[timer->level][timer->slot];
+    if (head->next == head) wheel->occupied[timer->level] &= ~(1ull << timer->slot);
+
+    timer->next = NULL;
+    timer->prev = NULL;
+}
+
+// Owner thread only. Re-arms the timer if it's armed already.
+void ArmTimer(struct timer_wheel *wheel, struct timer *timer, uint64_t deadline, timer_callback callback) {
+    if (wheel == NULL) return;
+
+    struct timer_wheel *previous = atomic_load(&timer->wheel);
+
+    // Armed by another worker, the connection moved since.
+    if (previous != NULL && previous != wheel) {
+        LockTimerWheel(previous);
+
+        if (atomic_load(&timer->wheel) == previous) {
+            UnlinkTimer(previous, timer);
+            previous->armed--;
+            atomic_store(&timer->wheel, NULL);
+        }
+
+        UnlockTimerWheel(previous);
+    }
+
+    LockTimerWheel(wheel);
+
+    if (atomic_load(&timer->wheel) == wheel) {
+        UnlinkTimer(wheel, timer);
+        wheel->armed--;
+    }
+
+    // That tick expired already.
+    if (deadline <= wheel->now) deadline = wheel->now + 1;
+
+    // Further ahead than the top level reaches within one rotation (over two years), fires as late as it can.
+    uint64_t maxDelta = ((uint64_t)(TIMER_SLOTS - 1) << TimerLevelShift(TIMER_LEVELS - 1)) - 1;
+    if (deadline - wheel->now > maxDelta) deadline = wheel->now + maxDelta;
+
+    timer->deadline = deadline;
+    timer->callback = callback;
+    atomic_store(&timer->wheel, wheel);
+
+    InsertTimer(wheel, timer);
+    wheel->armed++;
+
+    UnlockTimerWheel(wheel);
+}
+
+// Any thread. Once it returns the callback isn't running and won't be called.
+void CancelTimer(struct timer *timer) {
+    struct timer_wheel *wheel = atomic_load(&timer->wheel);
+    if (wheel == NULL) return;
+
+    // Held while the callback runs, so this waits for one that's firing.
+    LockTimerWheel(wheel);
+
+    // Expired (or re-armed by its owner) while waiting for the lock.
+    if (atomic_load(&timer->wheel) == wheel) {
+        UnlinkTimer(wheel, timer);
+        wheel->armed--;
+        atomic_store(&timer->wheel, NULL);
+    }
+
+    UnlockTimerWheel(wheel);
+}
+
+// Moves every timer of the slot the wheel just reached down to the levels below.
+void CascadeTimers(struct timer_wheel *wheel, uint32_t level) {
+    uint32_t slot = TimerSlotIndex(wheel->now, level);
+    struct timer *head = &wheel->slots[level][slot];
+
+    struct timer *timer = head->next;
+
+    head->next = head;
+    head->prev = head;
+    wheel->occupied[level] &= ~(1ull << slot);
+
+    while (timer != head) {
+        struct timer *next = timer->next;
+
+        InsertTimer(wheel, timer);
+        timer = next;
+    }
+}
+
+// Owner thread only. Runs the callback of every timer whose deadline is at or before now, returns how many.
+uint32_t ExpireTimers(struct timer_wheel *wheel, uint64_t now) {
+    if (wheel == NULL) return 0;
+
+    uint32_t expired = 0;
+
+    LockTimerWheel(wheel);
+
+    while (wheel->now < now) {
+        if (wheel->armed == 0) {
+            wheel->now = now;
+            break;
+        }
+
+        // Nothing due on level 0, skip ahead to where the next slot of level 1 cascades.
+        if (wheel->occupied[0] == 0) {
+            uint64_t wrap = (wheel->now | (TIMER_SLOTS - 1)) + 1;
+
+            if (wrap > now) {
+                wheel->now = now;
+                break;
+            }
+
+            wheel->now = wrap;
+        } else {
+            wheel->now++;
+        }
+
+        // Higher levels cascade whenever every level below them wrapped around.
+        for (uint32_t level = 1; level < TIMER_LEVELS; level++) {
+            if (TimerSlotIndex(wheel->now, level - 1) != 0) break;
+
+            CascadeTimers(wheel, level);
+        }
+
+        uint32_t slot = TimerSlotIndex(wheel->now, 0);
+        struct timer *head = &wheel->slots[0][slot];
+
+        while (head->next != head) {
+            struct timer *timer = head->next;
+
+            UnlinkTimer(wheel, timer);
+            wheel->armed--;
+
+            // Cleared once it returned, until then CancelTimer waits on the lock.
+            timer->callback(timer);
+            atomic_store(&timer->wheel, NULL);
+            expired++;
+        }
+    }
+
+    UnlockTimerWheel(wheel);
+
+    return expired;
+}
+
+// Owner thread only. Milliseconds until the wheel next has work (an expiry, or a cascade towards one), to wait for
+// at most. TIMER_NO_DEADLINE if nothing is armed.
+uint32_t NextTimerTimeout(struct timer_wheel *wheel, uint64_t now) {
+    if (wheel == NULL) return TIMER_NO_DEADLINE;
+
+    LockTimerWheel(wheel);
+
+    uint64_t next = UINT64_MAX;
+
+    for (uint32_t level = 0; level < TIMER_LEVELS; level++) {
+        uint64_t occupied = wheel->occupied[level];
+        if (occupied == 0) continue;
+
+        uint32_t current = TimerSlotIndex(wheel->now, level);
+        // Rotated so the slot after the current one is bit 0, the current slot is a whole rotation away.
+        uint64_t rotated = (occupied >> ((current + 1) & (TIMER_SLOTS - 1))) | (occupied << ((TIMER_SLOTS - current - 1) & (TIMER_SLOTS - 1)));
+        if (current == TIMER_SLOTS - 1) rotated = occupied;
+
+        uint64_t distance = (uint64_t)__builtin_ctzll(rotated) + 1;
+        uint64_t tick = ((wheel->now >> TimerLevelShift(level)) + distance) << TimerLevelShift(level);
+
+        if (tick < next) next = tick;
+    }
+
+    UnlockTimerWheel(wheel);
+
+    if (next == UINT64_MAX) return TIMER_NO_DEADLINE;
+    if (next <= now) return 0;
+
+    uint64_t timeout = next - now;
+    return timeout < TIMER_NO_DEADLINE ? (uint32_t)timeout : TIMER_NO_DEADLINE - 1;
+}
\ No newline at end of file